@@ -0,0 +1,86 @@
+#include "arena.h"
+
+#include <cstdlib>
+#include <cstring>
+
+// blocks stop doubling at this size, larger allocations get a block of their own
+static const size_t ARENA_MAX_BLOCK = 1 << 20;
+
+void* Arena::allocate(size_t size, size_t align) {
+    struct ArenaBlock* block = head;
+
+    // the usable bytes of a block start right after its header
+    auto aligned = [&](struct ArenaBlock* b) {
+        const uintptr_t base = reinterpret_cast<uintptr_t>(b + 1) + b->used;
+        return (base + align - 1) & ~(uintptr_t) (align - 1);
+    };
+
+    if (!block || aligned(block) + size > reinterpret_cast<uintptr_t>(block + 1) + block->size) {
+        const size_t needed = size + align;
+        size_t       bytes  = block_size;
+        if (bytes < ARENA_MAX_BLOCK) {
+            block_size *= 2;
+        }
+        if (bytes < needed) {
+            bytes = needed;
+        }
+
+        block = static_cast<struct ArenaBlock*>(malloc(sizeof(struct ArenaBlock) + bytes));
+        if (!block) {
+            throw std::bad_alloc();
+        }
+        *block = {head, bytes, 0};
+        head   = block;
+
+        n_blocks++;
+        capacity += bytes;
+    }
+
+    const uintptr_t address = aligned(block);
+    block->used             = address + size - reinterpret_cast<uintptr_t>(block + 1);
+
+    n_allocations++;
+    n_bytes += size;
+    return reinterpret_cast<void*>(address);
+}
+
+std::string_view Arena::copy(std::string_view string) {
+    if (string.empty()) {
+        return std::string_view();
+    }
+    char* bytes = static_cast<char*>(allocate(string.size(), 1));
+    memcpy(bytes, string.data(), string.size());
+    return std::string_view(bytes, string.size());
+}
+
+struct Arena* malloc_arena(size_t block_size) {
+    struct Arena* arena = new Arena{};
+
+    if (!arena) {
+        throw std::bad_alloc();
+    }
+
+    arena->block_size = block_size > 0 ? block_size : 1;
+    return arena;
+}
+
+void free_arena(struct Arena* arena) {
+    if (nullptr == arena) {
+        return;
+    }
+
+    // an object may still refer to any object created before it, so destroy the newest first
+    for (struct ArenaFinalizer* finalizer = arena->finalizers; finalizer;) {
+        struct ArenaFinalizer* next = finalizer->next;
+        finalizer->destroy(finalizer->object);
+        finalizer = next;
+    }
+
+    for (struct ArenaBlock* block = arena->head; block;) {
+        struct ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+
+    delete arena;
+}
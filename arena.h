@@ -0,0 +1,68 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+// A chunk of memory that allocations are carved out of, front to back.
+struct ArenaBlock {
+    struct ArenaBlock* next; // Block that was filled before this one
+    size_t             size; // Usable bytes after the header
+    size_t             used; // Bytes handed out so far, including alignment padding
+};
+
+// Destroys an object that owns memory outside of the arena, e.g. through a std::vector member.
+struct ArenaFinalizer {
+    struct ArenaFinalizer* next;                   // Finalizer registered before this one
+    void                   (*destroy)(void* object); // Calls the destructor of the object
+    void*                  object;                 // Object to destroy
+};
+
+// A bump allocator. Objects are never released on their own: free_arena runs the finalizers
+// in reverse order of creation and then returns every block at once, so thousands of small
+// objects cost a handful of mallocs.
+struct Arena {
+    struct ArenaBlock*     head       = nullptr; // Block being filled
+    struct ArenaFinalizer* finalizers = nullptr; // Most recently registered first
+    size_t                 block_size = 0;       // Size of the next block, doubled each time
+
+    size_t n_allocations = 0; // Number of calls to allocate
+    size_t n_bytes       = 0; // Bytes handed out, excluding alignment padding
+    size_t n_blocks      = 0; // Number of blocks
+    size_t capacity      = 0; // Usable bytes of every block
+
+    // uninitialized memory of size bytes aligned to align, a power of two
+    void* allocate(size_t size, size_t align = alignof(std::max_align_t));
+
+    // construct a T in the arena. its destructor runs in free_arena unless it is trivial.
+    template <typename T, typename... Args> T* create(Args &&...args) {
+        struct ArenaFinalizer* finalizer = nullptr;
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            finalizer = static_cast<struct ArenaFinalizer*>(
+                allocate(sizeof(struct ArenaFinalizer), alignof(struct ArenaFinalizer))
+            );
+        }
+
+        T* object = new (allocate(sizeof(T), alignof(T))) T{std::forward<Args>(args)...};
+
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            *finalizer = {finalizers, [](void* p) { static_cast<T*>(p)->~T(); }, object};
+            finalizers = finalizer;
+        }
+        return object;
+    }
+
+    // copy the bytes of string into the arena
+    std::string_view copy(std::string_view string);
+};
+
+// create an arena whose first block holds block_size bytes
+struct Arena* malloc_arena(size_t block_size = 4096);
+
+void free_arena(struct Arena* arena);
+
+#endif // ARENA_H
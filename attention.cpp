@@ -0,0 +1,778 @@
+/*
+ * attention.cpp
+ *
+ * Attention over the pages of the kv cache with an online softmax, so the scores of a query are
+ * consumed a page at a time instead of being written out for the whole context.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define ATTENTION_X86
+#elif defined(__aarch64__)
+    #include <arm_neon.h>
+    #define ATTENTION_NEON
+#endif
+
+#include "attention.h"
+#include "profile.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// attention with fewer multiply-adds than this finishes before the workers would wake up
+static const size_t ATTENTION_PARALLEL_MIN = 1 << 15;
+
+// the layer shapes with attention compiled for their dimensions
+#define ATTENTION_SHAPES 2
+
+/**
+ * The online softmax update of the group query heads that share a kv head, for one position and
+ * the n_keys keys and values of a page. queries, acc, max and sum hold a row per query head, and
+ * scores has room for group rows of a page.
+ */
+using AttentionPageFunction = void (*)(
+    const float* queries,
+    const float* keys,
+    const float* values,
+    size_t       n_keys,
+    float        scale,
+    float*       acc,
+    float*       max,
+    float*       sum,
+    float*       scores
+);
+
+// a head_dim and group whose page update is instantiated with both as constants
+struct AttentionShape {
+    const char*           name;     // The model the shape is deployed for, e.g. "gpt2"
+    size_t                head_dim; // Floats per head
+    size_t                group;    // Query heads per kv head
+    AttentionPageFunction page;     // nullptr when the instruction set has no kernel for it
+};
+
+// The vector primitives of the kernel, over a row of head_dim floats.
+struct AttentionKernels {
+    const char* name;
+
+    // out[j] = q . keys[j] for n_keys rows of n floats
+    void (*scores)(const float* q, const float* keys, size_t n_keys, size_t n, float* out);
+    void (*axpy)(float* y, float a, const float* x, size_t n); // y += a x
+    void (*scale)(float* y, float a, size_t n);                // y *= a
+
+    struct AttentionShape shapes[ATTENTION_SHAPES];
+};
+
+// turn the scores of a page into weights relative to the running maximum of a query and update
+// max and sum, returning the factor to rescale what was accumulated before by
+static inline float attention_softmax(float* scores, size_t n_keys, float &max, float &sum) {
+    float block_max = -std::numeric_limits<float>::infinity();
+    for (size_t j = 0; j < n_keys; ++j) {
+        block_max = std::max(block_max, scores[j]);
+    }
+
+    // exp(-inf) = 0 the first time, there is nothing to rescale yet
+    const float next       = std::max(max, block_max);
+    const float correction = std::exp(max - next);
+    float       block_sum  = 0.0f;
+    for (size_t j = 0; j < n_keys; ++j) {
+        scores[j]  = std::exp(scores[j] - next);
+        block_sum += scores[j];
+    }
+
+    sum = sum * correction + block_sum;
+    max = next;
+    return correction;
+}
+
+//
+// reference kernels
+//
+
+static float scalar_dot(const float* a, const float* b, size_t n) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+static void
+scalar_scores(const float* q, const float* keys, size_t n_keys, size_t n, float* out) {
+    for (size_t j = 0; j < n_keys; ++j) {
+        out[j] = scalar_dot(q, keys + j * n, n);
+    }
+}
+
+static void scalar_axpy(float* y, float a, const float* x, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        y[i] += a * x[i];
+    }
+}
+
+static void scalar_scale(float* y, float a, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        y[i] *= a;
+    }
+}
+
+//
+// x86 kernels
+//
+
+#if defined(ATTENTION_X86)
+
+// four keys at a time, so each load of the query is shared by four of them
+__attribute__((target("avx2,fma"))) static void
+avx2_scores(const float* q, const float* keys, size_t n_keys, size_t n, float* out) {
+    size_t j = 0;
+    for (; j + 4 <= n_keys && 0 == n % 8; j += 4) {
+        const float* k   = keys + j * n;
+        __m256       acc0 = _mm256_setzero_ps();
+        __m256       acc1 = _mm256_setzero_ps();
+        __m256       acc2 = _mm256_setzero_ps();
+        __m256       acc3 = _mm256_setzero_ps();
+        for (size_t i = 0; i < n; i += 8) {
+            const __m256 qi = _mm256_loadu_ps(q + i);
+            acc0            = _mm256_fmadd_ps(qi, _mm256_loadu_ps(k + i), acc0);
+            acc1            = _mm256_fmadd_ps(qi, _mm256_loadu_ps(k + n + i), acc1);
+            acc2            = _mm256_fmadd_ps(qi, _mm256_loadu_ps(k + 2 * n + i), acc2);
+            acc3            = _mm256_fmadd_ps(qi, _mm256_loadu_ps(k + 3 * n + i), acc3);
+        }
+
+        // the four sums, each half of the hadds holds a partial sum of every key
+        const __m256 sums = _mm256_hadd_ps(_mm256_hadd_ps(acc0, acc1), _mm256_hadd_ps(acc2, acc3));
+        _mm_storeu_ps(
+            out + j, _mm_add_ps(_mm256_castps256_ps128(sums), _mm256_extractf128_ps(sums, 1))
+        );
+    }
+    for (; j < n_keys; ++j) {
+        out[j] = scalar_dot(q, keys + j * n, n);
+    }
+}
+
+__attribute__((target("avx2,fma"))) static void
+avx2_axpy(float* y, float a, const float* x, size_t n) {
+    const __m256 va = _mm256_set1_ps(a);
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256 yi = _mm256_loadu_ps(y + i);
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + i), yi));
+    }
+    for (; i < n; ++i) {
+        y[i] += a * x[i];
+    }
+}
+
+__attribute__((target("avx2"))) static void avx2_scale(float* y, float a, size_t n) {
+    const __m256 va = _mm256_set1_ps(a);
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_mul_ps(va, _mm256_loadu_ps(y + i)));
+    }
+    for (; i < n; ++i) {
+        y[i] *= a;
+    }
+}
+
+// the sum of the lanes of v
+__attribute__((target("avx2,fma"))) static inline float avx2_sum(__m256 v) {
+    const __m128 x = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    const __m128 y = _mm_add_ps(x, _mm_movehl_ps(x, x));
+    return _mm_cvtss_f32(_mm_add_ss(y, _mm_movehdup_ps(y)));
+}
+
+// exp of every lane, the Cephes polynomial on x - n ln 2 scaled by 2^n, within 2 ulp of std::exp.
+// the inputs of a softmax are at most 0, those below the smallest normal float come out as 0.
+__attribute__((target("avx2,fma"))) static inline __m256 avx2_exp(__m256 x) {
+    const __m256 lowest = _mm256_set1_ps(-87.33654f);
+    const __m256 zero   = _mm256_cmp_ps(x, lowest, _CMP_LT_OQ);
+    x                   = _mm256_min_ps(_mm256_max_ps(x, lowest), _mm256_set1_ps(88.37626f));
+
+    const __m256 n = _mm256_round_ps(
+        _mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC
+    );
+    x = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+    x = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), x);
+
+    __m256 y = _mm256_set1_ps(1.9875691500e-4f);
+    y        = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.3981999507e-3f));
+    y        = _mm256_fmadd_ps(y, x, _mm256_set1_ps(8.3334519073e-3f));
+    y        = _mm256_fmadd_ps(y, x, _mm256_set1_ps(4.1665795894e-2f));
+    y        = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.6666665459e-1f));
+    y        = _mm256_fmadd_ps(y, x, _mm256_set1_ps(5.0000001201e-1f));
+    y        = _mm256_fmadd_ps(y, _mm256_mul_ps(x, x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+
+    const __m256i exponent = _mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127));
+    const __m256  scale    = _mm256_castsi256_ps(_mm256_slli_epi32(exponent, 23));
+    return _mm256_andnot_ps(zero, _mm256_mul_ps(y, scale));
+}
+
+// attention_softmax with the exponentials taken eight at a time
+__attribute__((target("avx2,fma"))) static inline float
+avx2_softmax(float* scores, size_t n_keys, float &max, float &sum) {
+    float block_max = -std::numeric_limits<float>::infinity();
+    for (size_t j = 0; j < n_keys; ++j) {
+        block_max = std::max(block_max, scores[j]);
+    }
+
+    const float next       = std::max(max, block_max);
+    const float correction = std::exp(max - next);
+    __m256      sums       = _mm256_setzero_ps();
+
+    size_t j = 0;
+    for (; j + 8 <= n_keys; j += 8) {
+        const __m256 e = avx2_exp(_mm256_sub_ps(_mm256_loadu_ps(scores + j), _mm256_set1_ps(next)));
+        _mm256_storeu_ps(scores + j, e);
+        sums = _mm256_add_ps(sums, e);
+    }
+
+    float block_sum = avx2_sum(sums);
+    for (; j < n_keys; ++j) {
+        scores[j]  = std::exp(scores[j] - next);
+        block_sum += scores[j];
+    }
+
+    sum = sum * correction + block_sum;
+    max = next;
+    return correction;
+}
+
+// the scaled scores of K keys against the G queries in q, G x K independent chains of fmas
+template <size_t D, size_t G, size_t K>
+__attribute__((target("avx2,fma"), always_inline)) static inline void avx2_page_scores(
+    const __m256 (&q)[G][D / 8], const float* keys, size_t j, size_t n_keys, float scale, float* out
+) {
+    __m256 a[K][G];
+    for (size_t k = 0; k < K; ++k) {
+        for (size_t g = 0; g < G; ++g) {
+            a[k][g] = _mm256_setzero_ps();
+        }
+    }
+
+    // each vector of a key is loaded once for the whole group
+    for (size_t v = 0; v < D / 8; ++v) {
+        for (size_t k = 0; k < K; ++k) {
+            const __m256 key = _mm256_loadu_ps(keys + (j + k) * D + 8 * v);
+            for (size_t g = 0; g < G; ++g) {
+                a[k][g] = _mm256_fmadd_ps(q[g][v], key, a[k][g]);
+            }
+        }
+    }
+
+    for (size_t k = 0; k < K; ++k) {
+        for (size_t g = 0; g < G; ++g) {
+            out[g * n_keys + j + k] = avx2_sum(a[k][g]) * scale;
+        }
+    }
+}
+
+template <size_t D, size_t G>
+__attribute__((target("avx2,fma"))) static void avx2_page(
+    const float* queries,
+    const float* keys,
+    const float* values,
+    size_t       n_keys,
+    float        scale,
+    float*       acc,
+    float*       max,
+    float*       sum,
+    float*       scores
+) {
+    static_assert(0 == D % 8, "Expected a head dimension of whole vectors.");
+    constexpr size_t V = D / 8;              // vectors per head
+    constexpr size_t K = G >= 4 ? 1 : 4 / G; // keys per pass, so at least four chains are in flight
+
+    // the queries are gathered once for every key of the page. only a small head and group fit
+    // in the 16 registers, e.g. for D = 128 and G = 4 the 64 vectors spill to the stack and each
+    // key reloads them from l1, which still beats reloading them through the generic path.
+    __m256 q[G][V];
+    for (size_t g = 0; g < G; ++g) {
+        for (size_t v = 0; v < V; ++v) {
+            q[g][v] = _mm256_loadu_ps(queries + g * D + 8 * v);
+        }
+    }
+
+    size_t j = 0;
+    for (; j + K <= n_keys; j += K) {
+        avx2_page_scores<D, G, K>(q, keys, j, n_keys, scale, scores);
+    }
+    for (; j < n_keys; ++j) {
+        avx2_page_scores<D, G, 1>(q, keys, j, n_keys, scale, scores);
+    }
+
+    __m256 o[G][V];
+    for (size_t g = 0; g < G; ++g) {
+        const float  correction = avx2_softmax(scores + g * n_keys, n_keys, max[g], sum[g]);
+        const __m256 c          = _mm256_set1_ps(correction);
+        for (size_t v = 0; v < V; ++v) {
+            o[g][v] = _mm256_mul_ps(c, _mm256_loadu_ps(acc + g * D + 8 * v));
+        }
+    }
+
+    // and each vector of a value is loaded once for the group as well. the accumulators spill
+    // the same way, so the gain is in the shared loads rather than in keeping o in registers.
+    for (size_t j = 0; j < n_keys; ++j) {
+        __m256 p[G];
+        for (size_t g = 0; g < G; ++g) {
+            p[g] = _mm256_set1_ps(scores[g * n_keys + j]);
+        }
+        for (size_t v = 0; v < V; ++v) {
+            const __m256 x = _mm256_loadu_ps(values + j * D + 8 * v);
+            for (size_t g = 0; g < G; ++g) {
+                o[g][v] = _mm256_fmadd_ps(p[g], x, o[g][v]);
+            }
+        }
+    }
+
+    for (size_t g = 0; g < G; ++g) {
+        for (size_t v = 0; v < V; ++v) {
+            _mm256_storeu_ps(acc + g * D + 8 * v, o[g][v]);
+        }
+    }
+}
+
+#endif // ATTENTION_X86
+
+//
+// arm kernels
+//
+
+#if defined(ATTENTION_NEON)
+
+static void neon_scores(const float* q, const float* keys, size_t n_keys, size_t n, float* out) {
+    size_t j = 0;
+    for (; j + 4 <= n_keys && 0 == n % 4; j += 4) {
+        const float* k    = keys + j * n;
+        float32x4_t  acc0 = vdupq_n_f32(0.0f);
+        float32x4_t  acc1 = vdupq_n_f32(0.0f);
+        float32x4_t  acc2 = vdupq_n_f32(0.0f);
+        float32x4_t  acc3 = vdupq_n_f32(0.0f);
+        for (size_t i = 0; i < n; i += 4) {
+            const float32x4_t qi = vld1q_f32(q + i);
+            acc0                 = vfmaq_f32(acc0, qi, vld1q_f32(k + i));
+            acc1                 = vfmaq_f32(acc1, qi, vld1q_f32(k + n + i));
+            acc2                 = vfmaq_f32(acc2, qi, vld1q_f32(k + 2 * n + i));
+            acc3                 = vfmaq_f32(acc3, qi, vld1q_f32(k + 3 * n + i));
+        }
+        vst1q_f32(out + j, vpaddq_f32(vpaddq_f32(acc0, acc1), vpaddq_f32(acc2, acc3)));
+    }
+    for (; j < n_keys; ++j) {
+        out[j] = scalar_dot(q, keys + j * n, n);
+    }
+}
+
+static void neon_axpy(float* y, float a, const float* x, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(y + i, vfmaq_n_f32(vld1q_f32(y + i), vld1q_f32(x + i), a));
+    }
+    for (; i < n; ++i) {
+        y[i] += a * x[i];
+    }
+}
+
+static void neon_scale(float* y, float a, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(y + i, vmulq_n_f32(vld1q_f32(y + i), a));
+    }
+    for (; i < n; ++i) {
+        y[i] *= a;
+    }
+}
+
+template <size_t D, size_t G, size_t K>
+__attribute__((always_inline)) static inline void neon_page_scores(
+    const float32x4_t (&q)[G][D / 4],
+    const float* keys,
+    size_t       j,
+    size_t       n_keys,
+    float        scale,
+    float*       out
+) {
+    float32x4_t a[K][G];
+    for (size_t k = 0; k < K; ++k) {
+        for (size_t g = 0; g < G; ++g) {
+            a[k][g] = vdupq_n_f32(0.0f);
+        }
+    }
+
+    for (size_t v = 0; v < D / 4; ++v) {
+        for (size_t k = 0; k < K; ++k) {
+            const float32x4_t key = vld1q_f32(keys + (j + k) * D + 4 * v);
+            for (size_t g = 0; g < G; ++g) {
+                a[k][g] = vfmaq_f32(a[k][g], q[g][v], key);
+            }
+        }
+    }
+
+    for (size_t k = 0; k < K; ++k) {
+        for (size_t g = 0; g < G; ++g) {
+            out[g * n_keys + j + k] = vaddvq_f32(a[k][g]) * scale;
+        }
+    }
+}
+
+template <size_t D, size_t G>
+static void neon_page(
+    const float* queries,
+    const float* keys,
+    const float* values,
+    size_t       n_keys,
+    float        scale,
+    float*       acc,
+    float*       max,
+    float*       sum,
+    float*       scores
+) {
+    static_assert(0 == D % 4, "Expected a head dimension of whole vectors.");
+    constexpr size_t V = D / 4;
+    constexpr size_t K = G >= 4 ? 1 : 4 / G;
+
+    float32x4_t q[G][V];
+    for (size_t g = 0; g < G; ++g) {
+        for (size_t v = 0; v < V; ++v) {
+            q[g][v] = vld1q_f32(queries + g * D + 4 * v);
+        }
+    }
+
+    size_t j = 0;
+    for (; j + K <= n_keys; j += K) {
+        neon_page_scores<D, G, K>(q, keys, j, n_keys, scale, scores);
+    }
+    for (; j < n_keys; ++j) {
+        neon_page_scores<D, G, 1>(q, keys, j, n_keys, scale, scores);
+    }
+
+    float32x4_t o[G][V];
+    for (size_t g = 0; g < G; ++g) {
+        const float correction = attention_softmax(scores + g * n_keys, n_keys, max[g], sum[g]);
+        for (size_t v = 0; v < V; ++v) {
+            o[g][v] = vmulq_n_f32(vld1q_f32(acc + g * D + 4 * v), correction);
+        }
+    }
+
+    for (size_t j = 0; j < n_keys; ++j) {
+        for (size_t v = 0; v < V; ++v) {
+            const float32x4_t x = vld1q_f32(values + j * D + 4 * v);
+            for (size_t g = 0; g < G; ++g) {
+                o[g][v] = vfmaq_n_f32(o[g][v], x, scores[g * n_keys + j]);
+            }
+        }
+    }
+
+    for (size_t g = 0; g < G; ++g) {
+        for (size_t v = 0; v < V; ++v) {
+            vst1q_f32(acc + g * D + 4 * v, o[g][v]);
+        }
+    }
+}
+
+#endif // ATTENTION_NEON
+
+//
+// dispatch
+//
+
+// the page update of a layer shape, instantiated for its head_dim and group
+#define ATTENTION_SHAPE(name, Shape, page) \
+    {name, Shape::head_dim, Shape::group, page<Shape::head_dim, Shape::group>}
+
+static struct AttentionKernels attention_select() {
+    // the scalar kernels have no shapes of their own, every config takes the generic path
+    struct AttentionKernels kernels = {
+        "scalar",
+        scalar_scores,
+        scalar_axpy,
+        scalar_scale,
+        {{"gpt2", GPT2Shape::head_dim, GPT2Shape::group, nullptr},
+         {"mistral", MistralShape::head_dim, MistralShape::group, nullptr}},
+    };
+
+#if defined(ATTENTION_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        kernels = {
+            "avx2",
+            avx2_scores,
+            avx2_axpy,
+            avx2_scale,
+            {ATTENTION_SHAPE("gpt2", GPT2Shape, avx2_page),
+             ATTENTION_SHAPE("mistral", MistralShape, avx2_page)},
+        };
+    }
+#elif defined(ATTENTION_NEON)
+    kernels = {
+        "neon",
+        neon_scores,
+        neon_axpy,
+        neon_scale,
+        {ATTENTION_SHAPE("gpt2", GPT2Shape, neon_page),
+         ATTENTION_SHAPE("mistral", MistralShape, neon_page)},
+    };
+#endif
+
+    return kernels;
+}
+
+static const struct AttentionKernels* attention_kernels() {
+    static const struct AttentionKernels selected = attention_select();
+    return &selected;
+}
+
+const char* attention_kernel_name() {
+    return attention_kernels()->name;
+}
+
+// the shape compiled for head_dim and group, nullptr for the generic path
+static const struct AttentionShape* attention_shape(size_t head_dim, size_t group) {
+    for (const struct AttentionShape &shape : attention_kernels()->shapes) {
+        if (shape.page && head_dim == shape.head_dim && group == shape.group) {
+            return &shape;
+        }
+    }
+    return nullptr;
+}
+
+const char* attention_specialization(const struct ModelConfig &config) {
+    const struct AttentionShape* shape
+        = attention_shape(config.n_embd / config.n_head, config.n_head / config.n_kv_head);
+    return shape ? shape->name : "generic";
+}
+
+//
+// attention
+//
+
+static void attention_check(
+    const struct KVCache    &cache,
+    const struct KVSequence &sequence,
+    size_t                   layer,
+    size_t                   pos,
+    size_t                   n,
+    const float*             q,
+    size_t                   n_head,
+    const float*             out
+) {
+    if (nullptr == q || nullptr == out) {
+        throw std::invalid_argument("Expected valid queries and output.");
+    }
+    if (layer >= cache.n_layer) {
+        throw std::out_of_range("Layer " + std::to_string(layer) + " is out of range.");
+    }
+    if (0 == n_head || 0 != n_head % cache.n_kv_head) {
+        throw std::invalid_argument("Expected a number of heads that the kv heads divide.");
+    }
+    if (pos + n > sequence.pages.size() * cache.page_tokens) {
+        throw std::out_of_range("Expected the keys and values of every position to be cached.");
+    }
+}
+
+// the running state of the queries of a task, grown on demand and kept for the life of the thread
+struct AttentionScratch {
+    std::vector<float> acc;    // Unnormalized output, a row of head_dim floats per query
+    std::vector<float> max;    // Largest score seen so far per query
+    std::vector<float> sum;    // Sum of the exponentials so far, relative to max
+    std::vector<float> scores; // Scores of a query against the keys of a page
+};
+
+static thread_local struct AttentionScratch attention_scratch;
+
+static void attention_run(
+    const struct AttentionShape* shape,
+    struct ThreadPool*           pool,
+    const struct KVCache        &cache,
+    const struct KVSequence     &sequence,
+    size_t                       layer,
+    size_t                       pos,
+    size_t                       n,
+    const float*                 q,
+    size_t                       n_head,
+    float*                       out
+) {
+    PROFILE_SCOPE("attention");
+
+    const struct AttentionKernels* kernels  = attention_kernels();
+    const size_t                   head_dim = cache.head_dim;
+    const size_t                   page     = cache.page_tokens;
+    const size_t                   group    = n_head / cache.n_kv_head;
+    const size_t                   row      = n_head * head_dim;
+    const size_t                   n_blocks = (n + ATTENTION_BLOCK_Q - 1) / ATTENTION_BLOCK_Q;
+    const float                    scale    = 1.0f / std::sqrt((float) head_dim);
+    const float                    lowest   = -std::numeric_limits<float>::infinity();
+
+    const TaskFunction task = [&](size_t task, size_t) {
+        const size_t kv_head = task / n_blocks;
+        const size_t i0      = task % n_blocks * ATTENTION_BLOCK_Q;
+        const size_t i1      = std::min(n, i0 + ATTENTION_BLOCK_Q);
+        const size_t rows    = (i1 - i0) * group;
+
+        struct AttentionScratch &scratch = attention_scratch;
+        scratch.acc.assign(rows * head_dim, 0.0f);
+        scratch.max.assign(rows, lowest);
+        scratch.sum.assign(rows, 0.0f);
+        scratch.scores.resize(group * page);
+
+        // every page up to the last position of the block, each read once for all its queries
+        const size_t last = pos + i1 - 1;
+        for (size_t start = 0; start <= last; start += page) {
+            const uint32_t id     = sequence.pages[start / page];
+            const float*   keys   = cache.keys(layer, id, kv_head);
+            const float*   values = cache.values(layer, id, kv_head);
+
+            for (size_t i = std::max(i0, start > pos ? start - pos : 0); i < i1; ++i) {
+                // causal, a query sees the keys up to and including its own position
+                const size_t n_keys  = std::min(page, pos + i + 1 - start);
+                const size_t r0      = (i - i0) * group;
+                const float* queries = q + i * row + kv_head * group * head_dim;
+                float*       scores  = scratch.scores.data();
+
+                if (shape) {
+                    float* acc = scratch.acc.data() + r0 * head_dim;
+                    float* max = scratch.max.data() + r0;
+                    float* sum = scratch.sum.data() + r0;
+                    shape->page(queries, keys, values, n_keys, scale, acc, max, sum, scores);
+                    continue;
+                }
+
+                for (size_t g = 0; g < group; ++g) {
+                    const size_t r     = r0 + g;
+                    const float* query = queries + g * head_dim;
+                    float*       acc   = scratch.acc.data() + r * head_dim;
+
+                    kernels->scores(query, keys, n_keys, head_dim, scores);
+                    for (size_t j = 0; j < n_keys; ++j) {
+                        scores[j] *= scale;
+                    }
+
+                    const float correction
+                        = attention_softmax(scores, n_keys, scratch.max[r], scratch.sum[r]);
+                    if (correction != 1.0f) {
+                        kernels->scale(acc, correction, head_dim);
+                    }
+                    for (size_t j = 0; j < n_keys; ++j) {
+                        kernels->axpy(acc, scores[j], values + j * head_dim, head_dim);
+                    }
+                }
+            }
+        }
+
+        for (size_t i = i0; i < i1; ++i) {
+            for (size_t g = 0; g < group; ++g) {
+                const size_t r   = (i - i0) * group + g;
+                float*       dst = out + i * row + (kv_head * group + g) * head_dim;
+                const float* acc = scratch.acc.data() + r * head_dim;
+                for (size_t d = 0; d < head_dim; ++d) {
+                    dst[d] = acc[d] / scratch.sum[r];
+                }
+            }
+        }
+    };
+
+    // two multiply-adds per key and dimension, for the scores and for the values
+    const size_t n_tasks = cache.n_kv_head * n_blocks;
+    const size_t work    = 2 * n * (pos + n) * n_head * head_dim;
+    if (pool && n_tasks > 1 && work >= ATTENTION_PARALLEL_MIN) {
+        pool->parallel_for(n_tasks, task);
+    } else {
+        for (size_t t = 0; t < n_tasks; ++t) {
+            task(t, 0);
+        }
+    }
+}
+
+void attention(
+    struct ThreadPool*       pool,
+    const struct KVCache    &cache,
+    const struct KVSequence &sequence,
+    size_t                   layer,
+    size_t                   pos,
+    size_t                   n,
+    const float*             q,
+    size_t                   n_head,
+    float*                   out
+) {
+    attention_check(cache, sequence, layer, pos, n, q, n_head, out);
+    if (0 == n) {
+        return;
+    }
+
+    const struct AttentionShape* shape = attention_shape(cache.head_dim, n_head / cache.n_kv_head);
+    attention_run(shape, pool, cache, sequence, layer, pos, n, q, n_head, out);
+}
+
+void attention_generic(
+    struct ThreadPool*       pool,
+    const struct KVCache    &cache,
+    const struct KVSequence &sequence,
+    size_t                   layer,
+    size_t                   pos,
+    size_t                   n,
+    const float*             q,
+    size_t                   n_head,
+    float*                   out
+) {
+    attention_check(cache, sequence, layer, pos, n, q, n_head, out);
+    if (0 == n) {
+        return;
+    }
+
+    attention_run(nullptr, pool, cache, sequence, layer, pos, n, q, n_head, out);
+}
+
+void attention_reference(
+    const struct KVCache    &cache,
+    const struct KVSequence &sequence,
+    size_t                   layer,
+    size_t                   pos,
+    size_t                   n,
+    const float*             q,
+    size_t                   n_head,
+    float*                   out
+) {
+    attention_check(cache, sequence, layer, pos, n, q, n_head, out);
+
+    const size_t       head_dim = cache.head_dim;
+    const size_t       group    = n_head / cache.n_kv_head;
+    const size_t       row      = n_head * head_dim;
+    const float        scale    = 1.0f / std::sqrt((float) head_dim);
+    std::vector<float> scores(pos + n);
+
+    for (size_t i = 0; i < n; ++i) {
+        const size_t n_keys = pos + i + 1;
+        for (size_t h = 0; h < n_head; ++h) {
+            const float* query   = q + i * row + h * head_dim;
+            const size_t kv_head = h / group;
+
+            float max = -std::numeric_limits<float>::infinity();
+            for (size_t t = 0; t < n_keys; ++t) {
+                const uint32_t id  = sequence.pages[t / cache.page_tokens];
+                const float*   key = cache.keys(layer, id, kv_head);
+                scores[t] = scalar_dot(query, key + t % cache.page_tokens * head_dim, head_dim);
+                scores[t] *= scale;
+                max = std::max(max, scores[t]);
+            }
+
+            float sum = 0.0f;
+            for (size_t t = 0; t < n_keys; ++t) {
+                scores[t] = std::exp(scores[t] - max);
+                sum += scores[t];
+            }
+
+            float* dst = out + i * row + h * head_dim;
+            std::fill(dst, dst + head_dim, 0.0f);
+            for (size_t t = 0; t < n_keys; ++t) {
+                const uint32_t id    = sequence.pages[t / cache.page_tokens];
+                const float*   value = cache.values(layer, id, kv_head);
+                const float*   slot  = value + t % cache.page_tokens * head_dim;
+                scalar_axpy(dst, scores[t] / sum, slot, head_dim);
+            }
+        }
+    }
+}
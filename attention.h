@@ -0,0 +1,75 @@
+#ifndef ATTENTION_H
+#define ATTENTION_H
+
+#include "kv-cache.h"
+#include "thread-pool.h"
+
+#include <cstddef>
+
+// positions of a chunk whose queries share every page of keys and values read for them
+#define ATTENTION_BLOCK_Q 16
+
+/**
+ * Causal attention for n positions of a sequence from pos on, over a layer of the cache.
+ *
+ * q and out hold n rows of n_head x head_dim floats. Query head h attends with kv head
+ * h / (n_head / n_kv_head), so grouped queries read the keys and values of their kv head once.
+ * The keys and values of the n positions must already be stored in the cache, position pos + i
+ * attends to positions 0 through pos + i.
+ *
+ * The scores are never materialized. Keys and values are read a page at a time, and for every
+ * ATTENTION_BLOCK_Q positions of each query head group a page is read once while it is in L1.
+ * The softmax is computed online, a running maximum and sum per query rescale what was
+ * accumulated so far, so the memory in use is a row of head_dim floats per query however long
+ * the context is. The work is split across pool by kv head and query block.
+ *
+ * The head_dim and group of the deployed layer shapes, see LayerShape, have page updates compiled
+ * with both as constants. They hold a query in registers for a whole page and load every key and
+ * value once for all query heads of a group. Other shapes take the generic path.
+ */
+void attention(
+    struct ThreadPool*       pool,
+    const struct KVCache    &cache,
+    const struct KVSequence &sequence,
+    size_t                   layer,
+    size_t                   pos,
+    size_t                   n,
+    const float*             q,
+    size_t                   n_head,
+    float*                   out
+);
+
+// attention as written down: every score of a query is computed and normalized before the
+// values are summed, e.g. to check attention() against.
+void attention_reference(
+    const struct KVCache    &cache,
+    const struct KVSequence &sequence,
+    size_t                   layer,
+    size_t                   pos,
+    size_t                   n,
+    const float*             q,
+    size_t                   n_head,
+    float*                   out
+);
+
+// attention() on the generic path whatever the shape, e.g. to measure the specialized kernels
+void attention_generic(
+    struct ThreadPool*       pool,
+    const struct KVCache    &cache,
+    const struct KVSequence &sequence,
+    size_t                   layer,
+    size_t                   pos,
+    size_t                   n,
+    const float*             q,
+    size_t                   n_head,
+    float*                   out
+);
+
+// instruction set of the attention kernels, e.g. "avx2"
+const char* attention_kernel_name();
+
+// the layer shape attention() is compiled for that a model's config matches, e.g. "gpt2", or
+// "generic" when there is none for its head_dim and group on this machine
+const char* attention_specialization(const struct ModelConfig &config);
+
+#endif // ATTENTION_H
@@ -0,0 +1,184 @@
+// Benchmark of the fused attention kernel against attention with materialized scores, for a
+// prompt prefilled in one chunk and for a decode step at the end of it. The kernels compiled for
+// the shape of the model, if there are any, are measured against the generic path as well.
+#include "attention.h"
+
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <getopt.h>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+// the milliseconds fn takes
+template <typename F>
+static double elapsed_ms(F fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// the largest difference from the reference relative to the largest reference magnitude
+static double relative_error(const std::vector<float> &out, const std::vector<float> &reference) {
+    double error = 0.0, scale = 0.0;
+    for (size_t i = 0; i < out.size(); ++i) {
+        error = std::max(error, (double) std::fabs(out[i] - reference[i]));
+        scale = std::max(scale, (double) std::fabs(reference[i]));
+    }
+    return scale > 0.0 ? error / scale : error;
+}
+
+int main(int argc, char* argv[]) {
+    const char* const   short_options  = "m:c:j:r:";
+    const struct option long_options[] = {
+        {"model-path", required_argument, nullptr, 'm'},
+        {"context", required_argument, nullptr, 'c'},
+        {"threads", required_argument, nullptr, 'j'},
+        {"rounds", required_argument, nullptr, 'r'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int                   opt;
+    std::filesystem::path directory = "models/openai-community/gpt2";
+    size_t                n_ctx     = 0; // the context of the model
+    size_t                n_threads = std::thread::hardware_concurrency();
+    size_t                rounds    = 3;
+
+    while ((opt = getopt_long(argc, argv, short_options, long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'm':
+                directory = std::filesystem::path(optarg);
+                break;
+
+            case 'c':
+                n_ctx = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'j':
+                n_threads = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'r':
+                rounds = strtoul(optarg, nullptr, 10);
+                break;
+
+            default:
+                fprintf(
+                    stderr,
+                    "Usage: %s [-m <model-path>] [-c <context>] [-j <threads>] [-r <rounds>]\n",
+                    argv[0]
+                );
+                return 1;
+        }
+    }
+
+    const std::filesystem::path config_path = directory / "config.json";
+    struct ModelConfig          config      = {};
+    try {
+        config = model_config_from_file(config_path.c_str());
+    } catch (const std::runtime_error &e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+
+    n_ctx          = n_ctx > 0 ? n_ctx : std::min<size_t>(config.n_ctx, 4096);
+    config.n_layer = 1; // a single layer is enough to time one
+
+    const size_t       n_pages  = (n_ctx + KV_PAGE_TOKENS - 1) / KV_PAGE_TOKENS;
+    struct KVCache*    cache    = malloc_kv_cache(config, n_pages);
+    struct ThreadPool* pool     = malloc_thread_pool(std::max<size_t>(1, n_threads));
+    struct KVSequence  sequence = {};
+    cache->reserve(sequence, n_ctx);
+
+    std::mt19937                          rng(42);
+    std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+
+    const size_t       kv_row = cache->n_kv_head * cache->head_dim;
+    const size_t       q_row  = config.n_head * cache->head_dim;
+    std::vector<float> k(n_ctx * kv_row), v(n_ctx * kv_row), q(n_ctx * q_row);
+    for (std::vector<float>* x : {&k, &v, &q}) {
+        for (float &e : *x) {
+            e = value(rng);
+        }
+    }
+    cache->store(sequence, 0, 0, n_ctx, k.data(), v.data());
+    cache->advance(sequence, n_ctx);
+
+    fprintf(
+        stdout,
+        "config: %s, %zu heads, %zu kv heads, head_dim %zu, context %zu, kernels %s (%s), "
+        "%zu threads\n",
+        config.type.c_str(),
+        config.n_head,
+        config.n_kv_head,
+        cache->head_dim,
+        n_ctx,
+        attention_kernel_name(),
+        attention_specialization(config),
+        pool->n_threads
+    );
+
+    // the score matrix a naive implementation keeps, against the running state of the kernel
+    const double naive_mib = (double) (config.n_head * n_ctx * n_ctx * sizeof(float)) / 1048576.0;
+    const double fused_kib = (double) (ATTENTION_BLOCK_Q * (config.n_head / config.n_kv_head)
+                                       * (cache->head_dim + 2) * sizeof(float))
+                           / 1024.0;
+    fprintf(
+        stdout, "scores: %.1f MiB materialized, %.1f KiB per task fused\n", naive_mib, fused_kib
+    );
+
+    // a whole prompt at once, the rest of a prompt prefilled in chunks from a position off a page
+    // boundary, and the last position alone as a decode step would see it
+    const size_t half = n_ctx / 2 - (n_ctx / 2 % KV_PAGE_TOKENS ? 0 : 1);
+    struct {
+        const char* name;
+        size_t      pos;
+        size_t      n;
+    } cases[] = {{"prefill", 0, n_ctx}, {"chunk", half, n_ctx - half}, {"decode", n_ctx - 1, 1}};
+
+    for (const auto &c : cases) {
+        std::vector<float> out(c.n * q_row), generic(c.n * q_row), reference(c.n * q_row);
+        const float*       queries = q.data() + c.pos * q_row;
+
+        const size_t n_head       = config.n_head;
+        const double reference_ms = elapsed_ms([&] {
+            attention_reference(*cache, sequence, 0, c.pos, c.n, queries, n_head, reference.data());
+        });
+
+        double fused_ms = 0.0;
+        for (size_t round = 0; round < rounds; ++round) {
+            fused_ms += elapsed_ms([&] {
+                attention(pool, *cache, sequence, 0, c.pos, c.n, queries, n_head, out.data());
+            });
+        }
+        fused_ms /= (double) std::max<size_t>(1, rounds);
+
+        double generic_ms = 0.0;
+        for (size_t round = 0; round < rounds; ++round) {
+            generic_ms += elapsed_ms([&] {
+                float* dst = generic.data();
+                attention_generic(pool, *cache, sequence, 0, c.pos, c.n, queries, n_head, dst);
+            });
+        }
+        generic_ms /= (double) std::max<size_t>(1, rounds);
+
+        fprintf(
+            stdout,
+            "%-7s: fused %9.3f ms, generic %9.3f ms, reference %9.3f ms, error %.2e, %.2e\n",
+            c.name,
+            fused_ms,
+            generic_ms,
+            reference_ms,
+            relative_error(out, reference),
+            relative_error(generic, reference)
+        );
+    }
+
+    free_thread_pool(pool);
+    free_kv_cache(cache);
+
+    return EXIT_SUCCESS;
+}
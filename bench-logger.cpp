@@ -0,0 +1,122 @@
+// Benchmark of the logger from several threads at once, synchronous against asynchronous, with
+// the lines written counted afterwards so no message goes missing unnoticed.
+#include "logger.h"
+
+#include <chrono>
+#include <fstream>
+#include <getopt.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// the lines of the file at path
+static size_t count_lines(const char* path) {
+    std::ifstream input(path);
+    size_t        n = 0;
+    for (std::string line; std::getline(input, line);) {
+        n++;
+    }
+    return n;
+}
+
+int main(int argc, char* argv[]) {
+    const char* const   short_options  = "o:j:n:i:";
+    const struct option long_options[] = {
+        {"output", required_argument, nullptr, 'o'},
+        {"threads", required_argument, nullptr, 'j'},
+        {"messages", required_argument, nullptr, 'n'},
+        {"interval", required_argument, nullptr, 'i'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int         opt;
+    const char* output     = "bench-logger.log";
+    size_t      n_threads  = 4;
+    size_t      n_messages = 100000; // per thread
+    size_t      interval   = 50;     // flush interval of the asynchronous mode, in ms
+
+    while ((opt = getopt_long(argc, argv, short_options, long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'o':
+                output = optarg;
+                break;
+
+            case 'j':
+                n_threads = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'n':
+                n_messages = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'i':
+                interval = strtoul(optarg, nullptr, 10);
+                break;
+
+            default:
+                fprintf(
+                    stderr,
+                    "Usage: %s [-o <output>] [-j <threads>] [-n <messages>] [-i <interval-ms>]\n",
+                    argv[0]
+                );
+                return 1;
+        }
+    }
+
+    n_threads = std::max<size_t>(1, n_threads);
+    fprintf(
+        stdout, "config: %zu threads, %zu messages each, output %s\n", n_threads, n_messages, output
+    );
+
+    for (bool async : {false, true}) {
+        struct Logger* logger = logger_create(LOG_LEVEL_INFO, LOG_TYPE_FILE, output);
+        if (nullptr == logger || LOG_TYPE_FILE != logger->log_type) {
+            fprintf(stderr, "Error: Failed to open %s for logging.\n", output);
+            return 1;
+        }
+
+        struct LoggerAsyncPolicy policy = LOGGER_ASYNC_POLICY_DEFAULT;
+        policy.flush_interval_ms        = interval;
+        if (async && !logger_async_start(logger, &policy)) {
+            return 1;
+        }
+
+        // a request's worth of trace, one message below the level that is filtered out
+        const auto start = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < n_threads; ++t) {
+            threads.emplace_back([&, t] {
+                for (size_t i = 0; i < n_messages; ++i) {
+                    LOG(logger, LOG_LEVEL_DEBUG, "request %zu: filtered\n", i);
+                    LOG(logger, LOG_LEVEL_INFO, "thread %zu, request %zu: %zu ids\n", t, i, i % 97);
+                }
+            });
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+
+        // the time the threads were held up, what is left to write is done by the writer
+        const auto   logged    = std::chrono::steady_clock::now();
+        const double logged_ms = std::chrono::duration<double, std::milli>(logged - start).count();
+
+        logger_destroy(logger);
+        const auto   end      = std::chrono::steady_clock::now();
+        const double total_ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+        const size_t n_total = n_threads * n_messages;
+        fprintf(
+            stdout,
+            "%-5s: %9.3f ms logging, %9.3f ms written, %7.1f ns per message, %zu of %zu lines\n",
+            async ? "async" : "sync",
+            logged_ms,
+            total_ms,
+            logged_ms * 1e6 / (double) std::max<size_t>(1, n_total),
+            count_lines(output),
+            n_total
+        );
+    }
+
+    return EXIT_SUCCESS;
+}
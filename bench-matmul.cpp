@@ -0,0 +1,205 @@
+// Benchmark of the matmul kernels for the shapes of the linear layers of a model, checked against
+// the scalar reference kernels on the same weights.
+#include "matmul.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <getopt.h>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// the milliseconds fn takes
+template <typename F>
+static double elapsed_ms(F fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// random n_out x n_in weights of type, stored the way a checkpoint would store them
+static std::vector<uint8_t> random_weights(data_t type, size_t n_out, size_t n_in, unsigned seed) {
+    std::mt19937                          rng(seed);
+    std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+    std::vector<float>                    row(n_in);
+    std::vector<uint8_t>                  weights(data_type_size(type, n_out * n_in));
+
+    const size_t row_bytes = data_type_size(type, n_in);
+    for (size_t j = 0; j < n_out; ++j) {
+        for (float &v : row) {
+            v = value(rng);
+        }
+
+        uint8_t* dst = weights.data() + j * row_bytes;
+        switch (type) {
+            case TYPE_FLOAT_F16:
+                convert_f32_to_f16(row.data(), reinterpret_cast<float16_t*>(dst), n_in);
+                break;
+            case TYPE_FLOAT_BF16:
+                convert_f32_to_bf16(row.data(), reinterpret_cast<bfloat16_t*>(dst), n_in);
+                break;
+            case TYPE_QUANT_K8:
+                quantize_row_q8(row.data(), reinterpret_cast<quant8_t*>(dst), n_in);
+                break;
+            case TYPE_QUANT_K4:
+                quantize_row_q4(row.data(), reinterpret_cast<quant4_t*>(dst), n_in);
+                break;
+            default:
+                memcpy(dst, row.data(), row_bytes);
+                break;
+        }
+    }
+    return weights;
+}
+
+// the largest difference from the reference relative to the largest reference magnitude
+static double relative_error(const std::vector<float> &out, const std::vector<float> &reference) {
+    double error = 0.0, scale = 0.0;
+    for (size_t i = 0; i < out.size(); ++i) {
+        error = std::max(error, (double) std::fabs(out[i] - reference[i]));
+        scale = std::max(scale, (double) std::fabs(reference[i]));
+    }
+    return scale > 0.0 ? error / scale : error;
+}
+
+int main(int argc, char* argv[]) {
+    const char* const   short_options  = "m:n:k:j:r:t:";
+    const struct option long_options[] = {
+        {"rows", required_argument, nullptr, 'm'},
+        {"out", required_argument, nullptr, 'n'},
+        {"in", required_argument, nullptr, 'k'},
+        {"threads", required_argument, nullptr, 'j'},
+        {"rounds", required_argument, nullptr, 'r'},
+        {"types", required_argument, nullptr, 't'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int                 opt;
+    std::vector<size_t> batches;
+    size_t              n_out     = 3072; // GPT-2 c_fc
+    size_t              n_in      = 768;
+    size_t              n_threads = std::thread::hardware_concurrency();
+    size_t              rounds    = 10;
+    std::vector<data_t> types;
+
+    while ((opt = getopt_long(argc, argv, short_options, long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'm':
+                batches.push_back(strtoul(optarg, nullptr, 10));
+                break;
+
+            case 'n':
+                n_out = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'k':
+                n_in = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'j':
+                n_threads = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'r':
+                rounds = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 't':
+                // a comma separated list of type names, e.g. f32,q8
+                for (char* name = strtok(optarg, ", "); name; name = strtok(nullptr, ", ")) {
+                    for (int type = 0; type < TYPE_MAX_COUNT; ++type) {
+                        if (0 == strcmp(name, data_type_name((data_t) type))) {
+                            types.push_back((data_t) type);
+                        }
+                    }
+                }
+                break;
+
+            default:
+                fprintf(
+                    stderr,
+                    "Usage: %s [-m <rows>]... [-n <out>] [-k <in>] [-j <threads>] [-r <rounds>] "
+                    "[-t <types>]\n",
+                    argv[0]
+                );
+                return 1;
+        }
+    }
+
+    if (batches.empty()) {
+        batches = {1, 64};
+    }
+    if (types.empty()) {
+        types = {TYPE_FLOAT_F32, TYPE_FLOAT_F16, TYPE_FLOAT_BF16, TYPE_QUANT_K8, TYPE_QUANT_K4};
+    }
+    n_threads = std::max<size_t>(1, n_threads);
+
+    const struct MatmulKernels* kernels = matmul_kernels();
+    struct ThreadPool*          pool    = malloc_thread_pool(n_threads);
+    fprintf(
+        stdout,
+        "kernels: tile %s %zu x %zu, gemv %s, quant %s, %zu threads\n",
+        kernels->name,
+        kernels->mr,
+        kernels->nr,
+        kernels->gemv_name,
+        precision_kernels()->quant_name,
+        n_threads
+    );
+
+    std::mt19937                          rng(7);
+    std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+
+    for (data_t type : types) {
+        const std::vector<uint8_t> weights = random_weights(type, n_out, n_in, 42);
+        for (size_t m : batches) {
+            std::vector<float> x(m * n_in), y(m * n_out), reference(m * n_out);
+            for (float &v : x) {
+                v = value(rng);
+            }
+
+            matmul_with(
+                &MATMUL_REFERENCE,
+                nullptr,
+                type,
+                weights.data(),
+                n_out,
+                n_in,
+                x.data(),
+                m,
+                reference.data()
+            );
+
+            double total = 0.0;
+            for (size_t round = 0; round < rounds; ++round) {
+                total += elapsed_ms([&] {
+                    matmul(pool, type, weights.data(), n_out, n_in, x.data(), m, y.data());
+                });
+            }
+
+            const double ms     = total / (double) std::max<size_t>(1, rounds);
+            const double gflops = 2.0 * (double) (m * n_out * n_in) / ms / 1e6;
+            const double gbps   = (double) weights.size() / ms / 1e6;
+            fprintf(
+                stdout,
+                "%-4s m %4zu, %zu x %zu: %8.3f ms, %7.2f GFLOP/s, %6.2f GB/s weights, "
+                "error %.2e\n",
+                data_type_name(type),
+                m,
+                n_out,
+                n_in,
+                ms,
+                gflops,
+                gbps,
+                relative_error(y, reference)
+            );
+        }
+    }
+
+    free_thread_pool(pool);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,270 @@
+// Benchmark of continuous batching against running one sequence at a time. The forward pass is
+// a stand-in with the cost profile of a real one, a stack of matmuls whose weights are read once
+// per step, so the gain of batching shows before the model itself exists.
+#include "matmul.h"
+#include "scheduler.h"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <getopt.h>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// prompts of a chat workload when no file is given, of mixed lengths
+static std::vector<std::string> builtin_prompts(size_t n) {
+    static const char* const topics[] = {
+        "the history of the printing press",
+        "how a compiler turns source code into machine code",
+        "why the sky is blue, in terms a child would understand",
+        "the differences between paged and segmented virtual memory",
+        "a recipe for bread that needs no kneading",
+        "the rules of chess, starting with how each piece moves",
+    };
+
+    std::vector<std::string> prompts;
+    for (size_t i = 0; i < n; ++i) {
+        std::string prompt = "Tell me about " + std::string(topics[i % 6]) + ".";
+        for (size_t j = 0; j < i % 4; ++j) {
+            prompt += " Please be thorough and give examples for every point you make.";
+        }
+        prompts.push_back(prompt);
+    }
+    return prompts;
+}
+
+int main(int argc, char* argv[]) {
+    const char* const   short_options  = "p:m:f:n:b:k:t:g:l:j:";
+    const struct option long_options[] = {
+        {"tokenizer", required_argument, nullptr, 'p'},
+        {"model-path", required_argument, nullptr, 'm'},
+        {"prompts", required_argument, nullptr, 'f'},
+        {"requests", required_argument, nullptr, 'n'},
+        {"sequences", required_argument, nullptr, 'b'},
+        {"kv-pages", required_argument, nullptr, 'k'},
+        {"batch-tokens", required_argument, nullptr, 't'},
+        {"new-tokens", required_argument, nullptr, 'g'},
+        {"layers", required_argument, nullptr, 'l'},
+        {"threads", required_argument, nullptr, 'j'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int                   opt;
+    std::filesystem::path tokenizer_path;
+    std::filesystem::path directory    = "models/openai-community/gpt2";
+    std::filesystem::path prompts_path;
+    size_t                n_requests   = 64;
+    size_t                n_sequences  = 32;
+    size_t                n_pages      = 1024;
+    size_t                batch_tokens = 512;
+    size_t                new_tokens   = 32;
+    size_t                n_layers     = 2;
+    size_t                n_threads    = std::thread::hardware_concurrency();
+
+    while ((opt = getopt_long(argc, argv, short_options, long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'p':
+                tokenizer_path = std::filesystem::path(optarg);
+                break;
+
+            case 'm':
+                directory = std::filesystem::path(optarg);
+                break;
+
+            case 'f':
+                prompts_path = std::filesystem::path(optarg);
+                break;
+
+            case 'n':
+                n_requests = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'b':
+                n_sequences = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'k':
+                n_pages = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 't':
+                batch_tokens = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'g':
+                new_tokens = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'l':
+                n_layers = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'j':
+                n_threads = strtoul(optarg, nullptr, 10);
+                break;
+
+            default:
+                fprintf(
+                    stderr,
+                    "Usage: %s -p <tokenizer> [-m <model-path>] [-f <prompts>] [-n <requests>] "
+                    "[-b <sequences>] [-k <kv-pages>] [-t <batch-tokens>] [-g <new-tokens>] "
+                    "[-l <layers>] [-j <threads>]\n",
+                    argv[0]
+                );
+                return 1;
+        }
+    }
+
+    if (tokenizer_path.empty()) {
+        fprintf(stderr, "Error: Expected a tokenizer image or directory with -p.\n");
+        return 1;
+    }
+
+    struct Tokenizer* tokenizer = nullptr;
+    try {
+        if (std::filesystem::is_directory(tokenizer_path)) {
+            std::ifstream f(tokenizer_path / "tokenizer.json");
+            tokenizer = malloc_tokenizer(nlohmann::json::parse(f));
+        } else {
+            tokenizer = mmap_tokenizer(tokenizer_path.c_str());
+        }
+    } catch (const std::exception &e) {
+        fprintf(stderr, "Error: Unable to load %s: %s\n", tokenizer_path.c_str(), e.what());
+        return 1;
+    }
+
+    // one prompt per line
+    std::vector<std::string> prompts;
+    if (!prompts_path.empty()) {
+        std::ifstream input(prompts_path);
+        for (std::string line; std::getline(input, line) && prompts.size() < n_requests;) {
+            if (!line.empty()) {
+                prompts.push_back(line);
+            }
+        }
+    } else {
+        prompts = builtin_prompts(n_requests);
+    }
+
+    const std::filesystem::path config_path = directory / "config.json";
+    struct ModelConfig          config      = {};
+    try {
+        config = model_config_from_file(config_path.c_str());
+    } catch (const std::runtime_error &e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        free_tokenizer(tokenizer);
+        return 1;
+    }
+
+    // two matmuls a layer, n_embd to n_ff and back, with random weights
+    std::mt19937                          rng(42);
+    std::uniform_real_distribution<float> value(-0.05f, 0.05f);
+    std::vector<std::vector<float>>       weights(2 * n_layers);
+    for (size_t i = 0; i < weights.size(); ++i) {
+        weights[i].resize(config.n_embd * config.n_ff);
+        for (float &w : weights[i]) {
+            w = value(rng);
+        }
+    }
+
+    struct ThreadPool* pool      = malloc_thread_pool(std::max<size_t>(1, n_threads));
+    size_t             positions = 0; // run by the forward passes of a scheduler
+    std::vector<float> x, hidden;
+
+    const ForwardFunction forward = [&](const struct Batch &batch, struct KVCache* cache,
+                                        uint32_t* next) {
+        const size_t n = batch.ids.size();
+        positions += n;
+        x.resize(n * config.n_embd);
+        hidden.resize(n * config.n_ff);
+        for (size_t i = 0; i < n; ++i) {
+            for (size_t j = 0; j < config.n_embd; ++j) {
+                x[i * config.n_embd + j] = (float) ((batch.ids[i] + j) % 17) / 17.0f;
+            }
+        }
+
+        for (size_t layer = 0; layer < n_layers; ++layer) {
+            const float* up   = weights[2 * layer].data();
+            const float* down = weights[2 * layer + 1].data();
+            const size_t d    = config.n_embd;
+            matmul(pool, TYPE_FLOAT_F32, up, config.n_ff, d, x.data(), n, hidden.data());
+            matmul(pool, TYPE_FLOAT_F32, down, d, config.n_ff, hidden.data(), n, x.data());
+        }
+
+        // the keys and values of every layer, the stand-in stores its activations for both
+        for (size_t e = 0; e < batch.entries.size(); ++e) {
+            const struct BatchEntry &entry = batch.entries[e];
+            for (size_t i = 0; i < entry.n; ++i) {
+                const float* kv = x.data() + (batch.offsets[e] + i) * config.n_embd;
+                for (size_t layer = 0; layer < cache->n_layer; ++layer) {
+                    cache->store(entry.sequence->kv, layer, entry.pos + i, 1, kv, kv);
+                }
+            }
+
+            // a deterministic next id, so runs with different batching produce the same text
+            const uint64_t seed = entry.sequence->id * 7919 + entry.pos + entry.n;
+            next[e]             = (uint32_t) (seed * 2654435761u % config.n_vocab);
+        }
+    };
+
+    const uint32_t eos_id = tokenizer->eos_token ? (uint32_t) tokenizer->eos_token->id : UINT32_MAX;
+
+    fprintf(
+        stdout,
+        "config: %s, %zu requests, %zu new tokens, %zu layers of %zu x %zu, %zu threads\n",
+        config.type.c_str(),
+        prompts.size(),
+        new_tokens,
+        n_layers,
+        config.n_embd,
+        config.n_ff,
+        pool->n_threads
+    );
+
+    // one sequence at a time is the static baseline the scheduler is measured against
+    for (size_t sequences : {std::max<size_t>(1, n_sequences), (size_t) 1}) {
+        struct KVCache*   cache     = malloc_kv_cache(config, n_pages);
+        struct Scheduler* scheduler = malloc_scheduler(
+            cache, tokenizer, forward, sequences, batch_tokens, config.n_ctx, eos_id
+        );
+
+        positions            = 0;
+        size_t latency_steps = 0; // steps from submission to the last id, summed over requests
+        scheduler->on_token  = [&](const struct ScheduledSequence &, uint32_t, bool finished) {
+            latency_steps += finished ? scheduler->n_steps + 1 : 0;
+        };
+
+        std::vector<std::string_view> views(prompts.begin(), prompts.end());
+        const auto                    start = std::chrono::steady_clock::now();
+        scheduler->submit(views, new_tokens, pool->n_threads);
+        scheduler->run();
+        const auto   end     = std::chrono::steady_clock::now();
+        const double seconds = std::chrono::duration<double>(end - start).count();
+
+        fprintf(
+            stdout,
+            "sequences %3zu: %zu steps, %zu prefilled, %zu generated, %zu preempted, %.2f s, "
+            "%.1f tokens/s, %.1f positions per step, %.1f steps to finish\n",
+            sequences,
+            scheduler->n_steps,
+            scheduler->n_prefilled,
+            scheduler->n_generated,
+            scheduler->n_preemptions,
+            seconds,
+            (double) scheduler->n_generated / seconds,
+            (double) positions / (double) std::max<size_t>(1, scheduler->n_steps),
+            (double) latency_steps / (double) std::max<size_t>(1, prompts.size())
+        );
+
+        free_scheduler(scheduler);
+        free_kv_cache(cache);
+    }
+
+    free_thread_pool(pool);
+    free_tokenizer(tokenizer);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,103 @@
+// Benchmark of a tokenizer loaded from its SentencePiece tokenizer.model against the same
+// tokenizer loaded from tokenizer.json, e.g. for Mistral.
+#include "tokenizer.h"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+// the milliseconds fn takes
+template <typename F>
+static double elapsed_ms(F fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// encode text in rounds and return the ids of the last round and its mean milliseconds
+static double bench_encode(
+    const struct Tokenizer* tokenizer,
+    const std::string      &text,
+    size_t                  rounds,
+    std::vector<uint32_t>  &ids
+) {
+    const TokenSink sink = [&](const uint32_t* chunk, size_t n) {
+        ids.insert(ids.end(), chunk, chunk + n);
+    };
+
+    double total = 0.0;
+    for (size_t round = 0; round < rounds; ++round) {
+        ids.clear();
+        total += elapsed_ms([&] { tokenizer->encode_stream(text.data(), text.size(), sink); });
+    }
+    return total / (double) rounds;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <model-directory> <text-file> [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    const std::filesystem::path directory = argv[1];
+    const size_t                rounds    = argc > 3 ? strtoul(argv[3], nullptr, 10) : 5;
+
+    std::ifstream     input(argv[2]);
+    std::stringstream buffer;
+    buffer << input.rdbuf();
+    const std::string text = buffer.str();
+
+    const std::filesystem::path json_path  = directory / "tokenizer.json";
+    const std::filesystem::path model_path = directory / "tokenizer.model";
+
+    // loading includes compiling the image, as that is what a cold start pays
+    struct Tokenizer* json  = nullptr;
+    struct Tokenizer* model = nullptr;
+
+    const double json_load_ms = elapsed_ms([&] {
+        std::ifstream f(json_path);
+        json = malloc_tokenizer(nlohmann::json::parse(f));
+    });
+    const double model_load_ms = elapsed_ms([&] {
+        model = malloc_sentencepiece_tokenizer(model_path.c_str());
+    });
+
+    // the caches would hide the merge loop, and the Viterbi search, after the first round
+    free_bpe_cache(json->cache);
+    free_bpe_cache(model->cache);
+    json->cache  = nullptr;
+    model->cache = nullptr;
+
+    std::vector<uint32_t> json_ids, model_ids;
+    const double          json_ms  = bench_encode(json, text, rounds, json_ids);
+    const double          model_ms = bench_encode(model, text, rounds, model_ids);
+
+    const double mb = (double) text.size() / (1024.0 * 1024.0);
+    fprintf(stdout, "text: %.2f MiB x %zu rounds\n", mb, rounds);
+    fprintf(
+        stdout,
+        "tokenizer.json:  %s, %8.2f ms load (%8ju bytes), %8.2f MiB/s, %zu ids\n",
+        json->type().c_str(),
+        json_load_ms,
+        (uintmax_t) std::filesystem::file_size(json_path),
+        mb / (json_ms / 1000.0),
+        json_ids.size()
+    );
+    fprintf(
+        stdout,
+        "tokenizer.model: %s, %8.2f ms load (%8ju bytes), %8.2f MiB/s, %zu ids\n",
+        model->type().c_str(),
+        model_load_ms,
+        (uintmax_t) std::filesystem::file_size(model_path),
+        mb / (model_ms / 1000.0),
+        model_ids.size()
+    );
+    fprintf(stdout, "ids: %s\n", json_ids == model_ids ? "identical" : "different");
+
+    free_tokenizer(json);
+    free_tokenizer(model);
+
+    return json_ids == model_ids ? 0 : 1;
+}
@@ -0,0 +1,490 @@
+// Throughput benchmark of whole tokenizers over several kinds of text. The results are written as
+// JSON so that runs on the same hardware can be compared between releases, e.g.
+//
+//     bench_tokenizer -p models/openai-community/gpt2 -c prose=book.txt -j 8 -o gpt2.json
+//
+// without -c the built-in samples are repeated up to -n bytes. they only exercise the code paths,
+// real corpora give figures worth tracking.
+#include "tokenizer.h"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <getopt.h>
+#include <sstream>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+// A named text whose lines are encoded as separate documents.
+struct BenchCorpus {
+    std::string                   name;      // Label of the corpus in the output
+    std::string                   text;      // Every document, newline separated
+    std::vector<std::string_view> documents; // Lines of text
+};
+
+static const char* const BENCH_ENGLISH =
+    "It was the best of times, it was the worst of times, it was the age of wisdom, it was the "
+    "age of foolishness, it was the epoch of belief, it was the epoch of incredulity.\n"
+    "The committee's report, published on Tuesday, recommended that the 1,250 remaining units "
+    "be decommissioned by the end of 2031 — a decade earlier than planned.\n"
+    "She hadn't expected the letter to arrive so soon; the postmark read \"3 March\", yet it "
+    "was barely the first week of February.\n"
+    "Photosynthesis converts light energy into chemical energy that can later be released to "
+    "fuel the organism's activities.\n";
+
+static const char* const BENCH_CODE =
+    "static int parse_header(const uint8_t* data, size_t size, struct header* out) {\n"
+    "    if (size < sizeof(*out)) { return -EINVAL; }\n"
+    "    memcpy(out, data, sizeof(*out)); // the wire format is little endian\n"
+    "    for (size_t i = 0; i < out->n_sections; ++i) { out->offsets[i] += 0x40; }\n"
+    "def tokenize(self, text: str) -> list[int]:\n"
+    "        return [self.vocab.get(word, self.unk_id) for word in text.split()]\n"
+    "const result = await fetch(`${baseUrl}/api/v2/items?limit=${limit}`).then((r) => r.json());"
+    "\n"
+    "SELECT id, name, COUNT(*) AS n FROM orders WHERE created_at >= '2024-01-01' GROUP BY 1, 2;"
+    "\n";
+
+static const char* const BENCH_CJK =
+    "今天天气很好，我们一起去公园散步吧。机器学习是人工智能的一个分支。\n"
+    "吾輩は猫である。名前はまだ無い。どこで生れたかとんと見当がつかぬ。\n"
+    "안녕하세요. 오늘은 날씨가 정말 좋네요. 한국어 문장을 토큰화합니다.\n"
+    "東京都の人口は約1400万人です。北京是中华人民共和国的首都。\n";
+
+// zero width joiners, variation selectors, skin tones and flags, written out so they show
+static const char* const BENCH_EMOJI =
+    "Congrats!!! \U0001F389\U0001F389\U0001F389 so proud of you \U0001F60D\U0001F64C "
+    "#winning\n"
+    "family trip \U0001F468\u200D\U0001F469\u200D\U0001F467\u200D\U0001F466 \u2708\uFE0F "
+    "\U0001F1EF\U0001F1F5 \U0001F363\U0001F35C\U0001F375\n"
+    "status: \u2705 done \u274C failed \u26A0\uFE0F warning \U0001F525 hot "
+    "\U0001F44D\U0001F3FD\n"
+    "lol \U0001F602\U0001F602\U0001F923 that's \U0001F4AF true \U0001F64F\U0001F3FB "
+    "\U0001F3F3\uFE0F\u200D\U0001F308\n";
+
+// the milliseconds since start
+static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::milli>(elapsed).count();
+}
+
+// the value below which fraction of the sorted samples fall
+static double percentile(const std::vector<double> &sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    return sorted[(size_t) (fraction * (double) (sorted.size() - 1) + 0.5)];
+}
+
+// peak resident memory of the process so far, in KiB on linux
+static long peak_rss_kib() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// resident memory of the process right now, in KiB
+static long rss_kib() {
+    long  pages    = 0;
+    long  resident = 0;
+    FILE* statm    = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (2 != fscanf(statm, "%ld %ld", &pages, &resident)) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// load a tokenizer the way the tokenizer tool does: a tokenizer.model, a binary image produced
+// by convert, or a directory with a tokenizer.json
+static struct Tokenizer* bench_load(const std::filesystem::path &path) {
+    if (std::filesystem::is_regular_file(path) && ".model" == path.extension()) {
+        return malloc_sentencepiece_tokenizer(path.c_str());
+    }
+    if (std::filesystem::is_regular_file(path)) {
+        return mmap_tokenizer(path.c_str());
+    }
+    std::ifstream f(path / "tokenizer.json");
+    if (!f) {
+        throw std::runtime_error("Unable to open " + (path / "tokenizer.json").string());
+    }
+    return malloc_tokenizer(nlohmann::json::parse(f));
+}
+
+static void bench_split(struct BenchCorpus &corpus) {
+    corpus.documents.clear();
+    std::string_view text = corpus.text;
+    while (!text.empty()) {
+        const size_t end = text.find('\n');
+        const size_t cut = std::string_view::npos == end ? text.size() : end + 1;
+        corpus.documents.push_back(text.substr(0, cut));
+        text.remove_prefix(cut);
+    }
+}
+
+// repeat sample until it holds at least size bytes
+static struct BenchCorpus bench_sample(const char* name, const char* sample, size_t size) {
+    struct BenchCorpus corpus = {name, "", {}};
+    while (corpus.text.size() < size) {
+        corpus.text += sample;
+    }
+    return corpus;
+}
+
+// encode and decode the documents of corpus one call at a time, then as batches
+static nlohmann::json bench_corpus(
+    struct Tokenizer*          tokenizer,
+    const struct BenchCorpus  &corpus,
+    size_t                     rounds,
+    const std::vector<size_t> &threads
+) {
+    const double mib = (double) corpus.text.size() / (1024.0 * 1024.0);
+
+    // the first pass warms the word cache like any long running process would
+    std::vector<std::vector<uint32_t>> ids(corpus.documents.size());
+    size_t                             n_tokens = 0;
+    for (size_t i = 0; i < corpus.documents.size(); ++i) {
+        ids[i]    = tokenizer->encode(corpus.documents[i]);
+        n_tokens += ids[i].size();
+    }
+
+    std::vector<double> latencies;
+    latencies.reserve(corpus.documents.size() * rounds);
+    double encode_ms = 0.0;
+    for (size_t round = 0; round < rounds; ++round) {
+        for (const std::string_view &document : corpus.documents) {
+            const auto start = std::chrono::steady_clock::now();
+            tokenizer->encode(document);
+            const double ms  = elapsed_ms(start);
+            encode_ms       += ms;
+            latencies.push_back(ms * 1000.0);
+        }
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    // out is reused, so this mostly measures the table lookups and copies
+    std::string out;
+    double      decode_ms = 0.0;
+    for (size_t round = 0; round < rounds; ++round) {
+        const auto start = std::chrono::steady_clock::now();
+        for (const std::vector<uint32_t> &document : ids) {
+            out.clear();
+            tokenizer->decode(document.data(), document.size(), out);
+        }
+        decode_ms += elapsed_ms(start);
+    }
+
+    const double seconds = encode_ms / 1000.0;
+    nlohmann::json result = {
+        {"corpus", corpus.name},
+        {"bytes", corpus.text.size()},
+        {"documents", corpus.documents.size()},
+        {"tokens", n_tokens},
+        {"encode",
+         {{"mib_per_s", mib * (double) rounds / seconds},
+          {"tokens_per_s", (double) (n_tokens * rounds) / seconds},
+          {"p50_us", percentile(latencies, 0.50)},
+          {"p99_us", percentile(latencies, 0.99)}}},
+        {"decode", {{"tokens_per_s", (double) (n_tokens * rounds) / (decode_ms / 1000.0)}}},
+        {"batch", nlohmann::json::array()},
+    };
+
+    for (size_t n_threads : threads) {
+        double batch_ms = 0.0;
+        for (size_t round = 0; round < rounds; ++round) {
+            const auto start = std::chrono::steady_clock::now();
+            tokenizer->encode_batch(corpus.documents, n_threads);
+            batch_ms += elapsed_ms(start);
+        }
+
+        const double batch_seconds = batch_ms / 1000.0;
+        result["batch"].push_back({
+            {"threads", n_threads},
+            {"mib_per_s", mib * (double) rounds / batch_seconds},
+            {"tokens_per_s", (double) (n_tokens * rounds) / batch_seconds},
+        });
+    }
+
+    fprintf(
+        stderr,
+        "  %-10s %8.2f MiB/s %12.0f tokens/s  p50 %7.2f us  p99 %8.2f us  decode %12.0f "
+        "tokens/s\n",
+        corpus.name.c_str(),
+        result["encode"]["mib_per_s"].get<double>(),
+        result["encode"]["tokens_per_s"].get<double>(),
+        result["encode"]["p50_us"].get<double>(),
+        result["encode"]["p99_us"].get<double>(),
+        result["decode"]["tokens_per_s"].get<double>()
+    );
+    for (const nlohmann::json &batch : result["batch"]) {
+        fprintf(
+            stderr,
+            "  %-10s %8.2f MiB/s %12.0f tokens/s  batch of %zu threads\n",
+            "",
+            batch["mib_per_s"].get<double>(),
+            batch["tokens_per_s"].get<double>(),
+            batch["threads"].get<size_t>()
+        );
+    }
+
+    return result;
+}
+
+// load the tokenizer at path and run it over every corpus
+static nlohmann::json bench_tokenizer(
+    const std::filesystem::path           &path,
+    const std::vector<struct BenchCorpus> &corpora,
+    size_t                                 rounds,
+    const std::vector<size_t>             &threads,
+    bool                                   cache
+) {
+    // each load starts from scratch, the mean of the rounds is reported. load_ms is the whole of
+    // bench_load, reading and parsing a tokenizer.json included, and build_ms the part of it
+    // spent in the tokenizer itself, as it reports in Tokenizer::load_ms.
+    double            load_ms   = 0.0;
+    double            build_ms  = 0.0;
+    struct Tokenizer* tokenizer = nullptr;
+    for (size_t round = 0; round < rounds; ++round) {
+        free_tokenizer(tokenizer);
+        tokenizer         = nullptr;
+        const auto start  = std::chrono::steady_clock::now();
+        tokenizer         = bench_load(path);
+        load_ms          += elapsed_ms(start);
+        build_ms         += tokenizer->load_ms;
+    }
+    load_ms  /= (double) rounds;
+    build_ms /= (double) rounds;
+
+    if (!cache) {
+        free_bpe_cache(tokenizer->cache);
+        tokenizer->cache = nullptr;
+    }
+
+    // tokenizer.model and tokenizer.bin are told apart by the model they belong to
+    std::string name = path.filename().string();
+    if ("tokenizer" == path.stem() && path.has_parent_path()) {
+        name = (path.parent_path().filename() / path.filename()).string();
+    }
+    fprintf(
+        stderr,
+        "%s: %s, %.2f ms load, %.2f ms of it reading and parsing\n",
+        name.c_str(),
+        tokenizer->type().c_str(),
+        load_ms,
+        load_ms - build_ms
+    );
+
+    nlohmann::json result = {
+        {"tokenizer", name},
+        {"path", path.string()},
+        {"type", tokenizer->type()},
+        {"load_ms", load_ms},
+        {"parse_ms", load_ms - build_ms},
+        {"corpora", nlohmann::json::array()},
+    };
+    for (const struct BenchCorpus &corpus : corpora) {
+        result["corpora"].push_back(bench_corpus(tokenizer, corpus, rounds, threads));
+    }
+
+    free_tokenizer(tokenizer);
+    return result;
+}
+
+// run bench_tokenizer in a child process of its own. ru_maxrss never decreases and memory a
+// tokenizer frees is kept by the allocator, so in one process every tokenizer would report the
+// peak of all of them. the child reports how far its peak rose above what it started with, i.e.
+// the memory of the tokenizer and its runs alone. returns false when the child failed.
+static bool bench_isolated(
+    const std::filesystem::path           &path,
+    const std::vector<struct BenchCorpus> &corpora,
+    size_t                                 rounds,
+    const std::vector<size_t>             &threads,
+    bool                                   cache,
+    nlohmann::json                        &result
+) {
+    int channel[2];
+    if (0 != pipe(channel)) {
+        fprintf(stderr, "Error: Unable to create a pipe for %s.\n", path.c_str());
+        return false;
+    }
+
+    fflush(stderr);
+    const pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Error: Unable to fork for %s.\n", path.c_str());
+        close(channel[0]);
+        close(channel[1]);
+        return false;
+    }
+
+    if (0 == pid) {
+        close(channel[0]);
+        int status = 0;
+        try {
+            const long     base   = rss_kib();
+            nlohmann::json output = bench_tokenizer(path, corpora, rounds, threads, cache);
+            output["peak_rss_growth_kib"] = peak_rss_kib() - base;
+
+            const std::string json = output.dump();
+            for (size_t n = 0; n < json.size() && 0 == status;) {
+                const ssize_t written = write(channel[1], json.data() + n, json.size() - n);
+                status                = written < 0 ? 1 : 0;
+                n                    += written < 0 ? 0 : (size_t) written;
+            }
+        } catch (const std::exception &e) {
+            fprintf(stderr, "Error: Unable to benchmark %s: %s\n", path.c_str(), e.what());
+            status = 1;
+        }
+        close(channel[1]);
+        fflush(stderr);
+        _exit(status);
+    }
+
+    close(channel[1]);
+    std::string json;
+    char        buffer[4096];
+    for (ssize_t n; (n = read(channel[0], buffer, sizeof(buffer))) > 0;) {
+        json.append(buffer, (size_t) n);
+    }
+    close(channel[0]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || 0 != WEXITSTATUS(status)) {
+        return false;
+    }
+    result = nlohmann::json::parse(json);
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    const char* const   short_options  = "p:c:j:r:n:o:x";
+    const struct option long_options[] = {
+        {"tokenizer-path", required_argument, nullptr, 'p'},
+        {"corpus", required_argument, nullptr, 'c'},
+        {"threads", required_argument, nullptr, 'j'},
+        {"rounds", required_argument, nullptr, 'r'},
+        {"size", required_argument, nullptr, 'n'},
+        {"output", required_argument, nullptr, 'o'},
+        {"no-cache", no_argument, nullptr, 'x'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int                                opt;
+    std::vector<std::filesystem::path> paths;
+    std::vector<struct BenchCorpus>    corpora;
+    std::filesystem::path              output_file;
+    size_t                             n_threads = std::thread::hardware_concurrency();
+    size_t                             rounds    = 5;
+    size_t                             size      = 1 << 20; // bytes of each built-in sample
+    bool                               cache     = true;
+
+    while ((opt = getopt_long(argc, argv, short_options, long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'p':
+                paths.push_back(std::filesystem::path(optarg));
+                break;
+
+            case 'c': {
+                // name=path, or just a path which is then also the name
+                const std::string argument = optarg;
+                const size_t      equals   = argument.find('=');
+                const std::string name     = argument.substr(0, equals);
+                const std::string path     = std::string::npos == equals
+                                                 ? argument
+                                                 : argument.substr(equals + 1);
+
+                std::ifstream input(path);
+                if (!input) {
+                    fprintf(stderr, "Error: Unable to open %s.\n", path.c_str());
+                    return 1;
+                }
+                std::stringstream buffer;
+                buffer << input.rdbuf();
+                corpora.push_back({name, buffer.str(), {}});
+                break;
+            }
+
+            case 'j':
+                n_threads = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'r':
+                rounds = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'n':
+                size = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'o':
+                output_file = std::filesystem::path(optarg);
+                break;
+
+            case 'x':
+                cache = false;
+                break;
+
+            default:
+                fprintf(
+                    stderr,
+                    "Usage: %s [-p <tokenizer-path>]... [-c [<name>=]<file>]... [-j <threads>] "
+                    "[-r <rounds>] [-n <bytes>] [-o <file>] [-x]\n",
+                    argv[0]
+                );
+                return 1;
+        }
+    }
+
+    if (paths.empty()) {
+        paths = {"models/openai-community/gpt2", "models/mistralai/Mistral-7B-Instruct-v0.1"};
+    }
+    if (corpora.empty()) {
+        corpora.push_back(bench_sample("english", BENCH_ENGLISH, size));
+        corpora.push_back(bench_sample("code", BENCH_CODE, size));
+        corpora.push_back(bench_sample("cjk", BENCH_CJK, size));
+        corpora.push_back(bench_sample("emoji", BENCH_EMOJI, size));
+    }
+    for (struct BenchCorpus &corpus : corpora) {
+        bench_split(corpus); // the views are only taken once the texts stop moving
+    }
+    rounds    = std::max<size_t>(rounds, 1);
+    n_threads = std::max<size_t>(n_threads, 1);
+
+    std::vector<size_t> threads = {1};
+    if (n_threads > 1) {
+        threads.push_back(n_threads);
+    }
+
+    nlohmann::json report = {
+        {"rounds", rounds},
+        {"threads", n_threads},
+        {"cache", cache},
+        {"tokenizers", nlohmann::json::array()},
+    };
+
+    for (const std::filesystem::path &path : paths) {
+        nlohmann::json result;
+        if (!bench_isolated(path, corpora, rounds, threads, cache, result)) {
+            return 1;
+        }
+        report["tokenizers"].push_back(result);
+    }
+
+    const std::string json = report.dump(2);
+    if (output_file.empty()) {
+        fprintf(stdout, "%s\n", json.c_str());
+    } else {
+        std::ofstream out(output_file);
+        out << json << "\n";
+        if (!out) {
+            fprintf(stderr, "Error: Unable to write %s.\n", output_file.c_str());
+            return 1;
+        }
+    }
+
+    return 0;
+}
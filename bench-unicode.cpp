@@ -0,0 +1,104 @@
+// Microbenchmark of utf-8 decoding on ascii-heavy text, where the vectorized ascii runs carry
+// most of the work, against a character at a time decoder that validates the same way.
+#include "unicode.h"
+
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// decode one character at a time, the way the ascii kernels fall back to
+static void decode_scalar(const std::string &utf8, std::vector<uint32_t> &cpts) {
+    cpts.resize(utf8.size());
+    size_t n_cpts = 0;
+    for (size_t offset = 0; offset < utf8.size();) {
+        const unsigned char c   = (unsigned char) utf8[offset];
+        const size_t        len = unicode_len_utf8((char) c);
+        if (0x80 == (c & 0xc0) || c >= 0xf8 || offset + len > utf8.size()) {
+            throw std::invalid_argument("invalid character");
+        }
+
+        uint32_t cpt = len > 1 ? c & (0x7f >> len) : c;
+        for (size_t i = 1; i < len; ++i) {
+            const unsigned char next = (unsigned char) utf8[offset + i];
+            if (0x80 != (next & 0xc0)) {
+                throw std::invalid_argument("invalid character");
+            }
+            cpt = (cpt << 6) | (next & 0x3f);
+        }
+
+        static const uint32_t min_cpt[5] = {0, 0, 0x80, 0x800, 0x10000};
+        if (cpt < min_cpt[len] || cpt > 0x10ffff || (0xd800 <= cpt && cpt <= 0xdfff)) {
+            throw std::invalid_argument("invalid character");
+        }
+        cpts[n_cpts++]  = cpt;
+        offset         += len;
+    }
+    cpts.resize(n_cpts);
+}
+
+// time fn over text and return the bytes decoded per nanosecond, i.e. GB/s
+template <typename F>
+static double bench(const std::string &text, size_t rounds, F fn) {
+    std::vector<uint32_t> cpts;
+    cpts.reserve(text.size());
+    size_t checksum = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; ++round) {
+        fn(text, cpts);
+        checksum += cpts.size() + cpts.back();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    // keep the decoding from being optimized away
+    if (1 == checksum) {
+        fprintf(stderr, "checksum: %zu\n", checksum);
+    }
+
+    const double elapsed = std::chrono::duration<double, std::nano>(end - start).count();
+    return (double) (text.size() * rounds) / elapsed;
+}
+
+// repeat sample until it holds at least size bytes
+static std::string repeat(const char* sample, size_t size) {
+    std::string text;
+    while (text.size() < size) {
+        text += sample;
+    }
+    return text;
+}
+
+int main(int argc, char* argv[]) {
+    const size_t rounds = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100;
+    const size_t size   = 1 << 20;
+
+    // from all ascii down to no ascii, e.g. source code, english prose, and chinese
+    const struct {
+        const char* name;
+        std::string text;
+    } samples[] = {
+        {"ascii", repeat("for (size_t i = 0; i < n; ++i) { sum += x[i] * y[i]; }\n", size)},
+        {"english",
+         repeat(
+             "The café opened at nine — “early,” she said, and ordered a "
+             "crème brûlée. Nobody else came in until the rain stopped.\n",
+             size
+         )},
+        {"chinese", repeat("快速的棕色狐狸跳过懒狗。\n", size)},
+    };
+
+    fprintf(stdout, "%-8s %12s %12s %8s\n", "text", "scalar GB/s", "vector GB/s", "speedup");
+    for (const auto &sample : samples) {
+        const double scalar = bench(sample.text, rounds, decode_scalar);
+        const double vector = bench(sample.text, rounds, [](const std::string &text, auto &cpts) {
+            unicode_cpts_from_utf8(text, cpts);
+        });
+        fprintf(
+            stdout, "%-8s %12.3f %12.3f %7.2fx\n", sample.name, scalar, vector, vector / scalar
+        );
+    }
+
+    return EXIT_SUCCESS;
+}
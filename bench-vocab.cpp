@@ -0,0 +1,102 @@
+// Microbenchmark of the vocab index against the std::map it replaced.
+#include "tokenizer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <random>
+#include <unordered_map>
+
+// time fn over every query and return the mean nanoseconds per lookup
+template <typename F>
+static double bench(const std::vector<std::string> &queries, size_t rounds, F fn) {
+    size_t checksum = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; ++round) {
+        for (const std::string &query : queries) {
+            checksum += fn(query);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    // keep the lookups from being optimized away
+    if (1 == checksum) {
+        fprintf(stderr, "checksum: %zu\n", checksum);
+    }
+
+    const double elapsed = std::chrono::duration<double, std::nano>(end - start).count();
+    return elapsed / (double) (queries.size() * rounds);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <tokenizer-path> [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    const std::filesystem::path path   = argv[1];
+    const size_t                rounds = argc > 2 ? strtoul(argv[2], nullptr, 10) : 10;
+
+    struct Tokenizer* tokenizer = nullptr;
+    if (std::filesystem::is_regular_file(path)) {
+        tokenizer = mmap_tokenizer(path.c_str());
+    } else {
+        std::ifstream f(path / "tokenizer.json");
+        tokenizer = malloc_tokenizer(nlohmann::json::parse(f));
+    }
+
+    const struct TokenizerModel* model = tokenizer->model;
+
+    // the containers under comparison, keyed on the same bytes as the index
+    std::map<std::string, size_t>           ordered;
+    std::unordered_map<std::string, size_t> unordered;
+    std::vector<std::string>                queries;
+    for (size_t slot = 0; slot < model->n_buckets; ++slot) {
+        const uint32_t id = model->vocab[slot].id;
+        if (TOKENIZER_NO_ID != id) {
+            const std::string token(model->token(id));
+            ordered[token]   = id;
+            unordered[token] = id;
+            queries.push_back(token);
+            queries.push_back(token + "\x01"); // a miss that shares the prefix of a hit
+        }
+    }
+    std::shuffle(queries.begin(), queries.end(), std::mt19937(42));
+
+    const double map_ns = bench(queries, rounds, [&](const std::string &query) {
+        auto it = ordered.find(query);
+        return ordered.end() == it ? 0 : it->second;
+    });
+
+    const double unordered_ns = bench(queries, rounds, [&](const std::string &query) {
+        auto it = unordered.find(query);
+        return unordered.end() == it ? 0 : it->second;
+    });
+
+    const double index_ns = bench(queries, rounds, [&](const std::string &query) {
+        return (size_t) model->find(query).value_or(0);
+    });
+
+    fprintf(
+        stdout,
+        "vocab: %zu tokens, %zu queries x %zu rounds\n",
+        model->n_vocab,
+        queries.size(),
+        rounds
+    );
+    fprintf(stdout, "std::map:           %8.2f ns/lookup\n", map_ns);
+    fprintf(stdout, "std::unordered_map: %8.2f ns/lookup\n", unordered_ns);
+    fprintf(
+        stdout,
+        "vocab index:        %8.2f ns/lookup (%.2fx vs std::map)\n",
+        index_ns,
+        map_ns / index_ns
+    );
+
+    free_tokenizer(tokenizer);
+
+    return 0;
+}
@@ -0,0 +1,250 @@
+"""
+Module: gen.parity
+
+Runs the C++ tokenizer and Hugging Face tokenizers over the same corpus and checks that both
+produce the same ids for every document, then compares their throughput.
+
+Every line of the corpus is a document, as with `tokenizer -f`. Both sides encode without
+special tokens, since the C++ tokenizer has no post-processor.
+
+Usage:
+    python -m gen.parity models/openai-community/gpt2 corpus.txt --binary build/tokenizer
+    python -m gen.parity models/mistralai/Mistral-7B-Instruct-v0.1 corpus.txt \\
+        --cpp-tokenizer models/mistralai/Mistral-7B-Instruct-v0.1/tokenizer.model --threads 8
+
+The exit status is 1 when any document differs, so it can gate changes to the encoder.
+"""
+
+import argparse
+import dataclasses
+import logging
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import time
+from pathlib import Path
+from typing import Optional
+
+logger = logging.getLogger(__file__)
+
+
+@dataclasses.dataclass(frozen=True)
+class Run:
+    """The ids of every document and the best milliseconds an encoder took over the rounds."""
+
+    ids: list[list[int]]
+    ms: float
+
+
+@dataclasses.dataclass(frozen=True)
+class Mismatch:
+    """A document whose ids differ, along with the first position where they do."""
+
+    index: int  # Line number of the document, 0-indexed
+    text: str  # The offending input
+    expected: list[int]  # Ids from Hugging Face tokenizers
+    actual: list[int]  # Ids from the C++ tokenizer
+    position: int  # First index where the sequences differ
+
+
+def read_documents(path: Path) -> list[str]:
+    """Split the corpus the way std::getline does: on '\\n' only, without a trailing empty line."""
+    text = path.read_bytes().decode("utf-8")
+    documents = text.split("\n")
+    if documents and documents[-1] == "":
+        documents.pop()
+    return documents
+
+
+def run_cpp(binary: Path, tokenizer: Path, corpus: Path, threads: int, rounds: int) -> Run:
+    """Encode the corpus with the tokenizer tool, which reports the time of encode_batch alone."""
+    best = float("inf")
+    ids: list[list[int]] = []
+    with tempfile.TemporaryDirectory() as directory:
+        output = Path(directory) / "ids.txt"
+        command = [
+            str(binary),
+            "-p",
+            str(tokenizer),
+            "-f",
+            str(corpus),
+            "-j",
+            str(threads),
+            "-o",
+            str(output),
+        ]
+        for _ in range(rounds):
+            result = subprocess.run(command, capture_output=True, text=True, check=True)
+            match = re.search(r"ms: ([0-9.]+)", result.stdout)
+            if match is None:
+                raise RuntimeError(f"Unexpected output from {binary}: {result.stdout}")
+            best = min(best, float(match.group(1)))
+
+        with open(output, encoding="ascii") as lines:
+            ids = [[int(id) for id in line.split()] for line in lines]
+    return Run(ids=ids, ms=best)
+
+
+def run_hf(tokenizer: Path, documents: list[str], rounds: int) -> Run:
+    """Encode the documents with Hugging Face tokenizers, loading afresh for every round."""
+    from tokenizers import Tokenizer
+
+    best = float("inf")
+    ids: list[list[int]] = []
+    for _ in range(rounds):
+        # a fresh tokenizer starts with an empty cache, like a fresh process of the tool
+        hf = Tokenizer.from_file(str(tokenizer / "tokenizer.json"))
+        start = time.perf_counter()
+        encodings = hf.encode_batch(documents, add_special_tokens=False)
+        best = min(best, (time.perf_counter() - start) * 1000.0)
+        ids = [encoding.ids for encoding in encodings]
+    return Run(ids=ids, ms=best)
+
+
+def compare(documents: list[str], expected: Run, actual: Run) -> list[Mismatch]:
+    if len(expected.ids) != len(actual.ids):
+        raise RuntimeError(
+            f"Expected {len(expected.ids)} documents from the C++ tokenizer, "
+            f"got {len(actual.ids)} instead."
+        )
+
+    mismatches = []
+    for index, (hf, cpp) in enumerate(zip(expected.ids, actual.ids)):
+        if hf != cpp:
+            position = next(
+                (i for i, (a, b) in enumerate(zip(hf, cpp)) if a != b), min(len(hf), len(cpp))
+            )
+            mismatches.append(Mismatch(index, documents[index], hf, cpp, position))
+    return mismatches
+
+
+def report_mismatch(mismatch: Mismatch, tokenizer: Path, context: int = 4) -> None:
+    from tokenizers import Tokenizer
+
+    hf = Tokenizer.from_file(str(tokenizer / "tokenizer.json"))
+    lo = max(0, mismatch.position - context)
+    hi = mismatch.position + context
+
+    def tokens(ids: list[int]) -> list[Optional[str]]:
+        return [hf.id_to_token(id) for id in ids[lo:hi]]
+
+    logger.error(
+        "document %d differs at id %d: %r", mismatch.index, mismatch.position, mismatch.text
+    )
+    logger.error("  tokenizers: %s %s", mismatch.expected[lo:hi], tokens(mismatch.expected))
+    logger.error("  c++:        %s %s", mismatch.actual[lo:hi], tokens(mismatch.actual))
+
+
+def get_arguments() -> argparse.Namespace:
+    parser = argparse.ArgumentParser(
+        description="Compare the C++ tokenizer against Hugging Face tokenizers"
+    )
+
+    parser.add_argument(
+        "tokenizer",
+        type=Path,
+        help="Model directory holding the tokenizer.json",
+    )
+
+    parser.add_argument(
+        "corpus",
+        type=Path,
+        help="UTF-8 text file, every line is encoded as a document",
+    )
+
+    parser.add_argument(
+        "--binary",
+        type=Path,
+        default=Path("build/tokenizer"),
+        help="The tokenizer tool (default: build/tokenizer)",
+    )
+
+    # e.g. a tokenizer.bin produced by convert or a tokenizer.model, to check those loaders too
+    parser.add_argument(
+        "--cpp-tokenizer",
+        type=Path,
+        help="Tokenizer path passed to the C++ tool (default: the model directory)",
+    )
+
+    parser.add_argument(
+        "--threads",
+        type=int,
+        default=1,
+        help="Threads for both encoders, 0 uses every core (default: 1)",
+    )
+
+    parser.add_argument(
+        "--rounds",
+        type=int,
+        default=3,
+        help="Runs of each encoder, the fastest is reported (default: 3)",
+    )
+
+    parser.add_argument(
+        "--max-mismatches",
+        type=int,
+        default=10,
+        help="Mismatches to print in full (default: 10)",
+    )
+
+    parser.add_argument(
+        "--verbose",
+        action="store_true",
+        help="Output debug messages (default: False)",
+    )
+
+    return parser.parse_args()
+
+
+def main():
+    args = get_arguments()
+
+    logging.basicConfig(level=logging.DEBUG if args.verbose else logging.INFO, format="%(message)s")
+
+    # the thread pool of tokenizers is sized from the environment when it is first used
+    if args.threads == 1:
+        os.environ["TOKENIZERS_PARALLELISM"] = "false"
+    elif args.threads > 1:
+        os.environ["TOKENIZERS_PARALLELISM"] = "true"
+        os.environ["RAYON_RS_NUM_CPUS"] = str(args.threads)
+
+    documents = read_documents(args.corpus)
+    size = sum(len(document.encode("utf-8")) + 1 for document in documents)
+    logger.info("corpus: %d documents, %.2f MiB", len(documents), size / (1024 * 1024))
+
+    rounds = max(1, args.rounds)
+    cpp_tokenizer = args.cpp_tokenizer or args.tokenizer
+    actual = run_cpp(args.binary, cpp_tokenizer, args.corpus, args.threads, rounds)
+    expected = run_hf(args.tokenizer, documents, rounds)
+
+    mismatches = compare(documents, expected, actual)
+    for mismatch in mismatches[: args.max_mismatches]:
+        report_mismatch(mismatch, args.tokenizer)
+
+    n_ids = sum(len(ids) for ids in expected.ids)
+    logger.info(
+        "parity: %d of %d documents differ, %d ids", len(mismatches), len(documents), n_ids
+    )
+
+    mib = size / (1024 * 1024)
+    logger.info(
+        "tokenizers: %8.2f ms, %8.2f MiB/s, %12.0f tokens/s",
+        expected.ms,
+        mib / (expected.ms / 1000.0),
+        n_ids / (expected.ms / 1000.0),
+    )
+    logger.info(
+        "c++:        %8.2f ms, %8.2f MiB/s, %12.0f tokens/s (%.2fx)",
+        actual.ms,
+        mib / (actual.ms / 1000.0),
+        n_ids / (actual.ms / 1000.0),
+        expected.ms / actual.ms,
+    )
+
+    sys.exit(1 if mismatches else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -123,9 +123,10 @@ class Codepoint:
 
     @staticmethod
     def parse_decomposition(field: str) -> tuple[str, int, ...]:
-        tokens = field.split(" ")
-        special = [tokens[0]]
-        values = [int(v, base=16) for v in tokens[1:]]
+        # e.g. "<compat> 0020 0301" or "0041 0300", the tag is empty for canonical mappings
+        tokens = field.split()
+        special = [tokens.pop(0)] if tokens and tokens[0].startswith("<") else [""]
+        values = [int(v, base=16) for v in tokens]
         return tuple(special + values)
 
     @classmethod
@@ -274,6 +275,50 @@ class CODEPOINT_FLAG:
     PUNCTUATION = 0x0020  # \p{P}
     SYMBOL = 0x0040  # \p{S}
     CONTROL = 0x0080  # \p{C}
+    # helper flags
+    WHITESPACE = 0x0100  # \s
+    LOWERCASE = 0x0200
+    UPPERCASE = 0x0400
+    NFD = 0x0800
+
+
+class NORMALIZATION_FLAG:
+    """
+    Class representing the normalization properties of a codepoint as defined in Unicode Standard
+    Annex #15 (https://www.unicode.org/reports/tr15/)
+
+    Attributes:
+        COMBINING_CLASS (int): Mask of the canonical combining class
+            (0x00FF)
+        NFD_NO (int): The codepoint never occurs in NFD text
+            (0x0100)
+        NFKD_NO (int): The codepoint never occurs in NFKD text
+            (0x0200)
+        NFC_NO (int): The codepoint never occurs in NFC text
+            (0x0400)
+        NFC_MAYBE (int): The codepoint may compose with the character before it
+            (0x0800)
+        NFKC_NO (int): The codepoint never occurs in NFKC text
+            (0x1000)
+        NFKC_MAYBE (int): The codepoint may compose with the character before it
+            (0x2000)
+
+    NOTE: See definition in unicode.cpp for implementation.
+    """
+
+    COMBINING_CLASS = 0x00FF
+    NFD_NO = 0x0100
+    NFKD_NO = 0x0200
+    NFC_NO = 0x0400
+    NFC_MAYBE = 0x0800
+    NFKC_NO = 0x1000
+    NFKC_MAYBE = 0x2000
+
+
+# hangul syllables are composed algorithmically, see section 3.12 of the Unicode Standard
+HANGUL_S_BASE, HANGUL_S_COUNT = 0xAC00, 11172
+HANGUL_V_BASE, HANGUL_V_COUNT = 0x1161, 21
+HANGUL_T_BASE, HANGUL_T_COUNT = 0x11A7, 28
 
 
 class CODEPOINT_CATEGORY:
@@ -374,12 +419,16 @@ class UnicodeTable:
     lowercase: list[tuple[int, int]] = dataclasses.field(default_factory=list)
     uppercase: list[tuple[int, int]] = dataclasses.field(default_factory=list)
     nfd: list[tuple[int, int]] = dataclasses.field(default_factory=list)
+    combining: list[tuple[int, int]] = dataclasses.field(default_factory=list)
+    decomposition: list[tuple[int, str, tuple[int, ...]]] = dataclasses.field(default_factory=list)
 
     def sort(self) -> None:
         self.whitespace.sort()
         self.lowercase.sort()
         self.uppercase.sort()
         self.nfd.sort()
+        self.combining.sort()
+        self.decomposition.sort()
 
 
 @dataclasses.dataclass
@@ -501,6 +550,7 @@ class CodepointProcessor:
             self.set_lowercase_table(codepoint)
             self.set_uppercase_table(codepoint)
             self.set_nfd_table(codepoint)
+            self.set_decomposition_table(codepoint)
 
         self.set_whitespace_table()
         self.unicode_table.sort()
@@ -525,6 +575,13 @@ class CodepointProcessor:
         if norm != codepoint.code:
             self._unicode_table.nfd.append((codepoint.code, norm))
 
+    def set_decomposition_table(self, codepoint: Codepoint) -> None:
+        if codepoint.cononical_cc:
+            self._unicode_table.combining.append((codepoint.code, codepoint.cononical_cc))
+        tag, *mapping = codepoint.decomposition
+        if mapping:
+            self._unicode_table.decomposition.append((codepoint.code, tag, tuple(mapping)))
+
     def set_whitespace_table(self) -> None:
         # whitespaces, see "<White_Space>" https://www.unicode.org/Public/UCD/latest/ucd/PropList.txt
         self._unicode_table.whitespace.extend(range(0x0009, 0x000D + 1))
@@ -533,6 +590,127 @@ class CodepointProcessor:
             [0x0020, 0x0085, 0x00A0, 0x1680, 0x2028, 0x2029, 0x202F, 0x205F, 0x3000]
         )
 
+    def codepoint_values(self) -> dict[str, list[int]]:
+        """return the value of every codepoint for each two-stage table"""
+        flags = list(self._codepoint_flags)
+        for code in self._unicode_table.whitespace:
+            flags[code] |= CODEPOINT_FLAG.WHITESPACE
+        for _, lower in self._unicode_table.lowercase:
+            flags[lower] |= CODEPOINT_FLAG.LOWERCASE
+        for _, upper in self._unicode_table.uppercase:
+            flags[upper] |= CODEPOINT_FLAG.UPPERCASE
+        for _, _, norm in self._codepoint_ranges.nfd:
+            flags[norm] |= CODEPOINT_FLAG.NFD
+
+        # mappings are stored as the offset from the codepoint, so blocks deduplicate
+        lowercase = [0] * self.MAX_CODEPOINTS
+        for code, lower in self._unicode_table.lowercase:
+            lowercase[code] = lower - code
+        uppercase = [0] * self.MAX_CODEPOINTS
+        for code, upper in self._unicode_table.uppercase:
+            uppercase[code] = upper - code
+        nfd = [0] * self.MAX_CODEPOINTS
+        for code, norm in self._unicode_table.nfd:
+            nfd[code] = norm - code
+
+        normalization, decomposition = self.normalization_values()
+
+        return {
+            "flags": flags,
+            "lowercase": lowercase,
+            "uppercase": uppercase,
+            "nfd": nfd,
+            "normalization": normalization,
+            "decomposition": decomposition,
+        }
+
+    def combining_classes(self) -> dict[int, int]:
+        return dict(self._unicode_table.combining)
+
+    def full_decompositions(self, compat: bool) -> dict[int, tuple[int, ...]]:
+        """return the recursive decomposition of every codepoint that has one, in canonical order"""
+        combining = self.combining_classes()
+        mappings = {code: (tag, mapping) for code, tag, mapping in self._unicode_table.decomposition}
+
+        def decompose(code: int) -> list[int]:
+            if code in mappings and (compat or not mappings[code][0]):
+                return [cpt for value in mappings[code][1] for cpt in decompose(value)]
+            return [code]
+
+        decompositions = {}
+        for code in mappings:
+            cpts = decompose(code)
+            # canonical ordering: a stable sort of each run of non-starters by combining class
+            for i in range(1, len(cpts)):
+                j = i
+                while j > 0 and 0 < combining.get(cpts[j], 0) < combining.get(cpts[j - 1], 0):
+                    cpts[j - 1], cpts[j] = cpts[j], cpts[j - 1]
+                    j -= 1
+            if cpts != [code]:
+                decompositions[code] = tuple(cpts)
+        return decompositions
+
+    def compositions(self) -> list[tuple[int, int, int]]:
+        """return the (first, second, composite) of every primary composite, sorted by pair"""
+        combining = self.combining_classes()
+        compositions = []
+        for code, tag, mapping in self._unicode_table.decomposition:
+            if tag or 2 != len(mapping):
+                continue  # compatibility mappings and singletons never compose
+            if combining.get(code, 0) or combining.get(mapping[0], 0):
+                continue  # non-starter decompositions are excluded from composition
+            if unicodedata.normalize("NFC", chr(code)) != chr(code):
+                continue  # listed in CompositionExclusions.txt
+            compositions.append((mapping[0], mapping[1], code))
+        return sorted(compositions)
+
+    def decomposition_pool(self) -> tuple[list[int], dict[tuple[int, ...], int]]:
+        """return the pool of full decompositions, each stored as its length then its codepoints"""
+        pool = [0]  # offset 0 stands for no decomposition
+        offsets: dict[tuple[int, ...], int] = {}
+        for compat in (False, True):
+            for cpts in self.full_decompositions(compat).values():
+                if cpts not in offsets:
+                    offsets[cpts] = len(pool)
+                    pool.extend((len(cpts),) + cpts)
+        assert len(pool) <= 0x10000, "decomposition offsets must fit in uint16_t"
+        return pool, offsets
+
+    def normalization_values(self) -> tuple[list[int], list[int]]:
+        """return the quick check flags and the decomposition offsets of every codepoint"""
+        canonical = self.full_decompositions(compat=False)
+        compatible = self.full_decompositions(compat=True)
+        composites = {composite for _, _, composite in self.compositions()}
+        seconds = {second for _, second, _ in self.compositions()}
+        _, offsets = self.decomposition_pool()
+
+        normalization = [0] * self.MAX_CODEPOINTS
+        decomposition = [0] * self.MAX_CODEPOINTS
+        for code, combining_class in self._unicode_table.combining:
+            normalization[code] |= combining_class
+        for code, cpts in canonical.items():
+            normalization[code] |= NORMALIZATION_FLAG.NFD_NO
+            if code not in composites:
+                normalization[code] |= NORMALIZATION_FLAG.NFC_NO | NORMALIZATION_FLAG.NFKC_NO
+            decomposition[code] |= offsets[cpts]
+        for code, cpts in compatible.items():
+            normalization[code] |= NORMALIZATION_FLAG.NFKD_NO
+            if cpts != canonical.get(code):
+                normalization[code] |= NORMALIZATION_FLAG.NFKC_NO
+            decomposition[code] |= offsets[cpts] << 16
+
+        # hangul syllables decompose into jamo, and the vowel and trailing jamo compose again
+        for code in range(HANGUL_S_BASE, HANGUL_S_BASE + HANGUL_S_COUNT):
+            normalization[code] |= NORMALIZATION_FLAG.NFD_NO | NORMALIZATION_FLAG.NFKD_NO
+        seconds.update(range(HANGUL_V_BASE, HANGUL_V_BASE + HANGUL_V_COUNT))
+        seconds.update(range(HANGUL_T_BASE + 1, HANGUL_T_BASE + HANGUL_T_COUNT))
+        for code in seconds:
+            normalization[code] |= NORMALIZATION_FLAG.NFC_MAYBE
+            if not normalization[code] & NORMALIZATION_FLAG.NFKC_NO:
+                normalization[code] |= NORMALIZATION_FLAG.NFKC_MAYBE
+
+        return normalization, decomposition
+
     def group_flag_ranges(self):
         # group ranges with same flags
         self._codepoint_ranges.flags = [(0, self._codepoint_flags[0])]  # first, flags
@@ -552,6 +730,50 @@ class CodepointProcessor:
             self._codepoint_ranges.nfd[-1] = (first, codepoint, norm)
 
 
+@dataclasses.dataclass
+class TwoStageTable:
+    """
+    A per-codepoint table split into blocks of `1 << shift` codepoints. Identical blocks are
+    stored once, so the value of a codepoint is two array reads:
+
+        data[(index[cpt >> shift] << shift) | (cpt & ((1 << shift) - 1))]
+
+    Attributes:
+        shift (int): log2 of the block size
+        index (list[int]): Block number of each block of codepoints
+        data (list[int]): The deduplicated blocks, concatenated
+    """
+
+    shift: int
+    index: list[int]
+    data: list[int]
+
+    @classmethod
+    def from_values(cls, values: list[int], value_size: int) -> "TwoStageTable":
+        """build the table with the block size that minimizes its size in bytes"""
+        best = None
+        for shift in range(4, 12):
+            block_size = 1 << shift
+            blocks: dict[tuple[int, ...], int] = {}
+            index = []
+            data = []
+            for first in range(0, len(values), block_size):
+                block = tuple(values[first : first + block_size])
+                block += (block[-1],) * (block_size - len(block))
+                if block not in blocks:
+                    blocks[block] = len(blocks)
+                    data.extend(block)
+                index.append(blocks[block])
+            assert len(blocks) <= 0x10000, "block numbers must fit in uint16_t"
+            table = cls(shift, index, data)
+            if best is None or table.size(value_size) < best.size(value_size):
+                best = table
+        return best
+
+    def size(self, value_size: int) -> int:
+        return 2 * len(self.index) + value_size * len(self.data)
+
+
 """
 Module: gen.unicode
 
@@ -593,41 +815,72 @@ def get_arguments() -> argparse.Namespace:
     return parser.parse_args()
 
 
-def build_unicode_data_h(max_codepoints: int = 0x110000) -> str:
+# name, C type, size in bytes of each table
+UNICODE_TABLES = [
+    ("flags", "uint16_t", 2),
+    ("lowercase", "int32_t", 4),
+    ("uppercase", "int32_t", 4),
+    ("nfd", "int32_t", 4),
+    ("normalization", "uint16_t", 2),
+    ("decomposition", "uint32_t", 4),
+]
+
+
+def build_unicode_data_h(
+    tables: dict[str, TwoStageTable],
+    compositions: list[tuple[int, int, int]],
+    max_codepoints: int = 0x110000,
+) -> str:
     # NOTE: The resulting string is segmented to prevent formatting conflicts with braces
     unicode_data_h = """\
     // generated with python gguf.cli.unicode
     #ifndef UNICODE_DATA_H
     #define UNICODE_DATA_H
 
-    #include <cstdint>
-    #include <vector>
-    #include <unordered_map>
-    #include <unordered_set>
+    #include <cstdint>\n
+    """
 
+    unicode_data_h += f"""\
+    static const uint32_t MAX_CODEPOINTS = {max_codepoints};\n
+    """
+
+    unicode_data_h += """\
     /**
-     * @brief Represents a Unicode character range with normalized form D (NFD)
+     * @brief Two-stage tables indexed by codepoint, see TwoStageTable in gen/unicode.py
+     *
+     * The value of a codepoint below MAX_CODEPOINTS is
+     * data[(index[cpt >> SHIFT] << SHIFT) | (cpt & ((1 << SHIFT) - 1))]. The case and NFD
+     * tables hold the offset from the codepoint to its mapping.
      */
-    struct range_nfd {
-        uint32_t first;
-        uint32_t last;
-        uint32_t nfd;
-    };\n
     """
 
-    unicode_data_h += f"""\
-    static const uint32_t MAX_CODEPOINTS = {max_codepoints};\n
+    for name, ctype, _ in UNICODE_TABLES:
+        unicode_data_h += f"""\
+    static const uint32_t UNICODE_{name.upper()}_SHIFT = {tables[name].shift};
+    extern const uint16_t unicode_{name}_index[];
+    extern const {ctype} unicode_{name}_data[];\n
     """
 
     unicode_data_h += """\
     /**
-     * @brief Externally linked variables for Unicode data structures
+     * @brief Full decompositions, each stored as its length followed by its codepoints
+     *
+     * The decomposition table holds the offset of the canonical decomposition of a codepoint in
+     * the low 16 bits and of its compatibility decomposition in the high 16 bits, 0 for none.
      */
-    extern const std::vector<std::pair<uint32_t, uint16_t>> unicode_ranges_flags;
-    extern const std::unordered_set<uint32_t> unicode_set_whitespace;
-    extern const std::unordered_map<uint32_t, uint32_t> unicode_map_lowercase;
-    extern const std::unordered_map<uint32_t, uint32_t> unicode_map_uppercase;
-    extern const std::vector<range_nfd> unicode_ranges_nfd;
+    extern const uint32_t unicode_decomposition_pool[];\n
+    """
+
+    unicode_data_h += f"""\
+    /**
+     * @brief Primary composites, sorted by the pair they compose from: first << 21 | second
+     */
+    static const uint32_t UNICODE_N_COMPOSITIONS = {len(compositions)};
+    extern const uint64_t unicode_composition_pairs[];
+    extern const uint32_t unicode_composition_cpts[];\n
+    """
+
+    unicode_data_h += """\
     #endif // UNICODE_DATA_H
     """
 
@@ -635,109 +888,81 @@ def build_unicode_data_h(max_codepoints: int = 0x110000) -> str:
     return "\n".join([line.strip() for line in unicode_data_h.split("\n")])
 
 
-# TODO: define helper functions for setting mapping?
-def set_ranges_flags(processor: CodepointProcessor, byte_order: str = "little") -> str:
-    unicode_ranges_flags = (
-        "// codepoint, flag // last=next_first-1\n"
-        "const std::vector<std::pair<uint32_t, uint16_t>> unicode_ranges_flags = {\n"
+def format_array(declaration: str, values: list[str], width: int = 100) -> str:
+    """format an array definition wrapped to width columns"""
+    lines = [f"{declaration} = {{"]
+    line = "   "
+    for value in values:
+        if len(line) + len(value) + 2 > width:
+            lines.append(line)
+            line = "   "
+        line += f" {value},"
+    lines.append(line)
+    lines.append("};\n\n")
+    return "\n".join(lines)
+
+
+def set_two_stage_table(name: str, ctype: str, table: TwoStageTable) -> str:
+    unicode_table = f"// block number of every {1 << table.shift} codepoints\n"
+    unicode_table += format_array(
+        f"const uint16_t unicode_{name}_index[]", ["%d" % index for index in table.index]
     )
-    logger.debug(unicode_ranges_flags)
-
-    for code, flag in processor.codepoint_ranges.flags:
-        line = "{0x%06X, 0x%04X}," % (code, flag)
-        logger.debug(line)
-        unicode_ranges_flags += line
-
-    line = "};\n\n"
-    logger.debug(line)
-
-    return unicode_ranges_flags + line
-
-
-def set_unicode_whitespace(processor: CodepointProcessor) -> str:
-    unicode_set_whitespace = "const std::unordered_set<uint32_t> unicode_set_whitespace = {\n"
-    logger.debug(unicode_set_whitespace)
-
-    for code in processor.unicode_table.whitespace:
-        line = "0x%06X" % code
-        logger.debug(line)
-        unicode_set_whitespace += f"{line}, "
-
-    line = "};\n\n"
-    logger.debug(line)
-
-    return unicode_set_whitespace + line
+    if "uint16_t" == ctype:
+        values = ["0x%04X" % value for value in table.data]
+    elif "uint32_t" == ctype:
+        values = ["0x%08X" % value for value in table.data]
+    else:
+        values = ["%d" % value for value in table.data]
+    unicode_table += format_array(f"const {ctype} unicode_{name}_data[]", values)
+    logger.debug(unicode_table)
+    return unicode_table
 
 
-def set_unicode_lowercase(processor: CodepointProcessor) -> str:
-    unicode_map_lowercase = (
-        "const std::unordered_map<uint32_t, uint32_t> unicode_map_lowercase = {\n"
+def set_normalization_arrays(pool: list[int], compositions: list[tuple[int, int, int]]) -> str:
+    unicode_arrays = format_array(
+        "const uint32_t unicode_decomposition_pool[]", ["0x%04X" % cpt for cpt in pool]
     )
-
-    for code, flag in processor.unicode_table.lowercase:
-        line = "{0x%06X, 0x%06X}," % (code, flag)
-        logger.debug(line)
-        unicode_map_lowercase += line
-
-    line = "};\n\n"
-    logger.debug(line)
-
-    return unicode_map_lowercase + line
-
-
-def set_unicode_uppercase(processor: CodepointProcessor) -> str:
-    unicode_map_uppercase = (
-        "const std::unordered_map<uint32_t, uint32_t> unicode_map_uppercase = {\n"
+    unicode_arrays += format_array(
+        "const uint64_t unicode_composition_pairs[]",
+        ["0x%011X" % (first << 21 | second) for first, second, _ in compositions],
     )
-
-    for code, flag in processor.unicode_table.uppercase:
-        line = "{0x%06X, 0x%06X}," % (code, flag)
-        logger.debug(line)
-        unicode_map_uppercase += line
-
-    line = "};\n\n"
-    logger.debug(line)
-
-    return unicode_map_uppercase + line
-
-
-def set_ranges_nfd(processor: CodepointProcessor) -> str:
-    unicode_ranges_nfd = (
-        "// first, last, nfd\n" "const std::vector<range_nfd> unicode_ranges_nfd = {\n"
+    unicode_arrays += format_array(
+        "const uint32_t unicode_composition_cpts[]",
+        ["0x%04X" % composite for _, _, composite in compositions],
     )
+    logger.debug(unicode_arrays)
+    return unicode_arrays
 
-    for first, last, nfd in processor.codepoint_ranges.nfd:
-        line = "{0x%06X, 0x%06X, 0x%06X}," % (first, last, nfd)
-        logger.debug(line)
-        unicode_ranges_nfd += line
 
-    line = "};\n"
-    logger.debug(line)
-
-    return unicode_ranges_nfd + line
-
-
-def build_unicode_data_cpp(processor: CodepointProcessor) -> str:
+def build_unicode_data_cpp(
+    tables: dict[str, TwoStageTable],
+    pool: list[int],
+    compositions: list[tuple[int, int, int]],
+) -> str:
     # define includes
-    unicode_data_cpp = """
+    unicode_data_cpp = """\
     // generated with python gguf.cli.unicode
 
     #include "unicode-data.h"
 
-    #include <cstdint>
-    #include <vector>
-    #include <unordered_map>
-    #include <unordered_set>\n
+    #include <cstdint>\n
     """
+    unicode_data_cpp = "\n".join([line.strip() for line in unicode_data_cpp.split("\n")])
     logger.debug(unicode_data_cpp)
 
-    unicode_data_cpp += set_ranges_flags(processor)
-    unicode_data_cpp += set_unicode_whitespace(processor)
-    unicode_data_cpp += set_unicode_lowercase(processor)
-    unicode_data_cpp += set_unicode_uppercase(processor)
-    unicode_data_cpp += set_ranges_nfd(processor)
+    for name, ctype, _ in UNICODE_TABLES:
+        unicode_data_cpp += set_two_stage_table(name, ctype, tables[name])
+
+    unicode_data_cpp += set_normalization_arrays(pool, compositions)
 
-    return unicode_data_cpp
+    return unicode_data_cpp.rstrip("\n") + "\n"
+
+
+def build_tables(processor: CodepointProcessor) -> dict[str, TwoStageTable]:
+    values = processor.codepoint_values()
+    return {
+        name: TwoStageTable.from_values(values[name], size) for name, _, size in UNICODE_TABLES
+    }
 
 
 def main():
@@ -751,11 +976,15 @@ def main():
     processor = CodepointProcessor(max_codepoints=args.max_codepoints)
     processor.process_unicode()
 
+    tables = build_tables(processor)
+    pool, _ = processor.decomposition_pool()
+    compositions = processor.compositions()
+
     # build the header file
-    unicode_data_h = build_unicode_data_h(args.max_codepoints)
+    unicode_data_h = build_unicode_data_h(tables, compositions, args.max_codepoints)
 
     # build the source file
-    unicode_data_cpp = build_unicode_data_cpp(processor)
+    unicode_data_cpp = build_unicode_data_cpp(tables, pool, compositions)
 
     if args.output_path:
         header_file = f"{args.output_path}/unicode-data.h"
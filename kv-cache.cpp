@@ -0,0 +1,153 @@
+#include "kv-cache.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+bool KVCache::reserve(struct KVSequence &sequence, size_t n_new) {
+    const size_t needed = pages_for(sequence.n_tokens + n_new);
+    if (needed <= sequence.pages.size()) {
+        return true;
+    }
+    if (needed - sequence.pages.size() > free_pages.size()) {
+        return false;
+    }
+
+    while (sequence.pages.size() < needed) {
+        const uint32_t page = free_pages.back();
+        free_pages.pop_back();
+        refs[page] = 1;
+        sequence.pages.push_back(page);
+    }
+    return true;
+}
+
+void KVCache::store(
+    struct KVSequence &sequence, size_t layer, size_t pos, size_t n, const float* k, const float* v
+) {
+    if (layer >= n_layer || pos + n > sequence.pages.size() * page_tokens) {
+        throw std::out_of_range(
+            "Positions " + std::to_string(pos) + " to " + std::to_string(pos + n)
+            + " are not reserved in layer " + std::to_string(layer) + "."
+        );
+    }
+
+    // a row of k holds every head of a position, the page holds every position of a head
+    const size_t row   = n_kv_head * head_dim;
+    const size_t bytes = head_dim * sizeof(float);
+    for (size_t i = 0; i < n; ++i) {
+        const uint32_t page = sequence.pages[(pos + i) / page_tokens];
+        const size_t   slot = (pos + i) % page_tokens;
+        if (refs[page] > 1) {
+            throw std::out_of_range("Position " + std::to_string(pos + i) + " is shared.");
+        }
+
+        for (size_t head = 0; head < n_kv_head; ++head) {
+            const size_t offset = i * row + head * head_dim;
+            memcpy(keys(layer, page, head) + slot * head_dim, k + offset, bytes);
+            memcpy(values(layer, page, head) + slot * head_dim, v + offset, bytes);
+        }
+    }
+}
+
+void KVCache::advance(struct KVSequence &sequence, size_t n) {
+    if (sequence.n_tokens + n > sequence.pages.size() * page_tokens) {
+        throw std::out_of_range("Expected positions to be reserved before they are cached.");
+    }
+    sequence.n_tokens += n;
+}
+
+bool KVCache::fork(const struct KVSequence &src, struct KVSequence &dst) {
+    const size_t full    = src.n_tokens / page_tokens;
+    const bool   partial = 0 != src.n_tokens % page_tokens;
+    if (partial && free_pages.empty()) {
+        return false;
+    }
+
+    release(dst);
+    dst.pages.assign(src.pages.begin(), src.pages.begin() + full);
+    for (uint32_t page : dst.pages) {
+        refs[page]++;
+    }
+
+    if (partial) {
+        const uint32_t page = free_pages.back();
+        free_pages.pop_back();
+        refs[page] = 1;
+        dst.pages.push_back(page);
+
+        // every layer of the page, only the slots in use are worth copying but the page is small
+        const uint32_t from = src.pages[full];
+        for (size_t layer = 0; layer < n_layer; ++layer) {
+            memcpy(keys(layer, page, 0), keys(layer, from, 0), 2 * page_floats * sizeof(float));
+        }
+    }
+
+    dst.n_tokens = src.n_tokens;
+    return true;
+}
+
+void KVCache::release(struct KVSequence &sequence) {
+    for (uint32_t page : sequence.pages) {
+        if (0 == --refs[page]) {
+            free_pages.push_back(page);
+        }
+    }
+    sequence.pages.clear();
+    sequence.n_tokens = 0;
+}
+
+size_t kv_cache_bytes_per_token(const struct ModelConfig &config) {
+    const size_t head_dim = config.n_embd / config.n_head;
+    return 2 * config.n_layer * config.n_kv_head * head_dim * sizeof(float);
+}
+
+struct KVCache*
+malloc_kv_cache(const struct ModelConfig &config, size_t n_pages, size_t page_tokens) {
+    if (0 == n_pages || 0 == page_tokens || 0 == config.n_layer) {
+        throw std::invalid_argument("Expected a kv cache of at least one page and layer.");
+    }
+    if (n_pages > UINT32_MAX) {
+        throw std::invalid_argument("Expected fewer than 2^32 pages.");
+    }
+
+    struct KVCache* cache = new KVCache{};
+
+    if (!cache) {
+        throw std::bad_alloc();
+    }
+
+    cache->n_layer     = config.n_layer;
+    cache->n_kv_head   = config.n_kv_head;
+    cache->head_dim    = config.n_embd / config.n_head;
+    cache->page_tokens = page_tokens;
+    cache->n_pages     = n_pages;
+    cache->page_floats = config.n_kv_head * page_tokens * cache->head_dim;
+
+    // aligned_alloc wants a multiple of the alignment
+    const size_t bytes = n_pages * config.n_layer * 2 * cache->page_floats * sizeof(float);
+    cache->bytes       = (bytes + 63) / 64 * 64;
+    cache->data        = static_cast<float*>(aligned_alloc(64, cache->bytes));
+    if (!cache->data) {
+        delete cache;
+        throw std::bad_alloc();
+    }
+
+    // pages are handed out from the back, lowest ids first
+    cache->refs.assign(n_pages, 0);
+    cache->free_pages.resize(n_pages);
+    for (size_t page = 0; page < n_pages; ++page) {
+        cache->free_pages[page] = (uint32_t) (n_pages - 1 - page);
+    }
+
+    return cache;
+}
+
+void free_kv_cache(struct KVCache* cache) {
+    if (cache) {
+        free(cache->data);
+        delete cache;
+    }
+}
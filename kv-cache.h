@@ -0,0 +1,118 @@
+#ifndef KV_CACHE_H
+#define KV_CACHE_H
+
+#include "model.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// positions per page, small enough that a sequence wastes little of its last page
+#define KV_PAGE_TOKENS 16
+
+/**
+ * The keys and values a sequence has cached, one page per page_tokens positions.
+ *
+ * pages is the block table: position pos lives in page pages[pos / page_tokens] at slot
+ * pos % page_tokens, in every layer. Only the last page is ever written, the full pages before
+ * it may be shared with sequences forked from this one.
+ */
+struct KVSequence {
+    std::vector<uint32_t> pages;    // Block table, page ids of the pool in position order
+    size_t                n_tokens; // Positions whose keys and values are cached
+};
+
+/**
+ * A pool of fixed size pages holding the keys and values of many sequences.
+ *
+ * The pool is a single allocation sized up front, so sequences of any length share it without
+ * fragmenting it or reserving the whole context for each. A page holds page_tokens positions of
+ * every layer, the keys and values of a kv head contiguous within it:
+ *
+ *     data[layer][page][key or value][kv head][slot][head_dim]
+ *
+ * so attention reads page_tokens x head_dim floats per head and page. Decoding a token stores
+ * one position per layer and reads the cached ones in place, rather than recomputing the prefix.
+ *
+ * Pages are reference counted so that forked sequences share their common prefix. The pool is
+ * not synchronized, a single thread schedules the sequences that use it.
+ */
+struct KVCache {
+    size_t n_layer;     // Layers of the model
+    size_t n_kv_head;   // Key and value heads per layer
+    size_t head_dim;    // Floats per head
+    size_t page_tokens; // Positions per page
+    size_t n_pages;     // Pages in the pool
+    size_t page_floats; // Floats of the keys, or of the values, of one layer of a page
+    float* data;        // The pool, 64 byte aligned
+    size_t bytes;       // Size of data
+
+    std::vector<uint32_t> free_pages; // Ids of unused pages, taken from the back
+    std::vector<uint32_t> refs;       // Sequences holding each page
+
+    // pages a sequence of n_tokens positions holds
+    size_t pages_for(size_t n_tokens) const {
+        return (n_tokens + page_tokens - 1) / page_tokens;
+    }
+
+    size_t n_free() const {
+        return free_pages.size();
+    }
+
+    // the keys of one kv head in a page of a layer, page_tokens rows of head_dim floats
+    float* keys(size_t layer, uint32_t page, size_t head) {
+        return data + ((layer * n_pages + page) * 2 * n_kv_head + head) * page_tokens * head_dim;
+    }
+
+    float* values(size_t layer, uint32_t page, size_t head) {
+        return keys(layer, page, head) + page_floats;
+    }
+
+    const float* keys(size_t layer, uint32_t page, size_t head) const {
+        return const_cast<KVCache*>(this)->keys(layer, page, head);
+    }
+
+    const float* values(size_t layer, uint32_t page, size_t head) const {
+        return const_cast<KVCache*>(this)->values(layer, page, head);
+    }
+
+    // take the pages sequence needs for n_new more positions. takes nothing and returns false
+    // when the pool has too few free pages, so the caller can wait for other sequences to end.
+    bool reserve(struct KVSequence &sequence, size_t n_new);
+
+    /**
+     * Store the keys and values of n positions from pos on in a layer. k and v hold n rows of
+     * n_kv_head x head_dim floats, as the key and value projections produce them. The positions
+     * must be reserved and must not lie in a shared page, throws std::out_of_range otherwise.
+     */
+    void store(
+        struct KVSequence &sequence,
+        size_t             layer,
+        size_t             pos,
+        size_t             n,
+        const float*       k,
+        const float*       v
+    );
+
+    // count n more positions as cached, once they are stored in every layer
+    void advance(struct KVSequence &sequence, size_t n);
+
+    // start dst as a copy of src that shares its full pages. the partial last page is copied, as
+    // both sequences go on to write to it. returns false when there is no page for the copy.
+    bool fork(const struct KVSequence &src, struct KVSequence &dst);
+
+    // return the pages of sequence to the pool and empty it
+    void release(struct KVSequence &sequence);
+};
+
+// bytes of keys and values a position takes across all layers
+size_t kv_cache_bytes_per_token(const struct ModelConfig &config);
+
+// allocate a pool of n_pages pages of page_tokens positions for the layers and heads of config
+struct KVCache* malloc_kv_cache(
+    const struct ModelConfig &config, size_t n_pages, size_t page_tokens = KV_PAGE_TOKENS
+);
+
+void free_kv_cache(struct KVCache* cache);
+
+#endif // KV_CACHE_H
@@ -4,10 +4,60 @@
  * Copyright © 2024 Austin Berrio
  */
 
+#define _POSIX_C_SOURCE 200809L // For clock_gettime and sem_timedwait
+
 #include "logger.h"
 
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
 const char* LOG_TYPE_NAME[] = {"unknown", "stream", "file"};
 
+/**
+ * @brief Ring buffer of formatted messages written by one thread.
+ *
+ * The owning thread is the only producer and the writer thread the only
+ * consumer, so head and tail are the only shared state. They count bytes and
+ * only grow, an index into data is taken modulo the capacity. A message is
+ * published by advancing tail past all of its bytes, so the writer never sees
+ * a partial message. Head and tail sit on separate cache lines so that the
+ * producer and the consumer do not invalidate each other's line on every access.
+ */
+struct LoggerRing {
+    _Alignas(64) _Atomic size_t head; /**< Bytes consumed by the writer. */
+    _Alignas(64) _Atomic size_t tail; /**< Bytes published by the owner. */
+    _Alignas(64) size_t capacity;     /**< Size of data, a power of two. */
+    char*              data;          /**< The buffered messages. */
+    pthread_t          owner;         /**< The thread that writes to the ring. */
+    struct LoggerRing* next;          /**< The ring registered before this one. */
+};
+
+/**
+ * @brief State of a logger in asynchronous mode.
+ */
+struct LoggerAsync {
+    struct LoggerAsyncPolicy    policy;  /**< The flush policy. */
+    uint64_t                    id;      /**< Identifies the backend to thread-local caches. */
+    _Atomic(struct LoggerRing*) rings;   /**< Rings of all threads that logged, newest first. */
+    _Atomic bool                running; /**< Cleared to stop the writer thread. */
+    _Atomic size_t              dropped; /**< Messages dropped because a ring was full. */
+    sem_t                       wake;    /**< Posted to wake the writer before its interval. */
+    pthread_t                   writer;  /**< The thread writing the rings to the stream. */
+};
+
+// identifiers of started backends, so a thread-local cache never matches a backend that was
+// stopped and another one allocated at the same address
+static _Atomic uint64_t logger_async_ids = 1;
+
+// the ring of the calling thread for the backend it last logged through
+static _Thread_local struct {
+    uint64_t           id;
+    struct LoggerRing* ring;
+} logger_thread_ring;
+
 /**
  * @brief Sets the logger type and name.
  *
@@ -108,6 +158,7 @@ struct Logger* logger_new(log_type_t log_type) {
 
     logger->file_path   = NULL;
     logger->file_stream = NULL;
+    logger->async       = NULL;
 
     // Initialize the mutex for thread safety
     int error_code = pthread_mutex_init(&logger->thread_lock, NULL);
@@ -183,6 +234,11 @@ bool logger_destroy(struct Logger* logger) {
         return false;
     }
 
+    // Write what is still buffered before the stream goes away
+    if (NULL != logger->async) {
+        logger_async_stop(logger);
+    }
+
     // Close the log file if it's a file logger
     if (LOG_TYPE_FILE == logger->log_type && NULL != logger->file_stream) {
         if (fclose(logger->file_stream) != 0) {
@@ -203,6 +259,297 @@ bool logger_destroy(struct Logger* logger) {
     return true;
 }
 
+static size_t logger_ring_capacity(size_t ring_bytes) {
+    // room for two messages of the longest length at least, so a full ring always drains
+    size_t capacity = 2 * LOGGER_MESSAGE_MAX;
+    while (capacity < ring_bytes) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+/**
+ * @brief Finds or registers the ring of the calling thread.
+ *
+ * The last ring used is cached per thread. On a miss the registered rings are
+ * searched, a thread alternating between two asynchronous loggers finds its
+ * ring of each, and a new ring is pushed onto the list with a compare-and-swap.
+ *
+ * @return The ring of the calling thread, or NULL if it could not be allocated.
+ */
+static struct LoggerRing* logger_ring_acquire(struct LoggerAsync* async) {
+    if (async->id == logger_thread_ring.id) {
+        return logger_thread_ring.ring;
+    }
+
+    const pthread_t    self = pthread_self();
+    struct LoggerRing* ring = atomic_load_explicit(&async->rings, memory_order_acquire);
+    while (NULL != ring && !pthread_equal(ring->owner, self)) {
+        ring = ring->next;
+    }
+
+    if (NULL == ring) {
+        ring = (struct LoggerRing*) aligned_alloc(64, sizeof(struct LoggerRing));
+        if (NULL == ring) {
+            return NULL;
+        }
+
+        ring->capacity = logger_ring_capacity(async->policy.ring_bytes);
+        ring->data     = (char*) malloc(ring->capacity);
+        if (NULL == ring->data) {
+            free(ring);
+            return NULL;
+        }
+
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        ring->owner = self;
+        ring->next  = atomic_load_explicit(&async->rings, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(
+            &async->rings, &ring->next, ring, memory_order_release, memory_order_relaxed
+        )) {
+            // ring->next was updated to the current list head, try again
+        }
+    }
+
+    logger_thread_ring.id   = async->id;
+    logger_thread_ring.ring = ring;
+    return ring;
+}
+
+/**
+ * @brief Copies a formatted message into the calling thread's ring.
+ *
+ * @return True if the message was published, false if it was dropped.
+ */
+static bool logger_ring_push(
+    struct LoggerAsync* async,
+    struct LoggerRing*  ring,
+    const char*         message,
+    size_t              length,
+    bool                wake
+) {
+    const size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t       head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    while (ring->capacity - (tail - head) < length) {
+        if (async->policy.drop_when_full) {
+            atomic_fetch_add_explicit(&async->dropped, 1, memory_order_relaxed);
+            return false;
+        }
+        sem_post(&async->wake);
+        sched_yield();
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    }
+
+    const size_t offset = tail & (ring->capacity - 1);
+    const size_t first  = length < ring->capacity - offset ? length : ring->capacity - offset;
+    memcpy(ring->data + offset, message, first);
+    memcpy(ring->data, message + first, length - first);
+    atomic_store_explicit(&ring->tail, tail + length, memory_order_release);
+
+    // wake the writer for errors and for a ring that fills up, otherwise its interval does
+    if (wake || tail + length - head >= async->policy.flush_bytes) {
+        sem_post(&async->wake);
+    }
+    return true;
+}
+
+/**
+ * @brief Writes everything published to the rings of a logger to its stream.
+ *
+ * @return The number of bytes written.
+ */
+static size_t logger_async_drain(struct Logger* logger) {
+    struct LoggerAsync* async   = logger->async;
+    size_t              written = 0;
+
+    struct LoggerRing* ring = atomic_load_explicit(&async->rings, memory_order_acquire);
+    for (; NULL != ring; ring = ring->next) {
+        const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        const size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head == tail) {
+            continue;
+        }
+
+        // at most two writes, the bytes up to the end of the buffer and those wrapped around
+        const size_t length = tail - head;
+        const size_t offset = head & (ring->capacity - 1);
+        const size_t first  = length < ring->capacity - offset ? length : ring->capacity - offset;
+        fwrite(ring->data + offset, 1, first, logger->file_stream);
+        fwrite(ring->data, 1, length - first, logger->file_stream);
+        atomic_store_explicit(&ring->head, tail, memory_order_release);
+        written += length;
+    }
+
+    return written;
+}
+
+static void* logger_async_writer(void* arg) {
+    struct Logger*      logger = (struct Logger*) arg;
+    struct LoggerAsync* async  = logger->async;
+
+    while (atomic_load_explicit(&async->running, memory_order_acquire)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        const uint64_t nsec = deadline.tv_nsec + async->policy.flush_interval_ms * 1000000ull;
+        deadline.tv_sec += nsec / 1000000000ull;
+        deadline.tv_nsec = nsec % 1000000000ull;
+        while (0 != sem_timedwait(&async->wake, &deadline) && EINTR == errno) {
+            // interrupted by a signal, keep waiting for the same deadline
+        }
+
+        // one flush for everything drained on this wake-up
+        if (logger_async_drain(logger) > 0) {
+            fflush(logger->file_stream);
+        }
+    }
+
+    logger_async_drain(logger);
+    fflush(logger->file_stream);
+    return NULL;
+}
+
+bool logger_async_start(struct Logger* logger, const struct LoggerAsyncPolicy* policy) {
+    if (NULL == logger || NULL != logger->async) {
+        fprintf(stderr, "Failed to start async logger: logger is NULL or already async\n");
+        return false;
+    }
+
+    struct LoggerAsync* async = (struct LoggerAsync*) malloc(sizeof(struct LoggerAsync));
+    if (NULL == async) {
+        fprintf(stderr, "Failed to allocate memory for async logger\n");
+        return false;
+    }
+
+    const struct LoggerAsyncPolicy default_policy = LOGGER_ASYNC_POLICY_DEFAULT;
+    async->policy = NULL == policy ? default_policy : *policy;
+    async->id     = atomic_fetch_add(&logger_async_ids, 1);
+    atomic_init(&async->rings, NULL);
+    atomic_init(&async->running, true);
+    atomic_init(&async->dropped, 0);
+
+    // a ring wakes the writer at half its capacity at the latest
+    const size_t capacity = logger_ring_capacity(async->policy.ring_bytes);
+    if (0 == async->policy.flush_bytes || async->policy.flush_bytes > capacity / 2) {
+        async->policy.flush_bytes = capacity / 2;
+    }
+    if (0 == async->policy.flush_interval_ms) {
+        async->policy.flush_interval_ms = 1;
+    }
+
+    if (0 != sem_init(&async->wake, 0, 0)) {
+        fprintf(stderr, "Failed to initialize semaphore: %s\n", strerror(errno));
+        free(async);
+        return false;
+    }
+
+    // Apply lazy initialization for global logger
+    if (NULL == logger->file_stream) {
+        logger->file_stream = stderr;
+    }
+
+    logger->async  = async;
+    int error_code = pthread_create(&async->writer, NULL, logger_async_writer, logger);
+    if (0 != error_code) {
+        fprintf(stderr, "Failed to create writer thread with error: %d\n", error_code);
+        logger->async = NULL;
+        sem_destroy(&async->wake);
+        free(async);
+        return false;
+    }
+
+    return true;
+}
+
+bool logger_async_stop(struct Logger* logger) {
+    if (NULL == logger || NULL == logger->async) {
+        return false;
+    }
+
+    struct LoggerAsync* async = logger->async;
+    atomic_store_explicit(&async->running, false, memory_order_release);
+    sem_post(&async->wake);
+    pthread_join(async->writer, NULL);
+
+    const size_t dropped = atomic_load(&async->dropped);
+    if (dropped > 0) {
+        fprintf(logger->file_stream, "[WARN] Async logger dropped %zu messages\n", dropped);
+        fflush(logger->file_stream);
+    }
+
+    struct LoggerRing* ring = atomic_load(&async->rings);
+    while (NULL != ring) {
+        struct LoggerRing* next = ring->next;
+        free(ring->data);
+        free(ring);
+        ring = next;
+    }
+
+    sem_destroy(&async->wake);
+    free(async);
+    logger->async = NULL;
+    return true;
+}
+
+/**
+ * @brief Formats a message and publishes it to the calling thread's ring.
+ *
+ * The prefix is the same as in synchronous mode. A message longer than
+ * LOGGER_MESSAGE_MAX is truncated, keeping its trailing newline if it had one.
+ *
+ * @return True if the message was published, false if it was dropped.
+ */
+static bool logger_async_message(
+    struct Logger* logger, log_level_t log_level, int err, const char* format, va_list args
+) {
+    struct LoggerAsync* async = logger->async;
+    struct LoggerRing*  ring  = logger_ring_acquire(async);
+    if (NULL == ring) {
+        atomic_fetch_add_explicit(&async->dropped, 1, memory_order_relaxed);
+        return false;
+    }
+
+    char message[LOGGER_MESSAGE_MAX];
+    int  length = 0;
+    switch (log_level) {
+        case LOG_LEVEL_DEBUG:
+            length = snprintf(message, sizeof(message), "[DEBUG] ");
+            break;
+        case LOG_LEVEL_INFO:
+            length = snprintf(message, sizeof(message), "[INFO] ");
+            break;
+        case LOG_LEVEL_WARN:
+            if (err != 0) {
+                length = snprintf(message, sizeof(message), "[WARN:%s] ", strerror(err));
+            } else {
+                length = snprintf(message, sizeof(message), "[WARN] ");
+            }
+            break;
+        case LOG_LEVEL_ERROR:
+            if (err != 0) {
+                length = snprintf(message, sizeof(message), "[ERROR:%s] ", strerror(err));
+            } else {
+                length = snprintf(message, sizeof(message), "[ERROR] ");
+            }
+            break;
+    }
+
+    size_t size = length < 0 ? 0 : (size_t) length;
+    size        = size < sizeof(message) ? size : sizeof(message) - 1;
+
+    const int body = vsnprintf(message + size, sizeof(message) - size, format, args);
+    if (body > 0) {
+        const size_t full = size + (size_t) body;
+        size              = full < sizeof(message) ? full : sizeof(message) - 1;
+        const size_t n_format = strlen(format);
+        if (full >= sizeof(message) && n_format > 0 && '\n' == format[n_format - 1]) {
+            message[size - 1] = '\n';
+        }
+    }
+
+    return logger_ring_push(async, ring, message, size, LOG_LEVEL_ERROR == log_level);
+}
+
 /**
  * @brief Logs a message with the specified log level to the logger's file.
  *
@@ -225,6 +572,15 @@ bool logger_message(struct Logger* logger, log_level_t log_level, const char* fo
 
     int err = errno; // Capture errno at the start of the function to avoid changes
 
+    // Format on the calling thread, the writer thread does the rest
+    if (NULL != logger->async) {
+        va_list args;
+        va_start(args, format);
+        bool published = logger_async_message(logger, log_level, err, format, args);
+        va_end(args);
+        return published;
+    }
+
     // Apply lazy initialization for global logger
     if (NULL == logger->file_stream) {
         logger->file_stream = stderr;
@@ -292,17 +648,19 @@ bool logger_message(struct Logger* logger, log_level_t log_level, const char* fo
  * - file_stream: The file stream for writing log messages.
  * - file_path: The path to the log file.
  * - thread_lock: Mutex to ensure thread-safe logging.
+ * - async: Asynchronous backend, NULL until logger_async_start is called.
  *
  * @warning Modifying the global logger object or attempting to reinitialize
  * the mutex after initialization can lead to undefined behavior.
  */
 struct Logger global_logger = {
-    LOG_LEVEL_DEBUG,          /**< Logging level */
-    LOG_TYPE_STREAM,          /**< Logger type */
-    "stream",                 /**< Logger type name */
-    NULL,                     /**< File stream */
-    NULL,                     /**< File path */
-    PTHREAD_MUTEX_INITIALIZER /**< Mutex for thread safety */
+    LOG_LEVEL_DEBUG,           /**< Logging level */
+    LOG_TYPE_STREAM,           /**< Logger type */
+    "stream",                  /**< Logger type name */
+    NULL,                      /**< File stream */
+    NULL,                      /**< File path */
+    PTHREAD_MUTEX_INITIALIZER, /**< Mutex for thread safety */
+    NULL                       /**< Asynchronous backend */
 };
 
 /**
@@ -15,6 +15,15 @@
 #include <stdlib.h> // For memory allocation support
 #include <string.h> // Include for strerror declaration
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Longest message the asynchronous backend formats, longer ones are truncated.
+ */
+#define LOGGER_MESSAGE_MAX 1024
+
 /**
  * @brief Enumeration representing different levels of logging.
  */
@@ -34,16 +43,37 @@ typedef enum LOG_TYPE {
     LOG_TYPE_FILE     /**< Log to a file. */
 } log_type_t;
 
+/**
+ * @brief Flush policy of a logger in asynchronous mode.
+ */
+struct LoggerAsyncPolicy {
+    size_t ring_bytes;        /**< Capacity of each thread's ring buffer. */
+    size_t flush_interval_ms; /**< Longest time a message waits before it is written. */
+    size_t flush_bytes;       /**< Bytes in a ring that wake the writer early. */
+    bool   drop_when_full;    /**< Drop messages instead of waiting for room in a ring. */
+};
+
+/**
+ * @brief Default asynchronous policy: 64 KiB per thread, written every 50 ms or at 16 KiB.
+ */
+#define LOGGER_ASYNC_POLICY_DEFAULT {65536, 50, 16384, false}
+
+/**
+ * @brief State of the asynchronous backend, private to logger.c.
+ */
+struct LoggerAsync;
+
 /**
  * @brief Structure representing a logger object.
  */
 struct Logger {
-    log_level_t     log_level;     /**< The logging level of the logger. */
-    log_type_t      log_type;      /**< The type of logger. */
-    const char*     log_type_name; /**< The name associated with the logger type. */
-    FILE*           file_stream;   /**< The file stream for writing log messages. */
-    const char*     file_path;     /**< The path to the log file. */
-    pthread_mutex_t thread_lock;   /**< Mutex to ensure thread-safe logging. */
+    log_level_t         log_level;     /**< The logging level of the logger. */
+    log_type_t          log_type;      /**< The type of logger. */
+    const char*         log_type_name; /**< The name associated with the logger type. */
+    FILE*               file_stream;   /**< The file stream for writing log messages. */
+    const char*         file_path;     /**< The path to the log file. */
+    pthread_mutex_t     thread_lock;   /**< Mutex to ensure thread-safe logging. */
+    struct LoggerAsync* async;         /**< Asynchronous backend, NULL when synchronous. */
 };
 
 /**
@@ -110,11 +140,48 @@ struct Logger* logger_new(log_type_t log_type);
  */
 struct Logger* logger_create(log_level_t log_level, log_type_t log_type, const char* file_path);
 
+/**
+ * @brief Switches a logger to asynchronous mode.
+ *
+ * Once started, logger_message formats each message on the calling thread into
+ * a lock-free ring buffer owned by that thread, and a background thread drains
+ * the rings of all threads in batches, with one write and one flush per ring
+ * and wake-up instead of a lock and a flush per message. The writer wakes every
+ * flush_interval_ms, once a ring holds flush_bytes, and immediately for an
+ * error message. Messages of one thread keep their order, messages of different
+ * threads are only ordered by the batch they are written in.
+ *
+ * When a ring is full the thread waits for the writer, or drops the message if
+ * drop_when_full is set. Dropped messages are counted and reported on stop.
+ *
+ * Start the backend before other threads log through the logger and stop it
+ * after they are done, it works with the global logger as well.
+ *
+ * @param logger A pointer to the logger instance to switch.
+ * @param policy The flush policy, or NULL for LOGGER_ASYNC_POLICY_DEFAULT.
+ *
+ * @return True if the writer thread was started, false otherwise.
+ */
+bool logger_async_start(struct Logger* logger, const struct LoggerAsyncPolicy* policy);
+
+/**
+ * @brief Switches a logger back to synchronous mode.
+ *
+ * This function writes every message still buffered, flushes the stream, joins
+ * the writer thread and releases the ring buffers.
+ *
+ * @param logger A pointer to the logger instance to switch.
+ *
+ * @return True if the logger was asynchronous and is now stopped, false otherwise.
+ */
+bool logger_async_stop(struct Logger* logger);
+
 /**
  * @brief Destroys a logger instance and releases associated resources.
  *
- * This function closes the log file associated with the logger, if any,
- * and frees the memory allocated for the logger instance.
+ * This function stops the asynchronous backend if it runs, closes the log file
+ * associated with the logger, if any, and frees the memory allocated for the
+ * logger instance.
  *
  * @param logger A pointer to the logger instance to be destroyed.
  * @return True if the logger was successfully destroyed, false otherwise.
@@ -126,7 +193,8 @@ bool logger_destroy(struct Logger* logger);
  *
  * This function logs a message with the specified log level to the logger's
  * file. If the logger's log level is lower than the specified log level, the
- * message will not be logged.
+ * message will not be logged. In asynchronous mode the message is formatted
+ * into the calling thread's ring buffer and written later.
  *
  * @param logger A pointer to the logger instance to use for logging.
  * @param log_level The log level of the message to be logged.
@@ -142,7 +210,8 @@ bool logger_message(struct Logger* logger, log_level_t log_level, const char* fo
  *
  * This macro provides a convenient shorthand for logging messages using a
  * logger instance. It calls the logger_message function with the specified logger,
- * log level, and message format.
+ * log level, and message format. Messages below the logger's level are filtered
+ * before the call, so their arguments are not evaluated.
  *
  * @param logger A pointer to the logger instance to use for logging.
  * @param level The log level of the message to be logged.
@@ -155,7 +224,8 @@ bool logger_message(struct Logger* logger, log_level_t log_level, const char* fo
  * @endcode
  */
 #define LOG(logger, level, format, ...) \
-    logger_message((logger), (level), "[%s:%d] " format, __FILE__, __LINE__, ##__VA_ARGS__)
+    ((level) >= (logger)->log_level \
+     && logger_message((logger), (level), "[%s:%d] " format, __FILE__, __LINE__, ##__VA_ARGS__))
 
 /**
  * @brief Global Logger Object
@@ -179,6 +249,7 @@ bool logger_message(struct Logger* logger, log_level_t log_level, const char* fo
  * - file_stream: The file stream for writing log messages.
  * - file_path: The path to the log file.
  * - thread_lock: Mutex to ensure thread-safe logging.
+ * - async: Asynchronous backend, NULL until logger_async_start is called.
  *
  * @warning Modifying the global logger object or attempting to reinitialize
  * the mutex after initialization can lead to undefined behavior.
@@ -211,4 +282,8 @@ void initialize_global_logger(
     const char* file_path
 );
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif // LOGGER_H
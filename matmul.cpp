@@ -0,0 +1,751 @@
+/*
+ * matmul.cpp
+ *
+ * Multiplies of activations with the weights of a linear layer. The multiply is blocked the way
+ * BLAS libraries block it: the weights are packed panel by panel into the layout the microkernel
+ * reads, converted to single precision on the way, and each microkernel call keeps its whole
+ * output tile in registers for the length of a panel.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define MATMUL_X86
+#elif defined(__aarch64__)
+    // arm_neon.h has a float16_t of its own, an __fp16, which would clash with ours
+    #define float16_t arm_float16_t
+    #include <arm_neon.h>
+    #undef float16_t
+    #define MATMUL_NEON
+#endif
+
+#include "matmul.h"
+#include "profile.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+// multiplies with fewer multiply-adds than this finish before the workers would wake up
+static const size_t MATMUL_PARALLEL_MIN = 1 << 16;
+
+// a batch of one is split into this many row ranges per thread, so stealing evens out the ranges
+// that land on a busy core
+static const size_t MATMUL_GEMV_SPLIT = 8;
+
+// quantized weights are multiplied with this many activation rows at a time, so each weight row
+// is read from L1 once per group rather than once per row
+static const size_t MATMUL_QUANT_ROWS = 8;
+
+template <data_t Type> struct WeightType;
+
+template <> struct WeightType<TYPE_FLOAT_F32> {
+    using type = float;
+};
+
+template <> struct WeightType<TYPE_FLOAT_F16> {
+    using type = float16_t;
+};
+
+template <> struct WeightType<TYPE_FLOAT_BF16> {
+    using type = bfloat16_t;
+};
+
+template <data_t Type> static inline float weight_to_float(typename WeightType<Type>::type value) {
+    if constexpr (TYPE_FLOAT_F32 == Type) {
+        return value;
+    } else if constexpr (TYPE_FLOAT_F16 == Type) {
+        return float16_to_float(value);
+    } else {
+        return bfloat16_to_float(value);
+    }
+}
+
+//
+// reference kernels
+//
+
+#define REFERENCE_MR 4
+#define REFERENCE_NR 4
+
+static void
+reference_tile(size_t kc, const float* a, const float* b, float* c, size_t ldc, bool accumulate) {
+    float acc[REFERENCE_MR][REFERENCE_NR] = {};
+    for (size_t kk = 0; kk < kc; ++kk, a += REFERENCE_MR, b += REFERENCE_NR) {
+        for (size_t i = 0; i < REFERENCE_MR; ++i) {
+            for (size_t j = 0; j < REFERENCE_NR; ++j) {
+                acc[i][j] += a[i] * b[j];
+            }
+        }
+    }
+
+    for (size_t i = 0; i < REFERENCE_MR; ++i) {
+        for (size_t j = 0; j < REFERENCE_NR; ++j) {
+            c[i * ldc + j] = accumulate ? c[i * ldc + j] + acc[i][j] : acc[i][j];
+        }
+    }
+}
+
+template <data_t Type>
+static void reference_gemv(
+    const typename WeightType<Type>::type* w, size_t n_in, const float* x, float* y, size_t n_rows
+) {
+    for (size_t j = 0; j < n_rows; ++j) {
+        float sum = 0.0f;
+        for (size_t k = 0; k < n_in; ++k) {
+            sum += weight_to_float<Type>(w[j * n_in + k]) * x[k];
+        }
+        y[j] = sum;
+    }
+}
+
+const struct MatmulKernels MATMUL_REFERENCE = {
+    "scalar",
+    REFERENCE_MR,
+    REFERENCE_NR,
+    reference_tile,
+    "scalar",
+    reference_gemv<TYPE_FLOAT_F32>,
+    reference_gemv<TYPE_FLOAT_F16>,
+    reference_gemv<TYPE_FLOAT_BF16>,
+};
+
+//
+// x86 kernels
+//
+
+#if defined(MATMUL_X86)
+
+    #define AVX2_MR 6
+    #define AVX2_NR 16
+
+// 6 x 16 takes 12 of the 16 ymm registers for the tile, 2 for the weights and 1 for the input
+__attribute__((target("avx2,fma"))) static void
+avx2_tile(size_t kc, const float* a, const float* b, float* c, size_t ldc, bool accumulate) {
+    __m256 acc[AVX2_MR][2];
+    for (size_t i = 0; i < AVX2_MR; ++i) {
+        acc[i][0] = _mm256_setzero_ps();
+        acc[i][1] = _mm256_setzero_ps();
+    }
+
+    for (size_t kk = 0; kk < kc; ++kk, a += AVX2_MR, b += AVX2_NR) {
+        const __m256 b0 = _mm256_load_ps(b);
+        const __m256 b1 = _mm256_load_ps(b + 8);
+        for (size_t i = 0; i < AVX2_MR; ++i) {
+            const __m256 ai = _mm256_broadcast_ss(a + i);
+            acc[i][0]       = _mm256_fmadd_ps(ai, b0, acc[i][0]);
+            acc[i][1]       = _mm256_fmadd_ps(ai, b1, acc[i][1]);
+        }
+    }
+
+    for (size_t i = 0; i < AVX2_MR; ++i) {
+        float* row = c + i * ldc;
+        if (accumulate) {
+            acc[i][0] = _mm256_add_ps(acc[i][0], _mm256_loadu_ps(row));
+            acc[i][1] = _mm256_add_ps(acc[i][1], _mm256_loadu_ps(row + 8));
+        }
+        _mm256_storeu_ps(row, acc[i][0]);
+        _mm256_storeu_ps(row + 8, acc[i][1]);
+    }
+}
+
+    #define AVX512_MR 8
+    #define AVX512_NR 32
+
+// 8 x 32 takes 16 of the 32 zmm registers for the tile, twice the work per load of avx2
+__attribute__((target("avx512f"))) static void
+avx512_tile(size_t kc, const float* a, const float* b, float* c, size_t ldc, bool accumulate) {
+    __m512 acc[AVX512_MR][2];
+    for (size_t i = 0; i < AVX512_MR; ++i) {
+        acc[i][0] = _mm512_setzero_ps();
+        acc[i][1] = _mm512_setzero_ps();
+    }
+
+    for (size_t kk = 0; kk < kc; ++kk, a += AVX512_MR, b += AVX512_NR) {
+        const __m512 b0 = _mm512_load_ps(b);
+        const __m512 b1 = _mm512_load_ps(b + 16);
+        for (size_t i = 0; i < AVX512_MR; ++i) {
+            const __m512 ai = _mm512_set1_ps(a[i]);
+            acc[i][0]       = _mm512_fmadd_ps(ai, b0, acc[i][0]);
+            acc[i][1]       = _mm512_fmadd_ps(ai, b1, acc[i][1]);
+        }
+    }
+
+    for (size_t i = 0; i < AVX512_MR; ++i) {
+        float* row = c + i * ldc;
+        if (accumulate) {
+            acc[i][0] = _mm512_add_ps(acc[i][0], _mm512_loadu_ps(row));
+            acc[i][1] = _mm512_add_ps(acc[i][1], _mm512_loadu_ps(row + 16));
+        }
+        _mm512_storeu_ps(row, acc[i][0]);
+        _mm512_storeu_ps(row + 16, acc[i][1]);
+    }
+}
+
+__attribute__((target("avx2"))) static inline float avx2_sum(__m256 v) {
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    sum        = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum        = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+    return _mm_cvtss_f32(sum);
+}
+
+// 8 weights widened to single precision
+template <data_t Type>
+__attribute__((target("avx2,f16c"))) static inline __m256
+avx2_load(const typename WeightType<Type>::type* w) {
+    if constexpr (TYPE_FLOAT_F32 == Type) {
+        return _mm256_loadu_ps(w);
+    } else if constexpr (TYPE_FLOAT_F16 == Type) {
+        return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(w)));
+    } else {
+        const __m256i wide = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) w));
+        return _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16));
+    }
+}
+
+// Rows weight rows at once, so every load of x is shared by as many rows
+template <data_t Type, size_t Rows>
+__attribute__((target("avx2,f16c,fma"))) static inline void
+avx2_gemv_rows(const typename WeightType<Type>::type* w, size_t n_in, const float* x, float* y) {
+    __m256 acc[Rows];
+    for (size_t r = 0; r < Rows; ++r) {
+        acc[r] = _mm256_setzero_ps();
+    }
+
+    size_t k = 0;
+    for (; k + 8 <= n_in; k += 8) {
+        const __m256 xk = _mm256_loadu_ps(x + k);
+        for (size_t r = 0; r < Rows; ++r) {
+            acc[r] = _mm256_fmadd_ps(avx2_load<Type>(w + r * n_in + k), xk, acc[r]);
+        }
+    }
+
+    for (size_t r = 0; r < Rows; ++r) {
+        float sum = avx2_sum(acc[r]);
+        for (size_t tail = k; tail < n_in; ++tail) {
+            sum += weight_to_float<Type>(w[r * n_in + tail]) * x[tail];
+        }
+        y[r] = sum;
+    }
+}
+
+template <data_t Type>
+__attribute__((target("avx2,f16c,fma"))) static void avx2_gemv(
+    const typename WeightType<Type>::type* w, size_t n_in, const float* x, float* y, size_t n_rows
+) {
+    size_t j = 0;
+    for (; j + 4 <= n_rows; j += 4) {
+        avx2_gemv_rows<Type, 4>(w + j * n_in, n_in, x, y + j);
+    }
+    for (; j < n_rows; ++j) {
+        avx2_gemv_rows<Type, 1>(w + j * n_in, n_in, x, y + j);
+    }
+}
+
+#endif // MATMUL_X86
+
+//
+// arm kernels
+//
+
+#if defined(MATMUL_NEON)
+
+    #define NEON_MR 8
+    #define NEON_NR 8
+
+// one row of the tile, i of the input times the 8 weights of b0 and b1
+    #define NEON_TILE_ROW(i, av, lane)                                         \
+        acc[i][0] = vfmaq_laneq_f32(acc[i][0], b0, av, lane);                  \
+        acc[i][1] = vfmaq_laneq_f32(acc[i][1], b1, av, lane)
+
+// 8 x 8 takes 16 of the 32 vector registers for the tile
+static void
+neon_tile(size_t kc, const float* a, const float* b, float* c, size_t ldc, bool accumulate) {
+    float32x4_t acc[NEON_MR][2];
+    for (size_t i = 0; i < NEON_MR; ++i) {
+        acc[i][0] = vdupq_n_f32(0.0f);
+        acc[i][1] = vdupq_n_f32(0.0f);
+    }
+
+    for (size_t kk = 0; kk < kc; ++kk, a += NEON_MR, b += NEON_NR) {
+        const float32x4_t b0 = vld1q_f32(b);
+        const float32x4_t b1 = vld1q_f32(b + 4);
+        const float32x4_t a0 = vld1q_f32(a);
+        const float32x4_t a1 = vld1q_f32(a + 4);
+        NEON_TILE_ROW(0, a0, 0);
+        NEON_TILE_ROW(1, a0, 1);
+        NEON_TILE_ROW(2, a0, 2);
+        NEON_TILE_ROW(3, a0, 3);
+        NEON_TILE_ROW(4, a1, 0);
+        NEON_TILE_ROW(5, a1, 1);
+        NEON_TILE_ROW(6, a1, 2);
+        NEON_TILE_ROW(7, a1, 3);
+    }
+
+    for (size_t i = 0; i < NEON_MR; ++i) {
+        float* row = c + i * ldc;
+        if (accumulate) {
+            acc[i][0] = vaddq_f32(acc[i][0], vld1q_f32(row));
+            acc[i][1] = vaddq_f32(acc[i][1], vld1q_f32(row + 4));
+        }
+        vst1q_f32(row, acc[i][0]);
+        vst1q_f32(row + 4, acc[i][1]);
+    }
+}
+
+// 4 weights widened to single precision
+template <data_t Type>
+static inline float32x4_t neon_load(const typename WeightType<Type>::type* w) {
+    if constexpr (TYPE_FLOAT_F32 == Type) {
+        return vld1q_f32(w);
+    } else if constexpr (TYPE_FLOAT_F16 == Type) {
+        return vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(w)));
+    } else {
+        return vreinterpretq_f32_u32(vshll_n_u16(vld1_u16(w), 16));
+    }
+}
+
+template <data_t Type, size_t Rows>
+static inline void
+neon_gemv_rows(const typename WeightType<Type>::type* w, size_t n_in, const float* x, float* y) {
+    float32x4_t acc[Rows];
+    for (size_t r = 0; r < Rows; ++r) {
+        acc[r] = vdupq_n_f32(0.0f);
+    }
+
+    size_t k = 0;
+    for (; k + 4 <= n_in; k += 4) {
+        const float32x4_t xk = vld1q_f32(x + k);
+        for (size_t r = 0; r < Rows; ++r) {
+            acc[r] = vfmaq_f32(acc[r], neon_load<Type>(w + r * n_in + k), xk);
+        }
+    }
+
+    for (size_t r = 0; r < Rows; ++r) {
+        float sum = vaddvq_f32(acc[r]);
+        for (size_t tail = k; tail < n_in; ++tail) {
+            sum += weight_to_float<Type>(w[r * n_in + tail]) * x[tail];
+        }
+        y[r] = sum;
+    }
+}
+
+template <data_t Type>
+static void neon_gemv(
+    const typename WeightType<Type>::type* w, size_t n_in, const float* x, float* y, size_t n_rows
+) {
+    size_t j = 0;
+    for (; j + 4 <= n_rows; j += 4) {
+        neon_gemv_rows<Type, 4>(w + j * n_in, n_in, x, y + j);
+    }
+    for (; j < n_rows; ++j) {
+        neon_gemv_rows<Type, 1>(w + j * n_in, n_in, x, y + j);
+    }
+}
+
+#endif // MATMUL_NEON
+
+//
+// dispatch
+//
+
+static struct MatmulKernels matmul_select() {
+    struct MatmulKernels kernels = MATMUL_REFERENCE;
+
+#if defined(MATMUL_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        kernels.name = "avx2";
+        kernels.mr   = AVX2_MR;
+        kernels.nr   = AVX2_NR;
+        kernels.tile = avx2_tile;
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        kernels.name = "avx512";
+        kernels.mr   = AVX512_MR;
+        kernels.nr   = AVX512_NR;
+        kernels.tile = avx512_tile;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c")
+        && __builtin_cpu_supports("fma")) {
+        kernels.gemv_name = "avx2";
+        kernels.gemv_f32  = avx2_gemv<TYPE_FLOAT_F32>;
+        kernels.gemv_f16  = avx2_gemv<TYPE_FLOAT_F16>;
+        kernels.gemv_bf16 = avx2_gemv<TYPE_FLOAT_BF16>;
+    }
+#elif defined(MATMUL_NEON)
+    kernels = {
+        "neon",
+        NEON_MR,
+        NEON_NR,
+        neon_tile,
+        "neon",
+        neon_gemv<TYPE_FLOAT_F32>,
+        neon_gemv<TYPE_FLOAT_F16>,
+        neon_gemv<TYPE_FLOAT_BF16>,
+    };
+#endif
+
+    return kernels;
+}
+
+const struct MatmulKernels* matmul_kernels() {
+    static const struct MatmulKernels selected = matmul_select();
+    return &selected;
+}
+
+//
+// multiply
+//
+
+// packing buffers of a thread, grown on demand and kept for the life of the thread, so the pool
+// workers allocate them once
+struct MatmulScratch {
+    float* data = nullptr; // 64 byte aligned, so packed panels can be loaded aligned
+    size_t size = 0;       // Floats in data
+
+    ~MatmulScratch() {
+        free(data);
+    }
+
+    float* reserve(size_t n) {
+        if (n > size) {
+            free(data);
+            size = (n + 15) / 16 * 16;
+            data = static_cast<float*>(aligned_alloc(64, size * sizeof(float)));
+            if (!data) {
+                size = 0;
+                throw std::bad_alloc();
+            }
+        }
+        return data;
+    }
+};
+
+static thread_local struct MatmulScratch matmul_scratch;
+
+static size_t div_up(size_t n, size_t d) {
+    return (n + d - 1) / d;
+}
+
+// call fn for every task, on the pool when there is one
+template <typename F> static void matmul_run(struct ThreadPool* pool, size_t n_tasks, F fn) {
+    if (pool && n_tasks > 1) {
+        pool->parallel_for(n_tasks, fn);
+    } else {
+        for (size_t task = 0; task < n_tasks; ++task) {
+            fn(task, 0);
+        }
+    }
+}
+
+// kc elements of row j of the weights from column k0 on, in single precision
+static const float* weight_row(
+    data_t type, const void* w, size_t n_in, size_t j, size_t k0, size_t kc, float* scratch
+) {
+    const size_t offset = j * n_in + k0;
+    switch (type) {
+        case TYPE_FLOAT_F16:
+            convert_f16_to_f32(static_cast<const float16_t*>(w) + offset, scratch, kc);
+            return scratch;
+        case TYPE_FLOAT_BF16:
+            convert_bf16_to_f32(static_cast<const bfloat16_t*>(w) + offset, scratch, kc);
+            return scratch;
+        default:
+            return static_cast<const float*>(w) + offset;
+    }
+}
+
+// pack kc columns from k0 on of weight rows [j0, j0 + cols) into panels of nr rows, the panel of
+// every nr rows holding b[kk * nr + j]. rows past the end are zero.
+static void pack_weights(
+    data_t      type,
+    const void* w,
+    size_t      n_in,
+    size_t      j0,
+    size_t      cols,
+    size_t      k0,
+    size_t      kc,
+    size_t      nr,
+    float*      packed,
+    float*      scratch
+) {
+    const size_t n_panels = div_up(cols, nr);
+    for (size_t r = 0; r < n_panels * nr; ++r) {
+        float* panel = packed + (r / nr) * nr * kc + r % nr;
+        if (r >= cols) {
+            for (size_t kk = 0; kk < kc; ++kk) {
+                panel[kk * nr] = 0.0f;
+            }
+            continue;
+        }
+
+        const float* src = weight_row(type, w, n_in, j0 + r, k0, kc, scratch);
+        for (size_t kk = 0; kk < kc; ++kk) {
+            panel[kk * nr] = src[kk];
+        }
+    }
+}
+
+// pack kc columns from k0 on of input rows [i0, i0 + rows) into panels of mr rows
+static void pack_input(
+    const float* x,
+    size_t       n_in,
+    size_t       i0,
+    size_t       rows,
+    size_t       k0,
+    size_t       kc,
+    size_t       mr,
+    float*       packed
+) {
+    const size_t n_panels = div_up(rows, mr);
+    for (size_t p = 0; p < n_panels; ++p) {
+        float* panel = packed + p * mr * kc;
+        for (size_t i = 0; i < mr; ++i) {
+            const size_t row = p * mr + i;
+            if (row >= rows) {
+                for (size_t kk = 0; kk < kc; ++kk) {
+                    panel[kk * mr + i] = 0.0f;
+                }
+                continue;
+            }
+
+            const float* src = x + (i0 + row) * n_in + k0;
+            for (size_t kk = 0; kk < kc; ++kk) {
+                panel[kk * mr + i] = src[kk];
+            }
+        }
+    }
+}
+
+static void matmul_blocked(
+    const struct MatmulKernels* kernels,
+    struct ThreadPool*          pool,
+    data_t                      type,
+    const void*                 w,
+    size_t                      n_out,
+    size_t                      n_in,
+    const float*                x,
+    size_t                      m,
+    float*                      y
+) {
+    const size_t mr       = kernels->mr;
+    const size_t nr       = kernels->nr;
+    const size_t mc       = mr * MATMUL_MC_TILES;
+    const size_t m_blocks = div_up(m, mc);
+
+    // narrow the column blocks until every thread has a few tasks, even for one row block
+    const size_t n_threads = pool ? pool->n_threads : 1;
+    const size_t wanted    = std::max<size_t>(1, 4 * n_threads / m_blocks);
+    const size_t nc_max    = std::max(nr, MATMUL_NC_MAX / nr * nr);
+    const size_t nc        = std::min(nc_max, div_up(div_up(n_out, wanted), nr) * nr);
+    const size_t n_blocks  = div_up(n_out, nc);
+
+    matmul_run(pool, m_blocks * n_blocks, [&](size_t task, size_t) {
+        const size_t i0      = task / n_blocks * mc;
+        const size_t j0      = task % n_blocks * nc;
+        const size_t rows    = std::min(mc, m - i0);
+        const size_t cols    = std::min(nc, n_out - j0);
+        const size_t tiles_m = div_up(rows, mr);
+        const size_t tiles_n = div_up(cols, nr);
+
+        const size_t a_floats = tiles_m * mr * MATMUL_KC;
+        const size_t b_floats = tiles_n * nr * MATMUL_KC;
+        float*       a_packed = matmul_scratch.reserve(a_floats + b_floats + MATMUL_KC);
+        float*       b_packed = a_packed + a_floats;
+        float*       row      = b_packed + b_floats;
+
+        for (size_t k0 = 0; k0 < n_in; k0 += MATMUL_KC) {
+            const size_t kc         = std::min<size_t>(MATMUL_KC, n_in - k0);
+            const bool   accumulate = k0 > 0;
+            pack_weights(type, w, n_in, j0, cols, k0, kc, nr, b_packed, row);
+            pack_input(x, n_in, i0, rows, k0, kc, mr, a_packed);
+
+            // a sliver of the weights stays in L1 while the input tiles stream past it
+            for (size_t tn = 0; tn < tiles_n; ++tn) {
+                const float* b         = b_packed + tn * nr * kc;
+                const size_t tile_cols = std::min(nr, cols - tn * nr);
+                for (size_t tm = 0; tm < tiles_m; ++tm) {
+                    const float* a         = a_packed + tm * mr * kc;
+                    const size_t tile_rows = std::min(mr, rows - tm * mr);
+                    float*       c         = y + (i0 + tm * mr) * n_out + j0 + tn * nr;
+                    if (tile_rows == mr && tile_cols == nr) {
+                        kernels->tile(kc, a, b, c, n_out, accumulate);
+                        continue;
+                    }
+
+                    // an edge tile goes through a buffer, the kernel always writes a full tile
+                    float edge[MATMUL_TILE_MAX];
+                    kernels->tile(kc, a, b, edge, nr, false);
+                    for (size_t i = 0; i < tile_rows; ++i) {
+                        for (size_t j = 0; j < tile_cols; ++j) {
+                            float* out = c + i * n_out + j;
+                            *out       = accumulate ? *out + edge[i * nr + j] : edge[i * nr + j];
+                        }
+                    }
+                }
+            }
+        }
+    });
+}
+
+// rows of the weights per task of a batch of one, a multiple of the 4 rows the kernels share
+static size_t gemv_rows_per_task(struct ThreadPool* pool, size_t n_out) {
+    const size_t n_threads = pool ? pool->n_threads : 1;
+    return std::max<size_t>(4, div_up(div_up(n_out, n_threads * MATMUL_GEMV_SPLIT), 4) * 4);
+}
+
+static void matmul_gemv(
+    const struct MatmulKernels* kernels,
+    struct ThreadPool*          pool,
+    data_t                      type,
+    const void*                 w,
+    size_t                      n_out,
+    size_t                      n_in,
+    const float*                x,
+    float*                      y
+) {
+    const size_t chunk = gemv_rows_per_task(pool, n_out);
+    matmul_run(pool, div_up(n_out, chunk), [&](size_t task, size_t) {
+        const size_t j0   = task * chunk;
+        const size_t rows = std::min(chunk, n_out - j0);
+        switch (type) {
+            case TYPE_FLOAT_F16:
+                kernels->gemv_f16(
+                    static_cast<const float16_t*>(w) + j0 * n_in, n_in, x, y + j0, rows
+                );
+                break;
+            case TYPE_FLOAT_BF16:
+                kernels->gemv_bf16(
+                    static_cast<const bfloat16_t*>(w) + j0 * n_in, n_in, x, y + j0, rows
+                );
+                break;
+            default:
+                kernels->gemv_f32(static_cast<const float*>(w) + j0 * n_in, n_in, x, y + j0, rows);
+                break;
+        }
+    });
+}
+
+static void matmul_quantized(
+    const struct PrecisionKernels* kernels,
+    struct ThreadPool*             pool,
+    data_t                         type,
+    const void*                    w,
+    size_t                         n_out,
+    size_t                         n_in,
+    const float*                   x,
+    size_t                         m,
+    float*                         y
+) {
+    if (0 != n_in % QUANT_BLOCK) {
+        throw std::invalid_argument("Expected quantized rows of whole blocks.");
+    }
+
+    // the input is quantized once, not once per weight row it meets
+    const size_t          blocks = n_in / QUANT_BLOCK;
+    std::vector<quant8_t> xq(m * blocks);
+    matmul_run(pool, m, [&](size_t i, size_t) {
+        quantize_row_q8(x + i * n_in, xq.data() + i * blocks, n_in);
+    });
+
+    const size_t   row_bytes = data_type_size(type, n_in);
+    const uint8_t* weights   = static_cast<const uint8_t*>(w);
+    const size_t   chunk     = gemv_rows_per_task(pool, n_out);
+    matmul_run(pool, div_up(n_out, chunk), [&](size_t task, size_t) {
+        const size_t j0 = task * chunk;
+        const size_t j1 = std::min(n_out, j0 + chunk);
+        for (size_t i0 = 0; i0 < m; i0 += MATMUL_QUANT_ROWS) {
+            const size_t i1 = std::min(m, i0 + MATMUL_QUANT_ROWS);
+            for (size_t j = j0; j < j1; ++j) {
+                const void* row = weights + j * row_bytes;
+                for (size_t i = i0; i < i1; ++i) {
+                    const quant8_t* xi = xq.data() + i * blocks;
+                    y[i * n_out + j]   = TYPE_QUANT_K8 == type
+                                             ? kernels->dot_q8_q8((const quant8_t*) row, xi, n_in)
+                                             : kernels->dot_q4_q8((const quant4_t*) row, xi, n_in);
+                }
+            }
+        }
+    });
+}
+
+void matmul_with(
+    const struct MatmulKernels* kernels,
+    struct ThreadPool*          pool,
+    data_t                      type,
+    const void*                 w,
+    size_t                      n_out,
+    size_t                      n_in,
+    const float*                x,
+    size_t                      m,
+    float*                      y
+) {
+    if (nullptr == kernels || nullptr == w || nullptr == x || nullptr == y) {
+        throw std::invalid_argument("Expected valid kernels, weights, input and output.");
+    }
+    if (0 == m || 0 == n_out) {
+        return;
+    }
+    if (0 == n_in) {
+        memset(y, 0, m * n_out * sizeof(float));
+        return;
+    }
+    PROFILE_SCOPE("matmul");
+    PROFILE_COUNT("matmul flops", 2 * m * n_out * n_in);
+
+    // small multiplies are done before the workers would have picked up their tasks
+    if (m * n_out * n_in < MATMUL_PARALLEL_MIN) {
+        pool = nullptr;
+    }
+
+    switch (type) {
+        case TYPE_FLOAT_F32:
+        case TYPE_FLOAT_F16:
+        case TYPE_FLOAT_BF16:
+            if (1 == m) {
+                matmul_gemv(kernels, pool, type, w, n_out, n_in, x, y);
+            } else {
+                matmul_blocked(kernels, pool, type, w, n_out, n_in, x, m, y);
+            }
+            break;
+        case TYPE_QUANT_K8:
+        case TYPE_QUANT_K4:
+            matmul_quantized(
+                &MATMUL_REFERENCE == kernels ? &PRECISION_REFERENCE : precision_kernels(),
+                pool,
+                type,
+                w,
+                n_out,
+                n_in,
+                x,
+                m,
+                y
+            );
+            break;
+        default:
+            throw std::invalid_argument("Unsupported weight type for matmul.");
+    }
+}
+
+void matmul(
+    struct ThreadPool* pool,
+    data_t             type,
+    const void*        w,
+    size_t             n_out,
+    size_t             n_in,
+    const float*       x,
+    size_t             m,
+    float*             y
+) {
+    matmul_with(matmul_kernels(), pool, type, w, n_out, n_in, x, m, y);
+}
+
+void matmul(struct ThreadPool* pool, const struct Tensor &w, const float* x, size_t m, float* y) {
+    if (2 != w.n_dims) {
+        throw std::invalid_argument("Expected two dimensional weights.");
+    }
+    matmul(pool, w.type, w.data, w.rows(), w.cols(), x, m, y);
+}
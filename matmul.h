@@ -0,0 +1,89 @@
+#ifndef MATMUL_H
+#define MATMUL_H
+
+#include "precision.h"
+#include "safetensors.h"
+#include "thread-pool.h"
+
+#include <cstddef>
+
+// Blocking of the multiply. A KC x NC panel of the weights stays in L2 while MC rows of the input
+// stream past it, and every microkernel call reads a KC x NR sliver of it from L1.
+#define MATMUL_KC 256
+#define MATMUL_MC_TILES 16 // MC is this many microkernel rows
+#define MATMUL_NC_MAX 512
+
+// the widest microkernel tile of any kernel set, the edge tiles are staged in a buffer this big
+#define MATMUL_TILE_MAX (8 * 32)
+
+/**
+ * The kernels of the multiply for one instruction set.
+ *
+ * tile computes an mr x nr block of the output from packed panels: a holds kc columns of mr input
+ * rows, a[kk * mr + i], and b holds kc columns of nr weight rows, b[kk * nr + j]. The block is
+ * stored to c at a stride of ldc floats, or added to it with accumulate.
+ *
+ * The gemv kernels compute y[j] = dot(w + j * n_in, x) for n_rows rows of the weights. A batch of
+ * one reads every weight once and does two flops per element, so they are bound by memory
+ * bandwidth and the 256-bit kernels already saturate it.
+ */
+struct MatmulKernels {
+    const char* name; // Instruction set of the tile kernel, e.g. "avx512"
+    size_t      mr;   // Rows of the microkernel tile
+    size_t      nr;   // Columns of the microkernel tile
+
+    void (*tile)(size_t kc, const float* a, const float* b, float* c, size_t ldc, bool accumulate);
+
+    const char* gemv_name; // Instruction set of the gemv kernels, e.g. "avx2"
+
+    void (*gemv_f32)(const float* w, size_t n_in, const float* x, float* y, size_t n_rows);
+    void (*gemv_f16)(const float16_t* w, size_t n_in, const float* x, float* y, size_t n_rows);
+    void (*gemv_bf16)(const bfloat16_t* w, size_t n_in, const float* x, float* y, size_t n_rows);
+};
+
+// the portable kernels, e.g. to check the vector ones against
+extern const struct MatmulKernels MATMUL_REFERENCE;
+
+// the kernels selected for this cpu
+const struct MatmulKernels* matmul_kernels();
+
+/**
+ * y = x W^T, for the m rows of x with n_in floats each and the n_out x n_in weights w of any
+ * data_t, laid out as nn.Linear stores them. y gets m rows of n_out floats.
+ *
+ * Float weights are multiplied by the cache-blocked microkernels, converted to single precision
+ * as their panels are packed. Quantized weights, whose rows are whole blocks, are multiplied with
+ * x quantized to 8 bits by the fused dot products of precision.h. A batch of one takes the gemv
+ * path, which streams the weights once.
+ *
+ * The work is split across pool, or done on the calling thread when pool is null.
+ */
+void matmul(
+    struct ThreadPool* pool,
+    data_t             type,
+    const void*        w,
+    size_t             n_out,
+    size_t             n_in,
+    const float*       x,
+    size_t             m,
+    float*             y
+);
+
+// the weights are a 2-D tensor of a checkpoint, e.g. a q_proj.weight
+void matmul(struct ThreadPool* pool, const struct Tensor &w, const float* x, size_t m, float* y);
+
+// matmul with kernels instead of the selected ones, e.g. MATMUL_REFERENCE. quantized weights are
+// multiplied by PRECISION_REFERENCE along with MATMUL_REFERENCE, by precision_kernels() otherwise.
+void matmul_with(
+    const struct MatmulKernels* kernels,
+    struct ThreadPool*          pool,
+    data_t                      type,
+    const void*                 w,
+    size_t                      n_out,
+    size_t                      n_in,
+    const float*                x,
+    size_t                      m,
+    float*                      y
+);
+
+#endif // MATMUL_H
@@ -0,0 +1,243 @@
+#include "attention.h"
+#include "kv-cache.h"
+#include "model.h"
+#include "precision.h"
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <getopt.h>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+static int model_main(int argc, char* argv[]) {
+    const char* const   short_options  = "p:t:n:r:Hq:k:";
+    const struct option long_options[] = {
+        {"model-path", required_argument, nullptr, 'p'},
+        {"tokens", required_argument, nullptr, 't'},
+        {"batch", required_argument, nullptr, 'n'},
+        {"rounds", required_argument, nullptr, 'r'},
+        {"huge-pages", no_argument, nullptr, 'H'},
+        {"quantize", required_argument, nullptr, 'q'},
+        {"kv-pages", required_argument, nullptr, 'k'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int                   opt;
+    std::filesystem::path directory;
+    std::vector<uint32_t> ids;
+    size_t                n_batch    = 4096; // ids gathered by a single lookup
+    size_t                rounds     = 10;
+    bool                  huge_pages = false;
+    data_t                quantize   = TYPE_MAX_COUNT; // weights are used as stored
+    size_t                kv_pages   = 0;              // no kv cache unless asked for
+
+    while ((opt = getopt_long(argc, argv, short_options, long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'p':
+                directory = std::filesystem::path(optarg);
+                break;
+
+            case 't':
+                // a comma separated list of token ids, e.g. the output of the tokenizer
+                for (char* id = strtok(optarg, ", "); id; id = strtok(nullptr, ", ")) {
+                    ids.push_back((uint32_t) strtoul(id, nullptr, 10));
+                }
+                break;
+
+            case 'n':
+                n_batch = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'r':
+                rounds = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'H':
+                huge_pages = true;
+                break;
+
+            case 'k':
+                kv_pages = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'q':
+                if (0 == strcmp(optarg, "q8") || 0 == strcmp(optarg, "q4")) {
+                    quantize = '4' == optarg[1] ? TYPE_QUANT_K4 : TYPE_QUANT_K8;
+                    break;
+                }
+                [[fallthrough]];
+
+            default:
+                fprintf(
+                    stderr,
+                    "Usage: %s -p <model-path> [-t <ids>] [-n <batch>] [-r <rounds>] [-H] "
+                    "[-q <q8|q4>] [-k <kv-pages>]\n",
+                    argv[0]
+                );
+                return 1;
+        }
+    }
+
+    if (directory.empty()) {
+        fprintf(stderr, "Error: Expected a model path with -p.\n");
+        return 1;
+    }
+
+    const std::filesystem::path config_path = directory / "config.json";
+    const struct ModelConfig    config      = model_config_from_file(config_path.c_str());
+    fprintf(
+        stdout,
+        "config: %s, n_vocab %zu, n_embd %zu, n_layer %zu, n_head %zu, n_kv_head %zu\n",
+        config.type.c_str(),
+        config.n_vocab,
+        config.n_embd,
+        config.n_layer,
+        config.n_head,
+        config.n_kv_head
+    );
+    fprintf(
+        stdout,
+        "layers: %s, attention kernels %s\n",
+        attention_specialization(config),
+        attention_kernel_name()
+    );
+
+    const struct PrecisionKernels* kernels = precision_kernels();
+    fprintf(
+        stdout,
+        "precision: f16 %s, bf16 %s, quant %s\n",
+        kernels->f16_name,
+        kernels->bf16_name,
+        kernels->quant_name
+    );
+
+    // the weights are optional, the tables are sized from the config alone without them
+    struct SafeTensors*         weights    = nullptr;
+    const std::filesystem::path checkpoint = directory / "model.safetensors";
+    const std::filesystem::path index      = directory / "model.safetensors.index.json";
+    if (std::filesystem::is_regular_file(checkpoint) || std::filesystem::is_regular_file(index)) {
+        const auto start = std::chrono::steady_clock::now();
+        weights          = TYPE_MAX_COUNT == quantize
+                               ? mmap_safetensors(directory.c_str())
+                               : mmap_quantized_safetensors(directory.c_str(), quantize);
+        const auto end   = std::chrono::steady_clock::now();
+
+        size_t bytes = 0;
+        for (const auto &[name, tensor] : weights->tensors) {
+            bytes += tensor.bytes;
+        }
+        fprintf(
+            stdout,
+            "weights: %zu tensors, %zu bytes in %zu files, %.2f ms\n",
+            weights->tensors.size(),
+            bytes,
+            weights->mappings.size(),
+            std::chrono::duration<double, std::milli>(end - start).count()
+        );
+    }
+
+    // GPT-2 checkpoints name the token embedding wte, Llama style ones embed_tokens
+    const struct Tensor* embedding = nullptr;
+    for (const char* name : {"wte.weight", "transformer.wte.weight", "model.embed_tokens.weight"}) {
+        if (weights && !embedding) {
+            embedding = weights->find(name);
+        }
+    }
+
+    struct EmbeddingTable* table = embedding ? malloc_embedding_table(*embedding, huge_pages)
+                                             : malloc_embedding_table(config, huge_pages);
+    fprintf(
+        stdout,
+        "embedding: %zu x %zu floats, stride %zu, %zu bytes, huge pages %s\n",
+        table->n_vocab,
+        table->n_embd,
+        table->stride,
+        table->bytes,
+        table->huge_pages ? "yes" : "no"
+    );
+
+    // without weights every element holds a value derived from its place
+    for (uint32_t id = 0; !embedding && id < table->n_vocab; ++id) {
+        float* row = table->row(id);
+        for (size_t i = 0; i < table->n_embd; ++i) {
+            row[i] = (float) id + (float) i / (float) table->n_embd;
+        }
+    }
+
+    for (uint32_t id : ids) {
+        if (id >= table->n_vocab) {
+            fprintf(
+                stderr, "Error: Token id %u is out of range, n_vocab is %zu.\n", id, table->n_vocab
+            );
+            free_embedding_table(table);
+            free_safetensors(weights);
+            return 1;
+        }
+    }
+
+    if (!ids.empty()) {
+        std::vector<float> out(ids.size() * table->n_embd);
+        table->lookup(ids.data(), ids.size(), out.data());
+        for (size_t i = 0; i < ids.size(); ++i) {
+            const float* e = out.data() + i * table->n_embd;
+            fprintf(stdout, "%u: %.3f %.3f ... %.3f\n", ids[i], e[0], e[1], e[table->n_embd - 1]);
+        }
+    }
+
+    // random ids defeat the caches, as the tokens of real text mostly do for large vocabularies
+    if (n_batch > 0 && rounds > 0) {
+        std::mt19937                            rng(42);
+        std::uniform_int_distribution<uint32_t> pick(0, (uint32_t) table->n_vocab - 1);
+        std::vector<uint32_t>                   batch(n_batch);
+        for (uint32_t &id : batch) {
+            id = pick(rng);
+        }
+
+        std::vector<float> out(n_batch * table->n_embd);
+        const auto         start = std::chrono::steady_clock::now();
+        for (size_t round = 0; round < rounds; ++round) {
+            table->lookup(batch.data(), batch.size(), out.data());
+        }
+        const auto   end     = std::chrono::steady_clock::now();
+        const double seconds = std::chrono::duration<double>(end - start).count();
+        const double bytes   = (double) (rounds * n_batch * table->n_embd * sizeof(float));
+        fprintf(
+            stdout,
+            "lookup: %zu ids x %zu rounds, %.2f GB/s\n",
+            n_batch,
+            rounds,
+            bytes / seconds / 1e9
+        );
+    }
+
+    // the pool a server would size from its memory budget, pages of KV_PAGE_TOKENS positions
+    if (kv_pages > 0) {
+        struct KVCache* cache = malloc_kv_cache(config, kv_pages);
+        fprintf(
+            stdout,
+            "kv cache: %zu pages x %zu tokens, %zu bytes, %zu bytes per token\n",
+            cache->n_pages,
+            cache->page_tokens,
+            cache->bytes,
+            kv_cache_bytes_per_token(config)
+        );
+        free_kv_cache(cache);
+    }
+
+    free_embedding_table(table);
+    free_safetensors(weights);
+
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[]) {
+    // e.g. a missing config.json or a checkpoint that does not match it
+    try {
+        return model_main(argc, argv);
+    } catch (const std::exception &e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+}
@@ -1,57 +1,223 @@
-#include <stdio.h>
-#include <stdlib.h>
+#include "model.h"
 
-// Global variables
-float* token_embedding;
-int    vocabulary_size     = 32000;
-int    embedding_dimension = 768;
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
 
-void init(int size, int dimension) {
-    // Initialize token embedding matrix
-    token_embedding = (float*) malloc((vocabulary_size + 1) * dimension);
+//
+// config
+//
 
-    if (!token_embedding) {
-        printf("Error: Unable to allocate memory for the token embedding.\n");
-        exit(EXIT_FAILURE);
+// the first of keys that config has, e.g. n_embd for GPT-2 and hidden_size for Llama
+template <typename T>
+static T
+config_value(const nlohmann::json &config, std::initializer_list<const char*> keys, T fallback) {
+    for (const char* key : keys) {
+        if (config.contains(key) && !config[key].is_null()) {
+            return config[key].get<T>();
+        }
+    }
+    return fallback;
+}
+
+struct ModelConfig model_config(const nlohmann::json &config) {
+    if (config.is_null()) {
+        throw std::invalid_argument("Expected a valid config argument, got null instead.");
+    }
+
+    struct ModelConfig model;
+    model.type    = config_value<std::string>(config, {"model_type"}, "");
+    model.n_vocab = config_value<size_t>(config, {"vocab_size"}, 0);
+    model.n_embd  = config_value<size_t>(config, {"n_embd", "hidden_size"}, 0);
+    model.n_layer = config_value<size_t>(config, {"n_layer", "num_hidden_layers"}, 0);
+    model.n_head  = config_value<size_t>(config, {"n_head", "num_attention_heads"}, 0);
+
+    // without grouped queries every query head has its own key and value head
+    model.n_kv_head = config_value<size_t>(config, {"num_key_value_heads"}, model.n_head);
+    model.n_ctx     = config_value<size_t>(config, {"n_positions", "max_position_embeddings"}, 0);
+
+    // GPT-2 leaves n_inner unset for the customary 4 x n_embd
+    model.n_ff = config_value<size_t>(config, {"n_inner", "intermediate_size"}, 4 * model.n_embd);
+
+    model.norm_eps   = config_value<float>(config, {"layer_norm_epsilon", "rms_norm_eps"}, 1e-5f);
+    model.rope_theta = config_value<float>(config, {"rope_theta"}, 0.0f);
+
+    if (0 == model.n_vocab || 0 == model.n_embd) {
+        throw std::invalid_argument("Expected vocab_size and n_embd or hidden_size in config.");
+    }
+    if (0 == model.n_head || 0 != model.n_embd % model.n_head) {
+        throw std::invalid_argument("Expected a number of heads that divides the embedding.");
+    }
+    if (0 == model.n_kv_head || 0 != model.n_head % model.n_kv_head) {
+        throw std::invalid_argument("Expected a number of key value heads that divides n_head.");
     }
 
-    vocabulary_size     = size;
-    embedding_dimension = dimension;
+    return model;
 }
 
-void set_parameter(int index, float value) {
-    if (index < 0 || index >= (vocabulary_size + 1)) {
-        printf("Error: Index out of range.\n");
-        exit(EXIT_FAILURE);
+struct ModelConfig model_config_from_file(const char* path) {
+    if (nullptr == path) {
+        throw std::invalid_argument("Expected a valid path argument, got null instead.");
     }
 
-    token_embedding[index * embedding_dimension] = value;
+    std::ifstream f(path);
+    if (!f) {
+        throw std::runtime_error("Unable to open model config: " + std::string(path));
+    }
+    try {
+        return model_config(nlohmann::json::parse(f));
+    } catch (const nlohmann::json::exception &e) {
+        throw std::runtime_error("Invalid model config: " + std::string(path) + ": " + e.what());
+    }
 }
 
-float* get_token_vector(int index) {
-    if (index < 0 || index >= vocabulary_size) {
-        printf("Error: Index out of range.\n");
-        exit(EXIT_FAILURE);
+//
+// token embedding
+//
+
+// explicit huge pages are 2 MiB on the hosts we run on
+static const size_t EMBEDDING_HUGE_PAGE = 2 << 20;
+
+// rows ahead of the one being copied whose first lines are requested from memory. the hardware
+// prefetcher follows a row once it is underway, it cannot guess the next row.
+static const size_t EMBEDDING_PREFETCH = 4;
+
+void EmbeddingTable::lookup(const uint32_t* ids, size_t n_ids, float* out) const {
+    uint32_t max_id = 0;
+    for (size_t i = 0; i < n_ids; ++i) {
+        max_id = ids[i] > max_id ? ids[i] : max_id;
+    }
+    if (n_ids > 0 && max_id >= n_vocab) {
+        throw std::out_of_range("Token id " + std::to_string(max_id) + " is out of range.");
     }
 
-    return &token_embedding[index * embedding_dimension];
+    const size_t row_bytes = n_embd * sizeof(float);
+    for (size_t i = 0; i < n_ids; ++i) {
+        if (i + EMBEDDING_PREFETCH < n_ids) {
+            const char* ahead = reinterpret_cast<const char*>(row(ids[i + EMBEDDING_PREFETCH]));
+            __builtin_prefetch(ahead);
+            __builtin_prefetch(ahead + EMBEDDING_ALIGN);
+        }
+        memcpy(out + i * n_embd, row(ids[i]), row_bytes);
+    }
 }
 
-int main() {
-    // Initialize the token embedding matrix
-    init(1000, 512);
+struct EmbeddingTable* malloc_embedding_table(size_t n_vocab, size_t n_embd, bool huge_pages) {
+    if (0 == n_vocab || 0 == n_embd) {
+        throw std::invalid_argument("Expected a non-empty embedding table.");
+    }
+
+    struct EmbeddingTable* table = new EmbeddingTable{};
 
-    // Set some example parameters
-    for (int i = 0; i < vocabulary_size + 1; ++i) {
-        set_parameter(i, rand() % 10 - 5.f);
+    if (!table) {
+        throw std::bad_alloc();
     }
 
-    float* token_vector = get_token_vector(42);
+    const size_t floats = EMBEDDING_ALIGN / sizeof(float);
+    table->n_vocab      = n_vocab;
+    table->n_embd       = n_embd;
+    table->stride       = (n_embd + floats - 1) / floats * floats;
 
-    printf("Token ID: 42\n");
-    for (int i = 0; i < embedding_dimension; ++i) {
-        printf("Component %d: %.3f\n", i, token_vector[i]);
+    const size_t bytes = n_vocab * table->stride * sizeof(float);
+
+    if (huge_pages) {
+        // explicit huge pages only exist when the administrator reserved them
+        const size_t pages = (bytes + EMBEDDING_HUGE_PAGE - 1) / EMBEDDING_HUGE_PAGE;
+        table->bytes       = pages * EMBEDDING_HUGE_PAGE;
+        void* data         = mmap(
+            nullptr,
+            table->bytes,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+            -1,
+            0
+        );
+
+        if (MAP_FAILED == data) {
+            data = mmap(
+                nullptr, table->bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+            );
+            if (MAP_FAILED == data) {
+                delete table;
+                throw std::bad_alloc();
+            }
+
+            // the kernel may still back the table with huge pages as it faults them in
+            if (0 != madvise(data, table->bytes, MADV_HUGEPAGE)) {
+                fprintf(stderr, "Warning: huge pages are not available for the embedding.\n");
+                huge_pages = false;
+            }
+        }
+
+        table->data       = static_cast<float*>(data);
+        table->mapped     = true;
+        table->huge_pages = huge_pages;
+        return table;
+    }
+
+    // aligned_alloc wants a multiple of the alignment, which every row already is
+    table->bytes = bytes;
+    table->data  = static_cast<float*>(aligned_alloc(EMBEDDING_ALIGN, bytes));
+    if (!table->data) {
+        delete table;
+        throw std::bad_alloc();
     }
+    memset(table->data, 0, bytes);
+
+    return table;
+}
+
+struct EmbeddingTable* malloc_embedding_table(const struct ModelConfig &config, bool huge_pages) {
+    return malloc_embedding_table(config.n_vocab, config.n_embd, huge_pages);
+}
 
-    return EXIT_SUCCESS;
+struct EmbeddingTable* malloc_embedding_table(const struct Tensor &tensor, bool huge_pages) {
+    if (2 != tensor.n_dims) {
+        throw std::invalid_argument("Expected a two dimensional token embedding.");
+    }
+
+    const size_t           row_bytes = data_type_size(tensor.type, tensor.cols());
+    struct EmbeddingTable* table = malloc_embedding_table(tensor.rows(), tensor.cols(), huge_pages);
+    for (uint32_t id = 0; id < table->n_vocab; ++id) {
+        const uint8_t* src = tensor.as<uint8_t>() + id * row_bytes;
+        float*         dst = table->row(id);
+        switch (tensor.type) {
+            case TYPE_FLOAT_F32:
+                memcpy(dst, src, row_bytes);
+                break;
+            case TYPE_FLOAT_F16:
+                convert_f16_to_f32(reinterpret_cast<const float16_t*>(src), dst, table->n_embd);
+                break;
+            case TYPE_FLOAT_BF16:
+                convert_bf16_to_f32(reinterpret_cast<const bfloat16_t*>(src), dst, table->n_embd);
+                break;
+            case TYPE_QUANT_K8:
+                dequantize_row_q8(reinterpret_cast<const quant8_t*>(src), dst, table->n_embd);
+                break;
+            case TYPE_QUANT_K4:
+                dequantize_row_q4(reinterpret_cast<const quant4_t*>(src), dst, table->n_embd);
+                break;
+            default:
+                free_embedding_table(table);
+                throw std::invalid_argument("Unsupported token embedding type.");
+        }
+    }
+
+    return table;
+}
+
+void free_embedding_table(struct EmbeddingTable* table) {
+    if (nullptr == table) {
+        return;
+    }
+
+    if (table->mapped) {
+        munmap(table->data, table->bytes);
+    } else {
+        free(table->data);
+    }
+    delete table;
 }
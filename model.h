@@ -0,0 +1,105 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include "safetensors.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+#include <string>
+
+//
+// config
+//
+
+// Hyperparameters of a model from its huggingface config.json. GPT-2 and Llama style models name
+// the same quantities differently, e.g. n_embd and hidden_size, both are accepted.
+struct ModelConfig {
+    std::string type;       // model_type, e.g. gpt2 or mistral
+    size_t      n_vocab;    // N_V, number of rows of the token embedding
+    size_t      n_embd;     // d_e, dimension of the embedding space
+    size_t      n_layer;    // Number of transformer blocks
+    size_t      n_head;     // Number of query heads
+    size_t      n_kv_head;  // Number of key and value heads, n_head without grouped queries
+    size_t      n_ctx;      // Longest sequence the positions were trained for
+    size_t      n_ff;       // Hidden dimension of the feed forward network
+    float       norm_eps;   // Epsilon of the layer or rms norm
+    float       rope_theta; // Base of the rotary embedding, 0 for learned positions
+};
+
+struct ModelConfig model_config(const nlohmann::json &config);
+
+// read the config.json of a model directory
+struct ModelConfig model_config_from_file(const char* path);
+
+/**
+ * The dimensions of a transformer layer as compile time constants, for the configs that are
+ * deployed. Kernels instantiated for a shape have every loop bound and tile size fixed, so the
+ * compiler unrolls and vectorizes the short per-head loops completely. Any other config takes the
+ * generic path with the same dimensions read from its ModelConfig.
+ */
+template <size_t N_EMBD, size_t N_HEAD, size_t N_KV_HEAD>
+struct LayerShape {
+    static_assert(N_HEAD > 0 && 0 == N_EMBD % N_HEAD, "heads must divide the embedding");
+    static_assert(N_KV_HEAD > 0 && 0 == N_HEAD % N_KV_HEAD, "kv heads must divide the heads");
+
+    static constexpr size_t n_embd    = N_EMBD;
+    static constexpr size_t n_head    = N_HEAD;
+    static constexpr size_t n_kv_head = N_KV_HEAD;
+    static constexpr size_t head_dim  = N_EMBD / N_HEAD;
+    static constexpr size_t group     = N_HEAD / N_KV_HEAD; // Query heads per kv head
+};
+
+using GPT2Shape    = LayerShape<768, 12, 12>;
+using MistralShape = LayerShape<4096, 32, 8>;
+
+//
+// token embedding
+//
+
+// rows start on a cache line, so a row never shares a line with its neighbours
+#define EMBEDDING_ALIGN 64
+
+/**
+ * The token embedding matrix W_e with one row of n_embd floats per token. Rows are stride floats
+ * apart, n_embd rounded up to a cache line, and the whole table is a single allocation.
+ *
+ * Ids are checked once per lookup rather than once per element: the gather itself is a copy of
+ * whole rows, so it runs at memory bandwidth.
+ */
+struct EmbeddingTable {
+    float* data;       // n_vocab rows of stride floats, EMBEDDING_ALIGN aligned
+    size_t n_vocab;    // Number of rows
+    size_t n_embd;     // Floats in use in every row
+    size_t stride;     // Floats between consecutive rows
+    size_t bytes;      // Size of the allocation
+    bool   mapped;     // Allocated with mmap rather than aligned_alloc
+    bool   huge_pages; // Backed by huge pages, explicit or transparent
+
+    float* row(uint32_t id) {
+        return data + (size_t) id * stride;
+    }
+
+    const float* row(uint32_t id) const {
+        return data + (size_t) id * stride;
+    }
+
+    // copy the rows of ids into out, n_ids rows of n_embd floats each.
+    // throws std::out_of_range before writing anything if an id is not below n_vocab.
+    void lookup(const uint32_t* ids, size_t n_ids, float* out) const;
+};
+
+// allocate a zeroed n_vocab x n_embd table. with huge_pages the table is backed by explicit huge
+// pages when the system has them reserved, transparent huge pages otherwise.
+struct EmbeddingTable* malloc_embedding_table(size_t n_vocab, size_t n_embd, bool huge_pages);
+
+struct EmbeddingTable*
+malloc_embedding_table(const struct ModelConfig &config, bool huge_pages = false);
+
+// allocate a table holding the rows of tensor, an n_vocab x n_embd matrix of any data_t. the rows
+// are converted to single precision once, so lookups stay a plain copy.
+struct EmbeddingTable* malloc_embedding_table(const struct Tensor &tensor, bool huge_pages = false);
+
+void free_embedding_table(struct EmbeddingTable* table);
+
+#endif // MODEL_H
@@ -0,0 +1,598 @@
+/*
+ * precision.c
+ *
+ * Conversions between single precision and the 16-bit types. Every kernel rounds to nearest even
+ * and produces the same bits as the scalar reference, except where noted in precision.h.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define PRECISION_X86
+#elif defined(__aarch64__)
+    // arm_neon.h has a float16_t of its own, an __fp16, which would clash with ours
+    #define float16_t arm_float16_t
+    #include <arm_neon.h>
+    #undef float16_t
+    #define PRECISION_NEON
+#endif
+
+#include "precision.h"
+
+#include <pthread.h>
+#include <string.h>
+
+static inline uint32_t float_bits(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static inline float bits_float(uint32_t bits) {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+//
+// scalar reference
+//
+
+bfloat16_t float_to_bfloat16(float value) {
+    const uint32_t bits = float_bits(value);
+
+    // keep nan a nan: truncation could clear every bit of the mantissa that remains
+    if ((bits & 0x7FFFFFFF) > 0x7F800000) {
+        return (bfloat16_t) ((bits >> 16) | 0x0040);
+    }
+
+    // round to nearest even: ties go to the value whose last kept bit is zero
+    const uint32_t rounding = 0x7FFF + ((bits >> 16) & 1);
+    return (bfloat16_t) ((bits + rounding) >> 16);
+}
+
+float bfloat16_to_float(bfloat16_t value) {
+    return bits_float((uint32_t) value << 16);
+}
+
+float16_t float_to_float16(float value) {
+    uint32_t       bits = float_bits(value);
+    const uint32_t sign = (bits >> 16) & 0x8000;
+    bits               &= 0x7FFFFFFF;
+
+    // inf stays inf, nan is quieted and keeps the top of its payload
+    if (bits >= 0x7F800000) {
+        const uint32_t nan = bits > 0x7F800000 ? 0x0200 | ((bits >> 13) & 0x03FF) : 0;
+        return (float16_t) (sign | 0x7C00 | nan);
+    }
+
+    // 65520 and above round to inf
+    if (bits >= 0x477FF000) {
+        return (float16_t) (sign | 0x7C00);
+    }
+
+    // below 2^-14 the result is subnormal. adding 0.5 lines the float mantissa up with the half
+    // precision one, 2^-24 per unit, and lets the hardware do the rounding.
+    if (bits < 0x38800000) {
+        const float shifted = bits_float(bits) + 0.5f;
+        return (float16_t) (sign | (float_bits(shifted) - 0x3F000000));
+    }
+
+    // rebias the exponent from 127 to 15 and round the 13 bits that are dropped
+    const uint32_t odd  = (bits >> 13) & 1;
+    bits               += ((uint32_t) (15 - 127) << 23) + 0x0FFF + odd;
+    return (float16_t) (sign | (bits >> 13));
+}
+
+float float16_to_float(float16_t value) {
+    const uint32_t sign     = ((uint32_t) value & 0x8000) << 16;
+    const uint32_t exponent = ((uint32_t) value >> 10) & 0x1F;
+    const uint32_t mantissa = (uint32_t) value & 0x03FF;
+
+    if (0 == exponent) {
+        // zero or subnormal, both exact in single precision
+        const float magnitude = (float) mantissa * 0x1p-24f;
+        return bits_float(sign | float_bits(magnitude));
+    }
+    if (0x1F == exponent) {
+        // like the hardware conversions, a signaling nan comes back quiet
+        const uint32_t nan = 0 != mantissa ? 0x00400000 : 0;
+        return bits_float(sign | 0x7F800000 | nan | (mantissa << 13));
+    }
+    return bits_float(sign | ((exponent + (127 - 15)) << 23) | (mantissa << 13));
+}
+
+static void scalar_f32_to_f16(const float* src, float16_t* dst, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] = float_to_float16(src[i]);
+    }
+}
+
+static void scalar_f16_to_f32(const float16_t* src, float* dst, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] = float16_to_float(src[i]);
+    }
+}
+
+static void scalar_f32_to_bf16(const float* src, bfloat16_t* dst, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] = float_to_bfloat16(src[i]);
+    }
+}
+
+static void scalar_bf16_to_f32(const bfloat16_t* src, float* dst, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] = bfloat16_to_float(src[i]);
+    }
+}
+
+//
+// quantization
+//
+
+size_t data_type_size(data_t type, size_t n) {
+    switch (type) {
+        case TYPE_FLOAT_F32:
+            return n * sizeof(float);
+        case TYPE_FLOAT_F16:
+            return n * sizeof(float16_t);
+        case TYPE_FLOAT_BF16:
+            return n * sizeof(bfloat16_t);
+        case TYPE_QUANT_K8:
+            return n / QUANT_BLOCK * sizeof(quant8_t);
+        case TYPE_QUANT_K4:
+            return n / QUANT_BLOCK * sizeof(quant4_t);
+        default:
+            return 0;
+    }
+}
+
+const char* data_type_name(data_t type) {
+    static const char* const names[TYPE_MAX_COUNT] = {"f32", "f16", "bf16", "q8", "q4"};
+    return type < TYPE_MAX_COUNT ? names[type] : "unknown";
+}
+
+// nearest integer, ties away from zero like roundf, without the call
+static inline int quant_round(float value) {
+    return (int) (value + (value < 0.0f ? -0.5f : 0.5f));
+}
+
+void quantize_row_q8(const float* src, quant8_t* dst, size_t n) {
+    assert(0 == n % QUANT_BLOCK);
+
+    for (size_t b = 0; b < n / QUANT_BLOCK; ++b) {
+        const float* x = src + b * QUANT_BLOCK;
+
+        float amax = 0.0f;
+        for (size_t j = 0; j < QUANT_BLOCK; ++j) {
+            const float a = x[j] < 0.0f ? -x[j] : x[j];
+            amax          = a > amax ? a : amax;
+        }
+
+        // the scale is stored in half precision, so the values are divided by what it rounds to
+        const float16_t delta = float_to_float16(amax / 127.0f);
+        const float     d     = float16_to_float(delta);
+        const float     id    = d != 0.0f ? 1.0f / d : 0.0f;
+
+        dst[b].delta = delta;
+        for (size_t j = 0; j < QUANT_BLOCK; ++j) {
+            const int q       = quant_round(x[j] * id);
+            dst[b].quants[j] = (int8_t) (q > 127 ? 127 : (q < -127 ? -127 : q));
+        }
+    }
+}
+
+void dequantize_row_q8(const quant8_t* src, float* dst, size_t n) {
+    assert(0 == n % QUANT_BLOCK);
+
+    for (size_t b = 0; b < n / QUANT_BLOCK; ++b) {
+        const float d = float16_to_float(src[b].delta);
+        for (size_t j = 0; j < QUANT_BLOCK; ++j) {
+            dst[b * QUANT_BLOCK + j] = d * (float) src[b].quants[j];
+        }
+    }
+}
+
+void quantize_row_q4(const float* src, quant4_t* dst, size_t n) {
+    assert(0 == n % QUANT_BLOCK);
+
+    for (size_t b = 0; b < n / QUANT_BLOCK; ++b) {
+        const float* x = src + b * QUANT_BLOCK;
+
+        // the value of largest magnitude maps to -8, which leaves 7 steps on the other side
+        float amax = 0.0f;
+        float max  = 0.0f;
+        for (size_t j = 0; j < QUANT_BLOCK; ++j) {
+            const float a = x[j] < 0.0f ? -x[j] : x[j];
+            if (a > amax) {
+                amax = a;
+                max  = x[j];
+            }
+        }
+
+        const float16_t delta = float_to_float16(max / -8.0f);
+        const float     d     = float16_to_float(delta);
+        const float     id    = d != 0.0f ? 1.0f / d : 0.0f;
+
+        dst[b].delta = delta;
+        for (size_t j = 0; j < QUANT_BLOCK / 2; ++j) {
+            const int lo      = quant_round(x[j] * id) + 8;
+            const int hi      = quant_round(x[j + QUANT_BLOCK / 2] * id) + 8;
+            const int q0      = lo > 15 ? 15 : (lo < 0 ? 0 : lo);
+            const int q1      = hi > 15 ? 15 : (hi < 0 ? 0 : hi);
+            dst[b].quants[j] = (uint8_t) (q0 | q1 << 4);
+        }
+    }
+}
+
+void dequantize_row_q4(const quant4_t* src, float* dst, size_t n) {
+    assert(0 == n % QUANT_BLOCK);
+
+    for (size_t b = 0; b < n / QUANT_BLOCK; ++b) {
+        const float d = float16_to_float(src[b].delta);
+        float*      y = dst + b * QUANT_BLOCK;
+        for (size_t j = 0; j < QUANT_BLOCK / 2; ++j) {
+            y[j]                   = d * (float) ((src[b].quants[j] & 0x0F) - 8);
+            y[j + QUANT_BLOCK / 2] = d * (float) ((src[b].quants[j] >> 4) - 8);
+        }
+    }
+}
+
+static float scalar_dot_q8_q8(const quant8_t* a, const quant8_t* b, size_t n) {
+    float sum = 0.0f;
+    for (size_t k = 0; k < n / QUANT_BLOCK; ++k) {
+        int32_t dot = 0;
+        for (size_t j = 0; j < QUANT_BLOCK; ++j) {
+            dot += (int32_t) a[k].quants[j] * (int32_t) b[k].quants[j];
+        }
+        sum += float16_to_float(a[k].delta) * float16_to_float(b[k].delta) * (float) dot;
+    }
+    return sum;
+}
+
+static float scalar_dot_q4_q8(const quant4_t* a, const quant8_t* b, size_t n) {
+    float sum = 0.0f;
+    for (size_t k = 0; k < n / QUANT_BLOCK; ++k) {
+        int32_t dot = 0;
+        for (size_t j = 0; j < QUANT_BLOCK / 2; ++j) {
+            const int32_t lo  = (a[k].quants[j] & 0x0F) - 8;
+            const int32_t hi  = (a[k].quants[j] >> 4) - 8;
+            dot              += lo * b[k].quants[j] + hi * b[k].quants[j + QUANT_BLOCK / 2];
+        }
+        sum += float16_to_float(a[k].delta) * float16_to_float(b[k].delta) * (float) dot;
+    }
+    return sum;
+}
+
+const struct PrecisionKernels PRECISION_REFERENCE = {
+    .f16_name    = "scalar",
+    .bf16_name   = "scalar",
+    .f32_to_f16  = scalar_f32_to_f16,
+    .f16_to_f32  = scalar_f16_to_f32,
+    .f32_to_bf16 = scalar_f32_to_bf16,
+    .bf16_to_f32 = scalar_bf16_to_f32,
+    .quant_name  = "scalar",
+    .dot_q8_q8   = scalar_dot_q8_q8,
+    .dot_q4_q8   = scalar_dot_q4_q8,
+};
+
+//
+// x86: f16c for half precision, avx2 or avx512-bf16 for bfloat16
+//
+
+#if defined(PRECISION_X86)
+
+__attribute__((target("avx2,f16c"))) static void
+f16c_f32_to_f16(const float* src, float16_t* dst, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256  x = _mm256_loadu_ps(src + i);
+        const __m128i h = _mm256_cvtps_ph(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        _mm_storeu_si128((__m128i*) (dst + i), h);
+    }
+    scalar_f32_to_f16(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx2,f16c"))) static void
+f16c_f16_to_f32(const float16_t* src, float* dst, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m128i h = _mm_loadu_si128((const __m128i*) (src + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+    }
+    scalar_f16_to_f32(src + i, dst + i, n - i);
+}
+
+// the rounding of the reference in integer lanes, for cpus without avx512-bf16
+__attribute__((target("avx2"))) static void
+avx2_f32_to_bf16(const float* src, bfloat16_t* dst, size_t n) {
+    const __m256i bias  = _mm256_set1_epi32(0x7FFF);
+    const __m256i one   = _mm256_set1_epi32(1);
+    const __m256i abs   = _mm256_set1_epi32(0x7FFFFFFF);
+    const __m256i inf   = _mm256_set1_epi32(0x7F800000);
+    const __m256i quiet = _mm256_set1_epi32(0x00400000);
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i halves[2];
+        for (int k = 0; k < 2; ++k) {
+            const __m256i bits     = _mm256_loadu_si256((const __m256i*) (src + i + 8 * k));
+            const __m256i odd      = _mm256_and_si256(_mm256_srli_epi32(bits, 16), one);
+            const __m256i rounded  = _mm256_add_epi32(bits, _mm256_add_epi32(bias, odd));
+            const __m256i nan_mask = _mm256_cmpgt_epi32(_mm256_and_si256(bits, abs), inf);
+            const __m256i nan      = _mm256_or_si256(bits, quiet);
+            const __m256i result   = _mm256_blendv_epi8(rounded, nan, nan_mask);
+            halves[k]              = _mm256_srli_epi32(result, 16);
+        }
+
+        // packus works within 128-bit lanes, the permute puts the 16 results back in order
+        const __m256i packed = _mm256_packus_epi32(halves[0], halves[1]);
+        const __m256i order  = _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i*) (dst + i), order);
+    }
+    scalar_f32_to_bf16(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+avx2_bf16_to_f32(const bfloat16_t* src, float* dst, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m128i h    = _mm_loadu_si128((const __m128i*) (src + i));
+        const __m256i bits = _mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16);
+        _mm256_storeu_si256((__m256i*) (dst + i), bits);
+    }
+    scalar_bf16_to_f32(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bf16"))) static void
+avx512bf16_f32_to_bf16(const float* src, bfloat16_t* dst, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m512   x = _mm512_loadu_ps(src + i);
+        const __m256bh h = _mm512_cvtneps_pbh(x);
+        _mm256_storeu_si256((__m256i*) (dst + i), (__m256i) h);
+    }
+    scalar_f32_to_bf16(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static void
+avx512_bf16_to_f32(const bfloat16_t* src, float* dst, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m256i h    = _mm256_loadu_si256((const __m256i*) (src + i));
+        const __m512i bits = _mm512_slli_epi32(_mm512_cvtepu16_epi32(h), 16);
+        _mm512_storeu_si512((void*) (dst + i), bits);
+    }
+    scalar_bf16_to_f32(src + i, dst + i, n - i);
+}
+
+// the 32 products of a block, each pair summed into 16 bits and then into 8 lanes of 32 bits.
+// maddubs multiplies unsigned by signed bytes, so the sign of a moves onto b first.
+__attribute__((target("avx2"))) static inline __m256i avx2_block_dot(__m256i a, __m256i b) {
+    const __m256i pairs = _mm256_maddubs_epi16(_mm256_sign_epi8(a, a), _mm256_sign_epi8(b, a));
+    return _mm256_madd_epi16(pairs, _mm256_set1_epi16(1));
+}
+
+__attribute__((target("avx2,f16c,fma"))) static float
+avx2_dot_q8_q8(const quant8_t* a, const quant8_t* b, size_t n) {
+    __m256 sum = _mm256_setzero_ps();
+    for (size_t k = 0; k < n / QUANT_BLOCK; ++k) {
+        const __m256i qa  = _mm256_loadu_si256((const __m256i*) a[k].quants);
+        const __m256i qb  = _mm256_loadu_si256((const __m256i*) b[k].quants);
+        const float   d   = _cvtsh_ss(a[k].delta) * _cvtsh_ss(b[k].delta);
+        const __m256  dot = _mm256_cvtepi32_ps(avx2_block_dot(qa, qb));
+        sum               = _mm256_fmadd_ps(_mm256_set1_ps(d), dot, sum);
+    }
+
+    const __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    const __m128 pair = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    return _mm_cvtss_f32(_mm_add_ss(pair, _mm_movehdup_ps(pair)));
+}
+
+__attribute__((target("avx2,f16c,fma"))) static float
+avx2_dot_q4_q8(const quant4_t* a, const quant8_t* b, size_t n) {
+    const __m256i low   = _mm256_set1_epi8(0x0F);
+    const __m256i eight = _mm256_set1_epi8(8);
+
+    __m256 sum = _mm256_setzero_ps();
+    for (size_t k = 0; k < n / QUANT_BLOCK; ++k) {
+        // values 0 to 15 from the low nibbles, 16 to 31 from the high ones
+        const __m128i packed  = _mm_loadu_si128((const __m128i*) a[k].quants);
+        const __m256i nibbles = _mm256_set_m128i(_mm_srli_epi16(packed, 4), packed);
+        const __m256i qa      = _mm256_sub_epi8(_mm256_and_si256(nibbles, low), eight);
+        const __m256i qb      = _mm256_loadu_si256((const __m256i*) b[k].quants);
+        const float   d       = _cvtsh_ss(a[k].delta) * _cvtsh_ss(b[k].delta);
+        const __m256  dot     = _mm256_cvtepi32_ps(avx2_block_dot(qa, qb));
+        sum                   = _mm256_fmadd_ps(_mm256_set1_ps(d), dot, sum);
+    }
+
+    const __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    const __m128 pair = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    return _mm_cvtss_f32(_mm_add_ss(pair, _mm_movehdup_ps(pair)));
+}
+
+#endif // PRECISION_X86
+
+//
+// aarch64: advanced simd is part of the base architecture
+//
+
+#if defined(PRECISION_NEON)
+
+static void neon_f32_to_f16(const float* src, float16_t* dst, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const float16x4_t lo = vcvt_f16_f32(vld1q_f32(src + i));
+        const float16x4_t hi = vcvt_f16_f32(vld1q_f32(src + i + 4));
+        vst1q_u16(dst + i, vreinterpretq_u16_f16(vcombine_f16(lo, hi)));
+    }
+    scalar_f32_to_f16(src + i, dst + i, n - i);
+}
+
+static void neon_f16_to_f32(const float16_t* src, float* dst, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const float16x8_t h = vreinterpretq_f16_u16(vld1q_u16(src + i));
+        vst1q_f32(dst + i, vcvt_f32_f16(vget_low_f16(h)));
+        vst1q_f32(dst + i + 4, vcvt_high_f32_f16(h));
+    }
+    scalar_f16_to_f32(src + i, dst + i, n - i);
+}
+
+static void neon_f32_to_bf16(const float* src, bfloat16_t* dst, size_t n) {
+    const uint32x4_t bias  = vdupq_n_u32(0x7FFF);
+    const uint32x4_t one   = vdupq_n_u32(1);
+    const uint32x4_t quiet = vdupq_n_u32(0x00400000);
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint16x4_t halves[2];
+        for (int k = 0; k < 2; ++k) {
+            const float32x4_t x       = vld1q_f32(src + i + 4 * k);
+            const uint32x4_t  bits    = vreinterpretq_u32_f32(x);
+            const uint32x4_t  odd     = vandq_u32(vshrq_n_u32(bits, 16), one);
+            const uint32x4_t  rounded = vaddq_u32(bits, vaddq_u32(bias, odd));
+            const uint32x4_t  number  = vceqq_f32(x, x); // false only for nan
+            const uint32x4_t  result  = vbslq_u32(number, rounded, vorrq_u32(bits, quiet));
+            halves[k]                 = vshrn_n_u32(result, 16);
+        }
+        vst1q_u16(dst + i, vcombine_u16(halves[0], halves[1]));
+    }
+    scalar_f32_to_bf16(src + i, dst + i, n - i);
+}
+
+static void neon_bf16_to_f32(const bfloat16_t* src, float* dst, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const uint16x8_t h = vld1q_u16(src + i);
+        vst1q_u32((uint32_t*) (dst + i), vshll_n_u16(vget_low_u16(h), 16));
+        vst1q_u32((uint32_t*) (dst + i + 4), vshll_n_u16(vget_high_u16(h), 16));
+    }
+    scalar_bf16_to_f32(src + i, dst + i, n - i);
+}
+
+// the 32 products of a block summed into 4 lanes, widening through 16 bits
+static inline int32x4_t neon_block_dot(int8x16_t a0, int8x16_t a1, int8x16_t b0, int8x16_t b1) {
+    int16x8_t products = vmull_s8(vget_low_s8(a0), vget_low_s8(b0));
+    products           = vmlal_s8(products, vget_high_s8(a0), vget_high_s8(b0));
+    int32x4_t dot      = vpaddlq_s16(products);
+
+    products = vmull_s8(vget_low_s8(a1), vget_low_s8(b1));
+    products = vmlal_s8(products, vget_high_s8(a1), vget_high_s8(b1));
+    return vpadalq_s16(dot, products);
+}
+
+static float neon_dot_q8_q8(const quant8_t* a, const quant8_t* b, size_t n) {
+    float32x4_t sum = vdupq_n_f32(0.0f);
+    for (size_t k = 0; k < n / QUANT_BLOCK; ++k) {
+        const int32x4_t dot = neon_block_dot(
+            vld1q_s8(a[k].quants),
+            vld1q_s8(a[k].quants + 16),
+            vld1q_s8(b[k].quants),
+            vld1q_s8(b[k].quants + 16)
+        );
+        const float d = float16_to_float(a[k].delta) * float16_to_float(b[k].delta);
+        sum           = vmlaq_n_f32(sum, vcvtq_f32_s32(dot), d);
+    }
+    return vaddvq_f32(sum);
+}
+
+static float neon_dot_q4_q8(const quant4_t* a, const quant8_t* b, size_t n) {
+    const uint8x16_t low   = vdupq_n_u8(0x0F);
+    const int8x16_t  eight = vdupq_n_s8(8);
+
+    float32x4_t sum = vdupq_n_f32(0.0f);
+    for (size_t k = 0; k < n / QUANT_BLOCK; ++k) {
+        const uint8x16_t packed = vld1q_u8(a[k].quants);
+        const int8x16_t  lo     = vsubq_s8(vreinterpretq_s8_u8(vandq_u8(packed, low)), eight);
+        const int8x16_t  hi     = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(packed, 4)), eight);
+        const int32x4_t  dot    = neon_block_dot(
+            lo, hi, vld1q_s8(b[k].quants), vld1q_s8(b[k].quants + 16)
+        );
+        const float d = float16_to_float(a[k].delta) * float16_to_float(b[k].delta);
+        sum           = vmlaq_n_f32(sum, vcvtq_f32_s32(dot), d);
+    }
+    return vaddvq_f32(sum);
+}
+
+#endif // PRECISION_NEON
+
+//
+// dispatch
+//
+
+static struct PrecisionKernels precision_selected;
+static pthread_once_t          precision_once = PTHREAD_ONCE_INIT;
+
+static void precision_select(void) {
+    precision_selected = PRECISION_REFERENCE;
+
+#if defined(PRECISION_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c")) {
+        precision_selected.f16_name   = "f16c";
+        precision_selected.f32_to_f16 = f16c_f32_to_f16;
+        precision_selected.f16_to_f32 = f16c_f16_to_f32;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        precision_selected.bf16_name   = "avx2";
+        precision_selected.f32_to_bf16 = avx2_f32_to_bf16;
+        precision_selected.bf16_to_f32 = avx2_bf16_to_f32;
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        precision_selected.bf16_to_f32 = avx512_bf16_to_f32;
+    }
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bf16")) {
+        precision_selected.bf16_name   = "avx512bf16";
+        precision_selected.f32_to_bf16 = avx512bf16_f32_to_bf16;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c")
+        && __builtin_cpu_supports("fma")) {
+        precision_selected.quant_name = "avx2";
+        precision_selected.dot_q8_q8  = avx2_dot_q8_q8;
+        precision_selected.dot_q4_q8  = avx2_dot_q4_q8;
+    }
+#elif defined(PRECISION_NEON)
+    precision_selected = (struct PrecisionKernels) {
+        .f16_name    = "neon",
+        .bf16_name   = "neon",
+        .f32_to_f16  = neon_f32_to_f16,
+        .f16_to_f32  = neon_f16_to_f32,
+        .f32_to_bf16 = neon_f32_to_bf16,
+        .bf16_to_f32 = neon_bf16_to_f32,
+        .quant_name  = "neon",
+        .dot_q8_q8   = neon_dot_q8_q8,
+        .dot_q4_q8   = neon_dot_q4_q8,
+    };
+#endif
+}
+
+const struct PrecisionKernels* precision_kernels(void) {
+    pthread_once(&precision_once, precision_select);
+    return &precision_selected;
+}
+
+void convert_f32_to_f16(const float* src, float16_t* dst, size_t n) {
+    precision_kernels()->f32_to_f16(src, dst, n);
+}
+
+void convert_f16_to_f32(const float16_t* src, float* dst, size_t n) {
+    precision_kernels()->f16_to_f32(src, dst, n);
+}
+
+void convert_f32_to_bf16(const float* src, bfloat16_t* dst, size_t n) {
+    precision_kernels()->f32_to_bf16(src, dst, n);
+}
+
+void convert_bf16_to_f32(const bfloat16_t* src, float* dst, size_t n) {
+    precision_kernels()->bf16_to_f32(src, dst, n);
+}
+
+float dot_q8_q8(const quant8_t* a, const quant8_t* b, size_t n) {
+    assert(0 == n % QUANT_BLOCK);
+    return precision_kernels()->dot_q8_q8(a, b, n);
+}
+
+float dot_q4_q8(const quant4_t* a, const quant8_t* b, size_t n) {
+    assert(0 == n % QUANT_BLOCK);
+    return precision_kernels()->dot_q4_q8(a, b, n);
+}
@@ -5,6 +5,10 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef enum DataType {
     TYPE_FLOAT_F32,
     TYPE_FLOAT_F16,
@@ -26,36 +30,107 @@ typedef uint16_t bfloat16_t;
 // Standard half-precision (IEEE 754)
 typedef uint16_t float16_t;
 
-// 8-bit quarter-precision
+// values that share one scale in the quantized types
+#define QUANT_BLOCK 32
+
+/**
+ * @brief 8-bit quarter-precision: a block of 32 values x = delta * q.
+ *
+ * Blocks hold their values in place, so a row of n values is n / 32 consecutive blocks that can
+ * be mapped from a file and streamed through simd as is.
+ */
 typedef struct {
-    float16_t delta;
-    uint8_t*  quants; // Dynamically allocated array for quantized values
-    size_t    size;   // Number of quantized values (default to 32)
+    float16_t delta;               /**< Scale of the block, max |x| / 127. */
+    int8_t    quants[QUANT_BLOCK]; /**< Quantized values in [-127, 127]. */
 } quant8_t;
 
-// 4-bit eighth-precision
+/**
+ * @brief 4-bit eighth-precision: a block of 32 values x = delta * (q - 8).
+ *
+ * The low nibble of byte j holds value j and the high nibble value j + 16, so both halves unpack
+ * with a mask and a shift.
+ */
 typedef struct {
-    float16_t delta;
-    uint8_t*  quants; // Dynamically allocated array for quantized nibbles
-    size_t    size;   // Number of quantized nibbles (default to 16)
+    float16_t delta;                   /**< Scale, the value of largest magnitude / -8. */
+    uint8_t   quants[QUANT_BLOCK / 2]; /**< Nibbles in [0, 15]. */
 } quant4_t;
 
+#ifdef __cplusplus
+static_assert(sizeof(quant8_t) == 2 + QUANT_BLOCK, "quant8_t must be packed");
+static_assert(sizeof(quant4_t) == 2 + QUANT_BLOCK / 2, "quant4_t must be packed");
+#else
+_Static_assert(sizeof(quant8_t) == 2 + QUANT_BLOCK, "quant8_t must be packed");
+_Static_assert(sizeof(quant4_t) == 2 + QUANT_BLOCK / 2, "quant4_t must be packed");
+#endif
+
+// bytes taken by n values of type, n a multiple of QUANT_BLOCK for the quantized types
+size_t data_type_size(data_t type, size_t n);
+
+const char* data_type_name(data_t type);
+
+// scalar conversions, rounding to nearest even. nan stays nan and is quieted.
 bfloat16_t float_to_bfloat16(float value);
 float      bfloat16_to_float(bfloat16_t value);
 
 float16_t float_to_float16(float value);
 float     float16_to_float(float16_t value);
 
-quant8_t* float_to_quant8(float value, size_t size);
-float     quant8_to_float(const quant8_t* quant);
+/**
+ * @brief Bulk conversions between single precision and the 16-bit types.
+ *
+ * Each direction has a scalar reference and a vector kernel per instruction set: F16C for half
+ * precision and AVX2 or AVX-512-BF16 for bfloat16 on x86, advanced SIMD on aarch64. The fastest
+ * kernel the cpu supports is chosen the first time any of them is used.
+ *
+ * Every conversion matches the reference bit for bit, with one exception: AVX-512-BF16 flushes
+ * subnormal inputs to zero when narrowing to bfloat16, which the weights of a checkpoint never
+ * depend on. The quantized dot products sum the blocks in a different order than the reference,
+ * so they agree to within rounding.
+ */
+struct PrecisionKernels {
+    const char* f16_name;  /**< Kernel used for half precision, e.g. "f16c". */
+    const char* bf16_name; /**< Kernel used for bfloat16, e.g. "avx512bf16". */
+
+    void (*f32_to_f16)(const float* src, float16_t* dst, size_t n);
+    void (*f16_to_f32)(const float16_t* src, float* dst, size_t n);
+    void (*f32_to_bf16)(const float* src, bfloat16_t* dst, size_t n);
+    void (*bf16_to_f32)(const bfloat16_t* src, float* dst, size_t n);
+
+    const char* quant_name; /**< Kernel used for the quantized dot products, e.g. "avx2". */
+
+    float (*dot_q8_q8)(const quant8_t* a, const quant8_t* b, size_t n);
+    float (*dot_q4_q8)(const quant4_t* a, const quant8_t* b, size_t n);
+};
+
+// the scalar kernels, e.g. to check the vector ones against
+extern const struct PrecisionKernels PRECISION_REFERENCE;
+
+// the kernels selected for this cpu
+const struct PrecisionKernels* precision_kernels(void);
+
+void convert_f32_to_f16(const float* src, float16_t* dst, size_t n);
+void convert_f16_to_f32(const float16_t* src, float* dst, size_t n);
+void convert_f32_to_bf16(const float* src, bfloat16_t* dst, size_t n);
+void convert_bf16_to_f32(const bfloat16_t* src, float* dst, size_t n);
+
+// quantize and dequantize rows of n values, n a multiple of QUANT_BLOCK
+void quantize_row_q8(const float* src, quant8_t* dst, size_t n);
+void dequantize_row_q8(const quant8_t* src, float* dst, size_t n);
 
-quant4_t* float_to_quant4(float value, size_t size);
-float     quant4_to_float(const quant4_t* quant);
+void quantize_row_q4(const float* src, quant4_t* dst, size_t n);
+void dequantize_row_q4(const quant4_t* src, float* dst, size_t n);
 
-quant8_t* malloc_quant8(float16_t delta, size_t size, uint8_t* quants);
-void      free_quant8(quant8_t* quant);
+/**
+ * @brief Dot products of quantized rows of n values, without dequantizing either.
+ *
+ * The integer products of a block are summed exactly and scaled once per block. Weights in either
+ * type are multiplied with activations quantized to 8 bits with quantize_row_q8.
+ */
+float dot_q8_q8(const quant8_t* a, const quant8_t* b, size_t n);
+float dot_q4_q8(const quant4_t* a, const quant8_t* b, size_t n);
 
-quant4_t* malloc_quant4(float16_t delta, size_t size, uint8_t* quants);
-void      free_quant4(quant4_t* quant);
+#ifdef __cplusplus
+}
+#endif
 
 #endif // PRECISION_H
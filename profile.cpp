@@ -0,0 +1,305 @@
+#include "profile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// what one thread added to a site. only the owning thread writes, so a relaxed load and store
+// replace a read-modify-write and readers on other threads still see whole values.
+struct ProfileSlot {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> ns{0};
+};
+
+// a scope entered while tracing
+struct ProfileEvent {
+    uint64_t site;
+    uint64_t start; // ns
+    uint64_t end;   // ns
+};
+
+struct ProfileThread {
+    size_t                tid; // in the order the threads first reached a site
+    struct ProfileSlot    slots[PROFILE_MAX_SITES];
+    struct ProfileEvent*  events = nullptr; // PROFILE_TRACE_EVENTS, allocated on first use
+    std::atomic<size_t>   n_events{0};      // published with release for the exporter
+    std::atomic<uint64_t> n_dropped{0};     // events past the end of events
+};
+
+// the sites and threads seen so far. thread states are never freed, the totals of a worker that
+// exited still count, and the registry is only locked when a site or thread is new.
+static struct ProfileRegistry {
+    std::mutex                  lock;
+    const char*                 names[PROFILE_MAX_SITES];
+    std::atomic<size_t>         n_sites{0};
+    std::vector<ProfileThread*> threads;
+    std::atomic<bool>           tracing{false};
+    uint64_t                    epoch = 0; // when tracing was enabled
+} registry;
+
+static thread_local struct ProfileThread* profile_self = nullptr;
+
+static struct ProfileThread* profile_thread() {
+    if (nullptr == profile_self) {
+        struct ProfileThread*       self = new ProfileThread{};
+        std::lock_guard<std::mutex> guard(registry.lock);
+        self->tid = registry.threads.size();
+        registry.threads.push_back(self);
+        profile_self = self;
+    }
+    return profile_self;
+}
+
+uint64_t profile_now() {
+    const auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+size_t profile_site(const char* name) {
+    std::lock_guard<std::mutex> guard(registry.lock);
+
+    // the same name from two places is one site, e.g. a scope in both overloads of a function
+    const size_t n_sites = registry.n_sites.load(std::memory_order_relaxed);
+    for (size_t site = 0; site < n_sites; ++site) {
+        if (0 == strcmp(registry.names[site], name)) {
+            return site;
+        }
+    }
+
+    if (n_sites >= PROFILE_MAX_SITES) {
+        throw std::out_of_range("Too many profile sites to add " + std::string(name) + ".");
+    }
+    registry.names[n_sites] = name;
+    registry.n_sites.store(n_sites + 1, std::memory_order_release);
+    return n_sites;
+}
+
+static void profile_add(std::atomic<uint64_t> &value, uint64_t n) {
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void profile_count(size_t site, uint64_t n) {
+    profile_add(profile_thread()->slots[site].count, n);
+}
+
+void profile_record(size_t site, uint64_t start_ns, uint64_t end_ns) {
+    struct ProfileThread* self = profile_thread();
+    profile_add(self->slots[site].count, 1);
+    profile_add(self->slots[site].ns, end_ns - start_ns);
+
+    if (!registry.tracing.load(std::memory_order_relaxed)) {
+        return;
+    }
+    if (nullptr == self->events) {
+        self->events = new ProfileEvent[PROFILE_TRACE_EVENTS];
+    }
+
+    const size_t n = self->n_events.load(std::memory_order_relaxed);
+    if (n >= PROFILE_TRACE_EVENTS) {
+        profile_add(self->n_dropped, 1);
+        return;
+    }
+    self->events[n] = {site, start_ns, end_ns};
+    self->n_events.store(n + 1, std::memory_order_release);
+}
+
+size_t profile_stats(struct ProfileStats* stats, size_t n_stats) {
+    std::lock_guard<std::mutex> guard(registry.lock);
+
+    const size_t n_sites = std::min(n_stats, registry.n_sites.load(std::memory_order_acquire));
+    for (size_t site = 0; site < n_sites; ++site) {
+        stats[site] = {registry.names[site], 0, 0};
+        for (const struct ProfileThread* thread : registry.threads) {
+            stats[site].count += thread->slots[site].count.load(std::memory_order_relaxed);
+            stats[site].ns    += thread->slots[site].ns.load(std::memory_order_relaxed);
+        }
+    }
+    return n_sites;
+}
+
+void profile_print(FILE* out) {
+    struct ProfileStats stats[PROFILE_MAX_SITES];
+    const size_t        n_sites = profile_stats(stats, PROFILE_MAX_SITES);
+
+    for (size_t site = 0; site < n_sites; ++site) {
+        const struct ProfileStats &s = stats[site];
+        if (0 == s.ns) {
+            fprintf(out, "%-24s %12lu\n", s.name, s.count);
+            continue;
+        }
+
+        const double ms = (double) s.ns / 1e6;
+        fprintf(
+            out,
+            "%-24s %12lu calls %12.3f ms %10.3f us per call\n",
+            s.name,
+            s.count,
+            ms,
+            1e3 * ms / (double) std::max<uint64_t>(1, s.count)
+        );
+    }
+}
+
+void profile_trace(bool enabled) {
+    std::lock_guard<std::mutex> guard(registry.lock);
+    if (enabled) {
+        // NOTE: events of threads that are mid-scope while the counts are reset may be lost
+        for (struct ProfileThread* thread : registry.threads) {
+            thread->n_events.store(0, std::memory_order_relaxed);
+            thread->n_dropped.store(0, std::memory_order_relaxed);
+        }
+        registry.epoch = profile_now();
+    }
+    registry.tracing.store(enabled, std::memory_order_relaxed);
+}
+
+bool profile_write_trace(const char* path) {
+    FILE* out = fopen(path, "w");
+    if (nullptr == out) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(registry.lock);
+
+    const int      pid   = (int) getpid();
+    const uint64_t epoch = registry.epoch;
+    auto           us    = [&](uint64_t ns) {
+        return (double) (ns > epoch ? ns - epoch : 0) / 1e3;
+    };
+
+    // chrome://tracing takes timestamps and durations in microseconds
+    const char* separator = "\n";
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    uint64_t last      = epoch;
+    uint64_t n_dropped = 0;
+    for (const struct ProfileThread* thread : registry.threads) {
+        fprintf(
+            out,
+            "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %zu, "
+            "\"args\": {\"name\": \"thread %zu\"}}",
+            separator,
+            pid,
+            thread->tid,
+            thread->tid
+        );
+        separator = ",\n";
+
+        const size_t n_events = thread->n_events.load(std::memory_order_acquire);
+        for (size_t i = 0; i < n_events; ++i) {
+            const struct ProfileEvent &event = thread->events[i];
+            fprintf(
+                out,
+                ",\n{\"name\": \"%s\", \"cat\": \"gpt\", \"ph\": \"X\", \"pid\": %d, "
+                "\"tid\": %zu, \"ts\": %.3f, \"dur\": %.3f}",
+                registry.names[event.site],
+                pid,
+                thread->tid,
+                us(event.start),
+                (double) (event.end - event.start) / 1e3
+            );
+            last = std::max(last, event.end);
+        }
+        n_dropped += thread->n_dropped.load(std::memory_order_relaxed);
+    }
+
+    // the counters as they stand at the end of the trace
+    const size_t n_sites = registry.n_sites.load(std::memory_order_acquire);
+    for (size_t site = 0; site < n_sites; ++site) {
+        uint64_t count = 0, ns = 0;
+        for (const struct ProfileThread* thread : registry.threads) {
+            count += thread->slots[site].count.load(std::memory_order_relaxed);
+            ns    += thread->slots[site].ns.load(std::memory_order_relaxed);
+        }
+        if (0 != ns) {
+            continue; // a scope, its events are in the trace already
+        }
+        fprintf(
+            out,
+            "%s{\"name\": \"%s\", \"ph\": \"C\", \"pid\": %d, \"ts\": %.3f, "
+            "\"args\": {\"value\": %lu}}",
+            separator,
+            registry.names[site],
+            pid,
+            us(last),
+            count
+        );
+        separator = ",\n";
+    }
+    fprintf(out, "\n], \"otherData\": {\"dropped_events\": %lu}}\n", n_dropped);
+
+    return 0 == fclose(out);
+}
+
+//
+// periodic reports
+//
+
+static struct ProfileReporter {
+    std::mutex              lock;
+    std::condition_variable wake;
+    std::thread             thread;
+    bool                    stop = false;
+
+    ~ProfileReporter() {
+        profile_report(nullptr, 0, LOG_LEVEL_INFO);
+    }
+} reporter;
+
+static void profile_report_loop(struct Logger* logger, size_t interval_ms, log_level_t log_level) {
+    struct ProfileStats last[PROFILE_MAX_SITES] = {};
+    struct ProfileStats stats[PROFILE_MAX_SITES];
+    size_t              n_last = profile_stats(last, PROFILE_MAX_SITES);
+
+    std::unique_lock<std::mutex> guard(reporter.lock);
+    while (!reporter.wake.wait_for(guard, std::chrono::milliseconds(interval_ms), [] {
+        return reporter.stop;
+    })) {
+        const size_t n_sites = profile_stats(stats, PROFILE_MAX_SITES);
+        logger_message(logger, log_level, "profile: last %zu ms\n", interval_ms);
+        for (size_t site = 0; site < n_sites; ++site) {
+            const uint64_t count = stats[site].count - (site < n_last ? last[site].count : 0);
+            const uint64_t ns    = stats[site].ns - (site < n_last ? last[site].ns : 0);
+            if (0 == count) {
+                continue; // idle over the interval
+            }
+            if (0 == stats[site].ns) {
+                logger_message(logger, log_level, "profile: %s: %lu\n", stats[site].name, count);
+            } else {
+                logger_message(
+                    logger,
+                    log_level,
+                    "profile: %s: %lu calls, %.3f ms\n",
+                    stats[site].name,
+                    count,
+                    (double) ns / 1e6
+                );
+            }
+        }
+        std::copy(stats, stats + n_sites, last);
+        n_last = n_sites;
+    }
+}
+
+void profile_report(struct Logger* logger, size_t interval_ms, log_level_t log_level) {
+    if (reporter.thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(reporter.lock);
+            reporter.stop = true;
+        }
+        reporter.wake.notify_all();
+        reporter.thread.join();
+        reporter.stop = false;
+    }
+
+    if (nullptr != logger && interval_ms > 0) {
+        reporter.thread = std::thread(profile_report_loop, logger, interval_ms, log_level);
+    }
+}
@@ -0,0 +1,97 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "logger.h"
+
+#include <cstddef>
+#include <cstdint>
+
+// the sites a program can have, a site is a named scope or counter in the source
+#define PROFILE_MAX_SITES 64
+
+// the events a thread records while tracing, later ones are counted and dropped
+#define PROFILE_TRACE_EVENTS (1 << 20)
+
+/**
+ * Built with GPT_PROFILE, PROFILE_SCOPE(name) times the rest of the enclosing block and
+ * PROFILE_COUNT(name, n) adds n to a counter. Without it both expand to nothing, the sites cost
+ * nothing and the functions below report no sites.
+ *
+ * Every thread accumulates into its own slots, so a site costs two clock reads and two stores
+ * without a lock or a shared cache line. A site is registered once, on its first use, and is
+ * named by a string literal.
+ */
+#ifdef GPT_PROFILE
+    #define PROFILE_CONCAT_(a, b) a##b
+    #define PROFILE_CONCAT(a, b)  PROFILE_CONCAT_(a, b)
+    #define PROFILE_SCOPE(name)                                                                   \
+        static const size_t PROFILE_CONCAT(profile_site_, __LINE__) = profile_site(name);         \
+        const struct ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(                      \
+            PROFILE_CONCAT(profile_site_, __LINE__)                                               \
+        )
+    #define PROFILE_COUNT(name, n)                                                                \
+        do {                                                                                      \
+            static const size_t profile_counter = profile_site(name);                             \
+            profile_count(profile_counter, (n));                                                  \
+        } while (0)
+#else
+    #define PROFILE_SCOPE(name)
+    #define PROFILE_COUNT(name, n) \
+        do {                       \
+        } while (0)
+#endif
+
+// the totals of a site, summed over every thread that reached it
+struct ProfileStats {
+    const char* name;  // as given to PROFILE_SCOPE or PROFILE_COUNT
+    uint64_t    count; // times the scope was entered, or the sum of what was counted
+    uint64_t    ns;    // time spent in the scope, 0 for counters
+};
+
+// the id of the site called name, registering it on first use
+size_t profile_site(const char* name);
+
+// the calling thread's slot of a site, written by that thread alone
+void profile_count(size_t site, uint64_t n);
+void profile_record(size_t site, uint64_t start_ns, uint64_t end_ns);
+
+// nanoseconds on the clock the scopes are timed with
+uint64_t profile_now();
+
+// times a scope from construction to destruction
+struct ProfileScope {
+    size_t   site;
+    uint64_t start;
+
+    explicit ProfileScope(size_t site) : site(site), start(profile_now()) {}
+    ~ProfileScope() {
+        profile_record(site, start, profile_now());
+    }
+};
+
+// the totals of every site, in the order they were registered
+size_t profile_stats(struct ProfileStats* stats, size_t n_stats);
+
+// the totals as a table of one site per line
+void profile_print(FILE* out);
+
+// starts or stops keeping every scope entered as an event of a Chrome trace
+void profile_trace(bool enabled);
+
+/**
+ * Write the events recorded since tracing was enabled as a Chrome trace, e.g. for
+ * chrome://tracing or ui.perfetto.dev. Scopes are complete events on the thread that ran them,
+ * and the totals of the counters are counter events at the end. Returns false if path cannot be
+ * written.
+ */
+bool profile_write_trace(const char* path);
+
+/**
+ * Log what every site added over the last interval_ms through logger, once per interval, from a
+ * thread of its own. A running profile is a cheap way to watch production traffic, the sites are
+ * always on and the summary is only built when it is due. Stops the previous reporter, if any,
+ * and 0 stops it without starting another.
+ */
+void profile_report(struct Logger* logger, size_t interval_ms, log_level_t log_level);
+
+#endif // PROFILE_H
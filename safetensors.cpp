@@ -0,0 +1,346 @@
+#include "safetensors.h"
+#include "profile.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// the data of the files we write starts on a cache line, and so does every tensor in it
+static const size_t SAFETENSORS_ALIGN = 64;
+
+// dtype strings, indexed by data_t. Q8 and Q4 are our own, for the quantized cache.
+static const char* const SAFETENSORS_DTYPES[TYPE_MAX_COUNT] = {"F32", "F16", "BF16", "Q8", "Q4"};
+
+data_t safetensors_type(std::string_view dtype) {
+    for (size_t type = 0; type < TYPE_MAX_COUNT; ++type) {
+        if (dtype == SAFETENSORS_DTYPES[type]) {
+            return (data_t) type;
+        }
+    }
+    return TYPE_MAX_COUNT;
+}
+
+// the files of the checkpoint at path, in a stable order
+static std::vector<std::filesystem::path> safetensors_files(const std::filesystem::path &path) {
+    if (std::filesystem::is_regular_file(path)) {
+        return {path};
+    }
+
+    const std::filesystem::path index = path / "model.safetensors.index.json";
+    if (!std::filesystem::is_regular_file(index)) {
+        return {path / "model.safetensors"};
+    }
+
+    std::ifstream        f(index);
+    const nlohmann::json data = nlohmann::json::parse(f);
+
+    // the weight map names the shard of every tensor, each shard is listed many times
+    std::set<std::string> shards;
+    for (const auto &[name, shard] : data["weight_map"].items()) {
+        shards.insert(shard.get<std::string>());
+    }
+
+    std::vector<std::filesystem::path> files;
+    for (const std::string &shard : shards) {
+        files.push_back(path / shard);
+    }
+    return files;
+}
+
+// map path and add its tensors to tensors
+static void safetensors_map_file(struct SafeTensors* tensors, const std::filesystem::path &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (-1 == fd) {
+        throw std::runtime_error("Unable to open safetensors: " + path.string());
+    }
+
+    struct stat info;
+    if (-1 == fstat(fd, &info)) {
+        close(fd);
+        throw std::runtime_error("Unable to stat safetensors: " + path.string());
+    }
+
+    const size_t size    = (size_t) info.st_size;
+    void*        mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping holds its own reference to the file
+    if (MAP_FAILED == mapping) {
+        throw std::runtime_error("Unable to map safetensors: " + path.string());
+    }
+    tensors->mappings.push_back({mapping, size});
+
+    // an 8 byte little endian header length, the json header, then the data of every tensor
+    const uint8_t* bytes = static_cast<const uint8_t*>(mapping);
+    uint64_t       n_header;
+    if (size < sizeof(n_header)) {
+        throw std::runtime_error("Invalid safetensors: " + path.string() + " is truncated.");
+    }
+    memcpy(&n_header, bytes, sizeof(n_header));
+    if (n_header > size - sizeof(n_header)) {
+        throw std::runtime_error("Invalid safetensors: " + path.string() + " has a bad header.");
+    }
+
+    const char*          header = reinterpret_cast<const char*>(bytes + sizeof(n_header));
+    const nlohmann::json data   = nlohmann::json::parse(header, header + n_header);
+    const uint8_t*       base   = bytes + sizeof(n_header) + n_header;
+    const size_t         n_data = size - sizeof(n_header) - n_header;
+
+    std::vector<std::pair<size_t, std::string>> order;
+    for (const auto &[name, entry] : data.items()) {
+        if ("__metadata__" == name) {
+            if (tensors->metadata.is_null()) {
+                tensors->metadata = entry;
+            }
+            continue;
+        }
+
+        const std::string dtype = entry["dtype"].get<std::string>();
+        const data_t      type  = safetensors_type(dtype);
+        if (TYPE_MAX_COUNT == type) {
+            fprintf(
+                stderr, "Warning: skipping %s, %s is not supported.\n", name.c_str(), dtype.c_str()
+            );
+            continue;
+        }
+
+        struct Tensor tensor = {};
+        tensor.type          = type;
+        tensor.n_dims        = entry["shape"].size();
+        tensor.n_elements    = 1;
+        if (tensor.n_dims > SAFETENSORS_MAX_DIMS) {
+            throw std::runtime_error("Invalid safetensors: " + name + " has too many dimensions.");
+        }
+        for (size_t i = 0; i < tensor.n_dims; ++i) {
+            tensor.shape[i]    = entry["shape"][i].get<size_t>();
+            tensor.n_elements *= tensor.shape[i];
+        }
+
+        const size_t begin = entry["data_offsets"][0].get<size_t>();
+        const size_t end   = entry["data_offsets"][1].get<size_t>();
+        tensor.bytes       = data_type_size(type, tensor.n_elements);
+        tensor.data        = base + begin;
+
+        const bool quantized = TYPE_QUANT_K8 == type || TYPE_QUANT_K4 == type;
+        const bool blocks    = !quantized || 0 == tensor.cols() % QUANT_BLOCK;
+        if (begin > end || end > n_data || end - begin != tensor.bytes || !blocks) {
+            throw std::runtime_error("Invalid safetensors: " + name + " has bad data offsets.");
+        }
+        if (!tensors->tensors.emplace(name, tensor).second) {
+            throw std::runtime_error("Invalid safetensors: " + name + " is defined twice.");
+        }
+        order.emplace_back(begin, name);
+    }
+
+    // the header is an object, so its order says nothing. the data is laid out in file order.
+    std::sort(order.begin(), order.end());
+    for (auto &[offset, name] : order) {
+        tensors->names.push_back(std::move(name));
+    }
+}
+
+struct SafeTensors* mmap_safetensors(const char* path) {
+    if (nullptr == path) {
+        throw std::invalid_argument("Expected a valid path argument, got null instead.");
+    }
+    PROFILE_SCOPE("safetensors map");
+
+    struct SafeTensors* tensors = new SafeTensors{};
+
+    if (!tensors) {
+        throw std::bad_alloc();
+    }
+
+    try {
+        for (const std::filesystem::path &file : safetensors_files(path)) {
+            safetensors_map_file(tensors, file);
+        }
+    } catch (...) {
+        free_safetensors(tensors);
+        throw;
+    }
+
+    return tensors;
+}
+
+//
+// quantized cache
+//
+
+// matrices are quantized along their rows, vectors such as biases and norms are left as they are
+static bool safetensors_quantizable(const struct Tensor &tensor) {
+    const bool floating = TYPE_FLOAT_F32 == tensor.type || TYPE_FLOAT_F16 == tensor.type
+                          || TYPE_FLOAT_BF16 == tensor.type;
+    return floating && 2 == tensor.n_dims && 0 == tensor.cols() % QUANT_BLOCK;
+}
+
+// the size and modification time of every file of the checkpoint, as the cache records them
+static std::string safetensors_stamp(const std::vector<std::filesystem::path> &files) {
+    nlohmann::json stamp = nlohmann::json::array();
+    for (const std::filesystem::path &file : files) {
+        const auto mtime = std::filesystem::last_write_time(file).time_since_epoch().count();
+        stamp.push_back({file.filename().string(), std::filesystem::file_size(file), mtime});
+    }
+    return stamp.dump();
+}
+
+// write the tensors of source to path with the quantizable ones converted to type
+static void safetensors_write_quantized(
+    const std::filesystem::path &path,
+    const struct SafeTensors    &source,
+    data_t                       type,
+    const nlohmann::json        &metadata
+) {
+    PROFILE_SCOPE("safetensors quantize");
+
+    nlohmann::json header = {{"__metadata__", metadata}};
+    size_t         offset = 0;
+    for (const std::string &name : source.names) {
+        const struct Tensor &tensor = *source.find(name);
+        const data_t         target = safetensors_quantizable(tensor) ? type : tensor.type;
+        const size_t         bytes  = data_type_size(target, tensor.n_elements);
+
+        offset = (offset + SAFETENSORS_ALIGN - 1) / SAFETENSORS_ALIGN * SAFETENSORS_ALIGN;
+        header[name] = {
+            {"dtype", SAFETENSORS_DTYPES[target]},
+            {"shape", std::vector<size_t>(tensor.shape, tensor.shape + tensor.n_dims)},
+            {"data_offsets", {offset, offset + bytes}},
+        };
+        offset += bytes;
+    }
+
+    // trailing spaces are allowed in the header, they line the data up
+    std::string    text     = header.dump();
+    const size_t   padded   = (sizeof(uint64_t) + text.size() + SAFETENSORS_ALIGN - 1)
+                              / SAFETENSORS_ALIGN * SAFETENSORS_ALIGN;
+    text.resize(padded - sizeof(uint64_t), ' ');
+    const uint64_t n_header = text.size();
+
+    FILE* out = fopen(path.c_str(), "wb");
+    if (nullptr == out) {
+        throw std::runtime_error("Unable to write quantized cache: " + path.string());
+    }
+    fwrite(&n_header, sizeof(n_header), 1, out);
+    fwrite(text.data(), 1, text.size(), out);
+
+    // rows are converted one at a time, so memory stays bounded by the widest row
+    std::vector<float>   row;
+    std::vector<uint8_t> blocks;
+    const char           zeros[SAFETENSORS_ALIGN] = {};
+    size_t               written                  = 0;
+    for (const std::string &name : source.names) {
+        const struct Tensor &tensor = *source.find(name);
+
+        const size_t aligned = (written + SAFETENSORS_ALIGN - 1) / SAFETENSORS_ALIGN
+                               * SAFETENSORS_ALIGN;
+        fwrite(zeros, 1, aligned - written, out);
+        written = aligned;
+
+        if (!safetensors_quantizable(tensor)) {
+            fwrite(tensor.data, 1, tensor.bytes, out);
+            written += tensor.bytes;
+            continue;
+        }
+
+        const size_t cols      = tensor.cols();
+        const size_t row_bytes = data_type_size(tensor.type, cols);
+        row.resize(cols);
+        blocks.resize(data_type_size(type, cols));
+        for (size_t r = 0; r < tensor.rows(); ++r) {
+            const uint8_t* src = tensor.as<uint8_t>() + r * row_bytes;
+            switch (tensor.type) {
+                case TYPE_FLOAT_F16:
+                    convert_f16_to_f32(reinterpret_cast<const float16_t*>(src), row.data(), cols);
+                    break;
+                case TYPE_FLOAT_BF16:
+                    convert_bf16_to_f32(
+                        reinterpret_cast<const bfloat16_t*>(src), row.data(), cols
+                    );
+                    break;
+                default:
+                    memcpy(row.data(), src, row_bytes);
+            }
+
+            if (TYPE_QUANT_K8 == type) {
+                quantize_row_q8(row.data(), reinterpret_cast<quant8_t*>(blocks.data()), cols);
+            } else {
+                quantize_row_q4(row.data(), reinterpret_cast<quant4_t*>(blocks.data()), cols);
+            }
+            fwrite(blocks.data(), 1, blocks.size(), out);
+            written += blocks.size();
+        }
+    }
+
+    const bool failed = 0 != ferror(out);
+    if (0 != fclose(out) || failed) {
+        throw std::runtime_error("Unable to write quantized cache: " + path.string());
+    }
+}
+
+struct SafeTensors*
+mmap_quantized_safetensors(const char* path, data_t type, const char* cache_path) {
+    if (nullptr == path) {
+        throw std::invalid_argument("Expected a valid path argument, got null instead.");
+    }
+    if (TYPE_QUANT_K8 != type && TYPE_QUANT_K4 != type) {
+        throw std::invalid_argument(
+            "Expected a quantized type, got " + std::string(data_type_name(type)) + " instead."
+        );
+    }
+
+    const std::vector<std::filesystem::path> files = safetensors_files(path);
+    const std::filesystem::path              directory
+        = std::filesystem::is_directory(path) ? std::filesystem::path(path)
+                                              : std::filesystem::path(path).parent_path();
+    const std::filesystem::path cache
+        = cache_path ? std::filesystem::path(cache_path)
+                     : directory / ("model." + std::string(data_type_name(type)) + ".safetensors");
+
+    // safetensors metadata maps strings to strings
+    const nlohmann::json metadata = {
+        {"quantization", data_type_name(type)},
+        {"source", safetensors_stamp(files)},
+    };
+
+    if (std::filesystem::is_regular_file(cache)) {
+        struct SafeTensors* cached = mmap_safetensors(cache.c_str());
+        if (cached->metadata == metadata) {
+            return cached;
+        }
+        free_safetensors(cached); // stale, the checkpoint changed since it was written
+    }
+
+    struct SafeTensors* source = mmap_safetensors(path);
+
+    // a unique name per process, so loads that race each other write separate files
+    const std::filesystem::path temporary = cache.string() + ".tmp." + std::to_string(getpid());
+    try {
+        safetensors_write_quantized(temporary, *source, type, metadata);
+        std::filesystem::rename(temporary, cache);
+    } catch (...) {
+        std::error_code error;
+        std::filesystem::remove(temporary, error);
+        free_safetensors(source);
+        throw;
+    }
+    free_safetensors(source);
+
+    return mmap_safetensors(cache.c_str());
+}
+
+void free_safetensors(struct SafeTensors* tensors) {
+    if (nullptr == tensors) {
+        return;
+    }
+
+    for (const struct SafeTensorsMapping &mapping : tensors->mappings) {
+        munmap(mapping.data, mapping.size);
+    }
+    delete tensors;
+}
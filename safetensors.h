@@ -0,0 +1,87 @@
+#ifndef SAFETENSORS_H
+#define SAFETENSORS_H
+
+#include "precision.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// dimensions beyond this are rejected, no checkpoint we load comes close
+#define SAFETENSORS_MAX_DIMS 8
+
+// A tensor of a checkpoint. data points into the file mapping, so a view costs nothing until its
+// pages are touched. Rows run along the last dimension, which is the contiguous one.
+struct Tensor {
+    data_t      type;                         // Element type, quantized tensors hold whole blocks
+    size_t      n_dims;                       // Number of dimensions, 0 for a scalar
+    size_t      shape[SAFETENSORS_MAX_DIMS];  // Extent of each dimension, outermost first
+    size_t      n_elements;                   // Product of the shape
+    size_t      bytes;                        // data_type_size(type, n_elements)
+    const void* data;                         // First byte of the tensor in the mapping
+
+    // the last dimension, 1 for a scalar
+    size_t cols() const {
+        return n_dims > 0 ? shape[n_dims - 1] : 1;
+    }
+
+    // every dimension but the last, flattened
+    size_t rows() const {
+        return n_elements / (cols() > 0 ? cols() : 1);
+    }
+
+    template <typename T> const T* as() const {
+        return static_cast<const T*>(data);
+    }
+};
+
+// A read-only shared mapping of a checkpoint file.
+struct SafeTensorsMapping {
+    void*  data; // Start of the file
+    size_t size; // Length of the file
+};
+
+/**
+ * The tensors of a checkpoint, which may be sharded across several files as described by its
+ * model.safetensors.index.json. Every file is mapped read-only and shared, so processes that load
+ * the same checkpoint share its pages in the page cache, and nothing is read until it is used.
+ */
+struct SafeTensors {
+    std::vector<struct SafeTensorsMapping>        mappings; // One per file
+    std::unordered_map<std::string, struct Tensor> tensors;  // Keyed on the tensor name
+    std::vector<std::string>                      names;    // Tensor names in file order
+    nlohmann::json                                metadata; // __metadata__ of the first file
+
+    // the tensor called name, or null when the checkpoint has none
+    const struct Tensor* find(const std::string &name) const {
+        auto it = tensors.find(name);
+        return tensors.end() == it ? nullptr : &it->second;
+    }
+};
+
+// map a .safetensors file, or the checkpoint in a model directory: model.safetensors, or the
+// shards listed in model.safetensors.index.json
+struct SafeTensors* mmap_safetensors(const char* path);
+
+/**
+ * Map the checkpoint at path with its matrices quantized to type, TYPE_QUANT_K8 or TYPE_QUANT_K4.
+ *
+ * The first load quantizes every two dimensional floating point tensor whose rows are whole
+ * blocks and writes the result to cache_path, model.<type>.safetensors in the model directory by
+ * default. The cache records the size and modification time of the files it was made from, later
+ * loads map it directly unless those have changed. The cache is written to a temporary file and
+ * renamed into place, so processes that load at the same time never see a partial one.
+ */
+struct SafeTensors*
+mmap_quantized_safetensors(const char* path, data_t type, const char* cache_path = nullptr);
+
+void free_safetensors(struct SafeTensors* tensors);
+
+// the data_t of a safetensors dtype such as "BF16", or TYPE_MAX_COUNT when it has none
+data_t safetensors_type(std::string_view dtype);
+
+#endif // SAFETENSORS_H
@@ -0,0 +1,241 @@
+#include "scheduler.h"
+#include "profile.h"
+
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+std::vector<uint64_t> Scheduler::submit(
+    const std::vector<std::string_view> &prompts, size_t max_new_tokens, size_t n_threads
+) {
+    if (nullptr == tokenizer) {
+        throw std::invalid_argument("Expected a tokenizer to encode the prompts with.");
+    }
+
+    const struct TokenBatch batch = tokenizer->encode_batch(prompts, n_threads);
+    std::vector<uint64_t>   ids;
+    ids.reserve(prompts.size());
+    for (size_t i = 0; i < prompts.size(); ++i) {
+        const size_t start = batch.offsets[i];
+        const size_t n_ids = batch.offsets[i + 1] - start;
+        ids.push_back(submit_ids(batch.ids.data() + start, n_ids, max_new_tokens));
+    }
+    return ids;
+}
+
+uint64_t Scheduler::submit_ids(const uint32_t* ids, size_t n_ids, size_t max_new_tokens) {
+    if (nullptr == ids || 0 == n_ids || 0 == max_new_tokens) {
+        throw std::invalid_argument("Expected a prompt of at least one id and a new token.");
+    }
+
+    // a sequence on its own must always fit, or preempting the others would not make room for it
+    const size_t longest = std::min(max_context, n_ids + max_new_tokens);
+    if (n_ids >= max_context || cache->pages_for(longest) > cache->n_pages) {
+        throw std::invalid_argument(
+            "A prompt of " + std::to_string(n_ids) + " ids does not fit the context or kv cache."
+        );
+    }
+
+    struct ScheduledSequence* sequence = new ScheduledSequence{};
+
+    if (!sequence) {
+        throw std::bad_alloc();
+    }
+
+    sequence->id             = next_id++;
+    sequence->n_prompt       = n_ids;
+    sequence->max_new_tokens = max_new_tokens;
+    sequence->state          = SEQUENCE_WAITING;
+    sequence->tokens.assign(ids, ids + n_ids);
+    waiting.push_back(sequence);
+
+    return sequence->id;
+}
+
+// admit waiting sequences in order while their ids fit, holding back a page for every running
+// sequence to decode into so that admitting does not force preemptions on the next step
+static void scheduler_admit(struct Scheduler* scheduler) {
+    struct KVCache* cache = scheduler->cache;
+    while (!scheduler->waiting.empty() && scheduler->running.size() < scheduler->max_sequences) {
+        struct ScheduledSequence* sequence = scheduler->waiting.front();
+        const size_t              needed   = cache->pages_for(sequence->tokens.size());
+        if (cache->n_free() < needed + scheduler->running.size()) {
+            return;
+        }
+
+        cache->reserve(sequence->kv, sequence->tokens.size());
+        sequence->state = SEQUENCE_RUNNING;
+        scheduler->waiting.pop_front();
+        scheduler->running.push_back(sequence);
+    }
+}
+
+// give back the pages of the most recently admitted sequence, it is prefilled again from its ids
+static void scheduler_preempt(struct Scheduler* scheduler) {
+    struct ScheduledSequence* sequence = scheduler->running.back();
+    scheduler->running.pop_back();
+    scheduler->cache->release(sequence->kv);
+    sequence->state = SEQUENCE_WAITING;
+    sequence->n_preempted++;
+    scheduler->n_preemptions++;
+    scheduler->waiting.push_front(sequence);
+}
+
+bool Scheduler::step() {
+    PROFILE_SCOPE("scheduler step");
+    scheduler_admit(this);
+    if (running.empty()) {
+        if (!waiting.empty()) {
+            throw std::runtime_error("Expected the kv cache to have pages for a waiting sequence.");
+        }
+        return false;
+    }
+
+    struct Batch batch;
+    size_t       budget = max_batch_tokens;
+
+    // decode steps go first, a long prompt being prefilled never stalls sequences mid-generation
+    for (size_t i = 0; i < running.size() && budget > 0; ++i) {
+        struct ScheduledSequence* sequence = running[i];
+        const size_t              pos      = sequence->kv.n_tokens;
+        if (pos + 1 != sequence->tokens.size()) {
+            continue;
+        }
+
+        bool reserved = cache->reserve(sequence->kv, 1);
+        while (!reserved && running.back() != sequence) {
+            scheduler_preempt(this);
+            reserved = cache->reserve(sequence->kv, 1);
+        }
+        if (!reserved) {
+            if (1 == running.size()) {
+                throw std::runtime_error("Expected the kv cache to hold a single sequence.");
+            }
+            scheduler_preempt(this); // the sequence is the last one, nothing after it runs
+            break;
+        }
+
+        batch.entries.push_back({sequence, pos, 1, true});
+        budget--;
+    }
+
+    // then the prompts, in admission order and in chunks that fit what is left of the step. their
+    // pages were reserved on admission.
+    for (size_t i = 0; i < running.size() && budget > 0; ++i) {
+        struct ScheduledSequence* sequence = running[i];
+        const size_t              pos      = sequence->kv.n_tokens;
+        const size_t              pending  = sequence->tokens.size() - pos;
+        if (1 == pending) {
+            continue;
+        }
+
+        const size_t n = std::min(pending, budget);
+        batch.entries.push_back({sequence, pos, n, pos + n == sequence->tokens.size()});
+        budget -= n;
+    }
+
+    batch.offsets.reserve(batch.entries.size() + 1);
+    for (const struct BatchEntry &entry : batch.entries) {
+        const uint32_t* ids = entry.sequence->tokens.data() + entry.pos;
+        batch.offsets.push_back(batch.ids.size());
+        batch.ids.insert(batch.ids.end(), ids, ids + entry.n);
+    }
+    batch.offsets.push_back(batch.ids.size());
+
+    std::vector<uint32_t> next(batch.entries.size(), UINT32_MAX);
+    forward(batch, cache, next.data());
+    n_steps++;
+
+    bool retired = false;
+    for (size_t i = 0; i < batch.entries.size(); ++i) {
+        const struct BatchEntry   &entry    = batch.entries[i];
+        struct ScheduledSequence* sequence = entry.sequence;
+        cache->advance(sequence->kv, entry.n);
+
+        // a single position past the prompt is a decode step, anything else a prompt, possibly
+        // one that is run again after a preemption
+        if (1 != entry.n || entry.pos < sequence->n_prompt) {
+            n_prefilled += entry.n;
+        }
+        if (!entry.sample) {
+            continue;
+        }
+
+        const uint32_t id = next[i];
+        sequence->tokens.push_back(id);
+        n_generated++;
+
+        const size_t generated = sequence->tokens.size() - sequence->n_prompt;
+        const bool   finished  = eos_id == id || generated >= sequence->max_new_tokens
+                              || sequence->tokens.size() >= max_context;
+        if (finished) {
+            sequence->state = SEQUENCE_FINISHED;
+            retired         = true;
+        }
+        if (on_token) {
+            on_token(*sequence, id, finished);
+        }
+    }
+
+    // finished sequences leave the batch now, waiting ones take their pages on the next step
+    if (retired) {
+        auto done = [&](struct ScheduledSequence* sequence) {
+            if (SEQUENCE_FINISHED != sequence->state) {
+                return false;
+            }
+            cache->release(sequence->kv);
+            delete sequence;
+            return true;
+        };
+        running.erase(std::remove_if(running.begin(), running.end(), done), running.end());
+    }
+
+    return !idle();
+}
+
+struct Scheduler* malloc_scheduler(
+    struct KVCache*   cache,
+    struct Tokenizer* tokenizer,
+    ForwardFunction   forward,
+    size_t            max_sequences,
+    size_t            max_batch_tokens,
+    size_t            max_context,
+    uint32_t          eos_id
+) {
+    if (nullptr == cache || !forward) {
+        throw std::invalid_argument("Expected a valid kv cache and forward function.");
+    }
+    if (0 == max_sequences || 0 == max_batch_tokens || max_context < 2) {
+        throw std::invalid_argument("Expected room for a sequence, a position and a new token.");
+    }
+
+    struct Scheduler* scheduler = new Scheduler{};
+
+    if (!scheduler) {
+        throw std::bad_alloc();
+    }
+
+    scheduler->cache            = cache;
+    scheduler->tokenizer        = tokenizer;
+    scheduler->forward          = std::move(forward);
+    scheduler->max_sequences    = max_sequences;
+    scheduler->max_batch_tokens = max_batch_tokens;
+    scheduler->max_context      = max_context;
+    scheduler->eos_id           = eos_id;
+
+    return scheduler;
+}
+
+void free_scheduler(struct Scheduler* scheduler) {
+    if (scheduler) {
+        for (struct ScheduledSequence* sequence : scheduler->running) {
+            scheduler->cache->release(sequence->kv);
+            delete sequence;
+        }
+        for (struct ScheduledSequence* sequence : scheduler->waiting) {
+            delete sequence;
+        }
+        delete scheduler;
+    }
+}
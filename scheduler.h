@@ -0,0 +1,131 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "kv-cache.h"
+#include "tokenizer.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string_view>
+#include <vector>
+
+enum SequenceState {
+    SEQUENCE_WAITING,  // Queued, holds no pages
+    SEQUENCE_RUNNING,  // Admitted, its pages are reserved
+    SEQUENCE_FINISHED, // Stopped, about to be freed
+};
+
+// A generation in flight: its prompt, the ids generated so far and the positions it has cached.
+struct ScheduledSequence {
+    uint64_t                id;             // Returned by submit
+    std::vector<uint32_t>   tokens;         // Prompt followed by the generated ids
+    size_t                  n_prompt;       // Ids of the prompt at the front of tokens
+    size_t                  max_new_tokens; // Stops after generating this many ids
+    struct KVSequence       kv;             // Positions cached, the first kv.n_tokens of tokens
+    enum SequenceState      state;          // Where the sequence is in the scheduler
+    size_t                  n_preempted;    // Times its pages were taken back for others
+};
+
+// The part of a step one sequence takes: positions [pos, pos + n) of its tokens, attending to
+// the pos positions it has cached. sample is set when the chunk ends at the last known id, so
+// the forward pass produces the next id of the sequence.
+struct BatchEntry {
+    struct ScheduledSequence* sequence;
+    size_t                    pos;    // First position of the chunk
+    size_t                    n;      // Positions in the chunk, 1 for a decode step
+    bool                      sample; // Whether the forward pass yields the next id
+};
+
+// Every chunk of a step, run as a single forward pass.
+// e.g. entry i has the ids ids[offsets[i]] through ids[offsets[i + 1] - 1]
+struct Batch {
+    std::vector<struct BatchEntry> entries;
+    std::vector<uint32_t>          ids;     // Concatenated ids of every chunk
+    std::vector<size_t>            offsets; // Start of each chunk in ids, plus the total size
+};
+
+/**
+ * Runs the model over a batch. For every entry it stores the keys and values of the positions of
+ * the chunk in cache, which has them reserved, and for every entry that samples it writes the
+ * next id to next[entry]. The scheduler counts the positions as cached once it returns.
+ */
+using ForwardFunction =
+    std::function<void(const struct Batch &batch, struct KVCache* cache, uint32_t* next)>;
+
+// Receives every id a sequence generates, with finished set on its last one. The sequence is
+// freed once the call for its last id returns.
+using TokenCallback =
+    std::function<void(const struct ScheduledSequence &sequence, uint32_t id, bool finished)>;
+
+/**
+ * Continuous batching over a paged kv cache.
+ *
+ * Every step joins the decode step of each running sequence with chunks of the prompts of newly
+ * admitted ones into one forward pass, so the weights are read once for the whole batch rather
+ * than once per sequence. Sequences leave the batch the step they finish, and waiting ones take
+ * their place the next step.
+ *
+ * A waiting sequence is admitted once the cache has free pages for all of its known ids, kept
+ * back from the pages the running sequences grow into. When a running sequence needs a page
+ * and none is left the most recently admitted one is preempted: its pages are released and it
+ * goes back to the front of the queue, to be prefilled again from its ids.
+ */
+struct Scheduler {
+    struct KVCache*   cache;     // Pages of every sequence
+    struct Tokenizer* tokenizer; // Encodes submitted prompts, may be null for submit_ids only
+    ForwardFunction   forward;
+    TokenCallback     on_token; // May be empty
+
+    size_t   max_sequences;    // Running at once
+    size_t   max_batch_tokens; // Positions per step, prompts are prefilled in chunks that fit
+    size_t   max_context;      // Positions of a sequence, e.g. n_ctx of the model
+    uint32_t eos_id;           // Stops a sequence when generated, UINT32_MAX for none
+
+    uint64_t                              next_id = 0;
+    std::deque<struct ScheduledSequence*> waiting; // In arrival order, preempted ones in front
+    std::vector<struct ScheduledSequence*> running; // In admission order
+
+    size_t n_steps       = 0; // Forward passes run
+    size_t n_prefilled   = 0; // Positions of prompts run, including those run again
+    size_t n_generated   = 0; // Ids generated
+    size_t n_preemptions = 0; // Sequences preempted
+
+    // encode prompts with encode_batch across n_threads and queue them. returns their ids.
+    std::vector<uint64_t> submit(
+        const std::vector<std::string_view> &prompts, size_t max_new_tokens, size_t n_threads = 1
+    );
+
+    // queue the already encoded prompt ids. throws std::invalid_argument when the prompt could
+    // never fit the cache or the context.
+    uint64_t submit_ids(const uint32_t* ids, size_t n_ids, size_t max_new_tokens);
+
+    // run one forward pass over the running sequences. returns false once none are left.
+    bool step();
+
+    // run steps until every submitted sequence has finished
+    void run() {
+        while (step()) {
+        }
+    }
+
+    bool idle() const {
+        return waiting.empty() && running.empty();
+    }
+};
+
+struct Scheduler* malloc_scheduler(
+    struct KVCache*   cache,
+    struct Tokenizer* tokenizer,
+    ForwardFunction   forward,
+    size_t            max_sequences,
+    size_t            max_batch_tokens,
+    size_t            max_context,
+    uint32_t          eos_id
+);
+
+// frees the sequences still queued or running, without calling on_token for them
+void free_scheduler(struct Scheduler* scheduler);
+
+#endif // SCHEDULER_H
@@ -0,0 +1,203 @@
+#include "sentencepiece.h"
+
+#include <cstring>
+#include <stdexcept>
+
+// wire types of the protobuf encoding
+enum ProtoWireType {
+    PROTO_VARINT  = 0,
+    PROTO_FIXED64 = 1,
+    PROTO_BYTES   = 2,
+    PROTO_FIXED32 = 5,
+};
+
+// A cursor over a serialized message. Nested messages are read with a cursor of their own over
+// the bytes of the field.
+struct ProtoReader {
+    const uint8_t* data;
+    size_t         size;
+    size_t         offset = 0;
+
+    bool done() const {
+        return offset >= size;
+    }
+
+    uint64_t varint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (offset >= size) {
+                throw std::runtime_error("Invalid sentencepiece model: truncated varint.");
+            }
+            const uint8_t byte  = data[offset++];
+            value              |= (uint64_t) (byte & 0x7F) << shift;
+            if (0 == (byte & 0x80)) {
+                return value;
+            }
+        }
+        throw std::runtime_error("Invalid sentencepiece model: varint is too long.");
+    }
+
+    // the bytes of a length delimited field
+    struct ProtoReader bytes() {
+        const uint64_t length = varint();
+        if (length > size - offset) {
+            throw std::runtime_error("Invalid sentencepiece model: truncated field.");
+        }
+        struct ProtoReader field = {data + offset, (size_t) length};
+        offset                  += (size_t) length;
+        return field;
+    }
+
+    float fixed32() {
+        if (4 > size - offset) {
+            throw std::runtime_error("Invalid sentencepiece model: truncated field.");
+        }
+        float value;
+        memcpy(&value, data + offset, sizeof(value)); // little endian, like the hosts we run on
+        offset += 4;
+        return value;
+    }
+
+    std::string string() {
+        const struct ProtoReader field = bytes();
+        return std::string(reinterpret_cast<const char*>(field.data), field.size);
+    }
+
+    void skip(uint32_t wire_type) {
+        switch (wire_type) {
+            case PROTO_VARINT:
+                varint();
+                break;
+            case PROTO_FIXED64:
+                if (8 > size - offset) {
+                    throw std::runtime_error("Invalid sentencepiece model: truncated field.");
+                }
+                offset += 8;
+                break;
+            case PROTO_BYTES:
+                bytes();
+                break;
+            case PROTO_FIXED32:
+                fixed32();
+                break;
+            default:
+                throw std::runtime_error(
+                    "Invalid sentencepiece model: wire type " + std::to_string(wire_type)
+                );
+        }
+    }
+};
+
+// message SentencePiece { string piece = 1; float score = 2; Type type = 3; }
+static struct SentencePiece sentencepiece_piece(struct ProtoReader reader) {
+    struct SentencePiece piece = {"", 0.0f, SENTENCEPIECE_NORMAL};
+    while (!reader.done()) {
+        const uint64_t key = reader.varint();
+        switch (key) {
+            case 1 << 3 | PROTO_BYTES:
+                piece.piece = reader.string();
+                break;
+            case 2 << 3 | PROTO_FIXED32:
+                piece.score = reader.fixed32();
+                break;
+            case 3 << 3 | PROTO_VARINT:
+                piece.type = (enum SentencePieceType) reader.varint();
+                break;
+            default:
+                reader.skip(key & 7);
+        }
+    }
+    return piece;
+}
+
+static void
+sentencepiece_trainer_spec(struct ProtoReader reader, struct SentencePieceModel &model) {
+    while (!reader.done()) {
+        const uint64_t key = reader.varint();
+        switch (key) {
+            case 3 << 3 | PROTO_VARINT:
+                model.type = (enum SentencePieceModelType) reader.varint();
+                break;
+            case 24 << 3 | PROTO_VARINT:
+                model.suffix = 0 != reader.varint();
+                break;
+            case 35 << 3 | PROTO_VARINT:
+                model.byte_fallback = 0 != reader.varint();
+                break;
+            // int32 fields are sign extended to 64 bits, e.g. an unset pad_id of -1
+            case 40 << 3 | PROTO_VARINT:
+                model.unk_id = (int32_t) reader.varint();
+                break;
+            case 41 << 3 | PROTO_VARINT:
+                model.bos_id = (int32_t) reader.varint();
+                break;
+            case 42 << 3 | PROTO_VARINT:
+                model.eos_id = (int32_t) reader.varint();
+                break;
+            default:
+                reader.skip(key & 7);
+        }
+    }
+}
+
+static void
+sentencepiece_normalizer_spec(struct ProtoReader reader, struct SentencePieceModel &model) {
+    while (!reader.done()) {
+        const uint64_t key = reader.varint();
+        switch (key) {
+            case 1 << 3 | PROTO_BYTES:
+                model.name = reader.string();
+                break;
+            case 2 << 3 | PROTO_BYTES:
+                model.precompiled_charsmap = reader.string();
+                break;
+            case 3 << 3 | PROTO_VARINT:
+                model.add_dummy_prefix = 0 != reader.varint();
+                break;
+            case 4 << 3 | PROTO_VARINT:
+                model.remove_extra_whitespaces = 0 != reader.varint();
+                break;
+            case 5 << 3 | PROTO_VARINT:
+                model.escape_whitespaces = 0 != reader.varint();
+                break;
+            default:
+                reader.skip(key & 7);
+        }
+    }
+}
+
+// message ModelProto {
+//     repeated SentencePiece pieces = 1;
+//     TrainerSpec trainer_spec = 2;
+//     NormalizerSpec normalizer_spec = 3;
+//     ...
+// }
+struct SentencePieceModel sentencepiece_parse(const uint8_t* data, size_t size) {
+    if (nullptr == data) {
+        throw std::invalid_argument("Expected a valid sentencepiece model, got null instead.");
+    }
+
+    struct SentencePieceModel model;
+    struct ProtoReader        reader = {data, size};
+    while (!reader.done()) {
+        const uint64_t key = reader.varint();
+        switch (key) {
+            case 1 << 3 | PROTO_BYTES:
+                model.pieces.push_back(sentencepiece_piece(reader.bytes()));
+                break;
+            case 2 << 3 | PROTO_BYTES:
+                sentencepiece_trainer_spec(reader.bytes(), model);
+                break;
+            case 3 << 3 | PROTO_BYTES:
+                sentencepiece_normalizer_spec(reader.bytes(), model);
+                break;
+            default:
+                reader.skip(key & 7);
+        }
+    }
+
+    if (model.pieces.empty()) {
+        throw std::runtime_error("Invalid sentencepiece model: no pieces.");
+    }
+    return model;
+}
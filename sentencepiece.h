@@ -0,0 +1,58 @@
+#ifndef SENTENCEPIECE_H
+#define SENTENCEPIECE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// What a piece stands for, numbered as in sentencepiece_model.proto.
+enum SentencePieceType {
+    SENTENCEPIECE_NORMAL       = 1, // Matched in text
+    SENTENCEPIECE_UNKNOWN      = 2, // The unk piece
+    SENTENCEPIECE_CONTROL      = 3, // e.g. <s> and </s>, never matched in text
+    SENTENCEPIECE_USER_DEFINED = 4, // Always matched in text as a single piece
+    SENTENCEPIECE_UNUSED       = 5,
+    SENTENCEPIECE_BYTE         = 6, // e.g. <0xE2>, the byte fallback of an unknown character
+};
+
+// The algorithm a model was trained with, numbered as in sentencepiece_model.proto.
+enum SentencePieceModelType {
+    SENTENCEPIECE_UNIGRAM = 1,
+    SENTENCEPIECE_BPE     = 2,
+    SENTENCEPIECE_WORD    = 3,
+    SENTENCEPIECE_CHAR    = 4,
+};
+
+struct SentencePiece {
+    std::string            piece; // Bytes of the piece, spaces are escaped as "▁"
+    float                  score; // Unigram: log probability, BPE: merge priority
+    enum SentencePieceType type;
+};
+
+// The fields of a SentencePiece ModelProto that encoding depends on. The defaults are those of
+// the proto, as a field that is left at its default is not serialized.
+struct SentencePieceModel {
+    std::vector<struct SentencePiece> pieces; // Indexed by id
+
+    // trainer_spec
+    enum SentencePieceModelType type          = SENTENCEPIECE_UNIGRAM;
+    int32_t                     unk_id        = 0;
+    int32_t                     bos_id        = 1;
+    int32_t                     eos_id        = 2;
+    bool                        byte_fallback = false;
+    bool                        suffix        = false; // treat_whitespace_as_suffix
+
+    // normalizer_spec
+    std::string name                     = "nmt_nfkc"; // Rule the charsmap was compiled from
+    std::string precompiled_charsmap     = "";
+    bool        add_dummy_prefix         = true;
+    bool        remove_extra_whitespaces = true;
+    bool        escape_whitespaces       = true;
+};
+
+// parse a serialized ModelProto straight from the protobuf wire format, so no protobuf
+// runtime is needed. throws std::runtime_error when data is malformed.
+struct SentencePieceModel sentencepiece_parse(const uint8_t* data, size_t size);
+
+#endif // SENTENCEPIECE_H
@@ -0,0 +1,296 @@
+// Tests of the tokenizer against itself: a streamed encode must produce the ids of encode() over
+// the whole text, whatever the chunk size and wherever the words fall, and a corrupt image must
+// not load.
+#include "tokenizer.h"
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// building blocks of the random texts, picked so that words, whitespace runs, scripts without
+// spaces, multibyte characters and added tokens all end up on either side of a chunk boundary
+static const char* const test_pieces[] = {
+    "hello",
+    "world",
+    "tokenization",
+    "supercalifragilisticexpialidocious",
+    "I",
+    "a",
+    "'s",
+    "'ll",
+    "don't",
+    "12345",
+    "3.14",
+    " ",
+    "  ",
+    "   ",
+    "\n",
+    "\n\n",
+    "\t",
+    " \n ",
+    ".",
+    ",",
+    "!?",
+    "...",
+    "--",
+    "(x)",
+    "\"quoted\"",
+    "日本語",
+    "中文字符",
+    "été",
+    "naïve",
+    "Привет",
+    "नमस्ते",
+    "\U0001F642",
+    "\U0001F44D\U0001F3FD",
+    " ",
+    "　",
+    "<|endoftext|>",
+    "</s>",
+    "<s>",
+};
+
+static std::string test_text(std::mt19937 &rng) {
+    const size_t n_pieces = sizeof(test_pieces) / sizeof(test_pieces[0]);
+    const size_t length   = std::uniform_int_distribution<size_t>(0, 96)(rng);
+
+    std::string text;
+    for (size_t i = 0; i < length; ++i) {
+        text += test_pieces[std::uniform_int_distribution<size_t>(0, n_pieces - 1)(rng)];
+    }
+    return text;
+}
+
+// encode text through the stream overloads, in memory and from a file
+static std::vector<uint32_t>
+test_stream(const struct Tokenizer* tokenizer, const std::string &text, size_t chunk_size, int fd) {
+    std::vector<uint32_t> ids;
+    auto                  sink = [&](const uint32_t* chunk, size_t n_ids) {
+        ids.insert(ids.end(), chunk, chunk + n_ids);
+    };
+
+    if (fd < 0) {
+        tokenizer->encode_stream(text.data(), text.size(), sink, chunk_size);
+        return ids;
+    }
+
+    if (0 != ftruncate(fd, 0) || (ssize_t) text.size() != pwrite(fd, text.data(), text.size(), 0)
+        || 0 != lseek(fd, 0, SEEK_SET)) {
+        throw std::runtime_error("Failed to write the test input.");
+    }
+    tokenizer->encode_stream(fd, sink, chunk_size);
+    return ids;
+}
+
+static size_t test_model(const std::filesystem::path &directory, size_t n_texts) {
+    std::ifstream      f(directory / "tokenizer.json");
+    struct Tokenizer*  tokenizer = malloc_tokenizer(nlohmann::json::parse(f));
+    std::mt19937       rng(20261014);
+    FILE*              file = tmpfile();
+    const int          fd   = fileno(file);
+
+    size_t n_failed = 0;
+    for (size_t i = 0; i < n_texts; ++i) {
+        const std::string text     = test_text(rng);
+        const size_t      chunk    = std::uniform_int_distribution<size_t>(1, 128)(rng);
+        const auto        expected = tokenizer->encode(text);
+
+        for (int input : {-1, fd}) {
+            if (test_stream(tokenizer, text, chunk, input) != expected) {
+                fprintf(
+                    stderr,
+                    "FAIL: %s: encode_stream(%s, %zu) differs from encode() for \"%s\"\n",
+                    directory.filename().c_str(),
+                    input < 0 ? "data" : "fd",
+                    chunk,
+                    text.c_str()
+                );
+                n_failed++;
+            }
+        }
+    }
+
+    fclose(file);
+    free_tokenizer(tokenizer);
+    fprintf(
+        stdout,
+        "%s: %zu of %zu streams differ\n",
+        directory.filename().c_str(),
+        n_failed,
+        2 * n_texts
+    );
+    return n_failed;
+}
+
+// a table of the image, viewed as an array of T
+template <typename T>
+static T* test_section(std::vector<uint8_t> &bytes, enum TokenizerSectionType type) {
+    const auto* header = reinterpret_cast<struct TokenizerHeader*>(bytes.data());
+    return reinterpret_cast<T*>(bytes.data() + header->sections[type].offset);
+}
+
+// a corruption of an image and the name of the rule of the format it breaks
+using TestCorruption = std::pair<const char*, void (*)(std::vector<uint8_t> &)>;
+
+// count the corruptions of image that load rather than throw
+template <size_t N>
+static size_t test_corruptions(
+    const std::filesystem::path &directory,
+    const std::vector<uint8_t>  &image,
+    const TestCorruption (&corruptions)[N]
+) {
+    size_t n_failed = 0;
+    for (const auto &[name, corrupt] : corruptions) {
+        std::vector<uint8_t> bytes = image;
+        corrupt(bytes);
+        try {
+            free_tokenizer_model(malloc_tokenizer_model(bytes.data(), bytes.size()));
+            fprintf(stderr, "FAIL: %s: an image with a bad %s loads\n", directory.c_str(), name);
+            n_failed++;
+        } catch (const std::runtime_error &) {
+        }
+    }
+
+    free_tokenizer_model(malloc_tokenizer_model(image.data(), image.size()));
+    return n_failed;
+}
+
+// a corrupt image must be rejected when it is loaded rather than read out of bounds later
+static size_t test_image(const std::filesystem::path &directory) {
+    std::ifstream              f(directory / "tokenizer.json");
+    nlohmann::json             data  = nlohmann::json::parse(f);
+    const std::vector<uint8_t> image = tokenizer_image(data);
+
+    // each one breaks a different rule of the format
+    const TestCorruption corruptions[] = {
+        {"truncated", [](std::vector<uint8_t> &bytes) { bytes.resize(bytes.size() / 2); }},
+        {"unk_id",
+         [](std::vector<uint8_t> &bytes) {
+             auto* header   = reinterpret_cast<struct TokenizerHeader*>(bytes.data());
+             header->unk_id = header->n_tokens;
+         }},
+        {"n_buckets",
+         [](std::vector<uint8_t> &bytes) {
+             reinterpret_cast<struct TokenizerHeader*>(bytes.data())->n_buckets = 0;
+         }},
+        {"n_slots",
+         [](std::vector<uint8_t> &bytes) {
+             auto* header    = reinterpret_cast<struct TokenizerHeader*>(bytes.data());
+             header->n_slots = 3 * header->n_slots / 2;
+         }},
+        {"n_tokens",
+         [](std::vector<uint8_t> &bytes) {
+             reinterpret_cast<struct TokenizerHeader*>(bytes.data())->n_tokens *= 2;
+         }},
+        {"token span",
+         [](std::vector<uint8_t> &bytes) {
+             const auto* header = reinterpret_cast<struct TokenizerHeader*>(bytes.data());
+             auto*       spans  = test_section<struct TokenSpan>(bytes, TOKENIZER_SECTION_TOKENS);
+             spans[header->n_tokens - 1].offset = UINT32_MAX - 1;
+         }},
+        {"decode span",
+         [](std::vector<uint8_t> &bytes) {
+             const auto* header = reinterpret_cast<struct TokenizerHeader*>(bytes.data());
+             auto* spans = test_section<struct TokenSpan>(bytes, TOKENIZER_SECTION_DECODE_TOKENS);
+             spans[header->n_tokens - 1].size = UINT32_MAX;
+         }},
+        {"vocab id",
+         [](std::vector<uint8_t> &bytes) {
+             const auto* header = reinterpret_cast<struct TokenizerHeader*>(bytes.data());
+             auto*       vocab  = test_section<struct VocabSlot>(bytes, TOKENIZER_SECTION_VOCAB);
+             for (size_t slot = 0; slot < header->n_buckets; ++slot) {
+                 vocab[slot].id = TOKENIZER_NO_ID != vocab[slot].id ? 0x7fffffff : vocab[slot].id;
+             }
+         }},
+        {"full vocab index",
+         [](std::vector<uint8_t> &bytes) {
+             const auto* header = reinterpret_cast<struct TokenizerHeader*>(bytes.data());
+             auto*       vocab  = test_section<struct VocabSlot>(bytes, TOKENIZER_SECTION_VOCAB);
+             for (size_t slot = 0; slot < header->n_buckets; ++slot) {
+                 vocab[slot].id = TOKENIZER_NO_ID == vocab[slot].id ? 0 : vocab[slot].id;
+             }
+         }},
+        {"merge id",
+         [](std::vector<uint8_t> &bytes) {
+             const auto* header = reinterpret_cast<struct TokenizerHeader*>(bytes.data());
+             auto*       merges = test_section<struct MergeSlot>(bytes, TOKENIZER_SECTION_MERGES);
+             for (size_t slot = 0; slot < header->n_slots; ++slot) {
+                 merges[slot].merge.id = header->n_tokens;
+             }
+         }},
+        {"full merge table",
+         [](std::vector<uint8_t> &bytes) {
+             const auto* header = reinterpret_cast<struct TokenizerHeader*>(bytes.data());
+             auto*       merges = test_section<struct MergeSlot>(bytes, TOKENIZER_SECTION_MERGES);
+             for (size_t slot = 0; slot < header->n_slots; ++slot) {
+                 merges[slot].key = MERGE_EMPTY_KEY == merges[slot].key ? slot : merges[slot].key;
+             }
+         }},
+    };
+
+    size_t n_failed = test_corruptions(directory, image, corruptions);
+
+    // a config that fails to compile is freed along with the model, which a leak check confirms
+    data["pre_tokenizer"] = {
+        {"type", "Split"},
+        {"pattern", {{"Regex", "(["}}},
+        {"behavior", "Isolated"},
+        {"invert", false},
+    };
+    try {
+        free_tokenizer(malloc_tokenizer(data));
+        fprintf(stderr, "FAIL: %s: a tokenizer with a bad regex loads\n", directory.c_str());
+        n_failed++;
+    } catch (const std::runtime_error &) {
+    }
+    return n_failed;
+}
+
+// the trie of a unigram image is walked without bounds checks as well
+static size_t test_unigram_image() {
+    const nlohmann::json data = {
+        {"model",
+         {
+             {"type", "Unigram"},
+             {"unk_id", 0},
+             {"vocab",
+              nlohmann::json::parse(R"([["<unk>", 0], ["a", -1], ["ab", -1.5], ["abc", -3]])")},
+         }},
+    };
+    const std::vector<uint8_t> image = tokenizer_image(data);
+
+    const TestCorruption corruptions[] = {
+        {"trie node id",
+         [](std::vector<uint8_t> &bytes) {
+             test_section<struct TrieNode>(bytes, TOKENIZER_SECTION_TRIE_NODES)[1].id = 5;
+         }},
+        {"trie node edges",
+         [](std::vector<uint8_t> &bytes) {
+             test_section<struct TrieNode>(bytes, TOKENIZER_SECTION_TRIE_NODES)[0].n_edges = 64;
+         }},
+        {"trie edge",
+         [](std::vector<uint8_t> &bytes) {
+             test_section<uint32_t>(bytes, TOKENIZER_SECTION_TRIE_EDGES)[0] |= 0xffff00;
+         }},
+    };
+    return test_corruptions("unigram", image, corruptions);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <model-directory>...\n", argv[0]);
+        return 1;
+    }
+
+    size_t n_failed = 0;
+    for (int i = 1; i < argc; ++i) {
+        n_failed += test_model(argv[i], 3000);
+        n_failed += test_image(argv[i]);
+    }
+    n_failed += test_unigram_image();
+    return 0 == n_failed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,90 @@
+// Tests of the utf-8 decoder: every well-formed character decodes to its codepoint and every
+// malformed sequence throws, whether it follows a run of ascii or starts the text.
+#include "unicode.h"
+
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct TestCase {
+    const char* name;
+    const char* utf8;
+    uint32_t    cpt; // the codepoint it decodes to, 0 when it must be rejected
+};
+
+static const struct TestCase test_cases[] = {
+    // the first and last codepoints of every length
+    {"U+0080", "\xC2\x80", 0x80},
+    {"U+07FF", "\xDF\xBF", 0x7FF},
+    {"U+0800", "\xE0\xA0\x80", 0x800},
+    {"U+D7FF", "\xED\x9F\xBF", 0xD7FF},
+    {"U+E000", "\xEE\x80\x80", 0xE000},
+    {"U+FFFF", "\xEF\xBF\xBF", 0xFFFF},
+    {"U+10000", "\xF0\x90\x80\x80", 0x10000},
+    {"U+10FFFF", "\xF4\x8F\xBF\xBF", 0x10FFFF},
+
+    // overlong forms, e.g. a NUL or a '/' spelled with more bytes than it needs
+    {"overlong NUL", "\xC0\x80", 0},
+    {"overlong U+007F", "\xC1\xBF", 0},
+    {"overlong U+07FF", "\xE0\x9F\xBF", 0},
+    {"overlong '/'", "\xE0\x80\xAF", 0},
+    {"overlong U+FFFF", "\xF0\x8F\xBF\xBF", 0},
+
+    // utf-16 surrogates are not characters
+    {"surrogate U+D800", "\xED\xA0\x80", 0},
+    {"surrogate U+DBFF", "\xED\xAF\xBF", 0},
+    {"surrogate U+DC00", "\xED\xB0\x80", 0},
+    {"surrogate U+DFFF", "\xED\xBF\xBF", 0},
+
+    // past the last plane
+    {"U+110000", "\xF4\x90\x80\x80", 0},
+    {"lead F5", "\xF5\x80\x80\x80", 0},
+    {"lead F8", "\xF8\x88\x80\x80\x80", 0},
+    {"lead FF", "\xFF", 0},
+
+    // broken sequences
+    {"lone continuation", "\x80", 0},
+    {"truncated", "\xE6\x97", 0},
+    {"bad continuation", "\xE6\x41\xA5", 0},
+};
+
+// decode text, returning whether it threw
+static bool test_decode(const std::string &text, std::vector<uint32_t> &cpts) {
+    try {
+        unicode_cpts_from_utf8(text, cpts);
+        return false;
+    } catch (const std::invalid_argument &) {
+        return true;
+    }
+}
+
+int main() {
+    // longer than a vector of the widest ascii kernel, so the sequence ends a vectorized run
+    const std::string ascii(67, 'a');
+
+    size_t                n_failed = 0;
+    std::vector<uint32_t> cpts;
+    for (const struct TestCase &test : test_cases) {
+        for (const std::string &prefix : {std::string(), ascii}) {
+            const bool threw = test_decode(prefix + test.utf8, cpts);
+            const bool ok    = 0 == test.cpt
+                                 ? threw
+                                 : !threw && cpts.size() == prefix.size() + 1
+                                       && test.cpt == cpts.back();
+            if (!ok) {
+                fprintf(
+                    stderr,
+                    "FAIL: %s after %zu ascii bytes %s\n",
+                    test.name,
+                    prefix.size(),
+                    0 == test.cpt ? "was accepted" : "did not decode"
+                );
+                n_failed++;
+            }
+        }
+    }
+
+    fprintf(stdout, "unicode: %zu of %zu cases failed\n", n_failed, 2 * std::size(test_cases));
+    return 0 == n_failed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
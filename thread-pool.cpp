@@ -0,0 +1,124 @@
+#include "thread-pool.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+// drain the worker's own block first, then steal from the other blocks in round-robin order
+static void thread_pool_run(struct ThreadPool* pool, size_t worker) {
+    const TaskFunction &fn = *pool->job;
+
+    try {
+        for (size_t i = 0; i < pool->n_threads; ++i) {
+            struct TaskRange &range = pool->ranges[(worker + i) % pool->n_threads];
+            for (size_t task; (task = range.next.fetch_add(1, std::memory_order_relaxed))
+                              < range.end;) {
+                fn(task, worker);
+            }
+        }
+    } catch (...) {
+        std::lock_guard<std::mutex> guard(pool->state_lock);
+        if (!pool->error) {
+            pool->error = std::current_exception();
+        }
+    }
+}
+
+static void thread_pool_worker(struct ThreadPool* pool, size_t worker) {
+    size_t generation = 0;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(pool->state_lock);
+            pool->wake.wait(lock, [&] { return pool->stop || pool->generation != generation; });
+            if (pool->stop) {
+                return;
+            }
+            generation = pool->generation;
+        }
+
+        thread_pool_run(pool, worker);
+
+        {
+            std::lock_guard<std::mutex> guard(pool->state_lock);
+            if (0 == --pool->running) {
+                pool->done.notify_one();
+            }
+        }
+    }
+}
+
+void ThreadPool::parallel_for(size_t n_tasks, const TaskFunction &fn) {
+    if (0 == n_tasks) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> job_guard(job_lock);
+
+    const size_t block = (n_tasks + n_threads - 1) / n_threads;
+    for (size_t worker = 0; worker < n_threads; ++worker) {
+        ranges[worker].next.store(std::min(worker * block, n_tasks), std::memory_order_relaxed);
+        ranges[worker].end = std::min((worker + 1) * block, n_tasks);
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(state_lock);
+        job     = &fn;
+        error   = nullptr;
+        running = workers.size();
+        generation++;
+    }
+    wake.notify_all();
+
+    thread_pool_run(this, 0); // the calling thread is worker 0
+
+    std::exception_ptr failure;
+    {
+        std::unique_lock<std::mutex> lock(state_lock);
+        done.wait(lock, [&] { return 0 == running; });
+        job     = nullptr;
+        failure = error;
+    }
+
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+}
+
+struct ThreadPool* malloc_thread_pool(size_t n_threads) {
+    if (0 == n_threads) {
+        throw std::invalid_argument("Expected at least one thread, got 0 instead.");
+    }
+
+    struct ThreadPool* pool = new ThreadPool{};
+
+    if (!pool) {
+        throw std::bad_alloc();
+    }
+
+    pool->n_threads = n_threads;
+    pool->ranges    = new TaskRange[n_threads];
+
+    pool->workers.reserve(n_threads - 1);
+    for (size_t worker = 1; worker < n_threads; ++worker) {
+        pool->workers.emplace_back(thread_pool_worker, pool, worker);
+    }
+
+    return pool;
+}
+
+void free_thread_pool(struct ThreadPool* pool) {
+    if (pool) {
+        {
+            std::lock_guard<std::mutex> guard(pool->state_lock);
+            pool->stop = true;
+        }
+        pool->wake.notify_all();
+
+        for (std::thread &worker : pool->workers) {
+            worker.join();
+        }
+
+        delete[] pool->ranges;
+        delete pool;
+    }
+}
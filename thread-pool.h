@@ -0,0 +1,49 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A contiguous block of task indices owned by one worker.
+// Other workers steal from the block once their own is exhausted.
+struct alignas(64) TaskRange {
+    std::atomic<size_t> next; // Next unclaimed task index
+    size_t              end;  // One past the last task index of the block
+};
+
+// task index, worker index
+using TaskFunction = std::function<void(size_t, size_t)>;
+
+// NOTE: workers are created once and parked between jobs, so jobs pay no thread startup cost.
+struct ThreadPool {
+    size_t                   n_threads; // Number of workers including the calling thread
+    std::vector<std::thread> workers;   // n_threads - 1 background workers
+    struct TaskRange*        ranges;    // One block of tasks per worker
+
+    std::mutex              job_lock;   // Serializes calls to parallel_for
+    std::mutex              state_lock; // Guards the fields below
+    std::condition_variable wake;       // Signals a new job or shutdown
+    std::condition_variable done;       // Signals that every worker finished the job
+
+    const TaskFunction* job        = nullptr; // Job of the current generation
+    size_t              generation = 0;       // Incremented for every job
+    size_t              running    = 0;       // Number of background workers still on the job
+    bool                stop       = false;   // Set once to shut the workers down
+    std::exception_ptr  error      = nullptr; // First exception thrown by a task of the job
+
+    // call fn(task, worker) for every task in [0, n_tasks) and block until all are complete.
+    // tasks are split into one block per worker and idle workers steal from the others.
+    void parallel_for(size_t n_tasks, const TaskFunction &fn);
+};
+
+struct ThreadPool* malloc_thread_pool(size_t n_threads);
+
+void free_thread_pool(struct ThreadPool* pool);
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,290 @@
+#include "profile.h"
+#include "tokenizer.h"
+
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <getopt.h>
+#include <stdexcept>
+#include <unistd.h>
+
+// write a binary tokenizer image to path, returns false on failure
+static bool write_image(const std::filesystem::path &path, const std::vector<uint8_t> &image) {
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(image.data()), image.size());
+    if (!out) {
+        fprintf(stderr, "Error: Unable to write %s.\n", path.c_str());
+        return false;
+    }
+
+    fprintf(stdout, "wrote: %s\n", path.c_str());
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (1 == argc) {
+        fprintf(
+            stderr,
+            "Usage: %s [-p <path>] [-t <text>] [-f <file>] [-j <threads>] [-s <file>] [-v] "
+            "[-T <trace>] [-i <report-ms>]\n",
+            argv[0]
+        );
+        fprintf(stderr, "       %s -p <path> -f <file> -o <ids-file>\n", argv[0]);
+        fprintf(stderr, "       %s convert -p <path> [-o <file>]\n", argv[0]);
+        return 1;
+    }
+
+    // convert compiles tokenizer.json or tokenizer.model into the binary format
+    const bool convert = 0 == strcmp(argv[1], "convert");
+    if (convert) {
+        optind = 2;
+    }
+
+    const char* const   short_options = "p:t:f:j:o:s:vT:i:";
+    const struct option long_options[] = {
+        {"tokenizer-path", required_argument, nullptr, 'p'},
+        {"text", required_argument, nullptr, 't'},
+        {"file", required_argument, nullptr, 'f'},
+        {"threads", required_argument, nullptr, 'j'},
+        {"output", required_argument, nullptr, 'o'},
+        {"stream", required_argument, nullptr, 's'},
+        {"stats", no_argument, nullptr, 'v'},
+        {"trace", required_argument, nullptr, 'T'},
+        {"report-interval", required_argument, nullptr, 'i'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int                   opt;
+    std::filesystem::path directory;
+    std::filesystem::path output_file;
+    std::string           text;
+    std::filesystem::path input_file;
+    std::filesystem::path stream_file;
+    std::filesystem::path trace_file;
+    size_t                n_threads = 0;     // 0 uses every available core
+    bool                  stats     = false; // print what loading cost
+    size_t                report_ms = 0;     // 0 logs no periodic profile
+
+    while ((opt = getopt_long(argc, argv, short_options, long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'p':
+                if (optarg == nullptr || strlen(optarg) < 1) {
+                    puts("Error: Invalid file path specified.");
+                    return 1;
+                }
+
+                directory = std::filesystem::path(optarg);
+                break;
+
+            case 't':
+                text = optarg;
+                break;
+
+            case 'f':
+                input_file = std::filesystem::path(optarg);
+                break;
+
+            case 'j':
+                n_threads = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'v':
+                stats = true;
+                break;
+
+            case 'o':
+                output_file = std::filesystem::path(optarg);
+                break;
+
+            case 's':
+                stream_file = std::filesystem::path(optarg);
+                break;
+
+            case 'T':
+                trace_file = std::filesystem::path(optarg);
+                break;
+
+            case 'i':
+                report_ms = strtoul(optarg, nullptr, 10);
+                break;
+
+            default:
+                puts(
+                    "Usage: vocab [-p <tokenizer-path>] [-t <text>] [-f <file>] [-j <threads>] "
+                    "[-s <file>] [-T <trace>] [-i <report-ms>]"
+                );
+                return 1;
+        }
+    }
+
+    // started before loading, so the load phases are in the trace and the first report
+    if (!trace_file.empty()) {
+        profile_trace(true);
+    }
+    if (report_ms > 0) {
+        profile_report(&global_logger, report_ms, LOG_LEVEL_INFO);
+    }
+
+    struct Tokenizer* tokenizer = nullptr;
+
+    // e.g. a path that is not a tokenizer, or a tokenizer.json that does not parse
+    try {
+        if (std::filesystem::is_regular_file(directory) && ".model" == directory.extension()) {
+            // a sentencepiece tokenizer.model is read as is, without its tokenizer.json
+            fprintf(stdout, "using: %s\n", directory.c_str());
+
+            if (convert) {
+                if (output_file.empty()) {
+                    output_file = directory.parent_path() / "tokenizer.bin";
+                }
+
+                std::ifstream              f(directory, std::ios::binary);
+                const std::vector<uint8_t> data(
+                    (std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>()
+                );
+                const struct SentencePieceModel model
+                    = sentencepiece_parse(data.data(), data.size());
+                return write_image(output_file, sentencepiece_image(model)) ? 0 : 1;
+            }
+
+            tokenizer = malloc_sentencepiece_tokenizer(directory.c_str());
+        } else if (std::filesystem::is_regular_file(directory)) {
+            // a path to a file is a binary tokenizer produced by convert
+            fprintf(stdout, "using: %s\n", directory.c_str());
+            tokenizer = mmap_tokenizer(directory.c_str());
+        } else {
+            std::filesystem::path tokenizer_json = directory / "tokenizer.json";
+
+            fprintf(stdout, "using: %s\n", tokenizer_json.c_str());
+
+            std::ifstream f(tokenizer_json);
+            if (!f) {
+                fprintf(stderr, "Error: Unable to open %s.\n", tokenizer_json.c_str());
+                return 1;
+            }
+
+            nlohmann::json data = nlohmann::json::parse(f);
+
+            if (data.is_null()) {
+                fprintf(stderr, "Error: Unable to parse tokenizer.json file.\n");
+                return 1;
+            }
+
+            const std::string version = data["version"];
+            fprintf(stdout, "version: %s\n", version.c_str());
+
+            if (convert) {
+                if (output_file.empty()) {
+                    output_file = directory / "tokenizer.bin";
+                }
+
+                return write_image(output_file, tokenizer_image(data)) ? 0 : 1;
+            }
+
+            tokenizer = malloc_tokenizer(data);
+        }
+    } catch (const std::exception &e) {
+        fprintf(stderr, "Error: Unable to load %s: %s\n", directory.c_str(), e.what());
+        return 1;
+    }
+
+    fprintf(stdout, "tokenizer->model->type: %s\n", tokenizer->type().c_str());
+
+    if (stats) {
+        tokenizer->print_stats(stderr);
+    }
+
+    if (!text.empty()) {
+        const std::vector<uint32_t> ids = tokenizer->encode(text);
+        for (uint32_t id : ids) {
+            fprintf(stdout, "%u ", id);
+        }
+        fprintf(stdout, "\n");
+        fprintf(stdout, "%s\n", tokenizer->decode(ids).c_str());
+    }
+
+    // every line of the input file is encoded as a separate document
+    if (!input_file.empty()) {
+        std::ifstream            input(input_file);
+        std::vector<std::string> lines;
+        for (std::string line; std::getline(input, line);) {
+            lines.push_back(line);
+        }
+
+        const std::vector<std::string_view> documents(lines.begin(), lines.end());
+        const auto                          start = std::chrono::steady_clock::now();
+        const struct TokenBatch             batch = tokenizer->encode_batch(documents, n_threads);
+        const auto                          end   = std::chrono::steady_clock::now();
+        fprintf(
+            stdout,
+            "documents: %zu, tokens: %zu, ms: %.3f\n",
+            documents.size(),
+            batch.ids.size(),
+            std::chrono::duration<double, std::milli>(end - start).count()
+        );
+
+        // -o writes the ids of each document on a line of its own, e.g. for gen/parity.py
+        if (!output_file.empty()) {
+            FILE* out = fopen(output_file.c_str(), "w");
+            if (nullptr == out) {
+                fprintf(stderr, "Error: Unable to write %s.\n", output_file.c_str());
+                return 1;
+            }
+            for (size_t i = 0; i < documents.size(); ++i) {
+                for (size_t j = batch.offsets[i]; j < batch.offsets[i + 1]; ++j) {
+                    fprintf(out, j > batch.offsets[i] ? " %u" : "%u", batch.ids[j]);
+                }
+                fputc('\n', out);
+            }
+            fclose(out);
+        }
+    }
+
+    // the whole input is encoded as one document in bounded memory, "-" reads stdin
+    if (!stream_file.empty()) {
+        const int fd = "-" == stream_file ? STDIN_FILENO : open(stream_file.c_str(), O_RDONLY);
+        if (-1 == fd) {
+            fprintf(stderr, "Error: Unable to open %s.\n", stream_file.c_str());
+            return 1;
+        }
+
+        uint64_t     checksum = 0;
+        const size_t n_ids    = tokenizer->encode_stream(fd, [&](const uint32_t* ids, size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                checksum = checksum * 31 + ids[i];
+            }
+        });
+        fprintf(stdout, "stream: tokens: %zu, checksum: %016lx\n", n_ids, checksum);
+
+        if (STDIN_FILENO != fd) {
+            close(fd);
+        }
+    }
+
+    if (tokenizer->cache) {
+        fprintf(
+            stderr,
+            "cache: hits %zu, misses %zu\n",
+            tokenizer->cache->hits(),
+            tokenizer->cache->misses()
+        );
+    }
+
+    profile_report(nullptr, 0, LOG_LEVEL_INFO);
+    if (stats) {
+        profile_print(stderr);
+    }
+    if (!trace_file.empty()) {
+        if (!profile_write_trace(trace_file.c_str())) {
+            fprintf(stderr, "Error: Unable to write %s.\n", trace_file.c_str());
+            return 1;
+        }
+        fprintf(stderr, "trace: %s\n", trace_file.c_str());
+    }
+
+    free_tokenizer(tokenizer);
+
+    return 0;
+}
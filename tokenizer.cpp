@@ -1,35 +1,25 @@
 #include "tokenizer.h"
+#include "profile.h"
+#include "unicode-regex.h"
+#include "unicode.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
 #include <cstring>
-#include <filesystem>
-#include <fstream>
-#include <getopt.h>
+#include <fcntl.h>
 #include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-struct Token* malloc_token(size_t id, std::string content) {
-    // allocate memory for the token object
-    struct Token* token = new Token{};
-
-    if (!token) {
-        throw std::bad_alloc();
-    }
-
-    // set the token object values
-    token->id      = id;
-    token->content = content;
-
-    // return the newly constructed token
-    return token;
-}
-
-void free_token(struct Token* token) {
-    // free token if and only if token is not null
-    if (token) {
-        free(token);
-    }
+struct Token* malloc_token(struct Arena* arena, size_t id, std::string_view content) {
+    return arena->create<Token>(id, arena->copy(content));
 }
 
-std::vector<struct AddedToken*> malloc_added_tokens(nlohmann::json added_tokens) {
+std::vector<struct AddedToken*>
+malloc_added_tokens(struct Arena* arena, const nlohmann::json &added_tokens) {
     if (added_tokens.is_null()) {
         throw std::invalid_argument("Expected a valid added_tokens argument, got null instead.");
     }
@@ -38,16 +28,12 @@ std::vector<struct AddedToken*> malloc_added_tokens(nlohmann::json added_tokens)
     tokens.reserve(added_tokens.size()); // allocate space for added tokens
 
     // added_tokens is a JSON list of JSON objects
-    for (nlohmann::json object : added_tokens) {
-        struct AddedToken* added = new AddedToken{};
-
-        if (!added) {
-            throw std::bad_alloc();
-        }
+    for (const nlohmann::json &object : added_tokens) {
+        struct AddedToken* added = arena->create<AddedToken>();
 
         size_t      id      = object["id"].get<size_t>();
         std::string content = object["content"].get<std::string>();
-        added->token        = malloc_token(id, content);
+        added->token        = malloc_token(arena, id, content);
 
         added->single_word = object["single_word"].get<bool>();
         added->left_strip  = object["lstrip"].get<bool>();
@@ -55,187 +41,2605 @@ std::vector<struct AddedToken*> malloc_added_tokens(nlohmann::json added_tokens)
         added->normalized  = object["normalized"].get<bool>();
         added->special     = object["special"].get<bool>();
 
-        // technically, we can have these in the stack. tbh, not sure if matters.
         tokens.push_back(added);
     }
 
     return tokens;
 }
 
-void free_added_tokens(std::vector<struct AddedToken*> added_tokens) {
-    // Deallocate memory for all struct AddedToken objects
-    for (struct AddedToken* added : added_tokens) {
-        if (added) {
-            free_token(added->token);
-            free(added);
+// round n up to the next multiple of TOKENIZER_ALIGN
+static size_t tokenizer_align(size_t n) {
+    return (n + TOKENIZER_ALIGN - 1) & ~((size_t) TOKENIZER_ALIGN - 1);
+}
+
+// a typed view of a section of the image
+template <typename T>
+static const T* tokenizer_section(const uint8_t* image, enum TokenizerSectionType type) {
+    const auto* header = reinterpret_cast<const struct TokenizerHeader*>(image);
+    return reinterpret_cast<const T*>(image + header->sections[type].offset);
+}
+
+// replace every occurrence of pattern in text with content
+static std::string
+replace_all(const std::string &text, const std::string &pattern, const std::string &content) {
+    std::string result;
+    size_t      start = 0;
+    for (size_t pos; (pos = text.find(pattern, start)) != std::string::npos;) {
+        result.append(text, start, pos - start).append(content);
+        start = pos + pattern.size();
+    }
+    return result.append(text, start, std::string::npos);
+}
+
+// concatenate the strings into a pool and record where each one landed
+static void tokenizer_pack(
+    const std::vector<std::string> &strings, std::string &pool, std::vector<struct TokenSpan> &spans
+) {
+    spans.reserve(strings.size());
+    for (const std::string &string : strings) {
+        spans.push_back({(uint32_t) pool.size(), (uint32_t) string.size()});
+        pool += string;
+    }
+    if (pool.size() > UINT32_MAX) {
+        throw std::runtime_error("String pool exceeds 4 GiB.");
+    }
+}
+
+// resolve the raw bytes a token decodes to. decoders that only act at the start of a
+// sequence (e.g. Strip) are recorded in strip instead.
+static std::string decode_token(const nlohmann::json &decoder, std::string token, uint32_t &strip) {
+    if (decoder.is_null()) {
+        return token;
+    }
+
+    const std::string type = decoder["type"];
+    if ("Sequence" == type) {
+        for (const nlohmann::json &rule : decoder["decoders"]) {
+            token = decode_token(rule, std::move(token), strip);
+        }
+    } else if ("ByteLevel" == type) {
+        // map each character of the byte-level alphabet back onto the byte it stands for
+        std::string bytes;
+        for (size_t offset = 0; offset < token.size();) {
+            const size_t remaining = token.size() - offset;
+            const size_t len       = std::min(unicode_len_utf8(token[offset]), remaining);
+
+            const std::string character = token.substr(offset, len);
+            try {
+                bytes.push_back((char) unicode_utf8_to_byte(character));
+            } catch (const std::out_of_range &) {
+                bytes += character; // e.g. an added token outside of the alphabet
+            }
+            offset += len;
+        }
+        token = bytes;
+    } else if ("Replace" == type && decoder["pattern"].contains("String")) {
+        token = replace_all(token, decoder["pattern"]["String"], decoder["content"]);
+    } else if ("ByteFallback" == type) {
+        // e.g. <0xE2> -> \xE2
+        if (6 == token.size() && 0 == token.compare(0, 3, "<0x") && '>' == token[5]
+            && isxdigit(token[3]) && isxdigit(token[4])) {
+            token = std::string(1, (char) strtoul(token.substr(3, 2).c_str(), nullptr, 16));
+        }
+    } else if ("Metaspace" == type) {
+        token = replace_all(token, decoder.value("replacement", "\u2581"), " ");
+        strip = 1; // the prefix space added while encoding
+    } else if ("Strip" == type) {
+        if (" " != decoder.value("content", " ") || 0 != decoder.value("stop", 0)) {
+            fprintf(stderr, "Unsupported decoder: Strip is only handled for leading spaces\n");
+        }
+        strip = decoder.value("start", 0);
+    } else if ("Fuse" != type) { // Fuse is implicit, the bytes of every token are concatenated
+        fprintf(stderr, "Unsupported decoder: '%s'\n", type.c_str());
+    }
+
+    return token;
+}
+
+// A merge rule resolved to ids.
+struct MergeRule {
+    uint32_t left;  // Id of the left token
+    uint32_t right; // Id of the right token
+    uint32_t id;    // Id of the merged token
+};
+
+// The parts an image is laid out from, whichever format they were read from.
+struct TokenizerParts {
+    struct TokenizerHeader        header = {}; // Settings that are not derived from the parts
+    std::vector<std::string>      tokens;      // id -> token
+    std::vector<uint32_t>         vocab;       // Ids of the vocab index
+    std::vector<struct MergeRule> merges;      // BPE: merge rules in order of priority
+    std::vector<float>            scores;      // Unigram: id -> log probability
+    std::vector<uint32_t>         pieces;      // Unigram: ids the encoder matches in text
+    std::vector<std::string>      decoded;     // id -> raw bytes
+    std::string                   config;      // Json settings compiled on creation
+};
+
+// load-time only lookup used to resolve tokens to ids
+static std::unordered_map<std::string_view, uint32_t>
+tokenizer_lookup(const struct TokenizerParts &parts) {
+    std::unordered_map<std::string_view, uint32_t> lookup;
+    lookup.reserve(parts.vocab.size());
+    for (uint32_t id : parts.vocab) {
+        lookup.emplace(parts.tokens[id], id);
+    }
+    return lookup;
+}
+
+// build the trie over the tokens of pieces. the edges of each node are laid out in the order
+// of their byte, as the pieces are inserted in byte order.
+static void tokenizer_trie(
+    const struct TokenizerParts &parts,
+    std::vector<struct TrieNode> &nodes,
+    std::vector<uint32_t>        &edges
+) {
+    if (parts.pieces.empty()) {
+        return;
+    }
+
+    std::vector<uint32_t> order = parts.pieces;
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return parts.tokens[a] < parts.tokens[b];
+    });
+
+    // the children of each node as index << 8 | byte. a piece that follows in byte order can
+    // only share the last child of a node, so that is the only one ever looked at.
+    std::vector<std::vector<uint32_t>> children(1);
+    nodes.assign(1, {TOKENIZER_NO_ID, 0, 0});
+    for (uint32_t id : order) {
+        uint32_t node = 0;
+        for (const unsigned char c : parts.tokens[id]) {
+            if (children[node].empty() || (uint8_t) children[node].back() != c) {
+                children[node].push_back((uint32_t) nodes.size() << 8 | c);
+                children.emplace_back();
+                nodes.push_back({TOKENIZER_NO_ID, 0, 0});
+            }
+            node = children[node].back() >> 8;
+        }
+        if (0 != node && TOKENIZER_NO_ID == nodes[node].id) {
+            nodes[node].id = id;
+        }
+    }
+    if (nodes.size() >= (1u << 24)) {
+        throw std::runtime_error("Trie exceeds 2^24 nodes.");
+    }
+
+    for (size_t node = 0; node < nodes.size(); ++node) {
+        nodes[node].edges   = (uint32_t) edges.size();
+        nodes[node].n_edges = (uint32_t) children[node].size();
+        edges.insert(edges.end(), children[node].begin(), children[node].end());
+    }
+}
+
+// build the tables of the image from its parts and lay them out after the header
+static std::vector<uint8_t> tokenizer_layout(struct TokenizerParts &parts) {
+    PROFILE_SCOPE("tokenizer layout");
+
+    struct TokenizerHeader &header = parts.header;
+    header.magic                   = TOKENIZER_MAGIC;
+    header.version                 = TOKENIZER_VERSION;
+    header.n_tokens                = (uint32_t) parts.tokens.size();
+    header.n_vocab                 = (uint32_t) parts.vocab.size();
+
+    // V* : t -> i where V* is set of tokens, t is token, and i is id
+    // e.g. this is a "forward mapping" hashed on the token bytes
+    header.n_buckets = 1;
+    while (header.n_buckets < 2 * parts.vocab.size()) {
+        header.n_buckets <<= 1; // keep the load factor at or below 1/2
+    }
+    std::vector<struct VocabSlot> buckets(header.n_buckets, {0, TOKENIZER_NO_ID});
+    for (uint32_t id : parts.vocab) {
+        const uint64_t hash = vocab_hash(parts.tokens[id]);
+        const size_t   mask = header.n_buckets - 1;
+        size_t         slot = hash & mask;
+        while (TOKENIZER_NO_ID != buckets[slot].id) {
+            slot = (slot + 1) & mask;
+        }
+        buckets[slot] = {(uint32_t) (hash >> 32), id};
+    }
+    fprintf(stderr, "set vocab\n"); // too large to print
+
+    // (V*, V*) -> (r, i) where r is the merge rank and i is the id of the merged token
+    // e.g. resolve each merge rule to ids once so the merge loop never touches strings
+    header.n_slots = 1;
+    while (header.n_slots < 2 * parts.merges.size()) {
+        header.n_slots <<= 1; // keep the load factor at or below 1/2
+    }
+    std::vector<struct MergeSlot> merges(header.n_slots, {MERGE_EMPTY_KEY, {0, 0}});
+    for (size_t rank = 0; rank < parts.merges.size(); ++rank) {
+        const struct MergeRule &rule = parts.merges[rank];
+        const uint64_t          key  = merge_pair_key(rule.left, rule.right);
+        const size_t            mask = header.n_slots - 1;
+        size_t                  slot = merge_pair_hash(key) & mask;
+        while (MERGE_EMPTY_KEY != merges[slot].key && key != merges[slot].key) {
+            slot = (slot + 1) & mask;
+        }
+
+        // the first occurrence of a pair has the highest priority
+        if (MERGE_EMPTY_KEY == merges[slot].key) {
+            merges[slot] = {key, {(uint32_t) rank, rule.id}};
+            header.n_merges++;
+        }
+    }
+    fprintf(stderr, "set merges: %u\n", header.n_merges); // too large to print
+
+    std::vector<struct TrieNode> trie;
+    std::vector<uint32_t>        trie_edges;
+    tokenizer_trie(parts, trie, trie_edges);
+    if (!trie.empty()) {
+        fprintf(stderr, "set trie: %zu nodes\n", trie.size());
+    }
+
+    // lay out the sections after the header
+    std::string                   pool, decode_pool;
+    std::vector<struct TokenSpan> spans, decode_spans;
+    tokenizer_pack(parts.tokens, pool, spans);
+    tokenizer_pack(parts.decoded, decode_pool, decode_spans);
+
+    const std::pair<const void*, size_t> sections[TOKENIZER_SECTION_COUNT] = {
+        {pool.data(), pool.size()},
+        {spans.data(), spans.size() * sizeof(struct TokenSpan)},
+        {buckets.data(), buckets.size() * sizeof(struct VocabSlot)},
+        {merges.data(), merges.size() * sizeof(struct MergeSlot)},
+        {decode_pool.data(), decode_pool.size()},
+        {decode_spans.data(), decode_spans.size() * sizeof(struct TokenSpan)},
+        {parts.scores.data(), parts.scores.size() * sizeof(float)},
+        {trie.data(), trie.size() * sizeof(struct TrieNode)},
+        {trie_edges.data(), trie_edges.size() * sizeof(uint32_t)},
+        {parts.config.data(), parts.config.size()},
+    };
+
+    size_t offset = tokenizer_align(sizeof(struct TokenizerHeader));
+    for (size_t i = 0; i < TOKENIZER_SECTION_COUNT; ++i) {
+        header.sections[i] = {offset, sections[i].second};
+        offset             = tokenizer_align(offset + sections[i].second);
+    }
+
+    std::vector<uint8_t> image(offset, 0);
+    memcpy(image.data(), &header, sizeof(header));
+    for (size_t i = 0; i < TOKENIZER_SECTION_COUNT; ++i) {
+        if (0 != sections[i].second) {
+            memcpy(image.data() + header.sections[i].offset, sections[i].first, sections[i].second);
+        }
+    }
+
+    fprintf(stderr, "created tokenizer image: %zu bytes <3\n", image.size());
+    return image;
+}
+
+// the score of a character that no token covers, e.g. it is encoded as unk or as bytes
+static float unigram_unk_score(const std::vector<float> &scores) {
+    static const float UNIGRAM_UNK_PENALTY = 10.0f;
+
+    float min_score = 0.0f;
+    for (float score : scores) {
+        min_score = std::min(min_score, score);
+    }
+    return min_score - UNIGRAM_UNK_PENALTY;
+}
+
+// read the tokens and merge rules of a BPE model
+static void tokenizer_bpe(const nlohmann::json &model, struct TokenizerParts &parts) {
+    for (auto &[token, id] : model["vocab"].items()) {
+        parts.tokens[id.get<size_t>()] = token;
+        parts.vocab.push_back(id.get<uint32_t>());
+    }
+
+    // merges is a vector of strings
+    if (!model.contains("merges")) {
+        throw std::domain_error("Missing key: tokenizer['model'] must contain a 'merges' key.");
+    }
+
+    const std::unordered_map<std::string_view, uint32_t> lookup = tokenizer_lookup(parts);
+
+    parts.merges.reserve(model["merges"].size());
+    for (const nlohmann::json &merge : model["merges"]) {
+        // merges are either "left right" strings or ["left", "right"] pairs depending on the
+        // version
+        std::string left, right;
+        if (merge.is_array()) {
+            left  = merge[0].get<std::string>();
+            right = merge[1].get<std::string>();
+        } else {
+            const std::string rule  = merge.get<std::string>();
+            const size_t      space = rule.find(' ', 1); // a token may begin with a space
+            if (std::string::npos == space) {
+                throw std::runtime_error("Invalid merge: expected 'left right', got: " + rule);
+            }
+            left  = rule.substr(0, space);
+            right = rule.substr(space + 1);
         }
+
+        auto left_it   = lookup.find(left);
+        auto right_it  = lookup.find(right);
+        auto merged_it = lookup.find(left + right);
+        if (lookup.end() == left_it || lookup.end() == right_it || lookup.end() == merged_it) {
+            continue; // merge references tokens outside of the vocab, so it can never apply
+        }
+        parts.merges.push_back({left_it->second, right_it->second, merged_it->second});
+    }
+
+    // the unk token is optional, e.g. byte-level models can represent any input
+    if (model.contains("unk_token") && model["unk_token"].is_string()) {
+        auto it = lookup.find(model["unk_token"].get<std::string>());
+        if (lookup.end() != it) {
+            parts.header.unk_id = it->second;
+        }
+    }
+}
+
+// read the tokens and scores of a Unigram model, e.g. vocab is a list of [token, score]
+static void tokenizer_unigram(const nlohmann::json &model, struct TokenizerParts &parts) {
+    const nlohmann::json &vocab = model["vocab"];
+
+    parts.scores.assign(parts.tokens.size(), 0.0f);
+    for (size_t id = 0; id < vocab.size(); ++id) {
+        parts.tokens[id] = vocab[id][0].get<std::string>();
+        parts.scores[id] = vocab[id][1].get<float>();
+        parts.vocab.push_back((uint32_t) id);
+        parts.pieces.push_back((uint32_t) id);
+    }
+    parts.header.unk_score = unigram_unk_score(parts.scores);
+
+    // unknown characters in a row are always fused, there is no setting for it
+    parts.header.flags |= TOKENIZER_FLAG_FUSE_UNK;
+
+    if (model.contains("unk_id") && model["unk_id"].is_number()) {
+        parts.header.unk_id = model["unk_id"].get<uint32_t>();
     }
 }
 
 // note: what a fucking nightmare! the variable state of a tokenizer.json makes this challenging.
 // will need to dig deeper into huggingface/tokenizers source code to figure out an optimal path
 // forward.
-struct TokenizerModel* malloc_tokenizer_model(nlohmann::json model) {
-    if (model.is_null()) {
+std::vector<uint8_t> tokenizer_image(nlohmann::json data) {
+    if (data.is_null() || data["model"].is_null()) {
         throw std::invalid_argument("Expected a valid model argument, got null instead.");
     }
+    PROFILE_SCOPE("tokenizer image");
 
-    struct TokenizerModel* tokenizer = new TokenizerModel{};
+    const nlohmann::json &model = data["model"];
 
-    if (!tokenizer) {
-        throw std::bad_alloc();
-    }
+    struct TokenizerParts   parts;
+    struct TokenizerHeader &header = parts.header;
+    header.unk_id                  = TOKENIZER_NO_ID;
 
-    // NOTE: model["type"] is not always available, so tokenizer->type will default to BPE if
+    // NOTE: model["type"] is not always available, so the type will default to BPE if
     // unavailable. The value may be present and null, so we ignore this edge case.
+    std::string type = "BPE";
     if (model.contains("type") && !model["type"].is_null()) {
-        tokenizer->type = model["type"];
+        type = model["type"];
     }
-    fprintf(stderr, "set type: %s\n", tokenizer->type.c_str());
+    if (("BPE" != type && "Unigram" != type) || type.size() >= sizeof(header.type)) {
+        throw std::runtime_error("Unsupported model type: '" + type + "'.");
+    }
+    memcpy(header.type, type.c_str(), type.size() + 1);
+    fprintf(stderr, "set type: %s\n", type.c_str());
 
     // V* ≅ [N_V] where V* is set of tokens and N_V is the vocab size
     // e.g. The set of tokens is congruent with the vocab size
     if (!model.contains("vocab")) { // if vocab is missing, something is wrong.
         throw std::runtime_error("Missing key: tokenizer['model'] must contain a 'vocab' key.");
     }
-    tokenizer->size = model["vocab"].size();
-    fprintf(stderr, "set size: %zd\n", tokenizer->size);
-
-    // V* : t -> i where V* is set of tokens, t is token, and i is id
-    // e.g. this is a "forward mapping"
-    tokenizer->vocab = model["vocab"];
-    fprintf(stderr, "set vocab\n"); // too large to print
 
-    /* map is unordered, but we need an ordered vector of tokens
-     * so we reserve an allocated amount based on the number of tokens
-     * this spares us the hassle of applying std::ordered_map to nlohmann::json::object
-     */
-    tokenizer->tokens.reserve(tokenizer->size);
+    // added tokens may extend past the model vocab, so the id -> token table covers both
+    const nlohmann::json added_tokens = data.value("added_tokens", nlohmann::json::array());
+    size_t               n_tokens     = "Unigram" == type ? model["vocab"].size() : 0;
+    if ("BPE" == type) {
+        for (auto &[token, id] : model["vocab"].items()) {
+            n_tokens = std::max(n_tokens, id.get<size_t>() + 1);
+        }
+    }
+    for (const nlohmann::json &object : added_tokens) {
+        n_tokens = std::max(n_tokens, object["id"].get<size_t>() + 1);
+    }
+    fprintf(stderr, "set size: %zu\n", n_tokens);
 
     // V*: i -> t where V* is set of tokens, i is id, and t is token
     // e.g. this is a "reverse mapping"
-    for (auto &[token, id] : model["vocab"].items()) {
-        // todo: token rendering needs to be fixed.
-        // note: expected utf-8, but most likely got utf-16. need to investigate further.
-        std::string t                       = token; // this is still producing mojibaked tokens
-        // fprintf(stderr, "token: %s, id: %d\n", t, i); // temp to view the issue with tokens
-        tokenizer->tokens[id.get<size_t>()] = token;
+    parts.tokens.resize(n_tokens);
+    {
+        PROFILE_SCOPE("tokenizer vocab");
+        if ("Unigram" == type) {
+            tokenizer_unigram(model, parts);
+        } else {
+            tokenizer_bpe(model, parts);
+        }
+        for (const nlohmann::json &object : added_tokens) {
+            std::string &token = parts.tokens[object["id"].get<size_t>()];
+            if (token.empty()) {
+                token = object["content"].get<std::string>();
+            }
+        }
     }
     fprintf(stderr, "set tokens\n"); // too large to print
 
-    // merges is a vector of strings
-    if (!model.contains("merges")) {
-        throw std::domain_error("Missing key: tokenizer['model'] must contain a 'merges' key.");
+    if (model.contains("byte_fallback") && !model["byte_fallback"].is_null()
+        && model["byte_fallback"].get<bool>()) {
+        header.flags |= TOKENIZER_FLAG_BYTE_FALLBACK;
     }
-    tokenizer->merges.reserve(model["merges"].size());
-    tokenizer->merges = model["merges"]; // if merges is missing, something is wrong.
-    fprintf(stderr, "set merges\n");     // too large to print
+    fprintf(stderr, "byte fallback: %d\n", 0 != (header.flags & TOKENIZER_FLAG_BYTE_FALLBACK));
 
-    if (model.contains("byte_fallback") && !model["byte_fallback"].is_null()) {
-        tokenizer->byte_fallback = model["byte_fallback"].get<bool>();
+    if (model.contains("ignore_merges") && !model["ignore_merges"].is_null()
+        && model["ignore_merges"].get<bool>()) {
+        header.flags |= TOKENIZER_FLAG_IGNORE_MERGES;
     }
-    fprintf(stderr, "byte fallback: %d\n", tokenizer->byte_fallback);
+    fprintf(stderr, "ignore merges: %d\n", 0 != (header.flags & TOKENIZER_FLAG_IGNORE_MERGES));
 
-    if (model.contains("ignore_merges") && !model["ignore_merges"].is_null()) {
-        tokenizer->ignore_merges = model["ignore_merges"].get<bool>();
+    if (model.contains("fuse_unk") && !model["fuse_unk"].is_null()
+        && model["fuse_unk"].get<bool>()) {
+        header.flags |= TOKENIZER_FLAG_FUSE_UNK;
     }
-    fprintf(stderr, "ignore merges: %d\n", tokenizer->ignore_merges);
+    fprintf(stderr, "fuse unk: %d\n", 0 != (header.flags & TOKENIZER_FLAG_FUSE_UNK));
 
     if (model.contains("dropout") && !model["dropout"].is_null()) {
-        tokenizer->dropout = model["dropout"].get<float>();
+        header.dropout = model["dropout"].get<float>();
     }
-    fprintf(stderr, "dropout: %f\n", tokenizer->dropout);
+    fprintf(stderr, "dropout: %f\n", header.dropout);
 
-    fprintf(stderr, "created tokenizer <3\n");
-    return tokenizer;
+    // these are small, so they are kept as json and compiled when the tokenizer is created
+    const nlohmann::json config = {
+        {"normalizer", data["normalizer"]},
+        {"pre_tokenizer", data["pre_tokenizer"]},
+        {"added_tokens", added_tokens},
+    };
+    parts.config = config.dump();
+
+    // id -> raw bytes for decoding, resolved through the decoder once per token
+    parts.decoded.resize(n_tokens);
+    {
+        PROFILE_SCOPE("tokenizer decoder");
+        const nlohmann::json &decoder = data["decoder"];
+        for (size_t id = 0; id < n_tokens; ++id) {
+            parts.decoded[id] = decode_token(decoder, parts.tokens[id], header.decode_strip);
+        }
+    }
+    fprintf(stderr, "set decoder: strip %u\n", header.decode_strip);
+
+    return tokenizer_layout(parts);
+}
+
+// the normalizer tokenizer.json would hold for the normalizer_spec of a model
+static nlohmann::json sentencepiece_normalizer(const struct SentencePieceModel &model) {
+    nlohmann::json steps = nlohmann::json::array();
+
+    // NOTE: the precompiled charsmap is a trie of replacements generated from a rule, so it is
+    // approximated by the normalization form the rule is built on.
+    if ("identity" != model.name) {
+        fprintf(stderr, "Unsupported normalizer: '%s' is treated as NFKC\n", model.name.c_str());
+        steps.push_back({{"type", "NFKC"}});
+        if (model.name.size() > 3 && 0 == model.name.compare(model.name.size() - 3, 3, "_cf")) {
+            steps.push_back({{"type", "Lowercase"}});
+        }
+    }
+    if (model.remove_extra_whitespaces) {
+        fprintf(stderr, "Unsupported normalizer: leading and trailing spaces are kept\n");
+        steps.push_back(
+            {{"type", "Replace"}, {"pattern", {{"Regex", " {2,}"}}}, {"content", " "}}
+        );
+    }
+
+    const std::string space = model.escape_whitespaces ? "▁" : " ";
+    if (model.add_dummy_prefix) {
+        if (model.suffix) {
+            fprintf(stderr, "Unsupported normalizer: the dummy prefix is not added as a suffix\n");
+        }
+        steps.push_back({{"type", "Prepend"}, {"prepend", space}});
+    }
+    if (model.escape_whitespaces) {
+        steps.push_back({{"type", "Replace"}, {"pattern", {{"String", " "}}}, {"content", space}});
+    }
+
+    return {{"type", "Sequence"}, {"normalizers", steps}};
+}
+
+std::vector<uint8_t> sentencepiece_image(const struct SentencePieceModel &model) {
+    struct TokenizerParts   parts;
+    struct TokenizerHeader &header = parts.header;
+
+    const std::string type = SENTENCEPIECE_BPE == model.type ? "BPE" : "Unigram";
+    if (SENTENCEPIECE_BPE != model.type && SENTENCEPIECE_UNIGRAM != model.type) {
+        throw std::runtime_error(
+            "Unsupported sentencepiece model type: " + std::to_string((int) model.type)
+        );
+    }
+    memcpy(header.type, type.c_str(), type.size() + 1);
+    fprintf(stderr, "set type: %s\n", type.c_str());
+
+    const size_t n_tokens = model.pieces.size();
+    fprintf(stderr, "set size: %zu\n", n_tokens);
+
+    // every piece is in the vocab, but the encoder only ever matches those meant for text
+    nlohmann::json added_tokens = nlohmann::json::array();
+    parts.tokens.resize(n_tokens);
+    parts.decoded.resize(n_tokens);
+    for (size_t id = 0; id < n_tokens; ++id) {
+        const struct SentencePiece &piece = model.pieces[id];
+        parts.tokens[id]                  = piece.piece;
+        parts.vocab.push_back((uint32_t) id);
+
+        // e.g. <0xE2> -> \xE2 and ▁ -> " "
+        if (SENTENCEPIECE_BYTE == piece.type) {
+            parts.decoded[id] = std::string(
+                1, (char) strtoul(piece.piece.substr(3, 2).c_str(), nullptr, 16)
+            );
+        } else if (model.escape_whitespaces) {
+            parts.decoded[id] = replace_all(piece.piece, "▁", " ");
+        } else {
+            parts.decoded[id] = piece.piece;
+        }
+
+        // control pieces are matched as special tokens the same way tokenizer.json does
+        const bool special = SENTENCEPIECE_CONTROL == piece.type
+                             || SENTENCEPIECE_UNKNOWN == piece.type;
+        if (special || SENTENCEPIECE_USER_DEFINED == piece.type) {
+            added_tokens.push_back({
+                {"id", id},
+                {"content", piece.piece},
+                {"single_word", false},
+                {"lstrip", false},
+                {"rstrip", false},
+                {"normalized", false},
+                {"special", special},
+            });
+        }
+    }
+    fprintf(stderr, "set tokens\n"); // too large to print
+
+    const std::unordered_map<std::string_view, uint32_t> lookup = tokenizer_lookup(parts);
+
+    if (SENTENCEPIECE_BPE == model.type) {
+        // a BPE model keeps no merge rules: the pieces are merged in order of score, so every
+        // split of a piece in two pieces is a rule at the priority of the piece. ties are
+        // broken on the ids, as the reference converter does.
+        std::vector<uint32_t> order(n_tokens);
+        for (size_t id = 0; id < n_tokens; ++id) {
+            order[id] = (uint32_t) id;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return model.pieces[a].score > model.pieces[b].score;
+        });
+
+        std::vector<struct MergeRule> rules;
+        for (uint32_t id : order) {
+            const std::string_view piece = parts.tokens[id];
+            if (piece.empty()) {
+                continue;
+            }
+
+            rules.clear();
+            for (size_t split = unicode_len_utf8(piece[0]); split < piece.size();
+                 split += unicode_len_utf8(piece[split])) {
+                auto left  = lookup.find(piece.substr(0, split));
+                auto right = lookup.find(piece.substr(split));
+                if (lookup.end() != left && lookup.end() != right) {
+                    rules.push_back({left->second, right->second, id});
+                }
+            }
+            std::sort(rules.begin(), rules.end(), [](const MergeRule &a, const MergeRule &b) {
+                return a.left != b.left ? a.left < b.left : a.right < b.right;
+            });
+            parts.merges.insert(parts.merges.end(), rules.begin(), rules.end());
+        }
+    } else {
+        parts.scores.resize(n_tokens);
+        std::vector<float> normal;
+        for (size_t id = 0; id < n_tokens; ++id) {
+            const struct SentencePiece &piece = model.pieces[id];
+            parts.scores[id]                  = piece.score;
+            if (SENTENCEPIECE_NORMAL == piece.type || SENTENCEPIECE_USER_DEFINED == piece.type) {
+                parts.pieces.push_back((uint32_t) id);
+            }
+            if (SENTENCEPIECE_NORMAL == piece.type) {
+                normal.push_back(piece.score);
+            }
+        }
+        header.unk_score = unigram_unk_score(normal);
+    }
+
+    // unknown characters in a row are always fused into a single unk piece
+    header.flags  |= TOKENIZER_FLAG_FUSE_UNK;
+    header.flags  |= model.byte_fallback ? TOKENIZER_FLAG_BYTE_FALLBACK : 0;
+    header.unk_id  = TOKENIZER_NO_ID;
+    if (model.unk_id >= 0 && (size_t) model.unk_id < n_tokens) {
+        header.unk_id = (uint32_t) model.unk_id;
+    }
+    fprintf(stderr, "byte fallback: %d\n", model.byte_fallback);
+
+    // the decoder strips the space the dummy prefix turns into
+    header.decode_strip = model.add_dummy_prefix ? 1 : 0;
+    fprintf(stderr, "set decoder: strip %u\n", header.decode_strip);
+
+    const nlohmann::json config = {
+        {"normalizer", sentencepiece_normalizer(model)},
+        {"pre_tokenizer", nullptr},
+        {"added_tokens", added_tokens},
+    };
+    parts.config = config.dump();
+
+    return tokenizer_layout(parts);
+}
+
+struct TokenizerModel* malloc_tokenizer_model(const uint8_t* image, size_t size) {
+    if (nullptr == image || size < sizeof(struct TokenizerHeader)) {
+        throw std::invalid_argument("Expected a valid tokenizer image, got null instead.");
+    }
+    PROFILE_SCOPE("tokenizer model");
+
+    const auto* header = reinterpret_cast<const struct TokenizerHeader*>(image);
+    if (TOKENIZER_MAGIC != header->magic) {
+        throw std::runtime_error("Invalid tokenizer image: bad magic.");
+    }
+    if (TOKENIZER_VERSION != header->version) {
+        throw std::runtime_error(
+            "Unsupported tokenizer image version: " + std::to_string(header->version)
+        );
+    }
+    for (const struct TokenizerSection &section : header->sections) {
+        if (section.offset % TOKENIZER_ALIGN || section.size > size
+            || section.offset > size - section.size) {
+            throw std::runtime_error("Invalid tokenizer image: section out of bounds.");
+        }
+    }
+    if (0 == header->n_slots || header->n_slots & (header->n_slots - 1)
+        || header->n_merges >= header->n_slots) {
+        throw std::runtime_error("Invalid tokenizer image: malformed merge table.");
+    }
+    if (0 == header->n_buckets || header->n_buckets & (header->n_buckets - 1)
+        || header->n_vocab >= header->n_buckets) {
+        throw std::runtime_error("Invalid tokenizer image: malformed vocab index.");
+    }
+    if (TOKENIZER_NO_ID != header->unk_id && header->unk_id >= header->n_tokens) {
+        throw std::runtime_error("Invalid tokenizer image: unk id out of range.");
+    }
+
+    // the tables are indexed without bounds checks, so each section must hold all of its table
+    const auto* sections = header->sections;
+    if (sections[TOKENIZER_SECTION_TOKENS].size < header->n_tokens * sizeof(struct TokenSpan)
+        || sections[TOKENIZER_SECTION_DECODE_TOKENS].size
+               < header->n_tokens * sizeof(struct TokenSpan)
+        || sections[TOKENIZER_SECTION_VOCAB].size < header->n_buckets * sizeof(struct VocabSlot)
+        || sections[TOKENIZER_SECTION_MERGES].size < header->n_slots * sizeof(struct MergeSlot)) {
+        throw std::runtime_error("Invalid tokenizer image: section too small for its table.");
+    }
+
+    // and so is the pool, by the spans of every token
+    const std::pair<enum TokenizerSectionType, enum TokenizerSectionType> pools[] = {
+        {TOKENIZER_SECTION_TOKENS, TOKENIZER_SECTION_POOL},
+        {TOKENIZER_SECTION_DECODE_TOKENS, TOKENIZER_SECTION_DECODE_POOL},
+    };
+    for (const auto &[spans_section, pool_section] : pools) {
+        const auto*    spans = tokenizer_section<struct TokenSpan>(image, spans_section);
+        const uint64_t pool  = sections[pool_section].size;
+        for (size_t id = 0; id < header->n_tokens; ++id) {
+            if ((uint64_t) spans[id].offset + spans[id].size > pool) {
+                throw std::runtime_error(
+                    "Invalid tokenizer image: token " + std::to_string(id) + " out of its pool."
+                );
+            }
+        }
+    }
+
+    // the probes of the vocab index and the merge table stop at the first empty slot, so each
+    // must have one, and the ids they hold index the tables above
+    const auto* vocab   = tokenizer_section<struct VocabSlot>(image, TOKENIZER_SECTION_VOCAB);
+    size_t      n_empty = 0;
+    for (size_t slot = 0; slot < header->n_buckets; ++slot) {
+        if (TOKENIZER_NO_ID == vocab[slot].id) {
+            n_empty++;
+        } else if (vocab[slot].id >= header->n_tokens) {
+            throw std::runtime_error("Invalid tokenizer image: vocab id out of range.");
+        }
+    }
+    if (0 == n_empty) {
+        throw std::runtime_error("Invalid tokenizer image: vocab index has no empty slot.");
+    }
+
+    const auto* merges = tokenizer_section<struct MergeSlot>(image, TOKENIZER_SECTION_MERGES);
+    n_empty            = 0;
+    for (size_t slot = 0; slot < header->n_slots; ++slot) {
+        if (MERGE_EMPTY_KEY == merges[slot].key) {
+            n_empty++;
+        } else if (merges[slot].merge.id >= header->n_tokens) {
+            throw std::runtime_error("Invalid tokenizer image: merge id out of range.");
+        }
+    }
+    if (0 == n_empty) {
+        throw std::runtime_error("Invalid tokenizer image: merge table has no empty slot.");
+    }
+
+    const bool unigram = 0 == strncmp(header->type, "Unigram", sizeof(header->type));
+    if (unigram) {
+        // the trie is walked from the root along the edges of each node
+        const size_t n_scores = sections[TOKENIZER_SECTION_SCORES].size / sizeof(float);
+        const size_t n_nodes
+            = sections[TOKENIZER_SECTION_TRIE_NODES].size / sizeof(struct TrieNode);
+        const size_t n_edges = sections[TOKENIZER_SECTION_TRIE_EDGES].size / sizeof(uint32_t);
+        if (n_scores != header->n_tokens || 0 == n_nodes) {
+            throw std::runtime_error("Invalid tokenizer image: malformed unigram tables.");
+        }
+
+        const auto* nodes = tokenizer_section<struct TrieNode>(image, TOKENIZER_SECTION_TRIE_NODES);
+        const auto* edges = tokenizer_section<uint32_t>(image, TOKENIZER_SECTION_TRIE_EDGES);
+        for (size_t node = 0; node < n_nodes; ++node) {
+            if ((TOKENIZER_NO_ID != nodes[node].id && nodes[node].id >= header->n_tokens)
+                || (uint64_t) nodes[node].edges + nodes[node].n_edges > n_edges) {
+                throw std::runtime_error(
+                    "Invalid tokenizer image: trie node " + std::to_string(node) + " out of range."
+                );
+            }
+        }
+        for (size_t edge = 0; edge < n_edges; ++edge) {
+            if ((edges[edge] >> 8) >= n_nodes) {
+                throw std::runtime_error("Invalid tokenizer image: trie edge out of range.");
+            }
+        }
+    }
+
+    struct TokenizerModel* model = new TokenizerModel{};
+
+    if (!model) {
+        throw std::bad_alloc();
+    }
+
+    model->type      = std::string(header->type, strnlen(header->type, sizeof(header->type)));
+    model->size      = header->n_tokens;
+    model->pool      = tokenizer_section<char>(image, TOKENIZER_SECTION_POOL);
+    model->tokens    = tokenizer_section<struct TokenSpan>(image, TOKENIZER_SECTION_TOKENS);
+    model->vocab     = tokenizer_section<struct VocabSlot>(image, TOKENIZER_SECTION_VOCAB);
+    model->n_vocab   = header->n_vocab;
+    model->n_buckets = header->n_buckets;
+    model->merges    = tokenizer_section<struct MergeSlot>(image, TOKENIZER_SECTION_MERGES);
+    model->n_merges  = header->n_merges;
+    model->n_slots   = header->n_slots;
+
+    model->decode_pool   = tokenizer_section<char>(image, TOKENIZER_SECTION_DECODE_POOL);
+    model->decode_tokens = tokenizer_section<struct TokenSpan>(
+        image, TOKENIZER_SECTION_DECODE_TOKENS
+    );
+    model->decode_strip = header->decode_strip;
+
+    if (unigram) {
+        model->scores     = tokenizer_section<float>(image, TOKENIZER_SECTION_SCORES);
+        model->trie       = tokenizer_section<struct TrieNode>(image, TOKENIZER_SECTION_TRIE_NODES);
+        model->trie_edges = tokenizer_section<uint32_t>(image, TOKENIZER_SECTION_TRIE_EDGES);
+        model->unk_score  = header->unk_score;
+    }
+
+    model->byte_fallback = header->flags & TOKENIZER_FLAG_BYTE_FALLBACK;
+    model->ignore_merges = header->flags & TOKENIZER_FLAG_IGNORE_MERGES;
+    model->fuse_unk      = header->flags & TOKENIZER_FLAG_FUSE_UNK;
+    model->dropout       = header->dropout;
+
+    for (size_t byte = 0; byte < 256; ++byte) {
+        auto id = model->find(unicode_byte_to_utf8((uint8_t) byte));
+        model->byte_ids[byte] = id ? *id : TOKENIZER_NO_ID;
+    }
+
+    return model;
 }
 
 void free_tokenizer_model(struct TokenizerModel* tokenizer_model) {
     if (tokenizer_model) {
-        free(tokenizer_model);
+        if (tokenizer_model->mapping) {
+            munmap(tokenizer_model->mapping, tokenizer_model->mapping_size);
+        }
+        delete tokenizer_model;
     }
 }
 
-struct Tokenizer* malloc_tokenizer(nlohmann::json data) {
-    if (data.is_null()) {
-        throw std::invalid_argument("Expected a valid model argument, got null instead.");
+struct BPECache* malloc_bpe_cache(size_t n_shards, size_t capacity, size_t max_word_size) {
+    if (0 == n_shards || 0 == capacity) {
+        throw std::invalid_argument("Expected a non-zero number of shards and capacity.");
     }
 
-    struct Tokenizer* tokenizer = new Tokenizer{};
+    struct BPECache* cache = new BPECache{};
 
-    if (!tokenizer) {
+    if (!cache) {
         throw std::bad_alloc();
     }
 
-    tokenizer->model        = malloc_tokenizer_model(data["model"]);
-    tokenizer->added_tokens = malloc_added_tokens(data["added_tokens"]);
+    cache->n_shards      = n_shards;
+    cache->capacity      = capacity;
+    cache->max_word_size = max_word_size;
+    cache->shards        = new BPECacheShard[n_shards];
 
-    // TODO/WIP: Note that normalize and pre_tokenizer are variable objects.
-    // using nlohmann::json data types to ensure sane defaults for now.
-    tokenizer->normalizer    = data["normalizer"];
-    tokenizer->pre_tokenizer = data["pre_tokenizer"];
+    for (size_t i = 0; i < n_shards; ++i) {
+        cache->shards[i].index.reserve(capacity);
+    }
 
-    return tokenizer;
+    return cache;
 }
 
-void free_tokenizer(struct Tokenizer* data) {
-    if (nullptr != data) {
-        free_tokenizer_model(data->model);
-        free_added_tokens(data->added_tokens);
-        free(data);
+void free_bpe_cache(struct BPECache* cache) {
+    if (cache) {
+        delete[] cache->shards;
+        delete cache;
     }
 }
 
-int main(int argc, char* argv[]) {
-    if (1 == argc) {
-        fprintf(stderr, "Usage: %s [-p <path>]\n", argv[0]);
-        return 1;
+static struct BPECacheShard &bpe_cache_shard(struct BPECache* cache, std::string_view word) {
+    return cache->shards[std::hash<std::string_view>{}(word) % cache->n_shards];
+}
+
+bool BPECache::get(std::string_view word, std::vector<uint32_t> &ids) {
+    if (word.size() > max_word_size) {
+        return false;
     }
 
-    const char* const   short_options = "p:";
-    const struct option long_options[]
-        = {{"tokenizer-path", required_argument, nullptr, 'p'}, NULL};
+    struct BPECacheShard       &shard = bpe_cache_shard(this, word);
+    std::lock_guard<std::mutex> guard(shard.lock);
 
-    int                   opt;
-    std::filesystem::path directory;
+    auto it = shard.index.find(word);
+    if (shard.index.end() == it) {
+        shard.misses++;
+        return false;
+    }
 
-    while ((opt = getopt_long(argc, argv, short_options, long_options, nullptr)) != -1) {
-        switch (opt) {
-            case 'p':
-                if (optarg == nullptr || strlen(optarg) < 1) {
-                    puts("Error: Invalid file path specified.");
-                    return 1;
-                }
+    shard.hits++;
+    shard.entries.splice(shard.entries.begin(), shard.entries, it->second); // mark most recent
+    ids.insert(ids.end(), it->second->ids.begin(), it->second->ids.end());
+    return true;
+}
 
-                directory = std::filesystem::path(optarg);
-                break;
+void BPECache::put(std::string_view word, const uint32_t* ids, size_t n_ids) {
+    if (word.size() > max_word_size) {
+        return;
+    }
 
-            default:
-                puts("Usage: vocab [-p <tokenizer-path>]");
-                return 1;
-        }
+    struct BPECacheShard       &shard = bpe_cache_shard(this, word);
+    std::lock_guard<std::mutex> guard(shard.lock);
+
+    if (shard.index.end() != shard.index.find(word)) {
+        return; // another thread raced us to the same word
+    }
+
+    if (shard.entries.size() >= capacity) {
+        shard.index.erase(shard.entries.back().word);
+        shard.entries.pop_back();
+    }
+
+    shard.entries.push_front({std::string(word), std::vector<uint32_t>(ids, ids + n_ids)});
+    shard.index.emplace(shard.entries.front().word, shard.entries.begin());
+}
+
+size_t BPECache::hits() const {
+    size_t total = 0;
+    for (size_t i = 0; i < n_shards; ++i) {
+        std::lock_guard<std::mutex> guard(shards[i].lock);
+        total += shards[i].hits;
+    }
+    return total;
+}
+
+size_t BPECache::misses() const {
+    size_t total = 0;
+    for (size_t i = 0; i < n_shards; ++i) {
+        std::lock_guard<std::mutex> guard(shards[i].lock);
+        total += shards[i].misses;
     }
+    return total;
+}
+
+// wrap a model in a tokenizer, reading the remaining settings from the config section. the
+// tokenizer owns model from here on, so model is freed with everything else when this throws.
+static struct Tokenizer*
+malloc_tokenizer_from_image(
+    struct TokenizerModel* model, const uint8_t* image, std::chrono::steady_clock::time_point start
+) {
+    PROFILE_SCOPE("tokenizer config");
+
+    struct Arena*     arena     = nullptr;
+    struct Tokenizer* tokenizer = nullptr;
+    try {
+        // a few hundred added tokens fit the first couple of blocks
+        arena            = malloc_arena(16 * 1024);
+        tokenizer        = arena->create<Tokenizer>();
+        tokenizer->arena = arena;
+        tokenizer->model = model;
+
+        const auto*          header = reinterpret_cast<const struct TokenizerHeader*>(image);
+        const char*          config = tokenizer_section<char>(image, TOKENIZER_SECTION_CONFIG);
+        const size_t         size   = header->sections[TOKENIZER_SECTION_CONFIG].size;
+        const nlohmann::json data   = nlohmann::json::parse(config, config + size);
+
+        tokenizer->added_tokens = malloc_added_tokens(arena, data["added_tokens"]);
+
+        // 16 shards of 4096 words covers the working set of natural language text.
+        // words longer than 256 bytes are rarely repeated, so they are not worth the memory.
+        tokenizer->cache = malloc_bpe_cache(16, 4096, 256);
 
-    std::filesystem::path tokenizer_json = directory / "tokenizer.json";
+        tokenizer->normalizer    = malloc_normalizer(data["normalizer"]);
+        tokenizer->pre_tokenizer = malloc_pre_tokenizer(data["pre_tokenizer"]);
 
-    fprintf(stdout, "using: %s\n", tokenizer_json.c_str());
+        // special tokens are usually matched on the raw text, the rest on the normalized text
+        const std::vector<struct AddedToken*> &added = tokenizer->added_tokens;
+        tokenizer->added_raw        = malloc_added_token_matcher(added, false, nullptr);
+        tokenizer->added_normalized = malloc_added_token_matcher(
+            added, true, tokenizer->normalizer
+        );
 
-    std::ifstream  f(tokenizer_json);
-    nlohmann::json data = nlohmann::json::parse(f);
+        // the unk token is optional, e.g. byte-level models can represent any input.
+        // its content is a view of the image, which outlives the tokenizer's arena.
+        if (TOKENIZER_NO_ID != header->unk_id) {
+            const std::string_view unk = model->token(header->unk_id);
+            tokenizer->unk_token       = arena->create<Token>((size_t) header->unk_id, unk);
+        }
+    } catch (...) {
+        if (tokenizer) {
+            free_tokenizer(tokenizer); // whatever was compiled so far, then the model and arena
+        } else {
+            free_tokenizer_model(model);
+            free_arena(arena);
+        }
+        throw;
+    }
+
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    tokenizer->load_ms = std::chrono::duration<double, std::milli>(elapsed).count();
+    return tokenizer;
+}
 
+struct Tokenizer* malloc_tokenizer(nlohmann::json data) {
     if (data.is_null()) {
-        fprintf(stderr, "Error: Unable to parse tokenizer.json file.\n");
-        return 1;
+        throw std::invalid_argument("Expected a valid model argument, got null instead.");
     }
 
-    const std::string version = data["version"];
-    fprintf(stdout, "version: %s\n", version.c_str());
+    const auto             start = std::chrono::steady_clock::now();
+    std::vector<uint8_t>   image = tokenizer_image(data);
+    struct TokenizerModel* model = malloc_tokenizer_model(image.data(), image.size());
+    model->image                 = std::move(image); // the buffer moves, the views stay valid
 
-    struct Tokenizer* tokenizer = malloc_tokenizer(data);
+    return malloc_tokenizer_from_image(model, model->image.data(), start);
+}
 
-    fprintf(stdout, "tokenizer->model->type: %s\n", tokenizer->type().c_str());
+struct Tokenizer* mmap_tokenizer(const char* path) {
+    if (nullptr == path) {
+        throw std::invalid_argument("Expected a valid path argument, got null instead.");
+    }
 
-    free_tokenizer(tokenizer);
+    const auto start = std::chrono::steady_clock::now();
 
-    return 0;
+    int fd = open(path, O_RDONLY);
+    if (-1 == fd) {
+        throw std::runtime_error("Unable to open tokenizer: " + std::string(path));
+    }
+
+    struct stat info;
+    if (-1 == fstat(fd, &info)) {
+        close(fd);
+        throw std::runtime_error("Unable to stat tokenizer: " + std::string(path));
+    }
+
+    const size_t size    = (size_t) info.st_size;
+    void*        mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping holds its own reference to the file
+    if (MAP_FAILED == mapping) {
+        throw std::runtime_error("Unable to map tokenizer: " + std::string(path));
+    }
+
+    struct TokenizerModel* model;
+    try {
+        model = malloc_tokenizer_model(static_cast<const uint8_t*>(mapping), size);
+    } catch (...) {
+        munmap(mapping, size);
+        throw;
+    }
+    model->mapping      = mapping;
+    model->mapping_size = size;
+
+    return malloc_tokenizer_from_image(model, static_cast<const uint8_t*>(mapping), start);
+}
+
+struct Tokenizer* malloc_sentencepiece_tokenizer(const char* path) {
+    if (nullptr == path) {
+        throw std::invalid_argument("Expected a valid path argument, got null instead.");
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+
+    int fd = open(path, O_RDONLY);
+    if (-1 == fd) {
+        throw std::runtime_error("Unable to open sentencepiece model: " + std::string(path));
+    }
+
+    struct stat info;
+    if (-1 == fstat(fd, &info)) {
+        close(fd);
+        throw std::runtime_error("Unable to stat sentencepiece model: " + std::string(path));
+    }
+
+    // the model is only read while the image is built, so the mapping is private and brief
+    const size_t size    = (size_t) info.st_size;
+    void*        mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == mapping) {
+        throw std::runtime_error("Unable to map sentencepiece model: " + std::string(path));
+    }
+
+    std::vector<uint8_t> image;
+    try {
+        image = sentencepiece_image(sentencepiece_parse(static_cast<uint8_t*>(mapping), size));
+    } catch (...) {
+        munmap(mapping, size);
+        throw;
+    }
+    munmap(mapping, size);
+
+    struct TokenizerModel* model = malloc_tokenizer_model(image.data(), image.size());
+    model->image                 = std::move(image); // the buffer moves, the views stay valid
+
+    return malloc_tokenizer_from_image(model, model->image.data(), start);
+}
+
+void Tokenizer::print_stats(FILE* out) const {
+    const bool   mapped = nullptr != model->mapping;
+    const size_t bytes  = mapped ? model->mapping_size : model->image.size();
+
+    size_t n_special = 0;
+    for (const struct AddedToken* added : added_tokens) {
+        n_special += added->special ? 1 : 0;
+    }
+
+    fprintf(out, "load:    %.3f ms\n", load_ms);
+    fprintf(out, "image:   %zu bytes (%s)\n", bytes, mapped ? "mapped" : "in memory");
+    fprintf(out, "tokens:  %zu (%s)\n", model->size, model->type.c_str());
+    fprintf(out, "vocab:   %zu entries in %zu buckets\n", model->n_vocab, model->n_buckets);
+    fprintf(out, "merges:  %zu rules in %zu slots\n", model->n_merges, model->n_slots);
+    fprintf(out, "added:   %zu tokens, %zu special\n", added_tokens.size(), n_special);
+    fprintf(
+        out,
+        "arena:   %zu allocations, %zu bytes in %zu blocks of %zu bytes\n",
+        arena->n_allocations,
+        arena->n_bytes,
+        arena->n_blocks,
+        arena->capacity
+    );
+}
+
+void free_tokenizer(struct Tokenizer* data) {
+    if (nullptr != data) {
+        free_tokenizer_model(data->model);
+        free_normalizer(data->normalizer);
+        free_pre_tokenizer(data->pre_tokenizer);
+        free_added_token_matcher(data->added_raw);
+        free_added_token_matcher(data->added_normalized);
+        free_bpe_cache(data->cache);
+        free_thread_pool(data->pool);
+        // the tokens, their contents and the tokenizer itself go last, all at once
+        free_arena(data->arena);
+    }
+}
+
+//
+// normalization
+//
+
+static void normalizer_compile(const nlohmann::json &normalizer, struct Normalizer* compiled) {
+    static const std::unordered_map<std::string, enum NormalizerType> types = {
+        {"NFD", NORMALIZER_NFD},
+        {"NFKD", NORMALIZER_NFKD},
+        {"NFC", NORMALIZER_NFC},
+        {"NFKC", NORMALIZER_NFKC},
+        {"Lowercase", NORMALIZER_LOWERCASE},
+        {"Prepend", NORMALIZER_PREPEND},
+        {"Replace", NORMALIZER_REPLACE},
+    };
+
+    const std::string type = normalizer["type"];
+    if ("Sequence" == type) {
+        for (const nlohmann::json &rule : normalizer["normalizers"]) {
+            normalizer_compile(rule, compiled);
+        }
+        return;
+    }
+
+    auto it = types.find(type);
+    if (types.end() == it) {
+        fprintf(stderr, "Unsupported normalizer: '%s'\n", type.c_str());
+        return;
+    }
+
+    struct NormalizerStep step = {it->second, "", "", nullptr};
+    if (NORMALIZER_PREPEND == step.type) {
+        step.pattern = normalizer["prepend"];
+    } else if (NORMALIZER_REPLACE == step.type) {
+        const nlohmann::json &pattern = normalizer["pattern"];
+        step.content                  = normalizer["content"];
+        if (pattern.contains("String")) {
+            step.pattern = pattern["String"];
+            if (step.pattern.empty()) {
+                return; // nothing would ever be replaced
+            }
+        } else {
+            step.pattern = pattern["Regex"];
+            step.regex   = unicode_regex_compile(step.pattern);
+        }
+    }
+    compiled->steps.push_back(std::move(step));
+}
+
+struct Normalizer* malloc_normalizer(const nlohmann::json &normalizer) {
+    if (normalizer.is_null()) {
+        return nullptr;
+    }
+
+    struct Normalizer* compiled = new Normalizer{};
+    try {
+        normalizer_compile(normalizer, compiled);
+    } catch (...) {
+        free_normalizer(compiled);
+        throw;
+    }
+    return compiled;
+}
+
+void free_normalizer(struct Normalizer* normalizer) {
+    if (normalizer) {
+        for (struct NormalizerStep &step : normalizer->steps) {
+            unicode_regex_free(step.regex);
+        }
+        delete normalizer;
+    }
+}
+
+// lowercase text into out, returns false without touching out when nothing changes
+static bool normalize_lowercase(std::string_view text, std::string &out) {
+    // find the first character with a lowercase mapping, most text has none past its first word
+    size_t first = text.size();
+    for (size_t offset = 0; offset < text.size() && first == text.size();) {
+        const unsigned char c = (unsigned char) text[offset];
+        if (c < 0x80) {
+            first   = 'A' <= c && c <= 'Z' ? offset : first;
+            offset += 1;
+            continue;
+        }
+        size_t         next = offset;
+        const uint32_t cpt  = unicode_cpt_from_utf8(text, next);
+        first               = unicode_tolower(cpt) != cpt ? offset : first;
+        offset              = next;
+    }
+    if (text.size() == first) {
+        return false;
+    }
+
+    out.assign(text.substr(0, first));
+    for (size_t offset = first; offset < text.size();) {
+        const unsigned char c = (unsigned char) text[offset];
+        if (c < 0x80) {
+            out     += (char) ('A' <= c && c <= 'Z' ? c + ('a' - 'A') : c);
+            offset  += 1;
+            continue;
+        }
+        out += unicode_cpt_to_utf8(unicode_tolower(unicode_cpt_from_utf8(text, offset)));
+    }
+    return true;
+}
+
+// replace every match of regex in text, returns false without touching out when there is none
+static bool normalize_replace_regex(
+    const struct unicode_regex* regex,
+    std::string_view            text,
+    const std::string          &content,
+    std::string                &out
+) {
+    const std::vector<uint32_t> cpts = unicode_cpts_from_utf8(text);
+
+    bool   replaced = false;
+    size_t offset   = 0; // byte offset of cpts[i]
+    for (size_t i = 0; i < cpts.size();) {
+        const size_t n_match = regex->match(cpts.data() + i, cpts.size() - i);
+        if (0 == n_match) {
+            const size_t len = unicode_len_utf8(text[offset]);
+            if (replaced) {
+                out.append(text.substr(offset, len));
+            }
+            offset += len;
+            i      += 1;
+            continue;
+        }
+
+        if (!replaced) {
+            out.assign(text.substr(0, offset));
+            replaced = true;
+        }
+        out += content;
+        for (size_t end = i + n_match; i < end; ++i) {
+            offset += unicode_len_utf8(text[offset]);
+        }
+    }
+    return replaced;
+}
+
+// apply a single step to text, returns false without touching out when text is left as is
+static bool normalize_step(
+    const struct NormalizerStep &step, std::string_view text, bool start, std::string &out
+) {
+    static const enum unicode_normalization forms[] = {
+        UNICODE_NFD,
+        UNICODE_NFKD,
+        UNICODE_NFC,
+        UNICODE_NFKC,
+    };
+
+    switch (step.type) {
+        case NORMALIZER_NFD:
+        case NORMALIZER_NFKD:
+        case NORMALIZER_NFC:
+        case NORMALIZER_NFKC:
+            if (unicode_is_normalized(text, forms[step.type])) {
+                return false;
+            }
+            unicode_normalize(text, forms[step.type], out);
+            return true;
+        case NORMALIZER_LOWERCASE:
+            return normalize_lowercase(text, out);
+        case NORMALIZER_PREPEND:
+            if (!start) {
+                return false;
+            }
+            out.assign(step.pattern).append(text);
+            return true;
+        case NORMALIZER_REPLACE: {
+            if (step.regex) {
+                return normalize_replace_regex(step.regex, text, step.content, out);
+            }
+            size_t pos = text.find(step.pattern);
+            if (std::string_view::npos == pos) {
+                return false;
+            }
+            out.clear();
+            size_t from = 0;
+            for (; std::string_view::npos != pos; pos = text.find(step.pattern, from)) {
+                out.append(text.substr(from, pos - from)).append(step.content);
+                from = pos + step.pattern.size();
+            }
+            out.append(text.substr(from));
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string_view
+Normalizer::normalize(std::string_view text, bool start, std::string (&buffers)[2]) const {
+    if (text.empty()) {
+        return text; // e.g. Prepend leaves empty text alone
+    }
+
+    // each step reads the output of the previous one and writes into the other buffer
+    std::string_view current = text;
+    size_t           next    = 0;
+    for (const struct NormalizerStep &step : steps) {
+        if (normalize_step(step, current, start, buffers[next])) {
+            current  = buffers[next];
+            next    ^= 1;
+        }
+    }
+    return current;
+}
+
+//
+// pre-tokenization
+//
+
+// GPT2 system regex used by the ByteLevel pre-tokenizer
+static const std::string BYTE_LEVEL_REGEX
+    = "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)|\\s+";
+
+// what the reference implementation splits on for Whitespace, WhitespaceSplit, Digits and
+// Punctuation, e.g. is_punctuation also takes the ascii symbols
+static const std::string WHITESPACE_REGEX       = "\\w+|[^\\w\\s]+";
+static const std::string WHITESPACE_SPLIT_REGEX = "\\s+";
+static const std::string DIGITS_REGEX           = "\\p{N}";
+static const std::string PUNCTUATION_REGEX      = "[\\p{P}!-/:-@\\[-`{-~]";
+
+static enum SplitBehavior pre_tokenizer_behavior(const nlohmann::json &pre_tokenizer) {
+    static const std::unordered_map<std::string, enum SplitBehavior> behaviors = {
+        {"Removed", SPLIT_REMOVED},
+        {"Isolated", SPLIT_ISOLATED},
+        {"MergedWithPrevious", SPLIT_MERGED_WITH_PREVIOUS},
+        {"MergedWithNext", SPLIT_MERGED_WITH_NEXT},
+        {"Contiguous", SPLIT_CONTIGUOUS},
+    };
+
+    const std::string behavior = pre_tokenizer.value("behavior", "Isolated");
+    auto              it       = behaviors.find(behavior);
+    if (behaviors.end() == it) {
+        throw std::runtime_error("Unsupported split behavior: " + behavior);
+    }
+    return it->second;
+}
+
+static struct PreTokenizerStep
+pre_tokenizer_split(const std::string &regex, enum SplitBehavior behavior, bool invert) {
+    return {
+        PRE_TOKENIZER_SPLIT,
+        PREPEND_NEVER,
+        "",
+        "",
+        "",
+        unicode_regex_compile(regex),
+        behavior,
+        invert,
+    };
+}
+
+static void
+pre_tokenizer_compile(const nlohmann::json &pre_tokenizer, struct PreTokenizer* compiled) {
+    const std::string type = pre_tokenizer["type"];
+    if ("Sequence" == type) {
+        for (const nlohmann::json &rule : pre_tokenizer["pretokenizers"]) {
+            pre_tokenizer_compile(rule, compiled);
+        }
+        return;
+    }
+
+    struct PreTokenizerStep step
+        = {PRE_TOKENIZER_SPLIT, PREPEND_NEVER, "", "", "", nullptr, SPLIT_ISOLATED, false};
+    if ("ByteLevel" == type) {
+        const bool prefixed = pre_tokenizer.value("add_prefix_space", false);
+        step.type           = PRE_TOKENIZER_BYTE_LEVEL;
+        step.prepend        = prefixed ? PREPEND_ALWAYS : PREPEND_NEVER;
+        step.prefix         = " ";
+        if (pre_tokenizer.value("use_regex", true)) {
+            step.regex = unicode_regex_compile(BYTE_LEVEL_REGEX);
+        }
+        compiled->byte_level = true;
+    } else if ("Metaspace" == type) {
+        step.type        = PRE_TOKENIZER_METASPACE;
+        step.replacement = pre_tokenizer.value("replacement", "\u2581");
+        step.prefix      = step.replacement;
+        if (pre_tokenizer.contains("prepend_scheme")) {
+            const std::string scheme = pre_tokenizer["prepend_scheme"];
+            step.prepend             = "always" == scheme  ? PREPEND_ALWAYS
+                                       : "first" == scheme ? PREPEND_FIRST
+                                                           : PREPEND_NEVER;
+        } else {
+            // e.g. older files only have add_prefix_space
+            step.prepend
+                = pre_tokenizer.value("add_prefix_space", true) ? PREPEND_ALWAYS : PREPEND_NEVER;
+        }
+        if (pre_tokenizer.value("split", true)) {
+            step.pattern  = step.replacement;
+            step.behavior = SPLIT_MERGED_WITH_NEXT;
+        }
+    } else if ("Split" == type) {
+        const nlohmann::json &pattern = pre_tokenizer["pattern"];
+        step.behavior                 = pre_tokenizer_behavior(pre_tokenizer);
+        step.invert                   = pre_tokenizer.value("invert", false);
+        if (pattern.contains("String")) {
+            step.pattern = pattern["String"];
+            if (step.pattern.empty()) {
+                return; // nothing would ever be split
+            }
+        } else {
+            step.regex = unicode_regex_compile(pattern["Regex"]);
+        }
+    } else if ("Digits" == type) {
+        const bool individual = pre_tokenizer.value("individual_digits", false);
+        step                  = pre_tokenizer_split(
+            DIGITS_REGEX, individual ? SPLIT_ISOLATED : SPLIT_CONTIGUOUS, false
+        );
+    } else if ("Whitespace" == type) {
+        step = pre_tokenizer_split(WHITESPACE_REGEX, SPLIT_REMOVED, true);
+    } else if ("WhitespaceSplit" == type) {
+        step = pre_tokenizer_split(WHITESPACE_SPLIT_REGEX, SPLIT_REMOVED, false);
+    } else if ("Punctuation" == type) {
+        const enum SplitBehavior behavior = pre_tokenizer_behavior(pre_tokenizer);
+        step = pre_tokenizer_split(PUNCTUATION_REGEX, behavior, false);
+    } else if ("BertPreTokenizer" == type) {
+        // whitespace splits, then punctuation is isolated
+        compiled->steps.push_back(
+            pre_tokenizer_split(WHITESPACE_SPLIT_REGEX, SPLIT_REMOVED, false)
+        );
+        step = pre_tokenizer_split(PUNCTUATION_REGEX, SPLIT_ISOLATED, false);
+    } else {
+        fprintf(stderr, "Unsupported pre_tokenizer: '%s'\n", type.c_str());
+        return;
+    }
+    compiled->steps.push_back(std::move(step));
+}
+
+struct PreTokenizer* malloc_pre_tokenizer(const nlohmann::json &pre_tokenizer) {
+    if (pre_tokenizer.is_null()) {
+        return nullptr;
+    }
+
+    struct PreTokenizer* compiled = new PreTokenizer{};
+    try {
+        pre_tokenizer_compile(pre_tokenizer, compiled);
+    } catch (...) {
+        free_pre_tokenizer(compiled);
+        throw;
+    }
+    return compiled;
+}
+
+void free_pre_tokenizer(struct PreTokenizer* pre_tokenizer) {
+    if (pre_tokenizer) {
+        for (struct PreTokenizerStep &step : pre_tokenizer->steps) {
+            unicode_regex_free(step.regex);
+        }
+        delete pre_tokenizer;
+    }
+}
+
+// whether the word at offset gets the prefix of step. the first word of a chunk that continues
+// a stream is not the start of the text, so it never does.
+static bool pre_tokenize_prefixed(
+    const struct PreTokenizerStep &step,
+    std::string_view               word,
+    size_t                         offset,
+    bool                           start,
+    bool                           first
+) {
+    if (PREPEND_NEVER == step.prepend || (0 == offset && !start)
+        || (PREPEND_FIRST == step.prepend && !(first && 0 == offset))) {
+        return false;
+    }
+    if (0 == word.compare(0, step.prefix.size(), step.prefix)) {
+        return false;
+    }
+    // a leading space turns into the prefix once it is replaced, e.g. " a" -> "▁a"
+    return !(step.replacement == step.prefix && !word.empty() && ' ' == word[0]);
+}
+
+// rewrite each word of spans into out: add the prefix and replace spaces. returns false
+// without touching out or spans when no word changes.
+static bool pre_tokenize_rewrite(
+    const struct PreTokenizerStep    &step,
+    std::string_view                  text,
+    bool                              start,
+    bool                              first,
+    std::string                      &out,
+    std::vector<struct unicode_span> &spans,
+    std::vector<struct unicode_span> &words
+) {
+    bool changed = false;
+    for (const struct unicode_span &span : spans) {
+        const std::string_view word = text.substr(span.offset, span.length);
+        changed = changed || pre_tokenize_prefixed(step, word, span.offset, start, first)
+                  || (!step.replacement.empty() && std::string_view::npos != word.find(' '));
+    }
+    if (!changed) {
+        return false;
+    }
+
+    out.clear();
+    words.clear();
+    for (const struct unicode_span &span : spans) {
+        const std::string_view word  = text.substr(span.offset, span.length);
+        const size_t           begin = out.size();
+        if (pre_tokenize_prefixed(step, word, span.offset, start, first)) {
+            out += step.prefix;
+        }
+        if (step.replacement.empty()) {
+            out.append(word);
+        } else {
+            for (const char c : word) {
+                if (' ' == c) {
+                    out += step.replacement;
+                } else {
+                    out += c;
+                }
+            }
+        }
+        words.push_back({begin, out.size() - begin});
+    }
+    spans.swap(words);
+    return true;
+}
+
+// find the pieces of the word at offset that the delimiter of step matches, and those between
+static void pre_tokenize_pieces(
+    const struct PreTokenizerStep &step,
+    std::string_view               word,
+    size_t                         offset,
+    struct PreTokenizerScratch    &scratch
+) {
+    std::vector<struct SplitPiece> &pieces = scratch.pieces;
+    pieces.clear();
+
+    size_t gap = 0; // end of the last match
+    auto   add = [&](size_t begin, size_t end) {
+        if (begin > gap) {
+            pieces.push_back({offset + gap, begin - gap, false});
+        }
+        pieces.push_back({offset + begin, end - begin, true});
+        gap = end;
+    };
+
+    if (step.regex) {
+        std::vector<uint32_t> &cpts = scratch.cpts;
+        unicode_cpts_from_utf8(word, cpts);
+
+        size_t bytes = 0; // byte offset of cpts[pos] in the word
+        for (size_t pos = 0; pos < cpts.size();) {
+            const size_t n_match = step.regex->match(cpts.data() + pos, cpts.size() - pos);
+            const size_t begin   = bytes;
+            for (size_t end = pos + std::max<size_t>(n_match, 1); pos < end; ++pos) {
+                bytes += unicode_len_utf8(word[bytes]);
+            }
+            if (n_match) {
+                add(begin, bytes);
+            }
+        }
+    } else {
+        for (size_t pos = word.find(step.pattern); std::string_view::npos != pos;
+             pos        = word.find(step.pattern, pos + step.pattern.size())) {
+            add(pos, pos + step.pattern.size());
+        }
+    }
+
+    if (word.size() > gap) {
+        pieces.push_back({offset + gap, word.size() - gap, false});
+    }
+}
+
+// split each word of spans on the delimiter of step
+static void pre_tokenize_split(
+    const struct PreTokenizerStep    &step,
+    std::string_view                  text,
+    std::vector<struct unicode_span> &spans,
+    struct PreTokenizerScratch       &scratch
+) {
+    std::vector<struct unicode_span> &words = scratch.spans;
+    words.clear();
+
+    for (const struct unicode_span &span : spans) {
+        pre_tokenize_pieces(step, text.substr(span.offset, span.length), span.offset, scratch);
+
+        const std::vector<struct SplitPiece> &pieces = scratch.pieces;
+        const size_t                          first  = words.size();
+        size_t                                merge  = SIZE_MAX; // start of a delimiter
+        for (size_t i = 0; i < pieces.size(); ++i) {
+            const struct SplitPiece &piece = pieces[i];
+
+            const bool delim      = piece.match != step.invert;
+            const bool prev_delim = i > 0 && pieces[i - 1].match != step.invert;
+            const bool next_delim = i + 1 < pieces.size() && pieces[i + 1].match != step.invert;
+
+            switch (step.behavior) {
+                case SPLIT_REMOVED:
+                    if (!delim) {
+                        words.push_back({piece.offset, piece.length});
+                    }
+                    break;
+                case SPLIT_ISOLATED:
+                    words.push_back({piece.offset, piece.length});
+                    break;
+                case SPLIT_MERGED_WITH_PREVIOUS:
+                    // a delimiter joins the word before it, unless that is a delimiter too
+                    if (delim && i > 0 && !prev_delim && words.size() > first) {
+                        words.back().length += piece.length;
+                    } else {
+                        words.push_back({piece.offset, piece.length});
+                    }
+                    break;
+                case SPLIT_MERGED_WITH_NEXT:
+                    // a delimiter joins the word after it, unless that is a delimiter too
+                    if (delim && i + 1 < pieces.size() && !next_delim) {
+                        merge = piece.offset;
+                    } else if (SIZE_MAX != merge) {
+                        words.push_back({merge, piece.offset + piece.length - merge});
+                        merge = SIZE_MAX;
+                    } else {
+                        words.push_back({piece.offset, piece.length});
+                    }
+                    break;
+                case SPLIT_CONTIGUOUS:
+                    if (delim && prev_delim && words.size() > first) {
+                        words.back().length += piece.length;
+                    } else {
+                        words.push_back({piece.offset, piece.length});
+                    }
+                    break;
+            }
+        }
+    }
+
+    spans.swap(words);
+}
+
+std::string_view PreTokenizer::pre_tokenize(
+    std::string_view                  text,
+    bool                              start,
+    bool                              first,
+    struct PreTokenizerScratch       &scratch,
+    std::vector<struct unicode_span> &spans
+) const {
+    spans.clear();
+    if (text.empty()) {
+        return text;
+    }
+    spans.push_back({0, text.size()});
+
+    // a step that rewrites the words reads the current text and writes into the other buffer
+    size_t next = 0;
+    for (const struct PreTokenizerStep &step : steps) {
+        if (PRE_TOKENIZER_SPLIT != step.type
+            && pre_tokenize_rewrite(
+                step, text, start, first, scratch.text[next], spans, scratch.spans
+            )) {
+            text  = scratch.text[next];
+            next ^= 1;
+        }
+        if (step.regex || !step.pattern.empty()) {
+            pre_tokenize_split(step, text, spans, scratch);
+        }
+    }
+    return text;
+}
+
+//
+// encoding
+//
+
+// A symbol is a node in a doubly linked list over the pieces of a word.
+// Merged symbols are tombstoned in place (len == 0) so queued positions stay valid.
+struct Symbol {
+    uint32_t id;   // Token id of the piece
+    int32_t  prev; // Index of the previous live symbol, -1 if none
+    int32_t  next; // Index of the next live symbol, -1 if none
+    uint32_t len;  // Number of bytes covered by the piece, 0 once merged away
+};
+
+// A candidate merge of the symbol at pos with its right neighbour.
+struct Candidate {
+    uint32_t rank; // Priority of the merge rule
+    uint32_t id;   // Id of the merged token
+    int32_t  pos;  // Index of the left symbol
+};
+
+// A node of the Viterbi lattice: the best segmentation of a word up to a byte offset.
+struct LatticeNode {
+    double   score; // Sum of the scores of the tokens, -inf while the offset is unreached
+    uint32_t id;    // Last token of the segmentation, TOKENIZER_NO_ID for an unknown character
+    uint32_t start; // Offset the last token starts at
+    uint32_t next;  // Offset the token after it ends at, once the best path is known
+};
+
+// Buffers reused across the words of an encode so that, once warm, no word allocates.
+struct EncodeScratch {
+    std::vector<struct unicode_span> spans;         // Words of the pre-tokenized text
+    std::vector<struct Symbol>       symbols;       // Linked list over the current word
+    std::vector<struct Candidate>    queue;         // Heap of candidate merges of the word
+    std::string                      word;          // Byte-level encoding of the current word
+    std::string                      normalized[2]; // Output of the normalizer steps
+    struct PreTokenizerScratch       pre_tokenized; // Buffers of the pre_tokenizer steps
+    std::vector<struct LatticeNode>  lattice;       // Viterbi lattice of a unigram word
+
+    std::vector<struct AddedTokenMatch> candidates; // Overlapping matches of added tokens
+    std::vector<struct AddedTokenMatch> added[2];   // Raw and normalized added tokens of the text
+    std::vector<struct unicode_span>    window;     // Words of the text a stream is cut in
+};
+
+// the id of the token a byte falls back to when it is not covered otherwise, e.g. <0xE2>
+static uint32_t byte_fallback_id(const struct TokenizerModel* model, uint8_t byte) {
+    char token[7];
+    snprintf(token, sizeof(token), "<0x%02X>", byte);
+    auto id = model->find(token);
+    if (!id) {
+        throw std::runtime_error("Missing byte fallback token: " + std::string(token));
+    }
+    return *id;
+}
+
+// split word into its initial symbols: utf-8 characters, or single bytes when byte_level
+static void bpe_symbols(
+    const struct Tokenizer*     tokenizer,
+    std::string_view            word,
+    bool                        byte_level,
+    std::vector<struct Symbol> &symbols
+) {
+    const struct TokenizerModel* model = tokenizer->model;
+
+    auto push = [&](uint32_t id, uint32_t len) {
+        const int32_t index = (int32_t) symbols.size();
+        symbols.push_back({id, index - 1, index + 1, len});
+    };
+
+    for (size_t offset = 0; offset < word.size();) {
+        std::optional<uint32_t> id;
+        size_t                  len = 1;
+        if (byte_level) {
+            const uint32_t byte_id = model->byte_ids[(uint8_t) word[offset]];
+            if (TOKENIZER_NO_ID != byte_id) {
+                id = byte_id;
+            }
+        } else {
+            len = std::min(unicode_len_utf8(word[offset]), word.size() - offset);
+            id  = model->find(word.substr(offset, len));
+        }
+
+        if (id) {
+            push(*id, (uint32_t) len);
+        } else if (model->byte_fallback) {
+            // e.g. <0xE2><0x96><0x81>
+            for (size_t i = 0; i < len; ++i) {
+                push(byte_fallback_id(model, (uint8_t) word[offset + i]), 1);
+            }
+        } else if (tokenizer->unk_token) {
+            const uint32_t unk = (uint32_t) tokenizer->unk_token->id;
+            if (model->fuse_unk && !symbols.empty() && symbols.back().id == unk) {
+                symbols.back().len += (uint32_t) len;
+            } else {
+                push(unk, (uint32_t) len);
+            }
+        } else {
+            throw std::runtime_error("Unable to encode character: no unk_token available.");
+        }
+
+        offset += len;
+    }
+
+    if (!symbols.empty()) {
+        symbols.back().next = -1;
+    }
+}
+
+// apply merges in order of rank using a priority queue over the linked list of symbols.
+// each merge pushes at most two new candidates, so a word of n pieces costs O(n log n).
+static void bpe_merge(
+    const struct TokenizerModel*   model,
+    std::vector<struct Symbol>    &symbols,
+    std::vector<struct Candidate> &queue
+) {
+    // a heap kept in the caller's storage, ordered by lowest rank then lowest position
+    auto compare = [](const Candidate &a, const Candidate &b) {
+        return a.rank != b.rank ? a.rank > b.rank : a.pos > b.pos;
+    };
+    queue.clear();
+
+    auto push = [&](int32_t pos) {
+        const int32_t next = symbols[pos].next;
+        if (next < 0) {
+            return;
+        }
+        const struct MergeRank* merge = model->merge(symbols[pos].id, symbols[next].id);
+        if (merge) {
+            queue.push_back({merge->rank, merge->id, pos});
+            std::push_heap(queue.begin(), queue.end(), compare);
+        }
+    };
+
+    for (int32_t pos = 0; pos + 1 < (int32_t) symbols.size(); ++pos) {
+        push(pos);
+    }
+
+    while (!queue.empty()) {
+        std::pop_heap(queue.begin(), queue.end(), compare);
+        const Candidate top = queue.back();
+        queue.pop_back();
+
+        struct Symbol &left = symbols[top.pos];
+        if (0 == left.len || left.next < 0) {
+            continue; // stale: the left symbol was merged away or is now last
+        }
+
+        // stale: the right neighbour changed since the candidate was queued
+        struct Symbol          &right = symbols[left.next];
+        const struct MergeRank* merge = model->merge(left.id, right.id);
+        if (!merge || merge->id != top.id) {
+            continue;
+        }
+
+        left.id   = top.id;
+        left.len += right.len;
+        left.next = right.next;
+        right.len = 0;
+        if (left.next >= 0) {
+            symbols[left.next].prev = top.pos;
+        }
+
+        if (left.prev >= 0) {
+            push(left.prev);
+        }
+        push(top.pos);
+    }
+}
+
+// segment word into the tokens whose scores have the highest sum, i.e. the most likely
+// segmentation under the unigram language model. the lattice is relaxed left to right along
+// the trie, so a word of n bytes costs O(n * the length of the longest token).
+static void unigram_encode(
+    const struct Tokenizer*          tokenizer,
+    std::string_view                 word,
+    std::vector<uint32_t>           &ids,
+    std::vector<struct LatticeNode> &lattice
+) {
+    const struct TokenizerModel* model = tokenizer->model;
+
+    const size_t n = word.size();
+    lattice.assign(n + 1, {-INFINITY, TOKENIZER_NO_ID, 0, 0});
+    lattice[0].score = 0.0;
+
+    auto relax = [&](size_t end, double score, uint32_t id, size_t start) {
+        if (score > lattice[end].score) {
+            lattice[end] = {score, id, (uint32_t) start, 0};
+        }
+    };
+
+    // every character boundary is reached, if only through an unknown character
+    for (size_t start = 0; start < n;) {
+        const size_t len  = std::min(unicode_len_utf8(word[start]), n - start);
+        const double base = lattice[start].score;
+
+        bool     single = false; // whether a token covers exactly the character at start
+        uint32_t node   = 0;
+        for (size_t end = start; end < n;) {
+            node = model->trie_next(node, (uint8_t) word[end++]);
+            if (0 == node) {
+                break;
+            }
+            const uint32_t id = model->trie[node].id;
+            if (TOKENIZER_NO_ID != id) {
+                relax(end, base + model->scores[id], id, start);
+                single = single || end - start == len;
+            }
+        }
+        if (!single) {
+            relax(start + len, base + model->unk_score, TOKENIZER_NO_ID, start);
+        }
+
+        start += len;
+    }
+
+    // link the best path forward, then emit it
+    for (size_t end = n; end > 0; end = lattice[end].start) {
+        lattice[lattice[end].start].next = (uint32_t) end;
+    }
+
+    const size_t first = ids.size();
+    for (size_t start = 0; start < n; start = lattice[start].next) {
+        const size_t   end = lattice[start].next;
+        const uint32_t id  = lattice[end].id;
+        if (TOKENIZER_NO_ID != id) {
+            ids.push_back(id);
+        } else if (model->byte_fallback) {
+            for (size_t i = start; i < end; ++i) {
+                ids.push_back(byte_fallback_id(model, (uint8_t) word[i]));
+            }
+        } else if (tokenizer->unk_token) {
+            const uint32_t unk = (uint32_t) tokenizer->unk_token->id;
+            if (!model->fuse_unk || ids.size() == first || ids.back() != unk) {
+                ids.push_back(unk);
+            }
+        } else {
+            throw std::runtime_error("Unable to encode character: no unk_token available.");
+        }
+    }
+}
+
+// pre-tokenize normalized text and append the ids of its words
+static void encode_words(
+    const struct Tokenizer* tokenizer,
+    std::string_view        text,
+    bool                    start,
+    bool                    first,
+    std::vector<uint32_t>  &ids,
+    struct EncodeScratch   &scratch
+) {
+    const struct TokenizerModel* model = tokenizer->model;
+    struct BPECache*             cache = tokenizer->cache;
+
+    bool byte_level = false;
+    if (tokenizer->pre_tokenizer) {
+        PROFILE_SCOPE("pre-tokenize");
+        const struct PreTokenizer* pre_tokenizer = tokenizer->pre_tokenizer;
+        text       = pre_tokenizer->pre_tokenize(
+            text, start, first, scratch.pre_tokenized, scratch.spans
+        );
+        byte_level = pre_tokenizer->byte_level;
+    } else {
+        scratch.spans.assign(1, {0, text.size()});
+    }
+
+    for (const struct unicode_span &span : scratch.spans) {
+        const std::string_view word(text.data() + span.offset, span.length);
+
+        if (model->ignore_merges) {
+            std::string_view token = word;
+            if (byte_level) {
+                scratch.word.resize(2 * word.size());
+                scratch.word.resize(
+                    unicode_byte_encode(word.data(), word.size(), scratch.word.data())
+                );
+                token = scratch.word;
+            }
+
+            auto id = model->find(token);
+            if (id) {
+                ids.push_back(*id);
+                continue;
+            }
+        }
+
+        // the cache is keyed on the raw bytes of the word
+        if (cache && cache->get(word, ids)) {
+            PROFILE_COUNT("bpe cache hits", 1);
+            continue;
+        }
+        PROFILE_COUNT("bpe cache misses", nullptr != cache);
+
+        const size_t first = ids.size();
+        if (model->trie) {
+            PROFILE_SCOPE("unigram encode");
+            unigram_encode(tokenizer, word, ids, scratch.lattice);
+        } else {
+            PROFILE_SCOPE("bpe merge");
+            scratch.symbols.clear();
+            bpe_symbols(tokenizer, word, byte_level, scratch.symbols);
+            bpe_merge(model, scratch.symbols, scratch.queue);
+
+            const std::vector<struct Symbol> &symbols = scratch.symbols;
+            for (int32_t pos = symbols.empty() ? -1 : 0; pos >= 0; pos = symbols[pos].next) {
+                ids.push_back(symbols[pos].id);
+            }
+        }
+
+        if (cache) {
+            cache->put(word, ids.data() + first, ids.size() - first);
+        }
+    }
+}
+
+using EncodeFunction = void (*)(
+    const struct Tokenizer*, std::string_view, bool, bool, std::vector<uint32_t> &, EncodeScratch &
+);
+
+// append the id of every added token of matcher in text and pass the text between them to
+// encode. each piece is a text of its own, e.g. a normalizer prepends to every one of them.
+static void encode_added(
+    const struct Tokenizer*              tokenizer,
+    const struct AddedTokenMatcher*      matcher,
+    std::string_view                     text,
+    bool                                 start,
+    bool                                 first,
+    std::vector<uint32_t>               &ids,
+    std::vector<struct AddedTokenMatch> &matches,
+    struct EncodeScratch                &scratch,
+    EncodeFunction                       encode
+) {
+    if (!matcher) {
+        encode(tokenizer, text, start, first, ids, scratch);
+        return;
+    }
+
+    matcher->find(text, scratch.candidates, matches);
+
+    size_t offset = 0;
+    for (const struct AddedTokenMatch &match : matches) {
+        if (offset < match.offset) {
+            const std::string_view piece = text.substr(offset, match.offset - offset);
+            encode(tokenizer, piece, start || offset > 0, first && 0 == offset, ids, scratch);
+        }
+        ids.push_back(match.id);
+        offset = match.offset + match.length;
+    }
+    if (0 == offset || offset < text.size()) {
+        const std::string_view piece = text.substr(offset);
+        encode(tokenizer, piece, start || offset > 0, first && 0 == offset, ids, scratch);
+    }
+}
+
+// normalize text and split it on the added tokens that are matched after normalization
+static void encode_normalized(
+    const struct Tokenizer* tokenizer,
+    std::string_view        text,
+    bool                    start,
+    bool                    first,
+    std::vector<uint32_t>  &ids,
+    struct EncodeScratch   &scratch
+) {
+    if (tokenizer->normalizer) {
+        PROFILE_SCOPE("normalize");
+        text = tokenizer->normalizer->normalize(text, start, scratch.normalized);
+    }
+    encode_added(
+        tokenizer,
+        tokenizer->added_normalized,
+        text,
+        start,
+        first,
+        ids,
+        scratch.added[1],
+        scratch,
+        encode_words
+    );
+}
+
+// encode text and append the ids. start is false for the chunks of a stream after the first.
+static void encode_text(
+    const struct Tokenizer* tokenizer,
+    std::string_view        text,
+    bool                    start,
+    std::vector<uint32_t>  &ids,
+    struct EncodeScratch   &scratch
+) {
+    encode_added(
+        tokenizer,
+        tokenizer->added_raw,
+        text,
+        start,
+        start,
+        ids,
+        scratch.added[0],
+        scratch,
+        encode_normalized
+    );
+}
+
+std::vector<uint32_t> Tokenizer::encode(std::string_view text) const {
+    PROFILE_SCOPE("encode");
+    std::vector<uint32_t> ids;
+    struct EncodeScratch  scratch;
+    encode_text(this, text, true, ids, scratch);
+    return ids;
+}
+
+//
+// streaming
+//
+
+// whether the character starting at pos is whitespace. pos must be a character boundary.
+static bool stream_is_space(std::string_view text, size_t pos) {
+    const unsigned char c = (unsigned char) text[pos];
+    if (c < 0x80) {
+        return ' ' == c || ('\t' <= c && c <= '\r');
+    }
+    if (pos + unicode_len_utf8((char) c) > text.size()) {
+        return true; // cut off, so never treat it as a safe neighbour
+    }
+    return unicode_cpt_flags(unicode_cpt_from_utf8(text, pos)).is_whitespace;
+}
+
+// the start of the character that ends right before pos
+static size_t stream_prev_char(std::string_view text, size_t pos) {
+    size_t prev = pos - 1;
+    while (prev > 0 && pos - prev < 4 && 0x80 == ((unsigned char) text[prev] & 0xC0)) {
+        prev--;
+    }
+    return prev;
+}
+
+// the end of the last whole character of text, which is text.size() unless one is cut off
+static size_t stream_complete(std::string_view text) {
+    if (text.empty()) {
+        return 0;
+    }
+    const size_t last = stream_prev_char(text, text.size());
+    return last + unicode_len_utf8(text[last]) > text.size() ? last : text.size();
+}
+
+// whether pos falls within an added token, or right after one that may strip what follows
+static bool stream_in_added(const struct EncodeScratch &scratch, size_t pos) {
+    for (const std::vector<struct AddedTokenMatch> &matches : scratch.added) {
+        for (const struct AddedTokenMatch &match : matches) {
+            if (match.offset < pos && pos <= match.offset + match.length) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool stream_same_span(const struct unicode_span &a, const struct unicode_span &b) {
+    return a.offset == b.offset && a.length == b.length;
+}
+
+// the last words of a window that are tried as the start of the next chunk
+static const size_t STREAM_CUT_TRIES = 4;
+
+/**
+ * Find the last position in text where it can be cut without changing the ids, or 0 when there
+ * is none and more text is needed. The text after the cut is only looked at, never encoded.
+ *
+ * Without a normalizer the pre_tokenizer is run over the text after the last added token and
+ * the cut is where one of its last words starts, the last word itself may go on past the text.
+ * The words before the cut are only taken if the chunk on its own is split into the same words,
+ * and as a word always starts a new match of the patterns the words after it are the same, too.
+ * Otherwise the words are only known after normalization, and the cut falls before a single
+ * space, or after a single newline, between two non-whitespace characters, e.g. "word| word".
+ *
+ * Either way a cut never splits a utf-8 character, an added token, or the bytes at the end of
+ * text that may begin one.
+ */
+static size_t stream_cut(
+    const struct Tokenizer* tokenizer,
+    std::string_view        text,
+    bool                    start,
+    struct EncodeScratch   &scratch
+) {
+    const struct AddedTokenMatcher* matchers[2] = {
+        tokenizer->added_raw,
+        tokenizer->added_normalized,
+    };
+    size_t limit = stream_complete(text);
+    for (const struct AddedTokenMatcher* matcher : matchers) {
+        if (matcher) {
+            limit = std::min(limit, text.size() - matcher->pending(text));
+        }
+    }
+    for (size_t i = 0; i < 2; ++i) {
+        scratch.added[i].clear();
+        if (matchers[i]) {
+            matchers[i]->find(text.substr(0, limit), scratch.candidates, scratch.added[i]);
+        }
+    }
+
+    if (tokenizer->pre_tokenizer && !tokenizer->normalizer) {
+        size_t added = 0;
+        for (const std::vector<struct AddedTokenMatch> &matches : scratch.added) {
+            for (const struct AddedTokenMatch &match : matches) {
+                added = std::max(added, match.offset + match.length);
+            }
+        }
+
+        const struct PreTokenizer* pre_tokenizer = tokenizer->pre_tokenizer;
+        const std::string_view     piece         = text.substr(added, limit - added);
+        const std::string_view     words         = pre_tokenizer->pre_tokenize(
+            piece, start || added > 0, start && 0 == added, scratch.pre_tokenized, scratch.window
+        );
+        if (words.data() == piece.data()) {
+            // a pattern may look past the end of a word, e.g. "\s+(?!\S)" keeps the last space
+            // of "\n\nb" for the "b" and "'ll" is a word of its own but "'l" is not, so a whole
+            // word must follow the cut and the words of the chunk on its own must be the same
+            const std::vector<struct unicode_span> &window = scratch.window;
+            if (window.size() < 3) {
+                return 0; // the last word may go on past the text
+            }
+            const size_t last = window.size() > STREAM_CUT_TRIES + 1
+                                  ? window.size() - STREAM_CUT_TRIES - 1
+                                  : 1;
+            for (size_t n = window.size() - 2; n >= last; --n) {
+                pre_tokenizer->pre_tokenize(
+                    piece.substr(0, window[n].offset),
+                    start || added > 0,
+                    start && 0 == added,
+                    scratch.pre_tokenized,
+                    scratch.spans
+                );
+                const std::vector<struct unicode_span> &spans = scratch.spans;
+                if (spans.size() == n
+                    && std::equal(spans.begin(), spans.end(), window.begin(), stream_same_span)) {
+                    return added + window[n].offset;
+                }
+            }
+            return 0;
+        }
+        // a step rewrote the text, so the words no longer have offsets into it
+    }
+
+    for (size_t pos = std::min(limit, text.size() - 1); pos >= 2; --pos) {
+        // e.g. "word| word" or "word\n|word"
+        size_t space = pos;
+        if ('\n' == text[pos - 1]) {
+            space = pos - 1;
+        } else if (' ' != text[pos] || pos + 1 == text.size()) {
+            continue;
+        }
+
+        if (!stream_is_space(text, stream_prev_char(text, space))
+            && !stream_is_space(text, space + 1) && !stream_in_added(scratch, pos)) {
+            return pos;
+        }
+    }
+    return 0;
+}
+
+/**
+ * The end of the next chunk of text, cut within the chunk_size bytes past its start unless there
+ * is no cut there. A window with no cut is doubled until one is found, and only when it grew
+ * by TOKENIZER_STREAM_MAX_WORD without one is the word cut before its last character. read(n)
+ * makes sure text holds n bytes, or all of the rest of the input when it has fewer.
+ */
+template <typename ReadFunction>
+static size_t stream_chunk(
+    const struct Tokenizer* tokenizer,
+    ReadFunction            read,
+    size_t                  chunk_size,
+    bool                    start,
+    struct EncodeScratch   &scratch
+) {
+    const size_t max_window = chunk_size + TOKENIZER_STREAM_MAX_WORD;
+    for (size_t window = chunk_size;; window = std::min(2 * window, max_window)) {
+        // look one byte past the window so a cut right at its end is still found
+        const std::string_view text = read(window + 1);
+        if (text.size() <= window) {
+            return text.size();
+        }
+
+        const size_t cut = stream_cut(tokenizer, text, start, scratch);
+        if (cut > 0) {
+            return cut;
+        }
+        if (window == max_window) {
+            return stream_prev_char(text, stream_complete(text.substr(0, window)));
+        }
+    }
+}
+
+size_t Tokenizer::encode_stream(
+    const char* data, size_t size, const TokenSink &sink, size_t chunk_size
+) const {
+    std::vector<uint32_t> ids;
+    struct EncodeScratch  scratch;
+
+    chunk_size = std::max<size_t>(1, chunk_size);
+
+    size_t n_ids = 0;
+    for (size_t start = 0; start < size;) {
+        auto read = [&](size_t n) {
+            return std::string_view(data + start, std::min(n, size - start));
+        };
+        const size_t end = start + stream_chunk(this, read, chunk_size, 0 == start, scratch);
+
+        ids.clear();
+        encode_text(this, std::string_view(data + start, end - start), 0 == start, ids, scratch);
+        sink(ids.data(), ids.size());
+
+        n_ids += ids.size();
+        start  = end;
+    }
+
+    return n_ids;
+}
+
+size_t Tokenizer::encode_stream(int fd, const TokenSink &sink, size_t chunk_size) const {
+    std::vector<uint32_t> ids;
+    struct EncodeScratch  scratch;
+
+    chunk_size = std::max<size_t>(1, chunk_size);
+
+    // carries the text after the last cut into the next chunk
+    std::string buffer;
+    buffer.reserve(2 * chunk_size);
+
+    bool eof  = false;
+    auto read = [&](size_t n) {
+        while (!eof && buffer.size() < n) {
+            const size_t used = buffer.size();
+            buffer.resize(n);
+            const ssize_t count = ::read(fd, buffer.data() + used, buffer.size() - used);
+            if (count < 0 && EINTR == errno) {
+                buffer.resize(used);
+                continue;
+            }
+            if (count < 0) {
+                throw std::runtime_error("Failed to read stream: " + std::string(strerror(errno)));
+            }
+            buffer.resize(used + (size_t) count);
+            eof = 0 == count;
+        }
+        return std::string_view(buffer.data(), std::min(n, buffer.size()));
+    };
+
+    size_t n_ids = 0;
+    bool   start = true;
+    while (!eof || !buffer.empty()) {
+        const size_t end = stream_chunk(this, read, chunk_size, start, scratch);
+        if (0 == end) {
+            break; // the input is empty
+        }
+
+        ids.clear();
+        encode_text(this, std::string_view(buffer.data(), end), start, ids, scratch);
+        sink(ids.data(), ids.size());
+
+        n_ids += ids.size();
+        start  = false;
+        buffer.erase(0, end);
+    }
+
+    return n_ids;
+}
+
+//
+// added tokens
+//
+
+struct AddedTokenMatcher* malloc_added_token_matcher(
+    const std::vector<struct AddedToken*> &added_tokens,
+    bool                                   normalized,
+    const struct Normalizer*               normalizer
+) {
+    // the bytes each token is matched as. the prefix a normalizer prepends belongs to the text
+    // rather than to the token, so contents are normalized as if they were within the text.
+    std::vector<std::string>              patterns;
+    std::vector<const struct AddedToken*> tokens;
+    std::string                           buffers[2];
+    for (const struct AddedToken* added : added_tokens) {
+        if (added->normalized != normalized) {
+            continue;
+        }
+        std::string_view content = added->token->content;
+        if (normalized && normalizer) {
+            content = normalizer->normalize(content, false, buffers);
+        }
+        if (!content.empty()) {
+            patterns.emplace_back(content);
+            tokens.push_back(added);
+        }
+    }
+    if (patterns.empty()) {
+        return nullptr;
+    }
+
+    struct AddedTokenMatcher* matcher = new AddedTokenMatcher{};
+
+    if (!matcher) {
+        throw std::bad_alloc();
+    }
+
+    // bytes that occur in no pattern share class 0, which always leads back to the root
+    matcher->n_classes = 1;
+    for (const std::string &pattern : patterns) {
+        for (const unsigned char c : pattern) {
+            if (0 == matcher->classes[c]) {
+                matcher->classes[c] = (uint16_t) matcher->n_classes++;
+            }
+        }
+    }
+    const size_t n_classes = matcher->n_classes;
+
+    // build the trie. no edge leads back to the root, so an edge to state 0 is a missing one.
+    std::vector<uint32_t> &transitions = matcher->transitions;
+    std::vector<uint32_t> &outputs     = matcher->outputs;
+    std::vector<uint32_t> &depths      = matcher->depths;
+    transitions.assign(n_classes, 0);
+    outputs.assign(1, TOKENIZER_NO_ID);
+    depths.assign(1, 0);
+    for (size_t index = 0; index < patterns.size(); ++index) {
+        uint32_t state = 0;
+        for (const unsigned char c : patterns[index]) {
+            const size_t edge = state * n_classes + matcher->classes[c];
+            if (0 == transitions[edge]) {
+                transitions[edge] = (uint32_t) outputs.size();
+                transitions.resize(transitions.size() + n_classes, 0);
+                outputs.push_back(TOKENIZER_NO_ID);
+                depths.push_back(depths[state] + 1);
+            }
+            state = transitions[edge];
+        }
+        // of tokens with the same content, the first one wins
+        if (TOKENIZER_NO_ID == outputs[state]) {
+            outputs[state] = (uint32_t) index;
+        }
+    }
+    matcher->n_states = (uint32_t) outputs.size();
+
+    // resolve the failure links breadth first, so the transitions of the state a link points to
+    // are complete by the time a longer state copies its missing edges from them
+    std::vector<uint32_t> &links = matcher->links;
+    std::vector<uint32_t>  failure(matcher->n_states, 0);
+    std::vector<uint32_t>  queue;
+    queue.reserve(matcher->n_states);
+    links.assign(matcher->n_states, 0);
+    for (size_t c = 0; c < n_classes; ++c) {
+        if (0 != transitions[c]) {
+            queue.push_back(transitions[c]);
+        }
+    }
+    for (size_t head = 0; head < queue.size(); ++head) {
+        const uint32_t state = queue[head];
+        const uint32_t link  = failure[state];
+        for (size_t c = 0; c < n_classes; ++c) {
+            uint32_t &next = transitions[state * n_classes + c];
+            if (0 == next) {
+                next = transitions[link * n_classes + c];
+                continue;
+            }
+            const uint32_t suffix = transitions[link * n_classes + c];
+            failure[next]         = suffix;
+            links[next]           = TOKENIZER_NO_ID != outputs[suffix] ? suffix : links[suffix];
+            queue.push_back(next);
+        }
+    }
+
+    matcher->tokens = std::move(tokens);
+    for (const std::string &pattern : patterns) {
+        matcher->lengths.push_back((uint32_t) pattern.size());
+    }
+
+    return matcher;
+}
+
+void free_added_token_matcher(struct AddedTokenMatcher* matcher) {
+    delete matcher;
+}
+
+// the flags of the character starting at pos. pos must be a character boundary.
+static codepoint_flags added_token_flags(std::string_view text, size_t pos) {
+    return unicode_cpt_flags(unicode_cpt_from_utf8(text, pos));
+}
+
+// whether the character starting at pos belongs to a word, and so does not bound one
+static bool added_token_is_word(std::string_view text, size_t pos) {
+    const codepoint_flags flags = added_token_flags(text, pos);
+    return flags.is_letter || flags.is_number;
+}
+
+void AddedTokenMatcher::find(
+    std::string_view                     text,
+    std::vector<struct AddedTokenMatch> &candidates,
+    std::vector<struct AddedTokenMatch> &matches
+) const {
+    candidates.clear();
+    matches.clear();
+
+    // every pattern that ends at each byte, the id holds the pattern until a match is final
+    uint32_t state = 0;
+    for (size_t pos = 0; pos < text.size(); ++pos) {
+        state = transitions[state * n_classes + classes[(unsigned char) text[pos]]];
+        for (uint32_t end = TOKENIZER_NO_ID != outputs[state] ? state : links[state]; 0 != end;
+             end = links[end]) {
+            const uint32_t pattern = outputs[end];
+            candidates.push_back({pos + 1 - lengths[pattern], lengths[pattern], pattern});
+        }
+    }
+    if (candidates.empty()) {
+        return;
+    }
+
+    std::sort(
+        candidates.begin(),
+        candidates.end(),
+        [](const struct AddedTokenMatch &a, const struct AddedTokenMatch &b) {
+            return a.offset != b.offset ? a.offset < b.offset : a.length > b.length;
+        }
+    );
+
+    size_t scan = 0; // end of the last leftmost-longest match
+    size_t end  = 0; // end of the last match that was kept, with the whitespace it strips
+    for (const struct AddedTokenMatch &candidate : candidates) {
+        if (candidate.offset < scan) {
+            continue; // overlaps a match to its left or a longer one at the same offset
+        }
+        scan = candidate.offset + candidate.length;
+
+        // e.g. a single_word token is dropped within "a<tok>b" but not within "a <tok>."
+        const struct AddedToken* added = tokens[candidate.id];
+        size_t                   begin = candidate.offset;
+        size_t                   stop  = scan;
+        if (added->single_word
+            && ((begin > 0 && added_token_is_word(text, stream_prev_char(text, begin)))
+                || (stop < text.size() && added_token_is_word(text, stop)))) {
+            continue;
+        }
+
+        // whitespace that the previous match stripped already is not stripped again
+        while (added->left_strip && begin > end) {
+            const size_t prev = stream_prev_char(text, begin);
+            if (!added_token_flags(text, prev).is_whitespace) {
+                break;
+            }
+            begin = prev;
+        }
+        while (added->right_strip && stop < text.size()
+               && added_token_flags(text, stop).is_whitespace) {
+            stop = std::min(text.size(), stop + unicode_len_utf8(text[stop]));
+        }
+        if (begin < end) {
+            continue; // the previous match stripped the start of this one
+        }
+
+        matches.push_back({begin, stop - begin, (uint32_t) added->token->id});
+        end = stop;
+    }
+}
+
+size_t AddedTokenMatcher::pending(std::string_view text) const {
+    uint32_t state = 0;
+    for (const unsigned char c : text) {
+        state = transitions[state * n_classes + classes[c]];
+    }
+    return depths[state];
+}
+
+//
+// decoding
+//
+
+void Tokenizer::decode(
+    const uint32_t* ids, size_t n_ids, std::string &out, struct DecodeState* state
+) const {
+    PROFILE_SCOPE("decode");
+    struct DecodeState  local = {};
+    struct DecodeState* s     = state ? state : &local;
+
+    const size_t start = out.size();
+    out.append(s->pending, s->n_pending);
+    s->n_pending = 0;
+
+    for (size_t i = 0; i < n_ids; ++i) {
+        if (ids[i] >= model->size) {
+            throw std::out_of_range("Token id out of range: " + std::to_string(ids[i]));
+        }
+
+        const struct TokenSpan &span  = model->decode_tokens[ids[i]];
+        const char*             bytes = model->decode_pool + span.offset;
+        size_t                  size  = span.size;
+
+        // e.g. Mistral removes the space that was prepended to the first word
+        if (!s->started) {
+            while (size > 0 && s->n_stripped < model->decode_strip && ' ' == *bytes) {
+                bytes++;
+                size--;
+                s->n_stripped++;
+            }
+            if (0 == size) {
+                continue; // nothing emitted yet, the next id is still the start of the sequence
+            }
+            s->started = true;
+        }
+
+        out.append(bytes, size);
+    }
+
+    if (!state) {
+        return; // not streaming, so there is nothing to complete later
+    }
+
+    // hold back a trailing utf-8 character that is still missing continuation bytes
+    const size_t end = out.size();
+    for (size_t back = 1; back <= 3 && back <= end - start; ++back) {
+        const unsigned char c = (unsigned char) out[end - back];
+        if (0x80 == (c & 0xC0)) {
+            continue; // continuation byte, keep looking for the lead byte
+        }
+        if (c >= 0xC0 && unicode_len_utf8((char) c) > back) {
+            memcpy(s->pending, out.data() + end - back, back);
+            s->n_pending = (uint32_t) back;
+            out.resize(end - back);
+        }
+        break;
+    }
+}
+
+struct TokenBatch
+Tokenizer::encode_batch(const std::vector<std::string_view> &texts, size_t n_threads) {
+    std::lock_guard<std::mutex> guard(pool_lock);
+
+    if (0 == n_threads) {
+        n_threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    }
+
+    if (!pool || pool->n_threads != n_threads) {
+        free_thread_pool(pool);
+        pool = malloc_thread_pool(n_threads);
+    }
+
+    // documents are heavily skewed in size, so each one is its own task and stolen individually.
+    // the number of ids of a document is only known once it is encoded, so rather than encode
+    // everything twice to lay out the batch first, each worker appends the ids of its documents
+    // to a buffer of its own, and a second pass that is only a copy moves them into place.
+    std::vector<struct EncodeScratch>      scratch(n_threads);
+    std::vector<std::vector<uint32_t>>     buffers(n_threads);
+    std::vector<std::pair<size_t, size_t>> sources(texts.size()); // Worker and offset of each
+
+    struct TokenBatch batch;
+    batch.offsets.assign(texts.size() + 1, 0);
+    pool->parallel_for(texts.size(), [&](size_t task, size_t worker) {
+        PROFILE_SCOPE("encode");
+        std::vector<uint32_t> &ids = buffers[worker];
+        sources[task]              = {worker, ids.size()};
+        encode_text(this, texts[task], true, ids, scratch[worker]);
+        batch.offsets[task + 1] = ids.size() - sources[task].second;
+    });
+
+    for (size_t i = 0; i < texts.size(); ++i) {
+        batch.offsets[i + 1] += batch.offsets[i];
+    }
+
+    batch.ids.resize(batch.offsets.back());
+    pool->parallel_for(texts.size(), [&](size_t task, size_t) {
+        const auto &[worker, offset] = sources[task];
+        const uint32_t* ids          = buffers[worker].data() + offset;
+        const size_t    n_ids        = batch.offsets[task + 1] - batch.offsets[task];
+        std::copy(ids, ids + n_ids, batch.ids.begin() + batch.offsets[task]);
+    });
+
+    return batch;
 }
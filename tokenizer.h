@@ -1,20 +1,32 @@
 #ifndef TOKENIZER_H
 #define TOKENIZER_H
 
+#include "arena.h"
+#include "sentencepiece.h"
+#include "thread-pool.h"
+#include "unicode.h"
+
+#include <algorithm>
+#include <cstdint>
 #include <cstdlib>
+#include <functional>
+#include <list>
+#include <mutex>
 #include <nlohmann/json.hpp>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 struct Token {
-    size_t      id;      // Unique identifier of the token
-    std::string content; // Content of the token
+    size_t           id;      // Unique identifier of the token
+    std::string_view content; // Content of the token, owned by the arena of the tokenizer
 };
 
-// allocate memory to a token
-struct Token* malloc_token(size_t id, std::string content);
-
-// deallocate memory from a token
-void free_token(struct Token* token);
+// allocate a token and a copy of its content in arena
+struct Token* malloc_token(struct Arena* arena, size_t id, std::string_view content);
 
 struct AddedToken {
     struct Token* token = nullptr;
@@ -26,38 +38,288 @@ struct AddedToken {
     bool special;     // Special flag
 };
 
-// allocate memory to a vector of added tokens
-std::vector<struct AddedToken*> malloc_added_tokens(nlohmann::json added_tokens);
+// allocate the added tokens and their contents in arena, they are released along with it
+std::vector<struct AddedToken*>
+malloc_added_tokens(struct Arena* arena, const nlohmann::json &added_tokens);
+
+enum NormalizerType {
+    NORMALIZER_NFD,
+    NORMALIZER_NFKD,
+    NORMALIZER_NFC,
+    NORMALIZER_NFKC,
+    NORMALIZER_LOWERCASE,
+    NORMALIZER_PREPEND,
+    NORMALIZER_REPLACE,
+};
 
-// free memory from a vector of a added tokens
-void free_added_tokens(std::vector<struct AddedToken*> added_tokens);
+// A single normalizer of tokenizer.json with its settings parsed ahead of time.
+struct NormalizerStep {
+    enum NormalizerType   type;
+    std::string           pattern;         // Replace: the string to replace, Prepend: the prefix
+    std::string           content;         // Replace: the replacement
+    struct unicode_regex* regex = nullptr; // Replace: the compiled pattern, if it is a Regex
+};
 
-// TODO/WIP
+// A normalizer compiled from tokenizer.json, e.g. a Sequence is flattened into its steps.
 struct Normalizer {
-    // there are 10 possible types of normalizers
-    std::string type; // type is always available if normalizer is not null
+    std::vector<struct NormalizerStep> steps; // Applied in order
 
-    // TODO: Handle sequences if type is Sequence
-    std::vector<nlohmann::json> rules;
+    // normalize text, start is false for the chunks of a stream after the first one. a step
+    // that would leave its input as is, e.g. NFC of text that passes the quick check, copies
+    // nothing, so text itself is returned when no step changes it. otherwise the result is a
+    // view into buffers, which are reused across calls.
+    std::string_view normalize(std::string_view text, bool start, std::string (&buffers)[2]) const;
+};
+
+// compile the normalizer of tokenizer.json, null when there is none
+struct Normalizer* malloc_normalizer(const nlohmann::json &normalizer);
+
+void free_normalizer(struct Normalizer* normalizer);
+
+enum PreTokenizerType {
+    PRE_TOKENIZER_BYTE_LEVEL, // Prefix a space, split on the GPT-2 regex and map onto bytes
+    PRE_TOKENIZER_METASPACE,  // Replace spaces, prefix the replacement and split before it
+    PRE_TOKENIZER_SPLIT,      // Split on a pattern, e.g. Digits and Whitespace compile to this
+};
+
+// What becomes of the text a split pattern matches.
+enum SplitBehavior {
+    SPLIT_REMOVED,              // Dropped
+    SPLIT_ISOLATED,             // A word of its own
+    SPLIT_MERGED_WITH_PREVIOUS, // Appended to the word before it
+    SPLIT_MERGED_WITH_NEXT,     // Prepended to the word after it
+    SPLIT_CONTIGUOUS,           // Adjacent matches form a single word
+};
+
+// Which words of the text get the prefix of a step.
+enum PrependScheme {
+    PREPEND_NEVER,
+    PREPEND_FIRST,  // Only the first word of the text
+    PREPEND_ALWAYS, // Every word that does not start with the prefix already
+};
+
+// A single pre_tokenizer of tokenizer.json with its settings parsed ahead of time. A step
+// first rewrites each word, then splits it.
+struct PreTokenizerStep {
+    enum PreTokenizerType type;
+    enum PrependScheme    prepend;     // ByteLevel, Metaspace: when words get the prefix
+    std::string           prefix;      // ByteLevel, Metaspace: e.g. " " or "▁"
+    std::string           replacement; // Metaspace: what replaces each space, e.g. "▁"
+    std::string           pattern;     // Split, Metaspace: literal delimiter, when regex is null
+    struct unicode_regex* regex;       // Split, ByteLevel: compiled delimiter, may be null
+    enum SplitBehavior    behavior;    // What becomes of the delimiters
+    bool                  invert;      // Whether the delimiters are the words instead
+};
+
+// A run of a word that a split pattern either matched or skipped over.
+struct SplitPiece {
+    size_t offset; // Byte offset of the piece in the text
+    size_t length; // Length of the piece in bytes
+    bool   match;  // Whether the pattern matched the piece
+};
 
-    // default to false because these member attributes may not be available
-    bool add_prefix_space = false;
-    bool trim_offsets     = false;
+// Buffers reused across calls to PreTokenizer::pre_tokenize.
+struct PreTokenizerScratch {
+    std::string                      text[2]; // Rewritten text, e.g. with spaces replaced
+    std::vector<struct unicode_span> spans;   // Words of the step being applied
+    std::vector<struct SplitPiece>   pieces;  // Pieces of the word being split
+    std::vector<uint32_t>            cpts;    // Codepoints of the word being split
 };
 
-// TODO/WIP
+// A pre_tokenizer compiled from tokenizer.json, e.g. a Sequence is flattened into its steps.
 struct PreTokenizer {
-    // there are 9 possible types of pre_tokenizers
-    std::string type; // type is always available if pre_tokenizer is not null
+    std::vector<struct PreTokenizerStep> steps; // Applied in order, each to every word
+
+    // whether words are mapped onto the byte-level alphabet before they are looked up
+    bool byte_level = false;
+
+    // split text into words, filling spans with their byte ranges in the returned text. that is
+    // text itself unless a step rewrites it, e.g. to add a prefix space, in which case it is a
+    // view into scratch. start is false for the chunks of a stream after the first one, first
+    // is whether text begins the input, e.g. it is false for the text after an added token.
+    std::string_view pre_tokenize(
+        std::string_view                  text,
+        bool                              start,
+        bool                              first,
+        struct PreTokenizerScratch       &scratch,
+        std::vector<struct unicode_span> &spans
+    ) const;
+};
+
+// compile the pre_tokenizer of tokenizer.json, null when there is none
+struct PreTokenizer* malloc_pre_tokenizer(const nlohmann::json &pre_tokenizer);
+
+void free_pre_tokenizer(struct PreTokenizer* pre_tokenizer);
+
+// An added token found in a text. The range includes the whitespace the token strips.
+struct AddedTokenMatch {
+    size_t   offset; // Byte offset of the match in the text
+    size_t   length; // Length of the match in bytes
+    uint32_t id;     // Id of the added token
+};
+
+// An Aho-Corasick automaton over the contents of a set of added tokens. The trie and its
+// failure links are compiled into a DFA over classes of bytes, so a text is scanned once at a
+// single table lookup per byte, however many tokens the model defines.
+struct AddedTokenMatcher {
+    uint32_t n_classes;    // Number of byte classes, class 0 is every byte outside the tokens
+    uint32_t n_states;     // Number of DFA states, state 0 is the root
+    uint16_t classes[256]; // Class of each byte
+
+    // state * n_classes + class: next state, the failure links are already followed
+    std::vector<uint32_t> transitions;
+    std::vector<uint32_t> outputs; // Pattern that ends at a state, TOKENIZER_NO_ID if none
+    std::vector<uint32_t> links;   // Nearest proper suffix of a state that ends a pattern, or 0
+    std::vector<uint32_t> depths;  // Length of the prefix of a pattern a state stands for
+
+    std::vector<const struct AddedToken*> tokens;  // Added token of each pattern
+    std::vector<uint32_t>                 lengths; // Length of each pattern in bytes
+
+    // fill matches with the leftmost-longest matches in text that do not overlap. single_word,
+    // left_strip and right_strip are applied to them the same way as the reference
+    // implementation. candidates is scratch space for every match, overlapping or not.
+    void find(
+        std::string_view                     text,
+        std::vector<struct AddedTokenMatch> &candidates,
+        std::vector<struct AddedTokenMatch> &matches
+    ) const;
+
+    // the length of the longest suffix of text that starts a pattern, i.e. of the match that
+    // the text after it may still complete. 0 when text ends outside of every pattern.
+    size_t pending(std::string_view text) const;
+};
+
+// compile the added tokens whose normalized flag equals normalized, null when there is none.
+// the contents of normalized tokens are passed through normalizer, as they are matched
+// against normalized text.
+struct AddedTokenMatcher* malloc_added_token_matcher(
+    const std::vector<struct AddedToken*> &added_tokens,
+    bool                                   normalized,
+    const struct Normalizer*               normalizer
+);
+
+void free_added_token_matcher(struct AddedTokenMatcher* matcher);
+
+// The result of merging a pair of adjacent token ids.
+// rank is the position of the merge rule in tokenizer.json; lower ranks are applied first.
+struct MergeRank {
+    uint32_t rank; // Priority of the merge rule
+    uint32_t id;   // Id of the merged token
+};
+
+// pack a pair of token ids into a single key for the merge-rank table
+inline uint64_t merge_pair_key(uint32_t left, uint32_t right) {
+    return ((uint64_t) left << 32) | (uint64_t) right;
+}
+
+// spread the packed pair over the bits used to index the merge-rank table
+inline uint64_t merge_pair_hash(uint64_t key) {
+    key *= 0x9E3779B97F4A7C15ull; // fibonacci hashing
+    return key ^ (key >> 32);
+}
+
+// An open addressing slot of the merge-rank table. Empty slots hold MERGE_EMPTY_KEY.
+struct MergeSlot {
+    uint64_t         key;   // Packed pair of token ids
+    struct MergeRank merge; // Result of merging the pair
+};
+
+static const uint64_t MERGE_EMPTY_KEY = UINT64_MAX;
+
+// 64-bit FNV-1a over the bytes of a token
+inline uint64_t vocab_hash(std::string_view token) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (unsigned char c : token) {
+        hash = (hash ^ c) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+// An open addressing slot of the vocab index. Empty slots hold TOKENIZER_NO_ID.
+// the tag is the high half of the hash, so most mismatches never touch the string pool.
+struct VocabSlot {
+    uint32_t tag; // High 32 bits of vocab_hash
+    uint32_t id;  // Id of the token
+};
+
+// A node of the trie over the tokens a Unigram model matches in text. The edges of a node are
+// contiguous and sorted on their byte, each one is the index of the child << 8 | the byte.
+struct TrieNode {
+    uint32_t id;      // Token spelled by the path to the node, TOKENIZER_NO_ID if none
+    uint32_t edges;   // Index of the first edge of the node
+    uint32_t n_edges; // Number of edges of the node
+};
+
+// Location of a token in the string pool.
+struct TokenSpan {
+    uint32_t offset; // Offset of the first byte in the pool
+    uint32_t size;   // Number of bytes
+};
 
-    // TODO: Handle sequences if type is Sequence
-    std::vector<nlohmann::json> rules;
+/*
+ * Binary tokenizer format
+ *
+ * A tokenizer.json is compiled once into a flat image that is used as is, either from memory
+ * or from a file mapping. Every section begins on a 64 byte boundary and is addressed by an
+ * offset from the start of the image, so the image can be shared between processes.
+ *
+ * - pool:   the bytes of every token, concatenated in id order
+ * - tokens: one TokenSpan per id
+ * - vocab:  the vocab index, a power of two number of VocabSlots hashed on the token bytes
+ * - merges: the merge-rank table, a power of two number of MergeSlots
+ * - decode: the raw bytes every id decodes to and one TokenSpan per id into them
+ * - scores: Unigram only, the log probability of every id
+ * - trie:   Unigram only, the TrieNodes and edges over the tokens matched in text
+ * - config: the remaining (small) json settings, e.g. normalizer and added_tokens
+ */
+static const uint32_t TOKENIZER_MAGIC   = 0x54545047; // "GPTT"
+static const uint32_t TOKENIZER_VERSION = 4;
+static const uint32_t TOKENIZER_ALIGN   = 64;
+static const uint32_t TOKENIZER_NO_ID   = UINT32_MAX;
+
+enum TokenizerSectionType {
+    TOKENIZER_SECTION_POOL,
+    TOKENIZER_SECTION_TOKENS,
+    TOKENIZER_SECTION_VOCAB,
+    TOKENIZER_SECTION_MERGES,
+    TOKENIZER_SECTION_DECODE_POOL,
+    TOKENIZER_SECTION_DECODE_TOKENS,
+    TOKENIZER_SECTION_SCORES,
+    TOKENIZER_SECTION_TRIE_NODES,
+    TOKENIZER_SECTION_TRIE_EDGES,
+    TOKENIZER_SECTION_CONFIG,
+    TOKENIZER_SECTION_COUNT, // number of sections
+};
+
+enum TokenizerFlag {
+    TOKENIZER_FLAG_BYTE_FALLBACK = 0x0001,
+    TOKENIZER_FLAG_IGNORE_MERGES = 0x0002,
+    TOKENIZER_FLAG_FUSE_UNK      = 0x0004,
+};
+
+struct TokenizerSection {
+    uint64_t offset; // Offset from the start of the image
+    uint64_t size;   // Number of bytes
+};
 
-    // default to false because these member attributes may not be available
-    bool add_prefix_space = false;
-    bool trim_offsets     = false;
+struct TokenizerHeader {
+    uint32_t                magic;        // TOKENIZER_MAGIC
+    uint32_t                version;      // TOKENIZER_VERSION
+    uint32_t                n_tokens;     // Number of ids, e.g. the size of the id -> token table
+    uint32_t                n_vocab;      // Number of entries in the vocab index
+    uint32_t                n_buckets;    // Capacity of the vocab index, a power of two
+    uint32_t                n_merges;     // Number of merge rules in the merge-rank table
+    uint32_t                n_slots;      // Capacity of the merge-rank table, a power of two
+    uint32_t                unk_id;       // Id of the unk token, TOKENIZER_NO_ID if unavailable
+    uint32_t                flags;        // Bitwise or of TokenizerFlag
+    float                   dropout;      // BPE dropout, unused at inference
+    uint32_t                decode_strip; // Leading spaces removed from a decoded sequence
+    float                   unk_score;    // Unigram: score of a character no token covers
+    char                    type[8];      // Model type, e.g. BPE, null terminated
+    struct TokenizerSection sections[TOKENIZER_SECTION_COUNT];
 };
 
+// NOTE: the model never owns its tables, they are views into the image.
 struct TokenizerModel {
     // BPE, WPM, etc...
     std::string type = "BPE"; // we can safely assume BPE if null
@@ -66,35 +328,185 @@ struct TokenizerModel {
     // e.g. The set of tokens is congruent with the vocab size
     size_t size; // we can only determine size at runtime
 
-    // V* : t -> i where V* is set of tokens, t is token, and i is id
-    // e.g. this is a "forward mapping"
-    std::map<std::string, size_t> vocab;
-
     // V*: i -> t where V* is set of tokens, i is id, and t is token
-    // e.g. this is a "reverse mapping"
-    std::vector<std::string> tokens;
+    // e.g. this is a "reverse mapping" into the string pool
+    const char*             pool   = nullptr;
+    const struct TokenSpan* tokens = nullptr;
 
-    // The array of merged tokens as strings.
-    // NOTE: These should be split before use
-    // with start and end indices included, respectively.
-    std::vector<std::string> merges;
+    // V* : t -> i where V* is set of tokens, t is token, and i is id
+    // e.g. this is a "forward mapping" hashed on the token bytes
+    const struct VocabSlot* vocab     = nullptr;
+    size_t                  n_vocab   = 0;
+    size_t                  n_buckets = 0;
+
+    // (V*, V*) -> (r, i) where r is the merge rank and i is the id of the merged token
+    // e.g. a compiled form of merges keyed on the pair of ids instead of strings
+    const struct MergeSlot* merges   = nullptr;
+    size_t                  n_merges = 0;
+    size_t                  n_slots  = 0;
+
+    // V*: i -> b where i is id and b is the raw bytes the token decodes to
+    // e.g. the decoder applied ahead of time, so decoding is a copy per token
+    const char*             decode_pool   = nullptr;
+    const struct TokenSpan* decode_tokens = nullptr;
+    uint32_t                decode_strip  = 0;
+
+    // V*: i -> s where s is the log probability of the token, Unigram only
+    // e.g. the Viterbi search maximizes the sum of scores over the tokens of a word
+    const float*           scores     = nullptr;
+    const struct TrieNode* trie       = nullptr;
+    const uint32_t*        trie_edges = nullptr;
+    float                  unk_score  = 0.0f;
+
+    // b -> i where b is a raw byte and i is the id of its byte-level character
+    // e.g. byte-level symbols are seeded from the raw bytes without mapping the word first
+    uint32_t byte_ids[256];
 
     // set sane defaults
     bool byte_fallback = false;
     bool ignore_merges = false;
+    bool fuse_unk      = false;
 
     float dropout = 0.0f;
+
+    // storage backing the views above: an image built in memory or a read-only file mapping
+    std::vector<uint8_t> image;
+    void*                mapping      = nullptr;
+    size_t               mapping_size = 0;
+
+    // the bytes of the token with the given id
+    std::string_view token(uint32_t id) const {
+        return std::string_view(pool + tokens[id].offset, tokens[id].size);
+    }
+
+    // the id of the token with the given bytes, if it is part of the model vocab
+    std::optional<uint32_t> find(std::string_view token) const {
+        const uint64_t hash = vocab_hash(token);
+        const uint32_t tag  = (uint32_t) (hash >> 32);
+        const size_t   mask = n_buckets - 1;
+        for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+            const struct VocabSlot &bucket = vocab[slot];
+            if (TOKENIZER_NO_ID == bucket.id) {
+                return std::nullopt;
+            }
+            if (tag == bucket.tag && this->token(bucket.id) == token) {
+                return bucket.id;
+            }
+        }
+    }
+
+    // the child of a trie node along byte, or 0 when there is none as no edge leads to the root
+    uint32_t trie_next(uint32_t node, uint8_t byte) const {
+        const uint32_t* first = trie_edges + trie[node].edges;
+        const uint32_t* last  = first + trie[node].n_edges;
+        const uint32_t* edge  = std::lower_bound(first, last, byte, [](uint32_t edge, uint8_t b) {
+            return (uint8_t) edge < b;
+        });
+        return last != edge && (uint8_t) *edge == byte ? *edge >> 8 : 0;
+    }
+
+    // the result of merging the pair of ids, or null if there is no merge rule for the pair
+    const struct MergeRank* merge(uint32_t left, uint32_t right) const {
+        const uint64_t key  = merge_pair_key(left, right);
+        const size_t   mask = n_slots - 1;
+        for (size_t slot = merge_pair_hash(key) & mask;; slot = (slot + 1) & mask) {
+            if (key == merges[slot].key) {
+                return &merges[slot].merge;
+            }
+            if (MERGE_EMPTY_KEY == merges[slot].key) {
+                return nullptr;
+            }
+        }
+    }
 };
 
-struct TokenizerModel* malloc_tokenizer_model(nlohmann::json model);
+// compile a huggingface tokenizer.json into the binary tokenizer format
+std::vector<uint8_t> tokenizer_image(nlohmann::json data);
+
+// compile a SentencePiece tokenizer.model into the binary tokenizer format
+std::vector<uint8_t> sentencepiece_image(const struct SentencePieceModel &model);
+
+// create a model viewing the image. the image must outlive the model.
+struct TokenizerModel* malloc_tokenizer_model(const uint8_t* image, size_t size);
 
 void free_tokenizer_model(struct TokenizerModel* model);
 
+struct BPECacheEntry {
+    std::string           word; // Pre-tokenized word the ids were computed for
+    std::vector<uint32_t> ids;  // Merged token ids of the word
+};
+
+using BPECacheList = std::list<struct BPECacheEntry>;
+
+// A single LRU list guarded by its own lock. The index keys view into the owning entry.
+struct BPECacheShard {
+    std::mutex                                                   lock;
+    BPECacheList                                                 entries; // most recent first
+    std::unordered_map<std::string_view, BPECacheList::iterator> index;
+
+    size_t hits   = 0; // Guarded by lock
+    size_t misses = 0; // Guarded by lock
+};
+
+// Bounded word -> ids cache in front of the merge loop.
+// Words are hashed onto independent shards so concurrent encodes rarely share a lock.
+struct BPECache {
+    size_t                n_shards;      // Number of independently locked shards
+    size_t                capacity;      // Maximum number of entries per shard
+    size_t                max_word_size; // Longer words bypass the cache
+    struct BPECacheShard* shards;
+
+    // append the cached ids for word to ids, returns false on a miss
+    bool get(std::string_view word, std::vector<uint32_t> &ids);
+
+    // insert ids for word, evicting the least recently used entry of the shard when full
+    void put(std::string_view word, const uint32_t* ids, size_t n_ids);
+
+    size_t hits() const;
+    size_t misses() const;
+};
+
+struct BPECache* malloc_bpe_cache(size_t n_shards, size_t capacity, size_t max_word_size);
+
+void free_bpe_cache(struct BPECache* cache);
+
+// The ids of many documents packed into a single buffer.
+// e.g. document i is ids[offsets[i]] through ids[offsets[i + 1] - 1]
+struct TokenBatch {
+    std::vector<uint32_t> ids;     // Concatenated ids of every document
+    std::vector<size_t>   offsets; // Start of each document in ids, plus the total size
+};
+
+// the bytes a streamed encode reads past a chunk at most while it looks for the end of a word.
+// only a word longer than that is cut in the middle, and then only between two characters.
+static const size_t TOKENIZER_STREAM_MAX_WORD = 1 << 16;
+
+// Receives the ids of a streamed encode, a chunk at a time.
+// The pointer is only valid for the duration of the call.
+using TokenSink = std::function<void(const uint32_t* ids, size_t n_ids)>;
+
+// Carries the state of a streamed decode between calls.
+// Zero initialize before decoding the first id of a sequence.
+struct DecodeState {
+    char     pending[4]; // Leading bytes of a utf-8 character split across calls
+    uint32_t n_pending;  // Number of bytes in pending
+    uint32_t n_stripped; // Number of leading spaces removed so far
+    bool     started;    // Whether any bytes of the sequence were emitted
+};
+
 // NOTE: This is a public class
 struct Tokenizer {
     // the huggingface tokenizers compatible model metadata
     struct TokenizerModel* model;
 
+    // owns the tokenizer itself along with its added tokens, the unk token and their contents.
+    // the model, normalizer, pre_tokenizer, matchers, cache and pool are allocations of their
+    // own, which free_tokenizer releases before the arena.
+    struct Arena* arena = nullptr;
+
+    // milliseconds spent in malloc_tokenizer, mmap_tokenizer or malloc_sentencepiece_tokenizer
+    double load_ms = 0.0;
+
     // added_tokens can be thought of as extras
     // as they aren't always used or available.
     // note that added_tokens are typically special
@@ -106,6 +518,13 @@ struct Tokenizer {
     struct Token* eos_token = nullptr;
     struct Token* unk_token = nullptr;
 
+    // per-word merge results shared by all callers, may be null to disable caching
+    struct BPECache* cache = nullptr;
+
+    // persistent workers for encode_batch, created on first use and reused between batches
+    struct ThreadPool* pool = nullptr;
+    std::mutex         pool_lock;
+
     // tokenizer model type: only supported implementation will be BPE
     std::string type() {
         return model->type;
@@ -115,21 +534,65 @@ struct Tokenizer {
         return model->size;
     };
 
-    size_t token_to_id(const std::string &token) {
-        return model->vocab[token];
+    std::optional<uint32_t> token_to_id(std::string_view token) const {
+        return model->find(token);
     };
 
     std::string id_to_token(size_t encoding) const {
-        return model->tokens[encoding];
+        return std::string(model->token((uint32_t) encoding));
     };
 
-    // TODO/WIP: Note that normalize and pre_tokenizer are variable objects
-    nlohmann::json normalizer;
-    nlohmann::json pre_tokenizer;
+    // encode text into a sequence of token ids using byte pair encoding
+    std::vector<uint32_t> encode(std::string_view text) const;
+
+    // print what loading cost: time, image and table sizes, and the arena allocations
+    void print_stats(FILE* out) const;
+
+    // append the bytes of ids to out. when state is passed, a utf-8 character that is cut off by
+    // the last id is held back until the ids that complete it arrive. out is only ever appended
+    // to, so reusing it across calls avoids allocations altogether.
+    void decode(
+        const uint32_t* ids, size_t n_ids, std::string &out, struct DecodeState* state = nullptr
+    ) const;
+
+    std::string decode(const std::vector<uint32_t> &ids) const {
+        std::string out;
+        decode(ids.data(), ids.size(), out);
+        return out;
+    }
+
+    // encode every document across n_threads workers. the vocab and merge tables are only read,
+    // so the workers share nothing but the cache.
+    struct TokenBatch encode_batch(const std::vector<std::string_view> &texts, size_t n_threads);
+
+    // encode input too large to hold in memory, passing the ids to sink as they are produced.
+    // the input is taken in chunks of about chunk_size bytes, each cut where the pre_tokenizer
+    // starts a word, so the ids match encode() while memory stays bounded. a chunk without such
+    // a cut is grown by up to TOKENIZER_STREAM_MAX_WORD bytes. returns the number of ids.
+    size_t encode_stream(int fd, const TokenSink &sink, size_t chunk_size = 1 << 20) const;
+
+    // same as above over a buffer in memory, e.g. a mapped file. nothing is copied.
+    size_t encode_stream(
+        const char* data, size_t size, const TokenSink &sink, size_t chunk_size = 1 << 20
+    ) const;
+
+    // compiled once when the tokenizer is created, either may be null when there is none
+    struct Normalizer*   normalizer    = nullptr;
+    struct PreTokenizer* pre_tokenizer = nullptr;
+
+    // added tokens matched before normalization and those matched after it, either may be null
+    struct AddedTokenMatcher* added_raw        = nullptr;
+    struct AddedTokenMatcher* added_normalized = nullptr;
 };
 
 struct Tokenizer* malloc_tokenizer(nlohmann::json data);
 
+// create a tokenizer from a binary tokenizer file. the file is mapped read-only and shared.
+struct Tokenizer* mmap_tokenizer(const char* path);
+
+// create a tokenizer from a SentencePiece tokenizer.model, which is read without protobuf
+struct Tokenizer* malloc_sentencepiece_tokenizer(const char* path);
+
 void free_tokenizer(struct Tokenizer* data);
 
 #endif // TOKENIZER_H
@@ -3,27 +3,53 @@
 #define UNICODE_DATA_H
 
 #include <cstdint>
-#include <vector>
-#include <unordered_map>
-#include <unordered_set>
+
+static const uint32_t MAX_CODEPOINTS = 1114112;
 
 /**
-* @brief Represents a Unicode character range with normalized form D (NFD)
+* @brief Two-stage tables indexed by codepoint, see TwoStageTable in gen/unicode.py
+*
+* The value of a codepoint below MAX_CODEPOINTS is
+* data[(index[cpt >> SHIFT] << SHIFT) | (cpt & ((1 << SHIFT) - 1))]. The case and NFD
+* tables hold the offset from the codepoint to its mapping.
 */
-struct range_nfd {
-uint32_t first;
-uint32_t last;
-uint32_t nfd;
-};
+static const uint32_t UNICODE_FLAGS_SHIFT = 5;
+extern const uint16_t unicode_flags_index[];
+extern const uint16_t unicode_flags_data[];
 
-static const uint32_t MAX_CODEPOINTS = 1114112;
+static const uint32_t UNICODE_LOWERCASE_SHIFT = 8;
+extern const uint16_t unicode_lowercase_index[];
+extern const int32_t unicode_lowercase_data[];
+
+static const uint32_t UNICODE_UPPERCASE_SHIFT = 8;
+extern const uint16_t unicode_uppercase_index[];
+extern const int32_t unicode_uppercase_data[];
+
+static const uint32_t UNICODE_NFD_SHIFT = 7;
+extern const uint16_t unicode_nfd_index[];
+extern const int32_t unicode_nfd_data[];
+
+static const uint32_t UNICODE_NORMALIZATION_SHIFT = 7;
+extern const uint16_t unicode_normalization_index[];
+extern const uint16_t unicode_normalization_data[];
+
+static const uint32_t UNICODE_DECOMPOSITION_SHIFT = 7;
+extern const uint16_t unicode_decomposition_index[];
+extern const uint32_t unicode_decomposition_data[];
 
 /**
-* @brief Externally linked variables for Unicode data structures
+* @brief Full decompositions, each stored as its length followed by its codepoints
+*
+* The decomposition table holds the offset of the canonical decomposition of a codepoint in
+* the low 16 bits and of its compatibility decomposition in the high 16 bits, 0 for none.
 */
-extern const std::vector<std::pair<uint32_t, uint16_t>> unicode_ranges_flags;
-extern const std::unordered_set<uint32_t> unicode_set_whitespace;
-extern const std::unordered_map<uint32_t, uint32_t> unicode_map_lowercase;
-extern const std::unordered_map<uint32_t, uint32_t> unicode_map_uppercase;
-extern const std::vector<range_nfd> unicode_ranges_nfd;
+extern const uint32_t unicode_decomposition_pool[];
+
+/**
+* @brief Primary composites, sorted by the pair they compose from: first << 21 | second
+*/
+static const uint32_t UNICODE_N_COMPOSITIONS = 941;
+extern const uint64_t unicode_composition_pairs[];
+extern const uint32_t unicode_composition_cpts[];
+
 #endif // UNICODE_DATA_H
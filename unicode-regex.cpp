@@ -0,0 +1,881 @@
+#include "unicode-regex.h"
+#include "unicode.h"
+
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// flags of a codepoint that classes can test: the general categories and \s
+static const uint16_t REGEX_WHITESPACE = 0x0100;
+static const uint16_t REGEX_FLAGS_MASK = 0x01FF;
+
+// limits that keep a hostile pattern from compiling into something enormous
+static const size_t REGEX_MAX_INSTS   = 4096;
+static const size_t REGEX_MAX_CLASSES = 0xFFFF;
+static const size_t REGEX_MAX_STATES  = 16384;
+
+static uint16_t regex_flags_key(uint32_t cpt) {
+    return unicode_cpt_flags(cpt).as_uint() & REGEX_FLAGS_MASK;
+}
+
+//
+// sets of codepoints
+//
+
+// A class such as [^\s\p{L}], \S or a single literal.
+struct regex_set {
+    bool                                       negated = false;
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;    // Inclusive ranges of codepoints
+    uint16_t                                   mask = 0;  // Flags of which any is enough
+    std::vector<uint16_t>                      not_masks; // Items like \S: none of the flags set
+
+    void add(uint32_t first, uint32_t last) {
+        ranges.emplace_back(first, last);
+    }
+
+    bool contains(uint32_t cpt, uint16_t flags) const {
+        bool in = 0 != (flags & mask);
+        for (size_t i = 0; !in && i < ranges.size(); ++i) {
+            in = ranges[i].first <= cpt && cpt <= ranges[i].second;
+        }
+        for (size_t i = 0; !in && i < not_masks.size(); ++i) {
+            in = 0 == (flags & not_masks[i]);
+        }
+        return in != negated;
+    }
+};
+
+//
+// parser: pattern -> syntax tree
+//
+
+struct regex_node {
+    enum Type { EMPTY, SET, CONCAT, ALT, REPEAT, ASSERT } type = EMPTY;
+
+    uint32_t set      = 0;     // SET, ASSERT: index of the set
+    bool     negative = false; // ASSERT: (?!...) rather than (?=...)
+    int32_t  min      = 0;     // REPEAT: minimum count
+    int32_t  max      = 0;     // REPEAT: maximum count, -1 when unbounded
+    bool     greedy   = true;  // REPEAT: prefer more repetitions
+
+    std::vector<regex_node> children;
+};
+
+struct regex_parser {
+    const std::string     &expr;
+    std::vector<uint32_t>  pattern;
+    size_t                 pos   = 0;
+    bool                   icase = false;
+    std::vector<regex_set> sets;
+
+    explicit regex_parser(const std::string &expr)
+        : expr(expr), pattern(unicode_cpts_from_utf8(expr)) {}
+
+    [[noreturn]] void fail(const std::string &reason) const {
+        throw std::runtime_error(
+            "Unsupported regex: " + reason + " at " + std::to_string(pos) + " in '" + expr + "'"
+        );
+    }
+
+    bool done() const {
+        return pos >= pattern.size();
+    }
+
+    uint32_t peek(size_t ahead = 0) const {
+        return pos + ahead < pattern.size() ? pattern[pos + ahead] : 0;
+    }
+
+    bool accept(uint32_t cpt) {
+        if (!done() && pattern[pos] == cpt) {
+            ++pos;
+            return true;
+        }
+        return false;
+    }
+
+    regex_node node_set(const regex_set &set) {
+        regex_node node;
+        node.type = regex_node::SET;
+        node.set  = (uint32_t) sets.size();
+        sets.push_back(set);
+        return node;
+    }
+
+    // add cpt and, when matching case-insensitively, its other cases
+    void add_literal(regex_set &set, uint32_t cpt) const {
+        set.add(cpt, cpt);
+        if (icase) {
+            const uint32_t lower = unicode_tolower(cpt);
+            const uint32_t upper = unicode_toupper(cpt);
+            set.add(lower, lower);
+            set.add(upper, upper);
+        }
+    }
+
+    uint32_t parse_hex(size_t n_digits) {
+        uint32_t value = 0;
+        for (size_t i = 0; i < n_digits; ++i) {
+            const uint32_t c = peek();
+            if ('0' <= c && c <= '9') {
+                value = value * 16 + (c - '0');
+            } else if ('a' <= (c | 0x20) && (c | 0x20) <= 'f') {
+                value = value * 16 + ((c | 0x20) - 'a' + 10);
+            } else {
+                fail("bad hex escape");
+            }
+            ++pos;
+        }
+        return value;
+    }
+
+    // \p{..} or \pX, returns the flags of the category
+    uint16_t parse_category() {
+        std::string name;
+        if (accept('{')) {
+            while (!done() && '}' != peek()) {
+                name += (char) pattern[pos++];
+            }
+            if (!accept('}')) {
+                fail("unterminated \\p{");
+            }
+        } else if (!done()) {
+            name = (char) pattern[pos++];
+        }
+
+        static const std::map<std::string, uint16_t> categories = {
+            {"L", codepoint_flags::LETTER},
+            {"Letter", codepoint_flags::LETTER},
+            {"N", codepoint_flags::NUMBER},
+            {"Number", codepoint_flags::NUMBER},
+            {"P", codepoint_flags::PUNCTUATION},
+            {"Punctuation", codepoint_flags::PUNCTUATION},
+            {"S", codepoint_flags::SYMBOL},
+            {"Symbol", codepoint_flags::SYMBOL},
+            {"M", codepoint_flags::ACCENT_MARK},
+            {"Mark", codepoint_flags::ACCENT_MARK},
+            {"Z", codepoint_flags::SEPARATOR},
+            {"Separator", codepoint_flags::SEPARATOR},
+            {"C", codepoint_flags::CONTROL | codepoint_flags::UNDEFINED},
+            {"Other", codepoint_flags::CONTROL | codepoint_flags::UNDEFINED},
+        };
+
+        auto it = categories.find(name);
+        if (categories.end() == it) {
+            fail("unknown category '" + name + "'");
+        }
+        return it->second;
+    }
+
+    // parse the escape after a backslash into set. negated escapes like \S are only exact
+    // outside of brackets, where they negate the whole set.
+    void parse_escape(regex_set &set, bool in_class) {
+        if (done()) {
+            fail("trailing backslash");
+        }
+
+        const uint32_t c = pattern[pos++];
+
+        uint16_t mask    = 0;
+        bool     negated = false;
+        switch (c) {
+            // NOTE: \d is approximated by \p{N}, which the flags hold, rather than \p{Nd}
+            case 'd':
+            case 'D':
+                mask    = codepoint_flags::NUMBER;
+                negated = 'D' == c;
+                break;
+            case 's':
+            case 'S':
+                mask    = REGEX_WHITESPACE;
+                negated = 'S' == c;
+                break;
+            // NOTE: \W within brackets also matches '_'
+            case 'w':
+            case 'W':
+                mask    = codepoint_flags::LETTER | codepoint_flags::NUMBER;
+                mask   |= codepoint_flags::ACCENT_MARK;
+                negated = 'W' == c;
+                if (!negated || !in_class) {
+                    set.add('_', '_');
+                }
+                break;
+            case 'p':
+            case 'P':
+                mask    = parse_category();
+                negated = 'P' == c;
+                break;
+            case 'n': set.add('\n', '\n'); return;
+            case 'r': set.add('\r', '\r'); return;
+            case 't': set.add('\t', '\t'); return;
+            case 'f': set.add('\f', '\f'); return;
+            case 'v': set.add('\v', '\v'); return;
+            case 'a': set.add('\a', '\a'); return;
+            case 'e': set.add(0x1B, 0x1B); return;
+            case '0': set.add(0, 0); return;
+            case 'x':
+                if (accept('{')) {
+                    size_t n_digits = 0;
+                    while (n_digits < pattern.size() - pos && '}' != peek(n_digits)) {
+                        n_digits++;
+                    }
+                    const uint32_t cpt = parse_hex(n_digits);
+                    if (!accept('}')) {
+                        fail("unterminated \\x{");
+                    }
+                    add_literal(set, cpt);
+                } else {
+                    add_literal(set, parse_hex(2));
+                }
+                return;
+            case 'u': add_literal(set, parse_hex(4)); return;
+            default:
+                if (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || ('0' <= c && c <= '9')) {
+                    --pos;
+                    fail(std::string("escape \\") + (char) c);
+                }
+                add_literal(set, c); // escaped punctuation
+                return;
+        }
+
+        if (!negated) {
+            set.mask |= mask;
+        } else if (in_class) {
+            set.not_masks.push_back(mask);
+        } else {
+            set.mask    |= mask;
+            set.negated  = true;
+        }
+    }
+
+    // [...] after the opening bracket
+    regex_node parse_class() {
+        regex_set set;
+        set.negated = accept('^');
+
+        bool first = true;
+        while (!done() && (first || ']' != peek())) {
+            first = false;
+
+            uint32_t lo;
+            if (accept('\\')) {
+                // only a single literal codepoint can start a range
+                regex_set item;
+                parse_escape(item, true);
+                const bool literal = 0 == item.mask && item.not_masks.empty()
+                                     && 1 == item.ranges.size()
+                                     && item.ranges[0].first == item.ranges[0].second;
+                if (!literal || '-' != peek() || ']' == peek(1)) {
+                    set.mask |= item.mask;
+                    set.ranges.insert(set.ranges.end(), item.ranges.begin(), item.ranges.end());
+                    set.not_masks.insert(
+                        set.not_masks.end(), item.not_masks.begin(), item.not_masks.end()
+                    );
+                    continue;
+                }
+                lo = item.ranges[0].first;
+            } else if ('[' == peek() && ':' == peek(1)) {
+                fail("posix class");
+            } else {
+                lo = pattern[pos++];
+            }
+
+            uint32_t hi = lo;
+            if ('-' == peek() && ']' != peek(1) && pos + 1 < pattern.size()) {
+                ++pos;
+                if (accept('\\')) {
+                    regex_set item;
+                    parse_escape(item, true);
+                    if (1 != item.ranges.size() || 0 != item.mask) {
+                        fail("bad range");
+                    }
+                    hi = item.ranges[0].first;
+                } else {
+                    hi = pattern[pos++];
+                }
+                if (hi < lo) {
+                    fail("reversed range");
+                }
+            }
+
+            set.add(lo, hi);
+            if (icase) {
+                // the other cases of short ranges like a-z
+                for (uint32_t cpt = lo; cpt <= hi && hi - lo < 256; ++cpt) {
+                    add_literal(set, cpt);
+                }
+            }
+        }
+
+        if (!accept(']')) {
+            fail("unterminated class");
+        }
+        return node_set(set);
+    }
+
+    regex_node parse_atom() {
+        const uint32_t c = pattern[pos++];
+        switch (c) {
+            case '(': return parse_group();
+            case '[': return parse_class();
+            case '.': {
+                regex_set set;
+                set.negated = true;
+                set.add('\n', '\n');
+                return node_set(set);
+            }
+            case '\\': {
+                regex_set set;
+                parse_escape(set, false);
+                return node_set(set);
+            }
+            case '^':
+            case '$':
+                --pos;
+                fail("anchor");
+            case '*':
+            case '+':
+            case '?':
+                --pos;
+                fail("nothing to repeat");
+            default: {
+                regex_set set;
+                add_literal(set, c);
+                return node_set(set);
+            }
+        }
+    }
+
+    // after the opening parenthesis
+    regex_node parse_group() {
+        const bool saved = icase;
+
+        bool lookahead = false;
+        bool negative  = false;
+        if (accept('?')) {
+            if (accept('=') || (negative = accept('!'))) {
+                lookahead = true;
+            } else if ('<' == peek() && ('=' == peek(1) || '!' == peek(1))) {
+                fail("lookbehind");
+            } else {
+                // flags, e.g. (?i:...), (?-i:...) or (?i) for the rest of the group
+                bool on = true;
+                while (!done() && ':' != peek() && ')' != peek()) {
+                    const uint32_t flag = pattern[pos++];
+                    if ('-' == flag) {
+                        on = false;
+                    } else if ('i' == flag) {
+                        icase = on;
+                    } else {
+                        fail("group flag");
+                    }
+                }
+                if (accept(')')) {
+                    // (?i) applies until the enclosing group closes, which restores it
+                    regex_node node;
+                    return node;
+                }
+                if (!accept(':')) {
+                    fail("unterminated group");
+                }
+            }
+        }
+
+        regex_node node = parse_alt();
+        if (!accept(')')) {
+            fail("unterminated group");
+        }
+        icase = saved;
+
+        if (lookahead) {
+            if (regex_node::SET != node.type) {
+                fail("lookahead on more than a single character");
+            }
+            node.type     = regex_node::ASSERT;
+            node.negative = negative;
+        }
+        return node;
+    }
+
+    // parse {n}, {n,} or {n,m}, or leave pos alone when the brace is a literal
+    bool parse_braces(int32_t &min, int32_t &max) {
+        size_t end = pos + 1;
+        auto   number = [&](int32_t &value) {
+            const size_t first = end;
+            value              = 0;
+            while (end < pattern.size() && '0' <= pattern[end] && pattern[end] <= '9') {
+                value = value * 10 + (int32_t) (pattern[end++] - '0');
+                if (value > 1000) {
+                    fail("repeat count");
+                }
+            }
+            return end > first;
+        };
+
+        if (!number(min)) {
+            return false;
+        }
+        max = min;
+        if (end < pattern.size() && ',' == pattern[end]) {
+            ++end;
+            if (!number(max)) {
+                max = -1;
+            }
+        }
+        if (end >= pattern.size() || '}' != pattern[end] || (max >= 0 && max < min)) {
+            return false;
+        }
+        pos = end + 1;
+        return true;
+    }
+
+    regex_node parse_repeat() {
+        regex_node node = parse_atom();
+        while (!done()) {
+            int32_t min;
+            int32_t max;
+            const uint32_t c = peek();
+            if ('*' == c || '+' == c || '?' == c) {
+                min = '+' == c ? 1 : 0;
+                max = '?' == c ? 1 : -1;
+                ++pos;
+            } else if ('{' != c || !parse_braces(min, max)) {
+                break;
+            }
+
+            if (regex_node::ASSERT == node.type) {
+                fail("repeated lookahead");
+            }
+
+            regex_node repeat;
+            repeat.type   = regex_node::REPEAT;
+            repeat.min    = min;
+            repeat.max    = max;
+            repeat.greedy = !accept('?');
+            if ('+' == peek()) {
+                fail("possessive quantifier");
+            }
+            repeat.children.push_back(std::move(node));
+            node = std::move(repeat);
+        }
+        return node;
+    }
+
+    regex_node parse_concat() {
+        regex_node node;
+        node.type = regex_node::CONCAT;
+        while (!done() && '|' != peek() && ')' != peek()) {
+            if ('{' == peek()) {
+                // a brace that isn't a quantifier is a literal
+                int32_t min;
+                int32_t max;
+                if (parse_braces(min, max)) {
+                    fail("nothing to repeat");
+                }
+            }
+            node.children.push_back(parse_repeat());
+        }
+        return 1 == node.children.size() ? std::move(node.children[0]) : node;
+    }
+
+    regex_node parse_alt() {
+        regex_node node;
+        node.type = regex_node::ALT;
+        node.children.push_back(parse_concat());
+        while (accept('|')) {
+            node.children.push_back(parse_concat());
+        }
+        return 1 == node.children.size() ? std::move(node.children[0]) : node;
+    }
+};
+
+//
+// compiler: syntax tree -> nfa program
+//
+
+struct regex_inst {
+    enum Op { CHAR, ASSERT, SPLIT, JMP, MATCH } op;
+
+    uint32_t set;      // CHAR, ASSERT
+    bool     negative; // ASSERT
+    int32_t  x;        // SPLIT: preferred branch, JMP: target
+    int32_t  y;        // SPLIT: other branch
+};
+
+struct regex_program {
+    std::vector<regex_inst> insts;
+
+    int32_t emit(regex_inst::Op op, uint32_t set = 0, bool negative = false) {
+        if (insts.size() >= REGEX_MAX_INSTS) {
+            throw std::runtime_error("Regex is too large to compile");
+        }
+        insts.push_back({op, set, negative, 0, 0});
+        return (int32_t) insts.size() - 1;
+    }
+
+    int32_t pc() const {
+        return (int32_t) insts.size();
+    }
+
+    void compile(const regex_node &node) {
+        switch (node.type) {
+            case regex_node::EMPTY: break;
+            case regex_node::SET: emit(regex_inst::CHAR, node.set); break;
+            case regex_node::ASSERT: emit(regex_inst::ASSERT, node.set, node.negative); break;
+            case regex_node::CONCAT:
+                for (const regex_node &child : node.children) {
+                    compile(child);
+                }
+                break;
+            case regex_node::ALT: {
+                std::vector<int32_t> jumps;
+                for (size_t i = 0; i + 1 < node.children.size(); ++i) {
+                    const int32_t split = emit(regex_inst::SPLIT);
+                    insts[split].x      = pc();
+                    compile(node.children[i]);
+                    jumps.push_back(emit(regex_inst::JMP));
+                    insts[split].y = pc();
+                }
+                compile(node.children.back());
+                for (int32_t jump : jumps) {
+                    insts[jump].x = pc();
+                }
+                break;
+            }
+            case regex_node::REPEAT: {
+                const regex_node &child = node.children[0];
+                for (int32_t i = 0; i < node.min; ++i) {
+                    compile(child);
+                }
+
+                if (node.max < 0) {
+                    // loop: split body, end; body; jmp loop
+                    const int32_t split = emit(regex_inst::SPLIT);
+                    compile(child);
+                    insts[emit(regex_inst::JMP)].x = split;
+                    branch(split, split + 1, pc(), node.greedy);
+                    break;
+                }
+
+                // optional copies that all skip to the same end, e.g. x{0,2} is (x(x)?)?
+                std::vector<int32_t> splits;
+                for (int32_t i = node.min; i < node.max; ++i) {
+                    splits.push_back(emit(regex_inst::SPLIT));
+                    compile(child);
+                }
+                for (int32_t split : splits) {
+                    branch(split, split + 1, pc(), node.greedy);
+                }
+                break;
+            }
+        }
+    }
+
+    void branch(int32_t split, int32_t more, int32_t less, bool greedy) {
+        insts[split].x = greedy ? more : less;
+        insts[split].y = greedy ? less : more;
+    }
+};
+
+//
+// dfa: subset construction over the nfa threads in priority order
+//
+
+// A DFA state is the ordered list of nfa instructions (CHAR, ASSERT and a final MATCH) that are
+// alive at a position. Everything after a MATCH has lower priority than the match and is cut.
+using regex_threads = std::vector<int32_t>;
+
+struct regex_builder {
+    const regex_program            &program;
+    std::vector<std::vector<bool>> &class_sets; // class -> whether it is in each set
+
+    std::vector<uint32_t> here_marks; // Instructions visited at the current position
+    std::vector<uint32_t> next_marks; // Instructions visited at the next position
+    uint32_t              generation = 0;
+
+    // follow SPLIT and JMP from pc into threads, in priority order. true once a MATCH is reached.
+    bool add(int32_t pc, regex_threads &threads, std::vector<uint32_t> &marks) {
+        if (marks[pc] == generation) {
+            return false;
+        }
+        marks[pc] = generation;
+
+        const regex_inst &inst = program.insts[pc];
+        switch (inst.op) {
+            case regex_inst::JMP: return add(inst.x, threads, marks);
+            case regex_inst::SPLIT: return add(inst.x, threads, marks) || add(inst.y, threads, marks);
+            case regex_inst::MATCH: threads.push_back(pc); return true;
+            default: threads.push_back(pc); return false;
+        }
+    }
+
+    regex_threads start() {
+        regex_threads threads;
+        generation++;
+        add(0, threads, next_marks);
+        return threads;
+    }
+
+    // run the thread at pc over a codepoint of class k, or the end of the text when k is
+    // n_classes. a lookahead is resolved against k before it is consumed, and the threads after
+    // it are run in turn. true once a MATCH is reached, as every later thread is cut.
+    bool run(int32_t pc, uint32_t k, regex_threads &next, bool &match_before) {
+        const bool        at_end = k == class_sets.size();
+        const regex_inst &inst   = program.insts[pc];
+        switch (inst.op) {
+            case regex_inst::CHAR:
+                if (at_end || !class_sets[k][inst.set]) {
+                    return false;
+                }
+                return add(pc + 1, next, next_marks);
+            case regex_inst::ASSERT: {
+                const bool in = !at_end && class_sets[k][inst.set];
+                if (in == inst.negative) {
+                    return false;
+                }
+                regex_threads resolved;
+                add(pc + 1, resolved, here_marks);
+                for (int32_t thread : resolved) {
+                    if (run(thread, k, next, match_before)) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+            case regex_inst::MATCH: match_before = true; return true;
+            default: return false;
+        }
+    }
+
+    regex_threads step(const regex_threads &threads, uint32_t k, bool &match_before) {
+        regex_threads next;
+        match_before = false;
+        generation++;
+
+        for (int32_t pc : threads) {
+            if (here_marks[pc] == generation) {
+                continue; // already run through a lookahead of higher priority
+            }
+            here_marks[pc] = generation;
+            if (run(pc, k, next, match_before)) {
+                break;
+            }
+        }
+        return next;
+    }
+};
+
+//
+// interface
+//
+
+uint32_t unicode_regex::classify(uint32_t cpt) const {
+    if (cpt < 128) {
+        return ascii[cpt];
+    }
+    if (!intervals.empty() && intervals.front().first <= cpt && cpt <= intervals.back().last) {
+        auto it = std::upper_bound(
+            intervals.begin(),
+            intervals.end(),
+            cpt,
+            [](uint32_t value, const unicode_regex_interval &interval) {
+                return value < interval.first;
+            }
+        );
+        if (it != intervals.begin() && cpt <= (--it)->last) {
+            return it->by_flags[regex_flags_key(cpt)];
+        }
+    }
+    return by_flags[regex_flags_key(cpt)];
+}
+
+size_t unicode_regex::match(const uint32_t* cpts, size_t n_cpts) const {
+    const size_t stride = n_classes + 1;
+
+    uint32_t state = start;
+    size_t   last  = 0;
+    for (size_t pos = 0; pos < n_cpts; ++pos) {
+        const uint32_t next = transitions[state * stride + classify(cpts[pos])];
+        if (next & 1) {
+            last = pos;
+        }
+        state = next >> 1;
+        if (0 == state) {
+            return last;
+        }
+        if (accepting[state]) {
+            last = pos + 1;
+        }
+    }
+
+    if (transitions[state * stride + n_classes] & 1) {
+        last = n_cpts;
+    }
+    return last;
+}
+
+struct unicode_regex* unicode_regex_compile(const std::string &expr) {
+    regex_parser     parser(expr);
+    const regex_node root = parser.parse_alt();
+    if (!parser.done()) {
+        parser.fail("unbalanced parenthesis");
+    }
+
+    regex_program program;
+    program.compile(root);
+    program.emit(regex_inst::MATCH);
+
+    const std::vector<regex_set> &sets = parser.sets;
+
+    struct unicode_regex* regex = new unicode_regex{};
+
+    // classes: codepoints that are in exactly the same sets share a class
+    std::map<std::vector<bool>, uint16_t> classes;
+    std::vector<std::vector<bool>>        class_sets;
+    auto classify = [&](uint32_t cpt, uint16_t flags) -> uint16_t {
+        std::vector<bool> in(sets.size());
+        for (size_t i = 0; i < sets.size(); ++i) {
+            in[i] = sets[i].contains(cpt, flags);
+        }
+        auto it = classes.find(in);
+        if (classes.end() != it) {
+            return it->second;
+        }
+        if (classes.size() >= REGEX_MAX_CLASSES) {
+            throw std::runtime_error("Regex has too many character classes: '" + expr + "'");
+        }
+        const uint16_t id = (uint16_t) classes.size();
+        classes.emplace(in, id);
+        class_sets.push_back(in);
+        return id;
+    };
+
+    for (uint32_t cpt = 0; cpt < 128; ++cpt) {
+        regex->ascii[cpt] = classify(cpt, regex_flags_key(cpt));
+    }
+    for (uint32_t key = 0; key <= REGEX_FLAGS_MASK; ++key) {
+        regex->by_flags[key] = classify(UINT32_MAX, (uint16_t) key); // in no range
+    }
+
+    // non-ascii ranges split into pieces that every range either covers or misses
+    std::vector<uint32_t> bounds;
+    for (const regex_set &set : sets) {
+        for (const auto &range : set.ranges) {
+            if (range.second >= 128) {
+                bounds.push_back(std::max<uint32_t>(range.first, 128));
+                bounds.push_back(range.second + 1);
+            }
+        }
+    }
+    std::sort(bounds.begin(), bounds.end());
+    bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+    for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+        const uint32_t first   = bounds[i];
+        bool           covered = false;
+        for (const regex_set &set : sets) {
+            for (const auto &range : set.ranges) {
+                covered = covered || (range.first <= first && first <= range.second);
+            }
+        }
+        if (!covered) {
+            continue;
+        }
+
+        unicode_regex_interval interval{first, bounds[i + 1] - 1, {}};
+        interval.by_flags.resize(REGEX_FLAGS_MASK + 1);
+        for (uint32_t key = 0; key <= REGEX_FLAGS_MASK; ++key) {
+            interval.by_flags[key] = classify(first, (uint16_t) key);
+        }
+        regex->intervals.push_back(std::move(interval));
+    }
+
+    regex->n_classes = (uint32_t) class_sets.size();
+
+    // states, discovered breadth first. state 0 is dead.
+    const size_t  n_insts = program.insts.size();
+    regex_builder builder{
+        program, class_sets, std::vector<uint32_t>(n_insts), std::vector<uint32_t>(n_insts)
+    };
+
+    std::map<regex_threads, uint32_t> ids;
+    std::vector<regex_threads>        states;
+    auto state_id = [&](const regex_threads &threads) -> uint32_t {
+        auto it = ids.find(threads);
+        if (ids.end() != it) {
+            return it->second;
+        }
+        if (states.size() >= REGEX_MAX_STATES) {
+            throw std::runtime_error("Regex has too many states: '" + expr + "'");
+        }
+        const uint32_t id = (uint32_t) states.size();
+        ids.emplace(threads, id);
+        states.push_back(threads);
+        return id;
+    };
+
+    state_id({});
+    regex->start = state_id(builder.start());
+
+    // rows are filled in the order states are discovered
+    for (size_t id = 0; id < states.size(); ++id) {
+        for (uint32_t k = 0; k <= regex->n_classes; ++k) {
+            bool                match_before;
+            const regex_threads next = builder.step(states[id], k, match_before);
+            // nothing follows the end of the text
+            const uint32_t target = k == regex->n_classes ? 0 : state_id(next);
+            regex->transitions.push_back(target << 1 | (match_before ? 1 : 0));
+        }
+    }
+
+    regex->n_states = (uint32_t) states.size();
+    regex->accepting.resize(states.size());
+    for (size_t id = 0; id < states.size(); ++id) {
+        const regex_threads &threads = states[id];
+        regex->accepting[id]
+            = !threads.empty() && regex_inst::MATCH == program.insts[threads.back()].op;
+    }
+
+    return regex;
+}
+
+void unicode_regex_free(struct unicode_regex* regex) {
+    delete regex;
+}
+
+std::vector<size_t> unicode_regex_apply(
+    const struct unicode_regex* regex,
+    const std::vector<uint32_t> &cpts,
+    const std::vector<size_t>   &offsets
+) {
+    std::vector<size_t> bpe_offsets;     // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+
+    size_t start = 0;
+    for (const size_t offset : offsets) {
+        const size_t end = start + offset;
+
+        // unmatched text between matches becomes a word of its own
+        size_t gap = start;
+        for (size_t pos = start; pos < end;) {
+            const size_t length = regex->match(cpts.data() + pos, end - pos);
+            if (0 == length) {
+                pos++;
+                continue;
+            }
+            if (pos > gap) {
+                bpe_offsets.push_back(pos - gap);
+            }
+            bpe_offsets.push_back(length);
+            pos += length;
+            gap  = pos;
+        }
+        if (end > gap) {
+            bpe_offsets.push_back(end - gap);
+        }
+
+        start = end;
+    }
+
+    return bpe_offsets;
+}
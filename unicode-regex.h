@@ -0,0 +1,56 @@
+#ifndef UNICODE_REGEX_H
+#define UNICODE_REGEX_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A range of codepoints whose class also depends on the flags of the codepoint.
+struct unicode_regex_interval {
+    uint32_t              first;    // First codepoint of the range
+    uint32_t              last;     // Last codepoint of the range
+    std::vector<uint16_t> by_flags; // Class of each flags key within the range
+};
+
+// A regex compiled into a DFA over classes of codepoints, built once and then only read, so
+// one instance can be shared by every thread.
+//
+// The supported subset is what pre-tokenizers use: literals, classes with ranges, \s \d \w and
+// the \p{..} general categories, groups, (?i:...), alternation, greedy and lazy quantifiers,
+// and lookahead on a single character such as (?!\S). Matches are leftmost-first like the
+// backtracking engines the regexes were written for, e.g. \s+(?!\S)|\s+ keeps the space before
+// a word out of the match.
+struct unicode_regex {
+    uint32_t n_classes; // Number of codepoint classes, the end of the text is class n_classes
+    uint32_t n_states;  // Number of DFA states, state 0 is dead
+    uint32_t start;     // DFA state before the first codepoint
+
+    // state * (n_classes + 1) + class: next state << 1 | 1 when a match ends before the class
+    std::vector<uint32_t> transitions;
+    std::vector<uint8_t>  accepting; // Whether a match ends after the codepoint leading to a state
+
+    uint16_t                            ascii[128];    // Class of each ascii codepoint
+    uint16_t                            by_flags[512]; // Class of other codepoints by flags key
+    std::vector<unicode_regex_interval> intervals;     // Sorted non-ascii literal ranges
+
+    // class of a codepoint
+    uint32_t classify(uint32_t cpt) const;
+
+    // length of the leftmost-first match at the start of cpts, 0 when there is none
+    size_t match(const uint32_t* cpts, size_t n_cpts) const;
+};
+
+// compile expr, throws std::runtime_error for syntax outside the supported subset
+struct unicode_regex* unicode_regex_compile(const std::string &expr);
+
+void unicode_regex_free(struct unicode_regex* regex);
+
+// split every word of offsets (lengths in codepoints) at the matches of regex. the text between
+// matches is kept as words of its own.
+std::vector<size_t> unicode_regex_apply(
+    const struct unicode_regex* regex,
+    const std::vector<uint32_t> &cpts,
+    const std::vector<size_t>   &offsets
+);
+
+#endif // UNICODE_REGEX_H
@@ -1,21 +1,28 @@
 /* Copyright (c) 2023-2024 The ggml authors */
 #include "unicode.h"
 #include "unicode-data.h"
+#include "unicode-regex.h"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
-#include <codecvt>
 #include <cstddef>
 #include <cstdint>
-#include <locale>
-#include <map>
-#include <regex>
+#include <cstring>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
-#include <unordered_set>
 #include <utility>
 #include <vector>
 
+#if defined(__x86_64__) || defined(__i386__)
+#    include <immintrin.h>
+#elif defined(__ARM_NEON)
+#    include <arm_neon.h>
+#endif
+
 static std::string unicode_cpts_to_utf8(const std::vector<uint32_t> &cps) {
     std::string result;
     for (size_t i = 0; i < cps.size(); ++i) {
@@ -24,7 +31,7 @@ static std::string unicode_cpts_to_utf8(const std::vector<uint32_t> &cps) {
     return result;
 }
 
-static uint32_t unicode_cpt_from_utf8(const std::string &utf8, size_t &offset) {
+uint32_t unicode_cpt_from_utf8(std::string_view utf8, size_t &offset) {
     assert(offset < utf8.size());
     if (!(utf8[offset + 0] & 0x80)) {
         auto result  = utf8[offset + 0];
@@ -38,8 +45,11 @@ static uint32_t unicode_cpt_from_utf8(const std::string &utf8, size_t &offset) {
         if (offset + 1 >= utf8.size() || !((utf8[offset + 1] & 0xc0) == 0x80)) {
             throw std::invalid_argument("invalid character");
         }
-        auto result  = ((utf8[offset + 0] & 0x1f) << 6) | (utf8[offset + 1] & 0x3f);
-        offset      += 2;
+        auto result = ((utf8[offset + 0] & 0x1f) << 6) | (utf8[offset + 1] & 0x3f);
+        if (result < 0x80) {
+            throw std::invalid_argument("invalid character"); // overlong, e.g. C0 80 for NUL
+        }
+        offset += 2;
         return result;
     }
     if (!(utf8[offset + 0] & 0x10)) {
@@ -49,6 +59,9 @@ static uint32_t unicode_cpt_from_utf8(const std::string &utf8, size_t &offset) {
         }
         auto result = ((utf8[offset + 0] & 0x0f) << 12) | ((utf8[offset + 1] & 0x3f) << 6)
                       | (utf8[offset + 2] & 0x3f);
+        if (result < 0x800 || (0xd800 <= result && result <= 0xdfff)) {
+            throw std::invalid_argument("invalid character"); // overlong, or a utf-16 surrogate
+        }
         offset += 3;
         return result;
     }
@@ -59,6 +72,9 @@ static uint32_t unicode_cpt_from_utf8(const std::string &utf8, size_t &offset) {
         }
         auto result = ((utf8[offset + 0] & 0x07) << 18) | ((utf8[offset + 1] & 0x3f) << 12)
                       | ((utf8[offset + 2] & 0x3f) << 6) | (utf8[offset + 3] & 0x3f);
+        if (result < 0x10000 || result > 0x10ffff) {
+            throw std::invalid_argument("invalid character"); // overlong, or past the last plane
+        }
         offset += 4;
         return result;
     }
@@ -114,118 +130,76 @@ static uint32_t unicode_cpt_from_utf8(const std::string &utf8, size_t &offset) {
 //     return result;
 // }
 
-static std::vector<codepoint_flags> unicode_cpt_flags_array() {
-    std::vector<codepoint_flags> cpt_flags(MAX_CODEPOINTS, codepoint_flags::UNDEFINED);
-
-    assert(unicode_ranges_flags.front().first == 0);
-    assert(unicode_ranges_flags.back().first == MAX_CODEPOINTS);
-    for (size_t i = 1; i < unicode_ranges_flags.size(); ++i) {
-        const auto range_ini = unicode_ranges_flags[i - 1]; // codepoint_ini, flags
-        const auto range_end = unicode_ranges_flags[i];     // codepoint_end, flags
-        for (uint32_t cpt = range_ini.first; cpt < range_end.first; ++cpt) {
-            cpt_flags[cpt] = range_ini.second;
-        }
-    }
-
-    for (auto cpt : unicode_set_whitespace) {
-        cpt_flags[cpt].is_whitespace = true;
-    }
-
-    for (auto p : unicode_map_lowercase) {
-        cpt_flags[p.second].is_lowercase = true;
-    }
-
-    for (auto p : unicode_map_uppercase) {
-        cpt_flags[p.second].is_uppercase = true;
-    }
-
-    for (auto &range : unicode_ranges_nfd) { // start, last, nfd
-        cpt_flags[range.nfd].is_nfd = true;
-    }
-
-    return cpt_flags;
-}
-
-static std::unordered_map<uint8_t, std::string> unicode_byte_to_utf8_map() {
-    std::unordered_map<uint8_t, std::string> map;
-    for (int ch = 0x21; ch <= 0x7E; ++ch) { // u'!' to u'~'
-        assert(0 <= ch && ch < 256);
-        map[ch] = unicode_cpt_to_utf8(ch);
-    }
-    for (int ch = 0xA1; ch <= 0xAC; ++ch) { // u'¡' to u'¬'
-        assert(0 <= ch && ch < 256);
-        map[ch] = unicode_cpt_to_utf8(ch);
-    }
-    for (int ch = 0xAE; ch <= 0xFF; ++ch) { // u'®' to u'ÿ'
-        assert(0 <= ch && ch < 256);
-        map[ch] = unicode_cpt_to_utf8(ch);
-    }
-    auto n = 0;
-    for (int ch = 0; ch < 256; ++ch) {
-        if (map.find(ch) == map.end()) {
-            map[ch] = unicode_cpt_to_utf8(256 + n);
-            ++n;
-        }
+// look up cpt in a two-stage table generated by gen/unicode.py, fallback when out of range
+template <typename T>
+static inline T unicode_table_lookup(
+    const uint16_t* index, const T* data, uint32_t shift, uint32_t cpt, T fallback
+) {
+    if (cpt >= MAX_CODEPOINTS) {
+        return fallback;
     }
-    return map;
+    const uint32_t block = index[cpt >> shift];
+    return data[(block << shift) | (cpt & ((1u << shift) - 1))];
 }
 
-static std::unordered_map<std::string, uint8_t> unicode_utf8_to_byte_map() {
-    std::unordered_map<std::string, uint8_t> map;
-    for (int ch = 0x21; ch <= 0x7E; ++ch) { // u'!' to u'~'
-        assert(0 <= ch && ch < 256);
-        map[unicode_cpt_to_utf8(ch)] = ch;
-    }
-    for (int ch = 0xA1; ch <= 0xAC; ++ch) { // u'¡' to u'¬'
-        assert(0 <= ch && ch < 256);
-        map[unicode_cpt_to_utf8(ch)] = ch;
-    }
-    for (int ch = 0xAE; ch <= 0xFF; ++ch) { // u'®' to u'ÿ'
-        assert(0 <= ch && ch < 256);
-        map[unicode_cpt_to_utf8(ch)] = ch;
+// The character of the byte-level alphabet standing for a byte, encoded as utf-8.
+struct unicode_byte_char {
+    uint8_t length;   // Number of bytes, 1 or 2 as the alphabet ends at U+0143
+    char    bytes[2]; // The utf-8 encoding of the character
+};
+
+// codepoint of the byte-level character of every byte: the printable bytes stand for themselves
+// and the others are shifted onto U+0100 and up, in byte order.
+static constexpr uint32_t unicode_byte_cpt(uint32_t byte) {
+    auto printable = [](uint32_t ch) {
+        return (0x21 <= ch && ch <= 0x7E) || (0xA1 <= ch && ch <= 0xAC)
+               || (0xAE <= ch && ch <= 0xFF);
+    };
+    if (printable(byte)) {
+        return byte;
     }
-    auto n = 0;
-    for (int ch = 0; ch < 256; ++ch) {
-        if (map.find(unicode_cpt_to_utf8(ch)) == map.end()) {
-            map[unicode_cpt_to_utf8(256 + n)] = ch;
-            ++n;
-        }
+    uint32_t n = 0;
+    for (uint32_t ch = 0; ch < byte; ++ch) {
+        n += !printable(ch);
     }
-    return map;
+    return 256 + n;
 }
 
-static inline std::wstring unicode_wstring_from_utf8(const std::string &s) {
-    std::wstring_convert<std::codecvt_utf8<wchar_t>> conv;
-    return conv.from_bytes(s);
-}
+static constexpr uint32_t UNICODE_BYTE_CPT_END = 0x144; // One past the last character
 
-static std::vector<std::string>
-unicode_byte_encoding_process(const std::vector<std::string> &bpe_words) {
-    std::vector<std::string> bpe_encoded_words;
-    for (const auto &word : bpe_words) {
-        std::string text_utf;
-        auto        utf_word = unicode_cpts_from_utf8(word);
-        for (size_t i = 0; i < utf_word.size(); ++i) {
-            text_utf += unicode_cpt_to_utf8(utf_word[i]);
+static constexpr std::array<struct unicode_byte_char, 256> unicode_byte_chars = [] {
+    std::array<struct unicode_byte_char, 256> chars = {};
+    for (uint32_t byte = 0; byte < 256; ++byte) {
+        const uint32_t cpt = unicode_byte_cpt(byte);
+        if (cpt < 0x80) {
+            chars[byte] = {1, {(char) cpt, 0}};
+        } else {
+            chars[byte] = {2, {(char) (0xC0 | (cpt >> 6)), (char) (0x80 | (cpt & 0x3F))}};
         }
+    }
+    return chars;
+}();
 
-        std::string encoded_token;
-        for (char &c : text_utf) {
-            encoded_token += unicode_byte_to_utf8(c);
-        }
-        bpe_encoded_words.emplace_back(encoded_token);
+// byte of every character of the alphabet, -1 for codepoints outside of it
+static constexpr std::array<int16_t, UNICODE_BYTE_CPT_END> unicode_byte_of_cpt = [] {
+    std::array<int16_t, UNICODE_BYTE_CPT_END> bytes = {};
+    for (uint32_t cpt = 0; cpt < UNICODE_BYTE_CPT_END; ++cpt) {
+        bytes[cpt] = -1;
     }
-    return bpe_encoded_words;
-}
+    for (uint32_t byte = 0; byte < 256; ++byte) {
+        bytes[unicode_byte_cpt(byte)] = (int16_t) byte;
+    }
+    return bytes;
+}();
 
 // GPT2 system regex:  's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
 static std::vector<size_t>
-unicode_regex_split_custom_gpt2(const std::string &text, const std::vector<size_t> &offsets) {
+unicode_regex_split_custom_gpt2(
+    const std::vector<uint32_t> &cpts, const std::vector<size_t> &offsets
+) {
     std::vector<size_t> bpe_offsets;     // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -345,12 +319,12 @@ unicode_regex_split_custom_gpt2(const std::string &text, const std::vector<size_
 // LLAMA3 system regex: "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}|
 // ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+"
 static std::vector<size_t>
-unicode_regex_split_custom_llama3(const std::string &text, const std::vector<size_t> &offsets) {
+unicode_regex_split_custom_llama3(
+    const std::vector<uint32_t> &cpts, const std::vector<size_t> &offsets
+) {
     std::vector<size_t> bpe_offsets;     // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -490,81 +464,19 @@ unicode_regex_split_custom_llama3(const std::string &text, const std::vector<siz
     return bpe_offsets;
 }
 
-// use std::wregex to split the text
-static std::vector<size_t> unicode_regex_split_stl(
-    const std::wstring &wtext, const std::wstring &regex_expr, const std::vector<size_t> &offsets
-) {
-    std::wregex         expr(regex_expr);
-    std::vector<size_t> bpe_offsets;     // store the offset of each word
-    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
-    size_t start = 0;
-    for (auto offset : offsets) {
-        std::wcregex_iterator it(wtext.data() + start, wtext.data() + start + offset, expr);
-        std::wcregex_iterator end;
-
-        int64_t start_idx = 0;
-        while (it != end) {
-            std::wcmatch match = *it;
-            if (match.position() > start_idx) {
-                bpe_offsets.emplace_back(match.position() - start_idx);
-            }
-            bpe_offsets.emplace_back(match.length());
-            start_idx = match.position() + match.length();
-            ++it;
-        }
-
-        if (start_idx < (int64_t) offset) {
-            bpe_offsets.emplace_back(offset - start_idx);
-        }
-        start += offset;
-    }
-
-    return bpe_offsets;
-}
-
-// use std::regex to split the text
-static std::vector<size_t> unicode_regex_split_stl(
-    const std::string &text, const std::string &regex_expr, const std::vector<size_t> &offsets
-) {
-    std::regex          expr(regex_expr);
-    std::vector<size_t> bpe_offsets;     // store the offset of each word
-    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
-    size_t start = 0;
-    for (auto offset : offsets) {
-        std::cregex_iterator it(text.data() + start, text.data() + start + offset, expr);
-        std::cregex_iterator end;
-
-        int64_t start_idx = 0;
-        while (it != end) {
-            std::cmatch match = *it;
-            if (match.position() > start_idx) {
-                bpe_offsets.emplace_back(match.position() - start_idx);
-            }
-            bpe_offsets.emplace_back(match.length());
-            start_idx = match.position() + match.length();
-            ++it;
-        }
-
-        if (start_idx < (int64_t) offset) {
-            bpe_offsets.emplace_back(offset - start_idx);
-        }
-        start += offset;
-    }
-
-    return bpe_offsets;
-}
-
 static std::vector<size_t> unicode_regex_split_custom(
-    const std::string &text, const std::string &regex_expr, const std::vector<size_t> &offsets
+    const std::vector<uint32_t> &cpts,
+    const std::string           &regex_expr,
+    const std::vector<size_t>   &offsets
 ) {
     std::vector<size_t> bpe_offsets;
 
     if (regex_expr
         == "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)") {
-        bpe_offsets = unicode_regex_split_custom_gpt2(text, offsets);
+        bpe_offsets = unicode_regex_split_custom_gpt2(cpts, offsets);
     } else if (regex_expr == "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" || regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
 
-        bpe_offsets = unicode_regex_split_custom_llama3(text, offsets);
+        bpe_offsets = unicode_regex_split_custom_llama3(cpts, offsets);
     }
 
     return bpe_offsets;
@@ -574,6 +486,12 @@ static std::vector<size_t> unicode_regex_split_custom(
 // interface
 //
 
+size_t unicode_len_utf8(char src) {
+    const size_t  lookup[] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 3, 4};
+    const uint8_t highbits = static_cast<uint8_t>(src) >> 4;
+    return lookup[highbits];
+}
+
 std::string unicode_cpt_to_utf8(uint32_t cp) {
     std::string result;
 
@@ -604,31 +522,335 @@ std::string unicode_cpt_to_utf8(uint32_t cp) {
 }
 
 std::vector<uint32_t> unicode_cpts_normalize_nfd(const std::vector<uint32_t> &cpts) {
-    auto comp = [](const uint32_t cpt, const range_nfd &range) { return cpt < range.first; };
     std::vector<uint32_t> result(cpts.size());
     for (size_t i = 0; i < cpts.size(); ++i) {
         const uint32_t cpt = cpts[i];
-        auto           it
-            = std::upper_bound(unicode_ranges_nfd.cbegin(), unicode_ranges_nfd.cend(), cpt, comp)
-              - 1;
-        result[i] = (it->first <= cpt && cpt <= it->last) ? it->nfd : cpt;
+        const int32_t  offset
+            = unicode_table_lookup(unicode_nfd_index, unicode_nfd_data, UNICODE_NFD_SHIFT, cpt, 0);
+        result[i] = cpt + offset;
     }
     return result;
 }
 
-std::vector<uint32_t> unicode_cpts_from_utf8(const std::string &utf8) {
+//
+// normalization
+//
+
+// flags of the normalization table, see NORMALIZATION_FLAG in gen/unicode.py
+enum : uint16_t {
+    UNICODE_COMBINING_CLASS = 0x00FF,
+    UNICODE_NFD_NO          = 0x0100,
+    UNICODE_NFKD_NO         = 0x0200,
+    UNICODE_NFC_NO          = 0x0400,
+    UNICODE_NFC_MAYBE       = 0x0800,
+    UNICODE_NFKC_NO         = 0x1000,
+    UNICODE_NFKC_MAYBE      = 0x2000,
+};
+
+// hangul syllables are composed algorithmically, see section 3.12 of the Unicode Standard
+static const uint32_t HANGUL_S_BASE  = 0xAC00;
+static const uint32_t HANGUL_L_BASE  = 0x1100;
+static const uint32_t HANGUL_V_BASE  = 0x1161;
+static const uint32_t HANGUL_T_BASE  = 0x11A7;
+static const uint32_t HANGUL_L_COUNT = 19;
+static const uint32_t HANGUL_V_COUNT = 21;
+static const uint32_t HANGUL_T_COUNT = 28;
+static const uint32_t HANGUL_N_COUNT = HANGUL_V_COUNT * HANGUL_T_COUNT;
+static const uint32_t HANGUL_S_COUNT = HANGUL_L_COUNT * HANGUL_N_COUNT;
+
+// quick check flags that rule out each form, indexed by unicode_normalization
+static const uint16_t unicode_normalization_quick_check[] = {
+    UNICODE_NFD_NO,
+    UNICODE_NFKD_NO,
+    UNICODE_NFC_NO | UNICODE_NFC_MAYBE,
+    UNICODE_NFKC_NO | UNICODE_NFKC_MAYBE,
+};
+
+static inline uint16_t unicode_normalization_flags(uint32_t cpt) {
+    return unicode_table_lookup<uint16_t>(
+        unicode_normalization_index, unicode_normalization_data, UNICODE_NORMALIZATION_SHIFT, cpt, 0
+    );
+}
+
+static inline uint8_t unicode_combining_class(uint32_t cpt) {
+    return unicode_normalization_flags(cpt) & UNICODE_COMBINING_CLASS;
+}
+
+// append the full decomposition of cpt to out
+static void unicode_decompose(uint32_t cpt, bool compat, std::vector<uint32_t> &out) {
+    if (cpt - HANGUL_S_BASE < HANGUL_S_COUNT) {
+        const uint32_t index = cpt - HANGUL_S_BASE;
+        out.push_back(HANGUL_L_BASE + index / HANGUL_N_COUNT);
+        out.push_back(HANGUL_V_BASE + (index % HANGUL_N_COUNT) / HANGUL_T_COUNT);
+        if (index % HANGUL_T_COUNT) {
+            out.push_back(HANGUL_T_BASE + index % HANGUL_T_COUNT);
+        }
+        return;
+    }
+
+    const uint32_t offsets = unicode_table_lookup<uint32_t>(
+        unicode_decomposition_index, unicode_decomposition_data, UNICODE_DECOMPOSITION_SHIFT, cpt, 0
+    );
+    const uint32_t offset = compat ? offsets >> 16 : offsets & 0xFFFF;
+    if (0 == offset) {
+        out.push_back(cpt);
+        return;
+    }
+    const uint32_t* pool = unicode_decomposition_pool + offset;
+    out.insert(out.end(), pool + 1, pool + 1 + pool[0]);
+}
+
+// the primary composite of first and second, 0 when they do not compose
+static uint32_t unicode_compose(uint32_t first, uint32_t second) {
+    if (first - HANGUL_L_BASE < HANGUL_L_COUNT && second - HANGUL_V_BASE < HANGUL_V_COUNT) {
+        return HANGUL_S_BASE
+               + ((first - HANGUL_L_BASE) * HANGUL_V_COUNT + second - HANGUL_V_BASE)
+                     * HANGUL_T_COUNT;
+    }
+    if (first - HANGUL_S_BASE < HANGUL_S_COUNT && 0 == (first - HANGUL_S_BASE) % HANGUL_T_COUNT
+        && second - HANGUL_T_BASE - 1 < HANGUL_T_COUNT - 1) {
+        return first + second - HANGUL_T_BASE;
+    }
+
+    const uint64_t  pair = (uint64_t) first << 21 | second;
+    const uint64_t* end  = unicode_composition_pairs + UNICODE_N_COMPOSITIONS;
+    const uint64_t* it   = std::lower_bound(unicode_composition_pairs, end, pair);
+    if (end == it || pair != *it) {
+        return 0;
+    }
+    return unicode_composition_cpts[it - unicode_composition_pairs];
+}
+
+bool unicode_is_normalized(std::string_view utf8, enum unicode_normalization form) {
+    const uint16_t quick_check = unicode_normalization_quick_check[form];
+
+    uint8_t last_class = 0;
+    size_t  offset     = 0;
+    while (offset < utf8.size()) {
+        // ascii is in every form and never follows a character it could be reordered with
+        if (offset + 8 <= utf8.size()) {
+            uint64_t block;
+            memcpy(&block, utf8.data() + offset, sizeof(block));
+            if (!(block & 0x8080808080808080ULL)) {
+                offset     += 8;
+                last_class  = 0;
+                continue;
+            }
+        }
+        if (!(utf8[offset] & 0x80)) {
+            offset     += 1;
+            last_class  = 0;
+            continue;
+        }
+
+        const uint16_t flags = unicode_normalization_flags(unicode_cpt_from_utf8(utf8, offset));
+        const uint8_t  klass = flags & UNICODE_COMBINING_CLASS;
+        if ((klass && last_class > klass) || (flags & quick_check)) {
+            return false;
+        }
+        last_class = klass;
+    }
+    return true;
+}
+
+std::vector<uint32_t>
+unicode_cpts_normalize(const std::vector<uint32_t> &cpts, enum unicode_normalization form) {
+    const bool compat = UNICODE_NFKD == form || UNICODE_NFKC == form;
+
     std::vector<uint32_t> result;
+    result.reserve(cpts.size());
+    for (const uint32_t cpt : cpts) {
+        unicode_decompose(cpt, compat, result);
+    }
+
+    // canonical ordering: a stable sort of each run of non-starters by combining class
+    for (size_t i = 1; i < result.size(); ++i) {
+        const uint32_t cpt   = result[i];
+        const uint8_t  klass = unicode_combining_class(cpt);
+        if (0 == klass) {
+            continue;
+        }
+        size_t j = i;
+        for (; j > 0 && unicode_combining_class(result[j - 1]) > klass; --j) {
+            result[j] = result[j - 1];
+        }
+        result[j] = cpt;
+    }
+
+    if (UNICODE_NFD == form || UNICODE_NFKD == form) {
+        return result;
+    }
+
+    // canonical composition: combine each character with the last starter unless a character
+    // in between blocks it, i.e. has a combining class of 0 or at least its own
+    size_t  n_result   = 0;
+    size_t  starter    = SIZE_MAX;
+    uint8_t last_class = 0;
+    for (size_t i = 0; i < result.size(); ++i) {
+        const uint32_t cpt     = result[i];
+        const uint8_t  klass   = unicode_combining_class(cpt);
+        const bool     blocked = starter + 1 != n_result && !(last_class && last_class < klass);
+        if (SIZE_MAX != starter && !blocked) {
+            const uint32_t composite = unicode_compose(result[starter], cpt);
+            if (composite) {
+                result[starter] = composite;
+                continue;
+            }
+        }
+        if (0 == klass) {
+            starter = n_result;
+        }
+        last_class         = klass;
+        result[n_result++] = cpt;
+    }
+    result.resize(n_result);
+    return result;
+}
+
+void unicode_normalize(std::string_view utf8, enum unicode_normalization form, std::string &out) {
+    if (unicode_is_normalized(utf8, form)) {
+        out.assign(utf8);
+        return;
+    }
+
+    out.clear();
+    for (const uint32_t cpt : unicode_cpts_normalize(unicode_cpts_from_utf8(utf8), form)) {
+        out += unicode_cpt_to_utf8(cpt);
+    }
+}
+
+//
+// ascii kernels: widen the leading run of ascii bytes of src into dst and return its length.
+// the caller decodes the multi-byte character that ends the run with unicode_cpt_from_utf8.
+//
+
+static size_t unicode_ascii_to_cpts_scalar(const char* src, size_t n, uint32_t* dst) {
+    size_t i = 0;
+
+    // test 8 bytes at a time for a set high bit
+    for (; i + 8 <= n; i += 8) {
+        uint64_t block;
+        memcpy(&block, src + i, sizeof(block));
+        if (block & 0x8080808080808080ULL) {
+            break;
+        }
+        for (size_t j = 0; j < 8; ++j) {
+            dst[i + j] = (uint8_t) src[i + j];
+        }
+    }
+
+    for (; i < n && !(src[i] & 0x80); ++i) {
+        dst[i] = (uint8_t) src[i];
+    }
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.1"))) static size_t
+unicode_ascii_to_cpts_sse41(const char* src, size_t n, uint32_t* dst) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i bytes = _mm_loadu_si128((const __m128i*) (src + i));
+        if (_mm_movemask_epi8(bytes)) {
+            break;
+        }
+        _mm_storeu_si128((__m128i*) (dst + i + 0), _mm_cvtepu8_epi32(bytes));
+        _mm_storeu_si128((__m128i*) (dst + i + 4), _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 4)));
+        _mm_storeu_si128((__m128i*) (dst + i + 8), _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 8)));
+        _mm_storeu_si128((__m128i*) (dst + i + 12), _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 12)));
+    }
+    return i + unicode_ascii_to_cpts_scalar(src + i, n - i, dst + i);
+}
+
+__attribute__((target("avx2"))) static size_t
+unicode_ascii_to_cpts_avx2(const char* src, size_t n, uint32_t* dst) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i bytes = _mm256_loadu_si256((const __m256i*) (src + i));
+        if (_mm256_movemask_epi8(bytes)) {
+            break;
+        }
+        const __m128i lo = _mm256_castsi256_si128(bytes);
+        const __m128i hi = _mm256_extracti128_si256(bytes, 1);
+        _mm256_storeu_si256((__m256i*) (dst + i + 0), _mm256_cvtepu8_epi32(lo));
+        _mm256_storeu_si256((__m256i*) (dst + i + 8), _mm256_cvtepu8_epi32(_mm_srli_si128(lo, 8)));
+        _mm256_storeu_si256((__m256i*) (dst + i + 16), _mm256_cvtepu8_epi32(hi));
+        _mm256_storeu_si256((__m256i*) (dst + i + 24), _mm256_cvtepu8_epi32(_mm_srli_si128(hi, 8)));
+    }
+    return i + unicode_ascii_to_cpts_scalar(src + i, n - i, dst + i);
+}
+#elif defined(__ARM_NEON)
+static size_t unicode_ascii_to_cpts_neon(const char* src, size_t n, uint32_t* dst) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const uint8x16_t bytes = vld1q_u8((const uint8_t*) (src + i));
+        if (vmaxvq_u8(bytes) & 0x80) {
+            break;
+        }
+        const uint16x8_t lo = vmovl_u8(vget_low_u8(bytes));
+        const uint16x8_t hi = vmovl_u8(vget_high_u8(bytes));
+        vst1q_u32(dst + i + 0, vmovl_u16(vget_low_u16(lo)));
+        vst1q_u32(dst + i + 4, vmovl_u16(vget_high_u16(lo)));
+        vst1q_u32(dst + i + 8, vmovl_u16(vget_low_u16(hi)));
+        vst1q_u32(dst + i + 12, vmovl_u16(vget_high_u16(hi)));
+    }
+    return i + unicode_ascii_to_cpts_scalar(src + i, n - i, dst + i);
+}
+#endif
+
+using unicode_ascii_kernel = size_t (*)(const char* src, size_t n, uint32_t* dst);
+
+// pick the widest kernel the cpu supports, once per process
+static unicode_ascii_kernel unicode_ascii_to_cpts_kernel() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return unicode_ascii_to_cpts_avx2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return unicode_ascii_to_cpts_sse41;
+    }
+    return unicode_ascii_to_cpts_scalar;
+#elif defined(__ARM_NEON)
+    return unicode_ascii_to_cpts_neon;
+#else
+    return unicode_ascii_to_cpts_scalar;
+#endif
+}
+
+std::vector<uint32_t> unicode_cpts_from_utf8(std::string_view utf8) {
+    std::vector<uint32_t> result;
+    unicode_cpts_from_utf8(utf8, result);
+    return result;
+}
+
+void unicode_cpts_from_utf8(std::string_view utf8, std::vector<uint32_t> &result) {
+    static const unicode_ascii_kernel ascii_to_cpts = unicode_ascii_to_cpts_kernel();
+
+    // a text never has more codepoints than bytes
+    result.resize(utf8.size());
+    size_t n_cpts = 0;
     size_t                offset = 0;
     while (offset < utf8.size()) {
-        result.push_back(unicode_cpt_from_utf8(utf8, offset));
+        const size_t n_ascii
+            = ascii_to_cpts(utf8.data() + offset, utf8.size() - offset, result.data() + n_cpts);
+        offset += n_ascii;
+        n_cpts += n_ascii;
+
+        // decode the run of multi-byte characters that ends it, e.g. a word of cjk text.
+        // unicode_cpt_from_utf8 validates each character and throws on malformed input, which
+        // includes overlong forms, surrogates and anything past U+10FFFF.
+        while (offset < utf8.size() && (utf8[offset] & 0x80)) {
+            result[n_cpts++] = unicode_cpt_from_utf8(utf8, offset);
+        }
     }
-    return result;
+    result.resize(n_cpts);
 }
 
 codepoint_flags unicode_cpt_flags(const uint32_t cp) {
-    static const codepoint_flags undef(codepoint_flags::UNDEFINED);
-    static const auto            cpt_flags = unicode_cpt_flags_array();
-    return cp < cpt_flags.size() ? cpt_flags[cp] : undef;
+    return unicode_table_lookup<uint16_t>(
+        unicode_flags_index, unicode_flags_data, UNICODE_FLAGS_SHIFT, cp, codepoint_flags::UNDEFINED
+    );
 }
 
 codepoint_flags unicode_cpt_flags(const std::string &utf8) {
@@ -640,196 +862,125 @@ codepoint_flags unicode_cpt_flags(const std::string &utf8) {
     return unicode_cpt_flags(unicode_cpt_from_utf8(utf8, offset));
 }
 
-std::string unicode_byte_to_utf8(uint8_t byte) {
-    static std::unordered_map<uint8_t, std::string> map = unicode_byte_to_utf8_map();
-    return map.at(byte);
-}
-
-uint8_t unicode_utf8_to_byte(const std::string &utf8) {
-    static std::unordered_map<std::string, uint8_t> map = unicode_utf8_to_byte_map();
-    return map.at(utf8);
+std::string_view unicode_byte_to_utf8(uint8_t byte) {
+    const struct unicode_byte_char &ch = unicode_byte_chars[byte];
+    return std::string_view(ch.bytes, ch.length);
 }
 
-uint32_t unicode_tolower(uint32_t cp) {
-    auto it = unicode_map_lowercase.find(cp);
-    return it == unicode_map_lowercase.end() ? cp : it->second;
+size_t unicode_byte_encode(const char* src, size_t n_src, char* dst) {
+    char* out = dst;
+    for (size_t i = 0; i < n_src; ++i) {
+        const struct unicode_byte_char &ch = unicode_byte_chars[(uint8_t) src[i]];
+        // both bytes are always stored, the second is overwritten by the next character
+        out[0] = ch.bytes[0];
+        out[1] = ch.bytes[1];
+        out += ch.length;
+    }
+    return (size_t) (out - dst);
 }
 
-std::vector<std::string>
-unicode_regex_split(const std::string &text, const std::vector<std::string> &regex_exprs) {
-    // unicode categories
-    static const std::map<std::string, int> k_ucat_enum = {
-        {"\\p{N}", codepoint_flags::NUMBER},
-        {"\\p{L}", codepoint_flags::LETTER},
-        {"\\p{P}", codepoint_flags::PUNCTUATION},
-    };
-
-    static const std::map<int, int> k_ucat_cpt = {
-        {codepoint_flags::NUMBER, 0xD1},
-        {codepoint_flags::LETTER, 0xD2},
-        {codepoint_flags::PUNCTUATION, 0xD3},
-    };
-
-    static const std::map<int, std::string> k_ucat_map = {
-        {codepoint_flags::NUMBER, "\x30-\x39"},          // 0-9
-        {codepoint_flags::LETTER, "\x41-\x5A\x61-\x7A"}, // A-Za-z
-        {codepoint_flags::PUNCTUATION,
-         "\x21-\x23\x25-\x2A\x2C-\x2F\x3A-\x3B\x3F-\x40\\\x5B-\\\x5D\x5F\\\x7B\\\x7D"
-        }, // !-#%-*,-/:-;?-@\[-\]_\{\}
-    };
-
-    // compute collapsed codepoints only if needed by at least one regex
-    bool need_collapse = false;
-    for (auto &regex_expr : regex_exprs) {
-        // search for unicode categories
-        for (const auto &ucat : k_ucat_enum) {
-            if (std::string::npos != regex_expr.find(ucat.first)) {
-                need_collapse = true;
-                break;
-            }
-        }
+uint8_t unicode_utf8_to_byte(std::string_view utf8) {
+    uint32_t cpt = UNICODE_BYTE_CPT_END;
+    if (1 == utf8.size() && (uint8_t) utf8[0] < 0x80) {
+        cpt = (uint8_t) utf8[0];
+    } else if (2 == utf8.size() && 0xC0 == ((uint8_t) utf8[0] & 0xE0)
+               && 0x80 == ((uint8_t) utf8[1] & 0xC0)) {
+        cpt = (((uint8_t) utf8[0] & 0x1F) << 6) | ((uint8_t) utf8[1] & 0x3F);
+    }
+    if (cpt >= UNICODE_BYTE_CPT_END || unicode_byte_of_cpt[cpt] < 0) {
+        throw std::out_of_range("Not a character of the byte-level alphabet");
     }
+    return (uint8_t) unicode_byte_of_cpt[cpt];
+}
 
-    const auto cpts = unicode_cpts_from_utf8(text);
+uint32_t unicode_tolower(uint32_t cp) {
+    return cp
+           + unicode_table_lookup(
+               unicode_lowercase_index, unicode_lowercase_data, UNICODE_LOWERCASE_SHIFT, cp, 0
+           );
+}
 
-    // generate a "collapsed" representation of the text, where all codepoints are replaced by a
-    // single byte ref: https://github.com/ggerganov/llama.cpp/pull/6920#issuecomment-2081479935
-    std::string text_collapsed;
-    if (need_collapse) {
-        // collapse all unicode categories
-        text_collapsed.resize(cpts.size());
+uint32_t unicode_toupper(uint32_t cp) {
+    return cp
+           + unicode_table_lookup(
+               unicode_uppercase_index, unicode_uppercase_data, UNICODE_UPPERCASE_SHIFT, cp, 0
+           );
+}
 
-        for (size_t i = 0; i < cpts.size(); ++i) {
-            // keep single-byte codepoints as is
-            if (cpts[i] < 128) {
-                text_collapsed[i] = cpts[i];
-                continue;
-            }
+// compile expr once per process. the compiled regexes are immutable, so they can be shared.
+static const struct unicode_regex* unicode_regex_cached(const std::string &expr) {
+    static std::mutex lock;
+    static std::unordered_map<std::string, std::unique_ptr<unicode_regex, void (*)(unicode_regex*)>>
+        cache;
 
-            const auto flags = unicode_cpt_flags(cpts[i]);
+    std::lock_guard<std::mutex> guard(lock);
 
-            if (flags.is_whitespace) {
-                // NOTE: C++ std::regex \s does not mach 0x85, Rust and Python regex does.
-                // text_collapsed[i] = (char) 0x85;  // <Next Line> as whitespace fallback
-                text_collapsed[i] = (char) 0x0B; // <vertical tab> as whitespace fallback
-            } else if (k_ucat_cpt.find(flags.category_flag()) != k_ucat_cpt.end()) {
-                text_collapsed[i] = k_ucat_cpt.at(flags.category_flag());
-            } else {
-                text_collapsed[i] = (char) 0xD0; // fallback
-            }
-        }
+    auto it = cache.find(expr);
+    if (cache.end() == it) {
+        auto regex = decltype(it->second)(unicode_regex_compile(expr), unicode_regex_free);
+        it         = cache.emplace(expr, std::move(regex)).first;
     }
+    return it->second.get();
+}
 
+// split cpts into words and return the length of each word in codepoints
+static std::vector<size_t> unicode_regex_split_offsets(
+    const std::vector<uint32_t> &cpts, const std::vector<std::string> &regex_exprs
+) {
     std::vector<size_t> bpe_offsets = {cpts.size()};
 
     for (auto &regex_expr : regex_exprs) {
         // first, see if we have an efficient custom regex implementation
-        auto tmp = unicode_regex_split_custom(text, regex_expr, bpe_offsets);
+        auto tmp = unicode_regex_split_custom(cpts, regex_expr, bpe_offsets);
 
         if (!tmp.empty()) {
             bpe_offsets = std::move(tmp);
             continue;
         }
 
-        // fallback to general-purpose std::regex / std::wregex
-        try {
-            // if a unicode category is used in the regex, we use the collapsed text and replace the
-            // unicode category with the corresponding collapsed representation
-            bool use_collapsed = false;
-            for (auto &ucat : k_ucat_enum) {
-                if (std::string::npos != regex_expr.find(ucat.first)) {
-                    use_collapsed = true;
-                    break;
-                }
-            }
-
-            if (use_collapsed) {
-                // sanity-check that the original regex does not contain any non-ASCII characters
-                const auto cpts_regex = unicode_cpts_from_utf8(regex_expr);
-                for (size_t i = 0; i < cpts_regex.size(); ++i) {
-                    if (cpts_regex[i] >= 128) {
-                        throw std::runtime_error("Regex includes both unicode categories and "
-                                                 "non-ASCII characters - not supported");
-                    }
-                }
-
-                // generate a collapsed representation of the regex
-                std::string regex_expr_collapsed;
-
-                // track if we are inside [], because nested [] are not allowed
-                bool inside = false;
-                for (size_t i = 0; i < regex_expr.size(); ++i) {
-                    if (regex_expr[i] == '[' && (i == 0 || regex_expr[i - 1] != '\\')) {
-                        regex_expr_collapsed += '[';
-                        inside                = true;
-                        continue;
-                    }
-
-                    if (inside && regex_expr[i] == ']' && regex_expr[i - 1] != '\\') {
-                        regex_expr_collapsed += ']';
-                        inside                = false;
-                        continue;
-                    }
+        // otherwise run the regex compiled into a dfa
+        bpe_offsets = unicode_regex_apply(unicode_regex_cached(regex_expr), cpts, bpe_offsets);
+    }
 
-                    if (regex_expr[i + 0] == '\\' && i + 4 < regex_expr.size()
-                        && regex_expr[i + 1] == 'p' && regex_expr[i + 2] == '{'
-                        && regex_expr[i + 4] == '}') {
-                        const std::string pat = regex_expr.substr(i, 5);
-                        if (k_ucat_enum.find(pat) != k_ucat_enum.end()) {
-                            if (!inside) {
-                                regex_expr_collapsed += '[';
-                            }
-                            regex_expr_collapsed += k_ucat_cpt.at(k_ucat_enum.at(pat));
-                            regex_expr_collapsed += k_ucat_map.at(k_ucat_enum.at(pat));
-                            if (!inside) {
-                                regex_expr_collapsed += ']';
-                            }
-                            i += 4;
-                            continue;
-                        }
-                    }
+    return bpe_offsets;
+}
 
-                    regex_expr_collapsed += regex_expr[i];
-                }
+void unicode_regex_split(
+    std::string_view                  text,
+    const std::vector<std::string>   &regex_exprs,
+    std::vector<struct unicode_span> &spans
+) {
+    const auto cpts        = unicode_cpts_from_utf8(text);
+    const auto bpe_offsets = unicode_regex_split_offsets(cpts, regex_exprs);
 
-                // printf("text_collapsed: %s\n", text_collapsed.c_str());
-                // printf("regex_expr_collapsed: %s\n", regex_expr_collapsed.c_str());
-                bpe_offsets
-                    = unicode_regex_split_stl(text_collapsed, regex_expr_collapsed, bpe_offsets);
-            } else {
-                // no unicode category used, we can use std::wregex directly
-                const std::wstring wregex_expr = unicode_wstring_from_utf8(regex_expr);
-
-                // std::wregex \s does not mach non-ASCII whitespaces, using 0x0B as fallback
-                std::wstring wtext(cpts.begin(), cpts.end());
-                for (size_t i = 0; i < wtext.size(); ++i) {
-                    if (wtext[i] > 0x7F && unicode_cpt_flags(wtext[i]).is_whitespace) {
-                        wtext[i] = 0x0B;
-                    }
-                }
+    spans.clear();
+    spans.reserve(bpe_offsets.size());
 
-                // printf("text: %s\n", text.c_str());
-                // printf("regex_expr: %s\n", regex_expr.c_str());
-                bpe_offsets = unicode_regex_split_stl(wtext, wregex_expr, bpe_offsets);
-            }
-        } catch (std::regex_error &e) {
-            fprintf(stderr, "Failed to process regex: '%s'\n", regex_expr.c_str());
-            fprintf(stderr, "Regex error: %s\n", e.what());
-            throw std::runtime_error("Failed to process regex");
+    // walk the bytes of text alongside the codepoint counts
+    size_t offset = 0;
+    for (const size_t n_cpts : bpe_offsets) {
+        size_t length = 0;
+        for (size_t i = 0; i < n_cpts; ++i) {
+            length += unicode_len_utf8(text[offset + length]);
         }
+        spans.push_back({offset, length});
+        offset += length;
     }
+}
 
-    std::vector<std::string> bpe_words;
-    bpe_words.reserve(bpe_offsets.size()); // reserve memory for the approximate size
+std::vector<std::string>
+unicode_regex_split(const std::string &text, const std::vector<std::string> &regex_exprs) {
+    std::vector<struct unicode_span> spans;
+    unicode_regex_split(text, regex_exprs, spans);
 
-    size_t start = 0;
-    for (size_t &offset : bpe_offsets) {
-        bpe_words.emplace_back();
-        for (size_t i = start; i < start + offset; ++i) {
-            bpe_words.back() += unicode_cpt_to_utf8(cpts[i]);
-        }
-        start += offset;
+    // the split already validated the utf-8, so every byte maps straight onto the alphabet
+    std::vector<std::string> bpe_words;
+    bpe_words.reserve(spans.size()); // reserve memory for the approximate size
+    for (const struct unicode_span &span : spans) {
+        std::string word(2 * span.length, '\0');
+        word.resize(unicode_byte_encode(text.data() + span.offset, span.length, word.data()));
+        bpe_words.push_back(std::move(word));
     }
 
-    return unicode_byte_encoding_process(bpe_words);
+    return bpe_words;
 }
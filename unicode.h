@@ -4,6 +4,7 @@
 
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 
 struct codepoint_flags {
@@ -48,20 +49,69 @@ struct codepoint_flags {
     }
 };
 
+size_t                unicode_len_utf8(char src);
 std::string           unicode_cpt_to_utf8(uint32_t cp);
-std::vector<uint32_t> unicode_cpts_from_utf8(const std::string &utf8);
+std::vector<uint32_t> unicode_cpts_from_utf8(std::string_view utf8);
+
+// same as above into cpts, reusing its capacity
+void unicode_cpts_from_utf8(std::string_view utf8, std::vector<uint32_t> &cpts);
+
+// decode the character at offset and move offset past it, throws std::invalid_argument for
+// malformed utf-8
+uint32_t unicode_cpt_from_utf8(std::string_view utf8, size_t &offset);
 
 std::vector<uint32_t> unicode_cpts_normalize_nfd(const std::vector<uint32_t> &cpts);
 
+// The normalization forms of Unicode Standard Annex #15.
+enum unicode_normalization {
+    UNICODE_NFD,
+    UNICODE_NFKD,
+    UNICODE_NFC,
+    UNICODE_NFKC,
+};
+
+// whether the quick check proves utf8 is already in form. false means it may not be, e.g. a
+// character that could compose with the one before it.
+bool unicode_is_normalized(std::string_view utf8, enum unicode_normalization form);
+
+// decompose, reorder and, for NFC and NFKC, recompose cpts into form
+std::vector<uint32_t>
+unicode_cpts_normalize(const std::vector<uint32_t> &cpts, enum unicode_normalization form);
+
+// replace out with utf8 in form, throws std::invalid_argument for malformed utf-8
+void unicode_normalize(std::string_view utf8, enum unicode_normalization form, std::string &out);
+
 codepoint_flags unicode_cpt_flags(const uint32_t cp);
 codepoint_flags unicode_cpt_flags(const std::string &utf8);
 
-std::string unicode_byte_to_utf8(uint8_t byte);
-uint8_t     unicode_utf8_to_byte(const std::string &utf8);
+// the character of the byte-level alphabet a byte maps onto, and back. unicode_utf8_to_byte
+// throws std::out_of_range for text that is not a single character of the alphabet.
+std::string_view unicode_byte_to_utf8(uint8_t byte);
+uint8_t          unicode_utf8_to_byte(std::string_view utf8);
+
+// write the byte-level characters of n_src bytes to dst, which must hold 2 * n_src bytes.
+// returns the number of bytes written.
+size_t unicode_byte_encode(const char* src, size_t n_src, char* dst);
 
 uint32_t unicode_tolower(uint32_t cp);
+uint32_t unicode_toupper(uint32_t cp);
 
+// A word of a split text as a byte range of the text.
+struct unicode_span {
+    size_t offset; // Byte offset of the word in the text
+    size_t length; // Length of the word in bytes
+};
+
+// split text into words and return each word byte-level encoded
 std::vector<std::string>
 unicode_regex_split(const std::string &text, const std::vector<std::string> &regex_exprs);
 
+// split text into words without copying them: spans is cleared and filled with the byte range of
+// each word in text. the words are not byte-level encoded.
+void unicode_regex_split(
+    std::string_view                  text,
+    const std::vector<std::string>   &regex_exprs,
+    std::vector<struct unicode_span> &spans
+);
+
 #endif // UNICODE_H